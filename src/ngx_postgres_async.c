@@ -0,0 +1,451 @@
+#include "ngx_postgres_include.h"
+
+
+typedef struct {
+    ngx_queue_t queue;
+    size_t size;
+} ngx_postgres_async_job_t; // followed by record: nParams, sql and (oid, len, value) per param
+
+typedef struct {
+    ngx_event_t lock;
+    ngx_event_t timeout;
+    ngx_file_t spool;
+    ngx_log_t *log;
+    ngx_postgres_common_t common;
+    ngx_postgres_connect_t *connect;
+    ngx_postgres_upstream_srv_conf_t *pusc;
+    ngx_queue_t queue;
+    ngx_uint_t dropped; // statements neither run nor spooled
+    ngx_uint_t failed; // statements run with error
+    ngx_uint_t n;
+    off_t offset; // replayed from spool
+    off_t size; // written to spool
+} ngx_postgres_async_t;
+
+
+static ngx_int_t ngx_postgres_async_spill(ngx_postgres_async_t *pa, ngx_postgres_async_job_t *job) {
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, pa->log, 0, "%s", __func__);
+    if (pa->spool.fd == NGX_INVALID_FILE) { ngx_log_error(NGX_LOG_ERR, pa->log, 0, "async spool is not opened, statement dropped"); pa->dropped++; return NGX_ERROR; }
+    uint32_t size = job->size; // blocking write, as nginx does for temp files
+    if (ngx_write_file(&pa->spool, (u_char *)&size, sizeof(size), pa->size) == NGX_ERROR) { ngx_log_error(NGX_LOG_ERR, pa->log, 0, "ngx_write_file == NGX_ERROR, statement dropped"); pa->dropped++; return NGX_ERROR; }
+    if (ngx_write_file(&pa->spool, (u_char *)(job + 1), job->size, pa->size + sizeof(size)) == NGX_ERROR) { ngx_log_error(NGX_LOG_ERR, pa->log, 0, "ngx_write_file == NGX_ERROR, statement dropped"); pa->dropped++; return NGX_ERROR; }
+    pa->size += sizeof(size) + job->size;
+    return NGX_OK;
+}
+
+
+static ngx_int_t ngx_postgres_async_open(ngx_postgres_async_t *pa) { // spool is adopted only after worker of previous cycle closed it
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, pa->log, 0, "%s", __func__);
+    ngx_fd_t fd = ngx_open_file(pa->spool.name.data, NGX_FILE_RDWR, NGX_FILE_CREATE_OR_OPEN, NGX_FILE_DEFAULT_ACCESS);
+    if (fd == NGX_INVALID_FILE) { ngx_log_error(NGX_LOG_ALERT, pa->log, ngx_errno, ngx_open_file_n " \"%V\" failed", &pa->spool.name); return NGX_ERROR; }
+    ngx_int_t rc = NGX_DECLINED;
+    ngx_file_info_t fi, ni;
+    ngx_err_t err = ngx_trylock_fd(fd);
+    if (err == NGX_EAGAIN || err == NGX_EACCES) { ngx_log_debug1(NGX_LOG_DEBUG_HTTP, pa->log, 0, "async spool \"%V\" is locked", &pa->spool.name); goto close; }
+    if (err) { ngx_log_error(NGX_LOG_ALERT, pa->log, err, ngx_trylock_fd_n " \"%V\" failed", &pa->spool.name); rc = NGX_ERROR; goto close; }
+    if (ngx_fd_info(fd, &fi) == NGX_FILE_ERROR) { ngx_log_error(NGX_LOG_ALERT, pa->log, ngx_errno, ngx_fd_info_n " \"%V\" failed", &pa->spool.name); rc = NGX_ERROR; goto close; }
+    if (ngx_file_info(pa->spool.name.data, &ni) == NGX_FILE_ERROR || ngx_file_uniq(&fi) != ngx_file_uniq(&ni)) { ngx_log_debug1(NGX_LOG_DEBUG_HTTP, pa->log, 0, "async spool \"%V\" is replaced", &pa->spool.name); goto close; } // unlocked when old worker renamed new one over it
+    pa->spool.fd = fd;
+    if ((pa->size = ngx_file_size(&fi))) ngx_log_error(NGX_LOG_NOTICE, pa->log, 0, "async spool \"%V\" has %O bytes to replay", &pa->spool.name, pa->size);
+    return NGX_OK;
+close:
+    if (ngx_close_file(fd) == NGX_FILE_ERROR) ngx_log_error(NGX_LOG_ALERT, pa->log, ngx_errno, ngx_close_file_n " \"%V\" failed", &pa->spool.name);
+    return rc;
+}
+
+
+static ngx_int_t ngx_postgres_async_replay(ngx_postgres_async_t *pa) {
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, pa->log, 0, "%s", __func__);
+    while (pa->n < pa->pusc->async.max && pa->offset < pa->size) {
+        uint32_t size;
+        if (ngx_read_file(&pa->spool, (u_char *)&size, sizeof(size), pa->offset) != sizeof(size)) { ngx_log_error(NGX_LOG_ERR, pa->log, 0, "ngx_read_file != %uz", sizeof(size)); return NGX_ERROR; }
+        if (pa->offset + (off_t)(sizeof(size) + size) > pa->size) { ngx_log_error(NGX_LOG_ALERT, pa->log, 0, "async spool \"%V\" is truncated at %O", &pa->spool.name, pa->offset); pa->offset = pa->size; break; }
+        ngx_postgres_async_job_t *job = ngx_alloc(sizeof(*job) + size, pa->log);
+        if (!job) { ngx_log_error(NGX_LOG_ERR, pa->log, 0, "!ngx_alloc"); return NGX_ERROR; }
+        if (ngx_read_file(&pa->spool, (u_char *)(job + 1), size, pa->offset + sizeof(size)) != (ssize_t)size) { ngx_log_error(NGX_LOG_ERR, pa->log, 0, "ngx_read_file != %uD", size); ngx_free(job); return NGX_ERROR; }
+        job->size = size;
+        ngx_queue_insert_tail(&pa->queue, &job->queue);
+        pa->n++;
+        pa->offset += sizeof(size) + size;
+    }
+    return NGX_OK;
+}
+
+
+static void ngx_postgres_async_event_handler(ngx_event_t *ev);
+
+
+static ngx_int_t ngx_postgres_async_connect(ngx_postgres_async_t *pa) {
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, pa->log, 0, "%s", __func__);
+    return ngx_postgres_connect_start(&pa->common, pa->connect->keywords, pa->connect->values, pa->connect->timeout, pa->log, ngx_postgres_async_event_handler, pa);
+}
+
+
+static void ngx_postgres_async_free(ngx_postgres_async_t *pa) {
+    while (!ngx_queue_empty(&pa->queue)) {
+        ngx_queue_t *queue = ngx_queue_head(&pa->queue);
+        ngx_queue_remove(queue);
+        ngx_free(ngx_queue_data(queue, ngx_postgres_async_job_t, queue));
+    }
+    pa->n = 0;
+}
+
+
+static void ngx_postgres_async_flush(ngx_postgres_async_t *pa) {
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, pa->log, 0, "%s", __func__);
+    if (ngx_queue_empty(&pa->queue) && !pa->offset) return;
+    if (pa->spool.fd == NGX_INVALID_FILE) { ngx_log_error(NGX_LOG_ERR, pa->log, 0, "async spool is not opened, %ui statements dropped", pa->n); pa->dropped += pa->n; ngx_postgres_async_free(pa); return; }
+    if (ngx_queue_empty(&pa->queue) && pa->offset == pa->size) {
+        if (ngx_ftruncate(pa->spool.fd, 0) == NGX_FILE_ERROR) ngx_log_error(NGX_LOG_ALERT, pa->log, ngx_errno, "ftruncate(\"%V\") failed", &pa->spool.name);
+        pa->offset = pa->size = 0;
+        return;
+    }
+    ngx_postgres_async_t tmp = *pa; // queued statements go first, then not yet replayed rest of spool
+    tmp.size = 0;
+    tmp.spool.name.len = pa->spool.name.len + sizeof(".tmp") - 1;
+    if (!(tmp.spool.name.data = ngx_alloc(tmp.spool.name.len + 1, pa->log))) { ngx_log_error(NGX_LOG_ERR, pa->log, 0, "!ngx_alloc"); goto free; }
+    ngx_memcpy(ngx_cpymem(tmp.spool.name.data, pa->spool.name.data, pa->spool.name.len), ".tmp", sizeof(".tmp"));
+    if ((tmp.spool.fd = ngx_open_file(tmp.spool.name.data, NGX_FILE_RDWR, NGX_FILE_TRUNCATE, NGX_FILE_DEFAULT_ACCESS)) == NGX_INVALID_FILE) { ngx_log_error(NGX_LOG_ALERT, pa->log, ngx_errno, ngx_open_file_n " \"%V\" failed", &tmp.spool.name); goto name; }
+    tmp.spool.offset = 0;
+    ngx_err_t err = ngx_trylock_fd(tmp.spool.fd); // locked before it replaces spool, so next worker waits until it is closed
+    if (err) { ngx_log_error(NGX_LOG_ALERT, pa->log, err, ngx_trylock_fd_n " \"%V\" failed", &tmp.spool.name); goto close; }
+    for (ngx_queue_t *queue = ngx_queue_head(&pa->queue); queue != ngx_queue_sentinel(&pa->queue); queue = ngx_queue_next(queue)) if (ngx_postgres_async_spill(&tmp, ngx_queue_data(queue, ngx_postgres_async_job_t, queue)) != NGX_OK) goto close;
+    u_char buf[4096];
+    for (off_t offset = pa->offset; offset < pa->size; ) {
+        ssize_t n = ngx_read_file(&pa->spool, buf, ngx_min((off_t)sizeof(buf), pa->size - offset), offset);
+        if (n <= 0) { ngx_log_error(NGX_LOG_ERR, pa->log, 0, "ngx_read_file <= 0"); goto close; }
+        if (ngx_write_file(&tmp.spool, buf, n, tmp.size) == NGX_ERROR) { ngx_log_error(NGX_LOG_ERR, pa->log, 0, "ngx_write_file == NGX_ERROR"); goto close; }
+        offset += n;
+        tmp.size += n;
+    }
+    if (ngx_rename_file(tmp.spool.name.data, pa->spool.name.data) == NGX_FILE_ERROR) { ngx_log_error(NGX_LOG_ALERT, pa->log, ngx_errno, ngx_rename_file_n " \"%V\" to \"%V\" failed", &tmp.spool.name, &pa->spool.name); goto close; }
+    if (ngx_close_file(pa->spool.fd) == NGX_FILE_ERROR) ngx_log_error(NGX_LOG_ALERT, pa->log, ngx_errno, ngx_close_file_n " \"%V\" failed", &pa->spool.name);
+    pa->spool.fd = tmp.spool.fd;
+    pa->spool.offset = tmp.spool.offset;
+    pa->offset = 0;
+    pa->size = tmp.size;
+    ngx_log_error(NGX_LOG_NOTICE, pa->log, 0, "async spool \"%V\" keeps %O bytes to replay", &pa->spool.name, pa->size);
+    ngx_free(tmp.spool.name.data);
+    ngx_postgres_async_free(pa);
+    return;
+close:
+    if (ngx_close_file(tmp.spool.fd) == NGX_FILE_ERROR) ngx_log_error(NGX_LOG_ALERT, pa->log, ngx_errno, ngx_close_file_n " \"%V\" failed", &tmp.spool.name);
+    if (ngx_delete_file(tmp.spool.name.data) == NGX_FILE_ERROR) ngx_log_error(NGX_LOG_ALERT, pa->log, ngx_errno, ngx_delete_file_n " \"%V\" failed", &tmp.spool.name);
+name:
+    ngx_free(tmp.spool.name.data);
+free:
+    ngx_log_error(NGX_LOG_ERR, pa->log, 0, "%ui queued statements dropped", pa->n);
+    pa->dropped += pa->n;
+    ngx_postgres_async_free(pa);
+}
+
+
+static void ngx_postgres_async_close(ngx_postgres_async_t *pa) {
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, pa->log, 0, "%s", __func__);
+    ngx_postgres_common_t *pac = &pa->common;
+    if (pac->connection) ngx_postgres_free_connection(pac);
+    pac->connection = NULL;
+    if (ngx_terminate || ngx_exiting) { ngx_postgres_async_flush(pa); return; }
+    if (pa->timeout.timer_set) return;
+    ngx_add_timer(&pa->timeout, pa->connect->timeout);
+}
+
+
+static ngx_int_t ngx_postgres_async_send(ngx_postgres_async_t *pa) {
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, pa->log, 0, "%s", __func__);
+    ngx_postgres_common_t *pac = &pa->common;
+    if (!pac->conn) return pa->timeout.timer_set || (ngx_queue_empty(&pa->queue) && pa->offset == pa->size) ? NGX_OK : ngx_postgres_async_connect(pa);
+    if (pac->state != state_idle) return NGX_OK;
+    if (ngx_queue_empty(&pa->queue) && ngx_postgres_async_replay(pa) != NGX_OK) return NGX_ERROR;
+    if (ngx_queue_empty(&pa->queue)) {
+        if (!pa->size) return NGX_OK;
+        if (ngx_ftruncate(pa->spool.fd, 0) == NGX_FILE_ERROR) { ngx_log_error(NGX_LOG_ALERT, pa->log, ngx_errno, "ftruncate(\"%V\") failed", &pa->spool.name); return NGX_OK; }
+        ngx_log_error(NGX_LOG_NOTICE, pa->log, 0, "async spool \"%V\" replayed", &pa->spool.name);
+        pa->offset = pa->size = 0;
+        return NGX_OK;
+    }
+    ngx_postgres_async_job_t *job = ngx_queue_data(ngx_queue_head(&pa->queue), ngx_postgres_async_job_t, queue);
+    u_char *p = (u_char *)(job + 1);
+    uint32_t nParams;
+    ngx_memcpy(&nParams, p, sizeof(nParams));
+    p += sizeof(nParams);
+    const char *sql = (const char *)p;
+    p += ngx_strlen(p) + 1;
+    Oid *paramTypes = NULL;
+    const char **paramValues = NULL;
+    if (nParams) {
+        if (!(paramTypes = ngx_alloc(nParams * (sizeof(*paramTypes) + sizeof(*paramValues)), pa->log))) { ngx_log_error(NGX_LOG_ERR, pa->log, 0, "!ngx_alloc"); return NGX_ERROR; }
+        paramValues = (const char **)(paramTypes + nParams);
+        for (uint32_t i = 0; i < nParams; i++) {
+            uint32_t oid;
+            int32_t len;
+            ngx_memcpy(&oid, p, sizeof(oid));
+            p += sizeof(oid);
+            ngx_memcpy(&len, p, sizeof(len));
+            p += sizeof(len);
+            paramTypes[i] = oid;
+            if (len < 0) { paramValues[i] = NULL; continue; }
+            paramValues[i] = (const char *)p;
+            p += len + 1;
+        }
+    }
+    int rc = PQsendQueryParams(pac->conn, sql, nParams, paramTypes, paramValues, NULL, NULL, 0);
+    if (paramTypes) ngx_free(paramTypes);
+    if (!rc) { ngx_log_error(NGX_LOG_ERR, pa->log, 0, "!PQsendQueryParams(\"%s\") and %s", sql, PQerrorMessageMy(pac->conn)); return NGX_ERROR; }
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, pa->log, 0, "PQsendQueryParams(\"%s\")", sql);
+    pac->state = state_result;
+    return NGX_OK;
+}
+
+
+static void ngx_postgres_async_event_handler(ngx_event_t *ev) {
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ev->log, 0, "write = %s", ev->write ? "true" : "false");
+    ngx_connection_t *c = ev->data;
+    ngx_postgres_async_t *pa = c->data;
+    ngx_postgres_common_t *pac = &pa->common;
+    if (c->close) { ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ev->log, 0, "close"); goto close; }
+    if (c->read->timedout) { ngx_log_error(NGX_LOG_ERR, ev->log, 0, "timedout"); goto close; }
+    if (c->write->timedout) { ngx_log_error(NGX_LOG_ERR, ev->log, 0, "timedout"); goto close; }
+    if (pac->state == state_connect) {
+again:
+        switch (PQconnectPoll(pac->conn)) {
+            case PGRES_POLLING_FAILED: ngx_log_error(NGX_LOG_ERR, ev->log, 0, "PQconnectPoll == PGRES_POLLING_FAILED and %s", PQerrorMessageMy(pac->conn)); goto close;
+            case PGRES_POLLING_OK: ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ev->log, 0, "PQconnectPoll == PGRES_POLLING_OK"); break;
+            case PGRES_POLLING_WRITING: if (PQstatus(pac->conn) == CONNECTION_MADE) goto again; return;
+            default: return;
+        }
+        if (c->write->timer_set) ngx_del_timer(c->write);
+        pac->state = state_idle;
+        if (ngx_postgres_async_send(pa) != NGX_OK) goto close;
+        return;
+    }
+    if (ev->write) return;
+    if (!PQconsumeInput(pac->conn)) { ngx_log_error(NGX_LOG_ERR, ev->log, 0, "!PQconsumeInput and %s", PQerrorMessageMy(pac->conn)); goto close; }
+    if (PQisBusy(pac->conn)) { ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ev->log, 0, "PQisBusy"); return; }
+    ngx_flag_t failed = 0;
+    for (PGresult *res; (res = PQgetResult(pac->conn)); PQclear(res)) switch(PQresultStatus(res)) {
+        case PGRES_FATAL_ERROR: ngx_log_error(NGX_LOG_ERR, ev->log, 0, "PQresultStatus == PGRES_FATAL_ERROR and %s", PQresultErrorMessageMy(res)); failed = 1; break;
+        default: ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ev->log, 0, "PQresultStatus == %s", PQresStatus(PQresultStatus(res))); break;
+    }
+    if (PQstatus(pac->conn) == CONNECTION_BAD) goto close; // statement is sent again after reconnect
+    if (pac->state == state_result && !ngx_queue_empty(&pa->queue)) { // failed statement is logged above and dropped
+        ngx_queue_t *queue = ngx_queue_head(&pa->queue);
+        ngx_queue_remove(queue);
+        ngx_free(ngx_queue_data(queue, ngx_postgres_async_job_t, queue));
+        pa->n--;
+        if (failed) pa->failed++;
+    }
+    pac->state = state_idle;
+    if (ngx_postgres_async_send(pa) == NGX_OK) return;
+close:
+    ngx_postgres_async_close(pa);
+}
+
+
+static void ngx_postgres_async_timeout(ngx_event_t *ev) {
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ev->log, 0, "%s", __func__);
+    ngx_postgres_async_t *pa = ev->data;
+    if (ngx_postgres_async_connect(pa) != NGX_OK) ngx_postgres_async_close(pa);
+}
+
+
+static void ngx_postgres_async_lock(ngx_event_t *ev) {
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ev->log, 0, "%s", __func__);
+    ngx_postgres_async_t *pa = ev->data;
+    switch (ngx_postgres_async_open(pa)) {
+        case NGX_DECLINED: ngx_add_timer(ev, pa->connect->timeout); return;
+        case NGX_OK: if (ngx_postgres_async_send(pa) != NGX_OK) ngx_postgres_async_close(pa); return;
+        default: return;
+    }
+}
+
+
+static ngx_int_t ngx_postgres_async_push(ngx_postgres_async_t *pa, ngx_postgres_async_job_t *job) {
+    if (pa->n >= pa->pusc->async.max || (!pa->lock.timer_set && (!pa->common.conn || pa->offset < pa->size))) { // keep order behind spooled statements, but only memory until spool is free
+        ngx_int_t rc = ngx_postgres_async_spill(pa, job);
+        ngx_free(job);
+        if (rc != NGX_OK) return rc;
+    } else {
+        ngx_queue_insert_tail(&pa->queue, &job->queue);
+        pa->n++;
+    }
+    if (ngx_postgres_async_send(pa) != NGX_OK) ngx_postgres_async_close(pa);
+    return NGX_OK;
+}
+
+
+static ngx_postgres_async_job_t *ngx_postgres_async_job(ngx_http_request_t *r, ngx_postgres_query_t *query) {
+    ngx_postgres_param_t *param = query->params.elts;
+    ngx_http_variable_value_t **values = NULL;
+    size_t sql = query->sql.len - query->percent;
+    size_t size = sizeof(uint32_t) + sql + 1;
+    if (query->params.nelts && !(values = ngx_pnalloc(r->pool, query->params.nelts * sizeof(*values)))) { ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "!ngx_pnalloc"); return NULL; }
+    for (ngx_uint_t i = 0; i < query->params.nelts; i++) {
+        ngx_http_variable_value_t *value = ngx_http_get_indexed_variable(r, param[i].index);
+        if (!value || !value->data || !value->len) value = NULL;
+        values[i] = value;
+        size += sizeof(uint32_t) + sizeof(int32_t) + (value ? value->len + 1 : 0);
+    }
+    ngx_postgres_async_job_t *job = ngx_alloc(sizeof(*job) + size, r->connection->log);
+    if (!job) { ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "!ngx_alloc"); return NULL; }
+    job->size = size;
+    u_char *p = (u_char *)(job + 1);
+    uint32_t nParams = query->params.nelts;
+    p = ngx_cpymem(p, &nParams, sizeof(nParams));
+    if (ngx_snprintf(p, sql, (char *)query->sql.data) != p + sql) { ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "ngx_snprintf"); ngx_free(job); return NULL; }
+    p += sql;
+    *p++ = '\0';
+    for (ngx_uint_t i = 0; i < query->params.nelts; i++) {
+        uint32_t oid = param[i].oid;
+        int32_t len = values[i] ? (int32_t)values[i]->len : -1;
+        p = ngx_cpymem(p, &oid, sizeof(oid));
+        p = ngx_cpymem(p, &len, sizeof(len));
+        if (!values[i]) continue;
+        p = ngx_cpymem(p, values[i]->data, values[i]->len);
+        *p++ = '\0';
+    }
+    return job;
+}
+
+
+ngx_int_t ngx_postgres_async_handler(ngx_http_request_t *r) {
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "%s", __func__);
+    ngx_postgres_location_t *location = ngx_http_get_module_loc_conf(r, ngx_postgres_module);
+    ngx_postgres_upstream_srv_conf_t *pusc = ngx_http_conf_upstream_srv_conf(location->upstream.upstream, ngx_postgres_module);
+    ngx_postgres_async_t *pa = pusc->async.queue;
+    if (!pa) { ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "async queue is not initialized"); return NGX_HTTP_SERVICE_UNAVAILABLE; }
+    ngx_postgres_query_t *query = location->queries.elts;
+    for (ngx_uint_t i = 0; i < location->queries.nelts; i++) {
+        ngx_postgres_async_job_t *job = ngx_postgres_async_job(r, &query[i]);
+        if (!job) { ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "!ngx_postgres_async_job"); return NGX_HTTP_INTERNAL_SERVER_ERROR; }
+        if (ngx_postgres_async_push(pa, job) != NGX_OK) return NGX_HTTP_SERVICE_UNAVAILABLE;
+    }
+    r->headers_out.status = NGX_HTTP_ACCEPTED;
+    r->headers_out.content_length_n = 0;
+    r->header_only = 1;
+    return ngx_http_send_header(r);
+}
+
+
+ngx_int_t ngx_postgres_async_variable(ngx_http_request_t *r, ngx_http_variable_value_t *v, uintptr_t data) {
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "%s", __func__);
+    v->not_found = 1;
+    ngx_postgres_location_t *location = ngx_http_get_module_loc_conf(r, ngx_postgres_module);
+    if (!location->upstream.upstream || !location->upstream.upstream->srv_conf) return NGX_OK;
+    ngx_postgres_upstream_srv_conf_t *pusc = ngx_http_conf_upstream_srv_conf(location->upstream.upstream, ngx_postgres_module);
+    ngx_postgres_async_t *pa = pusc ? pusc->async.queue : NULL;
+    if (!pa) return NGX_OK;
+    if (!(v->data = ngx_pnalloc(r->pool, NGX_INT_T_LEN))) { ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "!ngx_pnalloc"); return NGX_ERROR; }
+    v->len = ngx_sprintf(v->data, "%ui", data ? pa->failed : pa->dropped) - v->data; // per worker
+    v->valid = 1;
+    v->no_cacheable = 0;
+    v->not_found = 0;
+    return NGX_OK;
+}
+
+
+static ngx_postgres_async_t *ngx_postgres_async(ngx_cycle_t *cycle, ngx_http_upstream_srv_conf_t *usc, ngx_uint_t index) {
+    ngx_postgres_upstream_srv_conf_t *pusc = ngx_http_conf_upstream_srv_conf(usc, ngx_postgres_module);
+    ngx_postgres_connect_t *connect;
+    ngx_addr_t *addr;
+    if (ngx_postgres_connect_first(usc, &connect, &addr) != NGX_OK) { ngx_log_error(NGX_LOG_ERR, cycle->log, 0, "ngx_postgres_connect_first != NGX_OK"); return NULL; }
+    ngx_postgres_async_t *pa = ngx_pcalloc(cycle->pool, sizeof(*pa));
+    if (!pa) { ngx_log_error(NGX_LOG_ERR, cycle->log, 0, "!ngx_pcalloc"); return NULL; }
+    pa->log = pusc->ps.log ? pusc->ps.log : cycle->log;
+    pa->connect = connect;
+    pa->pusc = pusc;
+    ngx_queue_init(&pa->queue);
+    ngx_postgres_common_t *pac = &pa->common;
+    if (!(pac->addr.sockaddr = ngx_pcalloc(cycle->pool, addr->socklen))) { ngx_log_error(NGX_LOG_ERR, pa->log, 0, "!ngx_pcalloc"); return NULL; }
+    ngx_memcpy(pac->addr.sockaddr, addr->sockaddr, addr->socklen);
+    pac->addr.socklen = addr->socklen;
+    pa->timeout.cancelable = 1;
+    pa->timeout.data = pa;
+    pa->timeout.handler = ngx_postgres_async_timeout;
+    pa->timeout.log = pa->log;
+    pa->lock.cancelable = 1;
+    pa->lock.data = pa;
+    pa->lock.handler = ngx_postgres_async_lock;
+    pa->lock.log = pa->log;
+    ngx_path_t *path = pusc->async.path;
+    pa->spool.log = pa->log;
+    pa->spool.name.len = path->name.len + sizeof("/async_") - 1 + NGX_INT_T_LEN + sizeof("_") - 1 + NGX_INT_T_LEN;
+    if (!(pa->spool.name.data = ngx_pnalloc(cycle->pool, pa->spool.name.len + 1))) { ngx_log_error(NGX_LOG_ERR, pa->log, 0, "!ngx_pnalloc"); return NULL; }
+    pa->spool.name.len = ngx_sprintf(pa->spool.name.data, "%V/async_%ui_%ui", &path->name, index, ngx_worker) - pa->spool.name.data; // stable across restarts
+    pa->spool.name.data[pa->spool.name.len] = '\0';
+    pa->spool.fd = NGX_INVALID_FILE;
+    if (ngx_postgres_async_open(pa) == NGX_DECLINED) { // worker of previous cycle is still exiting
+        ngx_log_error(NGX_LOG_NOTICE, pa->log, 0, "async spool \"%V\" is still used, statements are kept in memory until it is free", &pa->spool.name);
+        ngx_add_timer(&pa->lock, pa->connect->timeout);
+    }
+    pusc->async.queue = pa;
+    return pa;
+}
+
+
+ngx_int_t ngx_postgres_async_init_process(ngx_cycle_t *cycle) {
+    if (ngx_process != NGX_PROCESS_WORKER && ngx_process != NGX_PROCESS_SINGLE) return NGX_OK;
+    ngx_http_upstream_main_conf_t *umcf = ngx_http_cycle_get_module_main_conf(cycle, ngx_http_upstream_module);
+    if (!umcf) return NGX_OK;
+    ngx_http_upstream_srv_conf_t **usc = umcf->upstreams.elts;
+    for (ngx_uint_t i = 0; i < umcf->upstreams.nelts; i++) {
+        if (!usc[i]->srv_conf || !usc[i]->srv_conf[ngx_postgres_module.ctx_index]) continue;
+        ngx_postgres_upstream_srv_conf_t *pusc = ngx_http_conf_upstream_srv_conf(usc[i], ngx_postgres_module);
+        if (!pusc->async.path) continue;
+        ngx_postgres_async_t *pa = ngx_postgres_async(cycle, usc[i], i);
+        if (!pa) { ngx_log_error(NGX_LOG_ERR, cycle->log, 0, "!ngx_postgres_async"); continue; }
+        if (ngx_postgres_async_send(pa) != NGX_OK) ngx_postgres_async_close(pa); // replay spool left by previous worker
+    }
+    return NGX_OK;
+}
+
+
+void ngx_postgres_async_exit_process(ngx_cycle_t *cycle) {
+    ngx_http_upstream_main_conf_t *umcf = ngx_http_cycle_get_module_main_conf(cycle, ngx_http_upstream_module);
+    if (!umcf) return;
+    ngx_http_upstream_srv_conf_t **usc = umcf->upstreams.elts;
+    for (ngx_uint_t i = 0; i < umcf->upstreams.nelts; i++) {
+        if (!usc[i]->srv_conf || !usc[i]->srv_conf[ngx_postgres_module.ctx_index]) continue;
+        ngx_postgres_upstream_srv_conf_t *pusc = ngx_http_conf_upstream_srv_conf(usc[i], ngx_postgres_module);
+        ngx_postgres_async_t *pa = pusc->async.queue;
+        if (!pa) continue;
+        if (pa->lock.timer_set) ngx_del_timer(&pa->lock);
+        ngx_postgres_async_flush(pa);
+        if (pa->spool.fd != NGX_INVALID_FILE && ngx_close_file(pa->spool.fd) == NGX_FILE_ERROR) ngx_log_error(NGX_LOG_ALERT, pa->log, ngx_errno, ngx_close_file_n " \"%V\" failed", &pa->spool.name);
+        pa->spool.fd = NGX_INVALID_FILE;
+    }
+}
+
+
+char *ngx_postgres_async_conf(ngx_conf_t *cf, ngx_command_t *cmd, void *conf) {
+    ngx_postgres_location_t *location = conf;
+    if (location->async != NGX_CONF_UNSET_UINT) return "duplicate";
+    ngx_str_t *elts = cf->args->elts;
+    static const ngx_conf_enum_t e[] = {
+        { ngx_string("off"), 0 },
+        { ngx_string("no"), 0 },
+        { ngx_string("false"), 0 },
+        { ngx_string("on"), 1 },
+        { ngx_string("yes"), 1 },
+        { ngx_string("true"), 1 },
+        { ngx_null_string, 0 }
+    };
+    ngx_uint_t i;
+    for (i = 0; e[i].name.len; i++) if (e[i].name.len == elts[1].len && !ngx_strncasecmp(e[i].name.data, elts[1].data, elts[1].len)) break;
+    if (!e[i].name.len) { ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "\"%V\" directive error: value \"%V\" must be \"off\", \"no\", \"false\", \"on\", \"yes\" or \"true\"", &cmd->name, &elts[1]); return NGX_CONF_ERROR; }
+    location->async = e[i].value ? 1024 : 0;
+    for (ngx_uint_t i = 2; i < cf->args->nelts; i++) {
+        if (elts[i].len > sizeof("queue=") - 1 && !ngx_strncasecmp(elts[i].data, (u_char *)"queue=", sizeof("queue=") - 1)) {
+            elts[i].len = elts[i].len - (sizeof("queue=") - 1);
+            elts[i].data = &elts[i].data[sizeof("queue=") - 1];
+            ngx_int_t n = ngx_atoi(elts[i].data, elts[i].len);
+            if (n == NGX_ERROR) { ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "\"%V\" directive error: \"queue\" value \"%V\" must be number", &cmd->name, &elts[i]); return NGX_CONF_ERROR; }
+            if (n <= 0) { ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "\"%V\" directive error: \"queue\" value \"%V\" must be positive", &cmd->name, &elts[i]); return NGX_CONF_ERROR; }
+            if (location->async) location->async = (ngx_uint_t)n;
+            continue;
+        }
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "\"%V\" directive error: invalid additional parameter \"%V\"", &cmd->name, &elts[i]);
+        return NGX_CONF_ERROR;
+    }
+    return NGX_CONF_OK;
+}
@@ -0,0 +1,357 @@
+#include "ngx_postgres_include.h"
+
+
+typedef struct {
+    ngx_event_t timer;
+    ngx_postgres_location_t *location;
+    ngx_queue_t queue;
+    ngx_queue_t requests;
+    ngx_str_t key; // values of parameters, which are not arrays
+    ngx_uint_t n;
+} ngx_postgres_batch_t;
+
+typedef struct ngx_postgres_batch_ctx_s ngx_postgres_batch_ctx_t;
+
+struct ngx_postgres_batch_ctx_s {
+    ngx_event_t wait;
+    ngx_flag_t alone;
+    ngx_flag_t leader;
+    ngx_int_t rc;
+    ngx_postgres_batch_t *batch;
+    ngx_postgres_batch_ctx_t *parent;
+    ngx_queue_t followers;
+    ngx_queue_t queue;
+    ngx_str_t charset;
+    PGresult *res;
+};
+
+
+static ngx_queue_t ngx_postgres_batches; // per-worker, one per location and key while collecting
+
+
+static void ngx_postgres_batch_free(ngx_postgres_batch_t *batch) {
+    if (batch->timer.timer_set) ngx_del_timer(&batch->timer);
+    ngx_queue_remove(&batch->queue);
+    ngx_free(batch);
+}
+
+
+static void ngx_postgres_batch_flush(ngx_postgres_batch_t *batch) {
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, batch->timer.log, 0, "%s", __func__);
+    if (!ngx_queue_empty(&batch->requests)) {
+        ngx_queue_t *queue = ngx_queue_head(&batch->requests);
+        ngx_queue_remove(queue);
+        ngx_postgres_batch_ctx_t *leader = ngx_queue_data(queue, ngx_postgres_batch_ctx_t, queue);
+        leader->batch = NULL;
+        leader->leader = 1;
+        ngx_queue_init(&leader->followers);
+        while (!ngx_queue_empty(&batch->requests)) {
+            queue = ngx_queue_head(&batch->requests);
+            ngx_queue_remove(queue);
+            ngx_postgres_batch_ctx_t *ctx = ngx_queue_data(queue, ngx_postgres_batch_ctx_t, queue);
+            ctx->batch = NULL;
+            ctx->parent = leader;
+            ngx_queue_insert_tail(&leader->followers, &ctx->queue);
+        }
+        ngx_post_event(&leader->wait, &ngx_posted_events);
+    }
+    ngx_postgres_batch_free(batch); // next request starts new batch
+}
+
+
+static void ngx_postgres_batch_timer_handler(ngx_event_t *ev) {
+    ngx_postgres_batch_flush(ev->data);
+}
+
+
+static void ngx_postgres_batch_release(ngx_postgres_batch_ctx_t *ctx, ngx_int_t rc, ngx_flag_t alone) {
+    if (!ctx->leader) return;
+    while (!ngx_queue_empty(&ctx->followers)) { // followers left without rows get the error of leader or run the query themselves
+        ngx_queue_t *queue = ngx_queue_head(&ctx->followers);
+        ngx_queue_remove(queue);
+        ngx_postgres_batch_ctx_t *fctx = ngx_queue_data(queue, ngx_postgres_batch_ctx_t, queue);
+        fctx->alone = alone;
+        fctx->parent = NULL;
+        fctx->rc = rc;
+        ngx_post_event(&fctx->wait, &ngx_posted_events);
+    }
+    ctx->leader = 0;
+}
+
+
+static void ngx_postgres_batch_cleanup(void *data) {
+    ngx_postgres_batch_ctx_t *ctx = data;
+    if (ctx->wait.posted) ngx_delete_posted_event(&ctx->wait);
+    if (ctx->batch) {
+        ngx_postgres_batch_t *batch = ctx->batch;
+        ngx_queue_remove(&ctx->queue);
+        if (!--batch->n) ngx_postgres_batch_free(batch);
+    }
+    if (ctx->parent) ngx_queue_remove(&ctx->queue);
+    ngx_postgres_batch_release(ctx, 0, 0);
+    if (ctx->res) PQclear(ctx->res);
+}
+
+
+static void ngx_postgres_batch_wait_handler(ngx_event_t *ev) {
+    ngx_http_request_t *r = ev->data;
+    ngx_connection_t *c = r->connection;
+    ngx_http_set_log_request(c->log, r);
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, c->log, 0, "%s", __func__);
+    ngx_postgres_batch_ctx_t *ctx = ngx_http_get_module_ctx(r, ngx_postgres_module);
+    ngx_http_finalize_request(r, ctx->res ? ngx_postgres_output_result(r, ctx->res, &ctx->charset) : ctx->rc ? ctx->rc : ngx_postgres_handler(r));
+    ngx_http_run_posted_requests(c);
+}
+
+
+static ngx_int_t ngx_postgres_batch_key(ngx_http_request_t *r, ngx_str_t *key) {
+    ngx_postgres_location_t *location = ngx_http_get_module_loc_conf(r, ngx_postgres_module);
+    ngx_postgres_query_t *query = location->queries.elts;
+    ngx_postgres_param_t *param = query->params.elts;
+    ngx_uint_t *ids = query->ids.elts;
+    ngx_http_variable_value_t *value[query->params.nelts + query->ids.nelts + 1];
+    ngx_uint_t n = 0;
+    for (ngx_uint_t i = 0; i < query->params.nelts; i++) if (location->batch.column.len && param[i].index != (ngx_uint_t)location->batch.index) value[n++] = ngx_http_get_indexed_variable(r, param[i].index); // taken from leader for every request
+    for (ngx_uint_t i = 0; i < query->ids.nelts; i++) value[n++] = ngx_http_get_indexed_variable(r, ids[i]);
+    size_t size = 0;
+    for (ngx_uint_t i = 0; i < n; i++) {
+        if (value[i] && (!value[i]->data || !value[i]->len)) value[i] = NULL; // NULL as for single request
+        size += value[i] ? NGX_SIZE_T_LEN + sizeof(":") - 1 + value[i]->len : sizeof("-") - 1;
+    }
+    ngx_str_null(key);
+    if (!size) return NGX_OK;
+    if (!(key->data = ngx_pnalloc(r->pool, size))) { ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "!ngx_pnalloc"); return NGX_ERROR; }
+    u_char *p = key->data;
+    for (ngx_uint_t i = 0; i < n; i++) p = value[i] ? ngx_sprintf(p, "%uz:%v", value[i]->len, value[i]) : ngx_copy(p, "-", sizeof("-") - 1);
+    key->len = p - key->data;
+    return NGX_OK;
+}
+
+
+ngx_int_t ngx_postgres_batch_handler(ngx_http_request_t *r) {
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "%s", __func__);
+    ngx_postgres_location_t *location = ngx_http_get_module_loc_conf(r, ngx_postgres_module);
+    if (location->batch.column.len && !(r->method & (NGX_HTTP_GET|NGX_HTTP_HEAD))) return NGX_DECLINED;
+    ngx_postgres_batch_ctx_t *ctx = ngx_http_get_module_ctx(r, ngx_postgres_module);
+    if (ctx && (ctx->leader || ctx->alone)) return NGX_DECLINED;
+    if (!ctx) {
+        if (!(ctx = ngx_pcalloc(r->pool, sizeof(*ctx)))) { ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "!ngx_pcalloc"); return NGX_HTTP_INTERNAL_SERVER_ERROR; }
+        ngx_pool_cleanup_t *cln = ngx_pool_cleanup_add(r->pool, 0);
+        if (!cln) { ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "!ngx_pool_cleanup_add"); return NGX_HTTP_INTERNAL_SERVER_ERROR; }
+        cln->data = ctx;
+        cln->handler = ngx_postgres_batch_cleanup;
+        ctx->wait.data = r;
+        ctx->wait.handler = ngx_postgres_batch_wait_handler;
+        ctx->wait.log = r->connection->log;
+        ngx_http_set_ctx(r, ctx, ngx_postgres_module);
+    }
+    ngx_str_t key;
+    if (ngx_postgres_batch_key(r, &key) != NGX_OK) { ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "ngx_postgres_batch_key != NGX_OK"); return NGX_HTTP_INTERNAL_SERVER_ERROR; }
+    if (!ngx_postgres_batches.next) ngx_queue_init(&ngx_postgres_batches);
+    ngx_postgres_batch_t *batch = NULL;
+    for (ngx_queue_t *queue = ngx_queue_head(&ngx_postgres_batches); queue != ngx_queue_sentinel(&ngx_postgres_batches); queue = ngx_queue_next(queue)) {
+        ngx_postgres_batch_t *elt = ngx_queue_data(queue, ngx_postgres_batch_t, queue);
+        if (elt->location == location && elt->key.len == key.len && (!key.len || !ngx_memcmp(elt->key.data, key.data, key.len))) { batch = elt; break; }
+    }
+    if (!batch) {
+        if (!(batch = ngx_calloc(sizeof(*batch) + key.len, ngx_cycle->log))) { ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "!ngx_calloc"); return NGX_HTTP_INTERNAL_SERVER_ERROR; }
+        batch->key.data = (u_char *)(batch + 1);
+        batch->key.len = key.len;
+        ngx_memcpy(batch->key.data, key.data, key.len);
+        batch->location = location;
+        batch->timer.data = batch;
+        batch->timer.handler = ngx_postgres_batch_timer_handler;
+        batch->timer.log = ngx_cycle->log;
+        ngx_queue_init(&batch->requests);
+        ngx_queue_insert_tail(&ngx_postgres_batches, &batch->queue);
+    }
+    ngx_queue_insert_tail(&batch->requests, &ctx->queue);
+    ctx->batch = batch;
+    ctx->rc = 0;
+    r->main->count++;
+    if (++batch->n >= location->batch.max) ngx_postgres_batch_flush(batch);
+    else if (!batch->timer.timer_set) ngx_add_timer(&batch->timer, location->batch.window);
+    return NGX_DONE;
+}
+
+
+static ngx_http_variable_value_t *ngx_postgres_batch_value(ngx_http_request_t *r, ngx_uint_t index) {
+    ngx_http_variable_value_t *value = ngx_http_get_indexed_variable(r, index);
+    return value && !value->not_found && value->len ? value : NULL; // NULL as for single request
+}
+
+
+static size_t ngx_postgres_batch_size(ngx_http_request_t *r, ngx_uint_t index) {
+    ngx_http_variable_value_t *value = ngx_postgres_batch_value(r, index);
+    return value ? 2 * value->len + sizeof("\"\",") - 1 : sizeof("NULL,") - 1;
+}
+
+
+static u_char *ngx_postgres_batch_escape(u_char *d, ngx_http_request_t *r, ngx_uint_t index) {
+    ngx_http_variable_value_t *value = ngx_postgres_batch_value(r, index);
+    if (!value) return ngx_copy(d, "NULL", sizeof("NULL") - 1);
+    *d++ = '"';
+    for (size_t i = 0; i < value->len; i++) {
+        if (value->data[i] == '"' || value->data[i] == '\\') *d++ = '\\';
+        *d++ = value->data[i];
+    }
+    *d++ = '"';
+    return d;
+}
+
+
+u_char *ngx_postgres_batch_array(ngx_http_request_t *r, ngx_uint_t index) {
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "%s", __func__);
+    ngx_postgres_batch_ctx_t *ctx = ngx_http_get_module_ctx(r, ngx_postgres_module);
+    ngx_flag_t leader = ctx && ctx->leader;
+    size_t size = sizeof("{}") + ngx_postgres_batch_size(r, index);
+    if (leader) for (ngx_queue_t *queue = ngx_queue_head(&ctx->followers); queue != ngx_queue_sentinel(&ctx->followers); queue = ngx_queue_next(queue)) {
+        ngx_postgres_batch_ctx_t *fctx = ngx_queue_data(queue, ngx_postgres_batch_ctx_t, queue);
+        size += ngx_postgres_batch_size(fctx->wait.data, index);
+    }
+    u_char *array = ngx_pnalloc(r->pool, size);
+    if (!array) { ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "!ngx_pnalloc"); return NULL; }
+    u_char *p = array;
+    *p++ = '{';
+    p = ngx_postgres_batch_escape(p, r, index);
+    if (leader) for (ngx_queue_t *queue = ngx_queue_head(&ctx->followers); queue != ngx_queue_sentinel(&ctx->followers); queue = ngx_queue_next(queue)) {
+        ngx_postgres_batch_ctx_t *fctx = ngx_queue_data(queue, ngx_postgres_batch_ctx_t, queue);
+        *p++ = ',';
+        p = ngx_postgres_batch_escape(p, fctx->wait.data, index);
+    }
+    *p++ = '}';
+    *p = '\0';
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "array = %s", array);
+    return array;
+}
+
+
+static PGresult *ngx_postgres_batch_rows(ngx_http_request_t *r, PGresult *res, int col, int k) {
+    PGresult *rows = PQcopyResult(res, PG_COPYRES_ATTRS);
+    if (!rows) return NULL;
+    ngx_postgres_location_t *location = ngx_http_get_module_loc_conf(r, ngx_postgres_module);
+    ngx_http_variable_value_t *value = col >= 0 ? ngx_postgres_batch_value(r, location->batch.index) : NULL;
+    if (PQresultStatus(res) != PGRES_TUPLES_OK) return rows; // only status of leader
+    if (col >= 0 && !value) return rows; // NULL key matches no row
+    int nfields = PQnfields(res);
+    for (int row = 0, m = 0; row < PQntuples(res); row++) {
+        if (col >= 0 && (PQgetisnull(res, row, col) || (size_t)PQgetlength(res, row, col) != value->len || ngx_strncmp(PQgetvalue(res, row, col), value->data, value->len))) continue;
+        if (col < 0 && row != k) continue;
+        for (int i = 0; i < nfields; i++) if (!PQsetvalue(rows, m, i, PQgetisnull(res, row, i) ? NULL : PQgetvalue(res, row, i), PQgetisnull(res, row, i) ? -1 : PQgetlength(res, row, i))) { PQclear(rows); return NULL; }
+        m++;
+    }
+    return rows;
+}
+
+
+ngx_int_t ngx_postgres_batch_split(ngx_postgres_data_t *pd) {
+    ngx_http_request_t *r = pd->request;
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "%s", __func__);
+    ngx_postgres_batch_ctx_t *ctx = ngx_http_get_module_ctx(r, ngx_postgres_module);
+    PGresult *res = pd->result.res;
+    if (!ctx) return NGX_OK;
+    ngx_postgres_location_t *location = ngx_http_get_module_loc_conf(r, ngx_postgres_module);
+    ngx_flag_t tuples = PQresultStatus(res) == PGRES_TUPLES_OK;
+    int col = -1, n = 1;
+    if (tuples && location->batch.column.len && (col = PQfnumber(res, (const char *)location->batch.column.data)) < 0) { ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "\"postgres_lookup\" column \"%V\" not found", &location->batch.column); return NGX_ERROR; }
+    if (!ctx->leader || ngx_queue_empty(&ctx->followers)) return NGX_OK; // only own rows were queried
+    for (ngx_queue_t *queue = ngx_queue_head(&ctx->followers); queue != ngx_queue_sentinel(&ctx->followers); queue = ngx_queue_next(queue)) n++;
+    if (tuples && col < 0 && PQntuples(res) != n) { // rows can not be told apart, but statement did run, so no retry
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "\"postgres_batch\" statement returned %d rows for %d requests", PQntuples(res), n);
+        ngx_postgres_batch_release(ctx, NGX_HTTP_INTERNAL_SERVER_ERROR, 0);
+        return NGX_ERROR;
+    }
+    for (int i = 1; !ngx_queue_empty(&ctx->followers); i++) {
+        ngx_queue_t *queue = ngx_queue_head(&ctx->followers);
+        ngx_postgres_batch_ctx_t *fctx = ngx_queue_data(queue, ngx_postgres_batch_ctx_t, queue);
+        ngx_http_request_t *fr = fctx->wait.data;
+        if (!(fctx->res = ngx_postgres_batch_rows(fr, res, col, i))) { ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "!ngx_postgres_batch_rows"); return NGX_ERROR; }
+        ngx_str_t *charset = &pd->common.charset;
+        if (charset->len && (fctx->charset.data = ngx_pnalloc(fr->pool, charset->len))) {
+            ngx_memcpy(fctx->charset.data, charset->data, charset->len);
+            fctx->charset.len = charset->len;
+        }
+        ngx_queue_remove(queue);
+        fctx->parent = NULL;
+        ngx_post_event(&fctx->wait, &ngx_posted_events);
+    }
+    if (!tuples) return NGX_OK; // leader keeps its status
+    PGresult *rows = ngx_postgres_batch_rows(r, res, col, 0);
+    if (!rows) { ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "!ngx_postgres_batch_rows"); return NGX_ERROR; }
+    PQclear(res);
+    pd->result.res = rows;
+    return NGX_OK;
+}
+
+
+ngx_int_t ngx_postgres_batch_retry(ngx_postgres_data_t *pd) {
+    ngx_http_request_t *r = pd->request;
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "%s", __func__);
+    ngx_postgres_batch_ctx_t *ctx = ngx_http_get_module_ctx(r, ngx_postgres_module);
+    if (!ctx || !ctx->leader || ngx_queue_empty(&ctx->followers)) return NGX_DECLINED;
+    ngx_postgres_batch_release(ctx, 0, 1); // one bad row fails only its own request
+    ngx_postgres_location_t *location = ngx_http_get_module_loc_conf(r, ngx_postgres_module);
+    ngx_postgres_query_t *query = location->queries.elts;
+    ngx_postgres_param_t *param = query->params.elts;
+    for (ngx_uint_t i = 0; i < query->params.nelts; i++) {
+        if (location->batch.column.len && param[i].index != (ngx_uint_t)location->batch.index) continue;
+        if (!(pd->query.paramValues[i] = ngx_postgres_batch_array(r, param[i].index))) { ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "!ngx_postgres_batch_array"); return NGX_ERROR; }
+    }
+    return NGX_OK;
+}
+
+
+void ngx_postgres_batch_finalize(ngx_http_request_t *r, ngx_int_t rc) {
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "%s", __func__);
+    ngx_postgres_batch_ctx_t *ctx = ngx_http_get_module_ctx(r, ngx_postgres_module);
+    if (ctx) ngx_postgres_batch_release(ctx, rc >= NGX_HTTP_SPECIAL_RESPONSE && rc != NGX_HTTP_CLIENT_CLOSED_REQUEST ? rc : 0, 0);
+}
+
+
+static char *ngx_postgres_batch_parse(ngx_conf_t *cf, ngx_command_t *cmd, ngx_postgres_location_t *location, ngx_uint_t i) {
+    ngx_str_t *elts = cf->args->elts;
+    location->batch.max = 64;
+    location->batch.window = 1;
+    for (; i < cf->args->nelts; i++) {
+        if (elts[i].len > sizeof("window=") - 1 && !ngx_strncasecmp(elts[i].data, (u_char *)"window=", sizeof("window=") - 1)) {
+            elts[i].len = elts[i].len - (sizeof("window=") - 1);
+            elts[i].data = &elts[i].data[sizeof("window=") - 1];
+            ngx_int_t n = ngx_parse_time(&elts[i], 0);
+            if (n == NGX_ERROR) { ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "\"%V\" directive error: \"window\" value \"%V\" must be time", &cmd->name, &elts[i]); return NGX_CONF_ERROR; }
+            location->batch.window = (ngx_msec_t)n;
+            continue;
+        }
+        if (elts[i].len > sizeof("max=") - 1 && !ngx_strncasecmp(elts[i].data, (u_char *)"max=", sizeof("max=") - 1)) {
+            elts[i].len = elts[i].len - (sizeof("max=") - 1);
+            elts[i].data = &elts[i].data[sizeof("max=") - 1];
+            ngx_int_t n = ngx_atoi(elts[i].data, elts[i].len);
+            if (n == NGX_ERROR) { ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "\"%V\" directive error: \"max\" value \"%V\" must be number", &cmd->name, &elts[i]); return NGX_CONF_ERROR; }
+            if (n <= 0) { ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "\"%V\" directive error: \"max\" value \"%V\" must be positive", &cmd->name, &elts[i]); return NGX_CONF_ERROR; }
+            location->batch.max = (ngx_uint_t)n;
+            continue;
+        }
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "\"%V\" directive error: invalid additional parameter \"%V\"", &cmd->name, &elts[i]);
+        return NGX_CONF_ERROR;
+    }
+    return NGX_CONF_OK;
+}
+
+
+char *ngx_postgres_batch_conf(ngx_conf_t *cf, ngx_command_t *cmd, void *conf) {
+    ngx_postgres_location_t *location = conf;
+    if (location->batch.max) return "duplicate";
+    return ngx_postgres_batch_parse(cf, cmd, location, 1);
+}
+
+
+char *ngx_postgres_lookup_conf(ngx_conf_t *cf, ngx_command_t *cmd, void *conf) {
+    ngx_postgres_location_t *location = conf;
+    if (location->batch.max) return "duplicate";
+    ngx_str_t *elts = cf->args->elts;
+    if (elts[1].len < 2 || elts[1].data[0] != '$') { ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "\"%V\" directive error: invalid variable name \"%V\"", &cmd->name, &elts[1]); return NGX_CONF_ERROR; }
+    ngx_str_t name = {elts[1].len - 1, elts[1].data + 1};
+    if ((location->batch.index = ngx_http_get_variable_index(cf, &name)) == NGX_ERROR) { ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "\"%V\" directive error: ngx_http_get_variable_index == NGX_ERROR", &cmd->name); return NGX_CONF_ERROR; }
+    if (!elts[2].len) return "error: empty column";
+    location->batch.column = elts[2];
+    return ngx_postgres_batch_parse(cf, cmd, location, 3);
+}
@@ -0,0 +1,779 @@
+#include <ngx_md5.h>
+#include "ngx_postgres_include.h"
+
+
+typedef struct {
+    size_t charset;
+    size_t size;
+    size_t tags;
+    size_t type;
+    time_t expire;
+    uint64_t start;
+} ngx_postgres_cache_header_t;
+
+typedef struct {
+    ngx_rbtree_node_t node;
+    ngx_queue_t queue;
+    ngx_msec_t lock;
+    ngx_postgres_cache_header_t h;
+    u_char *data;
+    u_char key[16];
+} ngx_postgres_cache_node_t;
+
+typedef struct {
+    ngx_str_node_t sn;
+    ngx_queue_t queue;
+    uint64_t time;
+} ngx_postgres_cache_tag_t;
+
+typedef struct {
+    ngx_queue_t queue;
+    ngx_queue_t tags;
+    ngx_rbtree_node_t sentinel;
+    ngx_rbtree_node_t tag_sentinel;
+    ngx_rbtree_t rbtree;
+    ngx_rbtree_t tag_rbtree;
+    time_t valid;
+    uint64_t flush;
+} ngx_postgres_cache_shm_t;
+
+typedef struct {
+    ngx_postgres_cache_shm_t *sh;
+    ngx_slab_pool_t *shpool;
+    ngx_str_t path;
+    off_t max; // size of files
+} ngx_postgres_cache_t;
+
+typedef struct {
+    ngx_str_t name;
+    off_t size;
+    time_t expire;
+} ngx_postgres_cache_file_t;
+
+typedef struct {
+    ngx_array_t files;
+    ngx_pool_t *pool;
+    off_t size;
+} ngx_postgres_cache_manager_t;
+
+typedef struct {
+    ngx_str_node_t sn;
+    ngx_queue_t followers;
+} ngx_postgres_coalesce_t;
+
+typedef struct {
+    ngx_event_t wait;
+    ngx_flag_t leader;
+    ngx_msec_t lock;
+    ngx_msec_t start;
+    ngx_postgres_cache_header_t h;
+    ngx_postgres_cache_t *cache;
+    ngx_postgres_coalesce_t *coalesce;
+    ngx_queue_t queue;
+    u_char *data;
+    u_char key[16];
+} ngx_postgres_cache_ctx_t;
+
+
+static ngx_rbtree_t ngx_postgres_coalesce_rbtree; // in-flight queries of worker
+static ngx_rbtree_node_t ngx_postgres_coalesce_sentinel;
+
+
+static void ngx_postgres_cache_rbtree_insert_value(ngx_rbtree_node_t *temp, ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel) {
+    for (ngx_rbtree_node_t **p; ; temp = *p) {
+        if (node->key != temp->key) p = node->key < temp->key ? &temp->left : &temp->right;
+        else p = ngx_memcmp(((ngx_postgres_cache_node_t *)node)->key, ((ngx_postgres_cache_node_t *)temp)->key, sizeof(((ngx_postgres_cache_node_t *)node)->key)) < 0 ? &temp->left : &temp->right;
+        if (*p == sentinel) { *p = node; break; }
+    }
+    node->parent = temp;
+    node->left = sentinel;
+    node->right = sentinel;
+    ngx_rbt_red(node);
+}
+
+
+static ngx_postgres_cache_node_t *ngx_postgres_cache_lookup(ngx_postgres_cache_t *cache, u_char *key) {
+    ngx_rbtree_key_t hash;
+    ngx_memcpy(&hash, key, sizeof(hash));
+    ngx_rbtree_node_t *node = cache->sh->rbtree.root;
+    ngx_rbtree_node_t *sentinel = cache->sh->rbtree.sentinel;
+    while (node != sentinel) {
+        if (hash != node->key) { node = hash < node->key ? node->left : node->right; continue; }
+        ngx_postgres_cache_node_t *pcn = (ngx_postgres_cache_node_t *)node;
+        ngx_int_t rc = ngx_memcmp(key, pcn->key, sizeof(pcn->key));
+        if (!rc) return pcn;
+        node = rc < 0 ? node->left : node->right;
+    }
+    return NULL;
+}
+
+
+static void ngx_postgres_cache_delete(ngx_postgres_cache_t *cache, ngx_postgres_cache_node_t *pcn) {
+    ngx_rbtree_delete(&cache->sh->rbtree, &pcn->node);
+    ngx_queue_remove(&pcn->queue);
+    ngx_slab_free_locked(cache->shpool, pcn);
+}
+
+
+static void *ngx_postgres_cache_slab(ngx_postgres_cache_t *cache, size_t size) {
+    void *p;
+    while (!(p = ngx_slab_alloc_locked(cache->shpool, size))) { // evict least recently used
+        if (ngx_queue_empty(&cache->sh->queue)) return NULL;
+        ngx_postgres_cache_delete(cache, ngx_queue_data(ngx_queue_last(&cache->sh->queue), ngx_postgres_cache_node_t, queue));
+    }
+    return p;
+}
+
+
+static ngx_postgres_cache_node_t *ngx_postgres_cache_alloc(ngx_postgres_cache_t *cache, u_char *key, size_t size) {
+    ngx_postgres_cache_node_t *pcn = ngx_postgres_cache_slab(cache, sizeof(*pcn) + size);
+    if (!pcn) return NULL;
+    ngx_memzero(pcn, sizeof(*pcn));
+    ngx_memcpy(pcn->key, key, sizeof(pcn->key));
+    ngx_memcpy(&pcn->node.key, key, sizeof(pcn->node.key));
+    ngx_rbtree_insert(&cache->sh->rbtree, &pcn->node);
+    ngx_queue_insert_head(&cache->sh->queue, &pcn->queue);
+    return pcn;
+}
+
+
+static ngx_flag_t ngx_postgres_cache_locked(ngx_postgres_cache_node_t *pcn) {
+    return pcn && pcn->lock && (ngx_msec_int_t)(pcn->lock - ngx_current_msec) > 0;
+}
+
+
+static uint64_t ngx_postgres_cache_now(void) {
+    ngx_time_t *tp = ngx_timeofday();
+    return (uint64_t)tp->sec * 1000 + tp->msec;
+}
+
+
+static ngx_flag_t ngx_postgres_cache_stale(ngx_postgres_cache_t *cache, ngx_postgres_cache_header_t *h, u_char *tags) {
+    if (h->expire <= ngx_time()) return 1;
+    ngx_postgres_cache_shm_t *sh = cache->sh;
+    if (h->start <= sh->flush) return 1;
+    for (u_char *p = tags, *last = tags + h->tags, *space; p < last; p = space + 1) { // tags are separated by single space
+        if (!(space = ngx_strlchr(p, last, ' '))) space = last;
+        ngx_str_t tag = {space - p, p};
+        ngx_postgres_cache_tag_t *pct = (ngx_postgres_cache_tag_t *)ngx_str_rbtree_lookup(&sh->tag_rbtree, &tag, ngx_crc32_short(tag.data, tag.len));
+        if (pct && h->start <= pct->time) return 1; // invalidated after request had started
+    }
+    return 0;
+}
+
+
+static ngx_int_t ngx_postgres_cache_insert(ngx_postgres_cache_t *cache, u_char *key, ngx_postgres_cache_header_t *h, u_char *meta, ngx_chain_t *chain) {
+    size_t size = h->type + h->charset + h->tags + h->size;
+    if (size > (size_t)(cache->shpool->end - cache->shpool->start) / 8) return NGX_DECLINED; // do not flush the whole zone for one response
+    ngx_shmtx_lock(&cache->shpool->mutex);
+    ngx_postgres_cache_node_t *pcn = ngx_postgres_cache_lookup(cache, key);
+    if (pcn) ngx_postgres_cache_delete(cache, pcn);
+    if (ngx_postgres_cache_stale(cache, h, meta + h->type + h->charset)) { ngx_shmtx_unlock(&cache->shpool->mutex); return NGX_OK; } // invalidated while querying
+    if (!(pcn = ngx_postgres_cache_alloc(cache, key, size))) { ngx_shmtx_unlock(&cache->shpool->mutex); return NGX_DECLINED; }
+    if (cache->sh->valid < h->expire - (time_t)(h->start / 1000)) cache->sh->valid = h->expire - (time_t)(h->start / 1000);
+    pcn->h = *h;
+    u_char *p = pcn->data = (u_char *)(pcn + 1);
+    p = ngx_cpymem(p, meta, h->type + h->charset + h->tags);
+    for (ngx_chain_t *cl = chain; cl; cl = cl->next) p = ngx_cpymem(p, cl->buf->pos, cl->buf->last - cl->buf->pos);
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+    return NGX_OK;
+}
+
+
+static ngx_int_t ngx_postgres_cache_send(ngx_http_request_t *r, ngx_postgres_cache_header_t *h, u_char *data) {
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "%s", __func__);
+    r->headers_out.status = NGX_HTTP_OK;
+    r->headers_out.content_type.data = data;
+    r->headers_out.content_type.len = h->type;
+    r->headers_out.content_type_len = h->type;
+    r->headers_out.content_type_lowcase = NULL;
+    if (h->charset) {
+        r->headers_out.charset.data = data + h->type;
+        r->headers_out.charset.len = h->charset;
+    }
+    ngx_http_clear_content_length(r);
+    r->headers_out.content_length_n = h->size;
+    ngx_postgres_location_t *location = ngx_http_get_module_loc_conf(r, ngx_postgres_module);
+    if (location->etag.enable) {
+        ngx_buf_t buf;
+        ngx_memzero(&buf, sizeof(buf));
+        buf.pos = data + h->type + h->charset + h->tags;
+        buf.last = buf.pos + h->size;
+        ngx_chain_t body = {&buf, NULL};
+        if (ngx_postgres_etag(r, &body) != NGX_OK) { ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "ngx_postgres_etag != NGX_OK"); return NGX_ERROR; }
+    }
+    ngx_int_t rc = ngx_http_send_header(r);
+    if (rc == NGX_ERROR || rc > NGX_OK || r->header_only) return rc;
+    ngx_buf_t *b = ngx_calloc_buf(r->pool);
+    if (!b) { ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "!ngx_calloc_buf"); return NGX_ERROR; }
+    if (h->size) {
+        b->memory = 1;
+        b->pos = data + h->type + h->charset + h->tags;
+        b->last = b->pos + h->size;
+    }
+    b->last_buf = r == r->main ? 1 : 0;
+    b->last_in_chain = 1;
+    ngx_chain_t cl = {b, NULL};
+    return ngx_http_output_filter(r, &cl);
+}
+
+
+static u_char *ngx_postgres_cache_name(ngx_http_request_t *r, ngx_postgres_cache_ctx_t *ctx) {
+    ngx_postgres_cache_t *cache = ctx->cache;
+    u_char *name = ngx_pnalloc(r->pool, cache->path.len + 1 + 2 * sizeof(ctx->key) + sizeof(".4294967295"));
+    if (!name) { ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "!ngx_pnalloc"); return NULL; }
+    u_char *last = ngx_cpymem(name, cache->path.data, cache->path.len);
+    *last++ = '/';
+    last = ngx_hex_dump(last, ctx->key, sizeof(ctx->key));
+    *last = '\0';
+    return name;
+}
+
+
+static ngx_int_t ngx_postgres_cache_read(ngx_http_request_t *r, ngx_postgres_cache_ctx_t *ctx) {
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "%s", __func__);
+    ngx_file_t file;
+    ngx_memzero(&file, sizeof(file));
+    if (!(file.name.data = ngx_postgres_cache_name(r, ctx))) return NGX_DECLINED;
+    file.name.len = ngx_strlen(file.name.data);
+    file.log = r->connection->log;
+    if ((file.fd = ngx_open_file(file.name.data, NGX_FILE_RDONLY, NGX_FILE_OPEN, 0)) == NGX_INVALID_FILE) {
+        if (ngx_errno != NGX_ENOENT) ngx_log_error(NGX_LOG_CRIT, r->connection->log, ngx_errno, ngx_open_file_n " \"%V\" failed", &file.name);
+        return NGX_DECLINED;
+    }
+    ngx_file_info_t fi;
+    ngx_postgres_cache_header_t h = {0};
+    u_char *data = NULL;
+    if (ngx_fd_info(file.fd, &fi) == NGX_FILE_ERROR) { ngx_log_error(NGX_LOG_CRIT, r->connection->log, ngx_errno, ngx_fd_info_n " \"%V\" failed", &file.name); goto close; }
+    if (ngx_read_file(&file, (u_char *)&h, sizeof(h), 0) != sizeof(h)) goto close;
+    size_t size = h.type + h.charset + h.tags + h.size;
+    if ((off_t)(sizeof(h) + size) != ngx_file_size(&fi)) { ngx_log_error(NGX_LOG_WARN, r->connection->log, 0, "invalid cache file \"%V\"", &file.name); goto close; }
+    if (h.expire <= ngx_time()) goto close;
+    if (!(data = ngx_pnalloc(r->pool, size + 1))) { ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "!ngx_pnalloc"); goto close; }
+    if (ngx_read_file(&file, data, size, sizeof(h)) != (ssize_t)size) data = NULL;
+close:
+    if (ngx_close_file(file.fd) == NGX_FILE_ERROR) ngx_log_error(NGX_LOG_ALERT, r->connection->log, ngx_errno, ngx_close_file_n " \"%V\" failed", &file.name);
+    if (!data) return NGX_DECLINED;
+    ngx_buf_t b = {.pos = data + h.type + h.charset + h.tags, .last = data + h.type + h.charset + h.tags + h.size, .memory = 1};
+    ngx_chain_t cl = {&b, NULL};
+    ngx_postgres_cache_t *cache = ctx->cache;
+    ngx_shmtx_lock(&cache->shpool->mutex);
+    ngx_flag_t stale = ngx_postgres_cache_stale(cache, &h, data + h.type + h.charset);
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+    if (stale) return NGX_DECLINED;
+    (void)ngx_postgres_cache_insert(cache, ctx->key, &h, data, &cl); // promote to shared memory
+    return ngx_postgres_cache_send(r, &h, data);
+}
+
+
+static void ngx_postgres_cache_write(ngx_http_request_t *r, ngx_postgres_cache_ctx_t *ctx, ngx_postgres_cache_header_t *h, u_char *meta, ngx_chain_t *chain) {
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "%s", __func__);
+    u_char *name = ngx_postgres_cache_name(r, ctx);
+    if (!name) return;
+    size_t len = ngx_strlen(name);
+    ngx_file_t file;
+    ngx_memzero(&file, sizeof(file));
+    file.name.data = name;
+    file.name.len = ngx_sprintf(name + len, ".%P", ngx_pid) - name;
+    name[file.name.len] = '\0';
+    file.log = r->connection->log;
+    if ((file.fd = ngx_open_file(file.name.data, NGX_FILE_WRONLY, NGX_FILE_TRUNCATE, NGX_FILE_DEFAULT_ACCESS)) == NGX_INVALID_FILE && ngx_errno == NGX_ENOENT && !ngx_create_full_path(file.name.data, 0700)) file.fd = ngx_open_file(file.name.data, NGX_FILE_WRONLY, NGX_FILE_TRUNCATE, NGX_FILE_DEFAULT_ACCESS); // directory was removed
+    if (file.fd == NGX_INVALID_FILE) { ngx_log_error(NGX_LOG_CRIT, r->connection->log, ngx_errno, ngx_open_file_n " \"%V\" failed", &file.name); return; }
+    ngx_buf_t *b = ngx_create_temp_buf(r->pool, sizeof(*h) + h->type + h->charset + h->tags);
+    if (!b) { ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "!ngx_create_temp_buf"); goto delete; }
+    b->last = ngx_cpymem(b->last, h, sizeof(*h));
+    b->last = ngx_cpymem(b->last, meta, h->type + h->charset + h->tags);
+    ngx_chain_t cl = {b, chain};
+    ssize_t n = ngx_write_chain_to_file(&file, &cl, 0, r->pool);
+    if (n != NGX_ERROR && ngx_set_file_time(file.name.data, file.fd, h->expire) != NGX_OK) ngx_log_error(NGX_LOG_ALERT, r->connection->log, ngx_errno, ngx_set_file_time_n " \"%V\" failed", &file.name); // cache manager removes it after expire
+    if (ngx_close_file(file.fd) == NGX_FILE_ERROR) ngx_log_error(NGX_LOG_ALERT, r->connection->log, ngx_errno, ngx_close_file_n " \"%V\" failed", &file.name);
+    if (n != (ssize_t)(sizeof(*h) + h->type + h->charset + h->tags + h->size)) goto delete;
+    name[len] = '\0';
+    if (ngx_rename_file(file.name.data, name) != NGX_FILE_ERROR) return;
+    ngx_log_error(NGX_LOG_CRIT, r->connection->log, ngx_errno, ngx_rename_file_n " \"%V\" to \"%s\" failed", &file.name, name);
+    name[len] = '.';
+delete:
+    if (ngx_delete_file(file.name.data) == NGX_FILE_ERROR) ngx_log_error(NGX_LOG_CRIT, r->connection->log, ngx_errno, ngx_delete_file_n " \"%V\" failed", &file.name);
+}
+
+
+static void ngx_postgres_cache_variable(ngx_http_request_t *r, ngx_md5_t *md5, ngx_uint_t index) {
+    ngx_http_variable_value_t *value = ngx_http_get_indexed_variable(r, index);
+    size_t len = value && value->data ? value->len : 0; // empty is NULL for query
+    ngx_md5_update(md5, &len, sizeof(len));
+    if (len) ngx_md5_update(md5, value->data, len);
+}
+
+
+static void ngx_postgres_cache_output(ngx_md5_t *md5, ngx_postgres_output_t *output) {
+    u_char flags[] = {output->binary, output->header, output->single, output->string, output->delimiter, output->escape, output->quote};
+    ngx_md5_update(md5, flags, sizeof(flags));
+    ngx_md5_update(md5, &output->format.len, sizeof(output->format.len));
+    ngx_md5_update(md5, output->format.data, output->format.len);
+    ngx_md5_update(md5, &output->name.len, sizeof(output->name.len));
+    ngx_md5_update(md5, output->name.data, output->name.len);
+    ngx_md5_update(md5, &output->null.len, sizeof(output->null.len));
+    ngx_md5_update(md5, output->null.data, output->null.len);
+}
+
+
+static ngx_int_t ngx_postgres_cache_key(ngx_http_request_t *r, u_char *key) {
+    ngx_postgres_location_t *location = ngx_http_get_module_loc_conf(r, ngx_postgres_module);
+    ngx_md5_t md5;
+    ngx_md5_init(&md5);
+    if (location->cache.key) {
+        ngx_str_t value;
+        if (ngx_http_complex_value(r, location->cache.key, &value) != NGX_OK) { ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "ngx_http_complex_value != NGX_OK"); return NGX_ERROR; }
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "cache key = \"%V\"", &value);
+        ngx_md5_update(&md5, value.data, value.len);
+    } else { // location, sql, output and bound values
+        ngx_http_core_loc_conf_t *core = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
+        u_char flags[] = {location->append, location->envelope};
+        ngx_md5_update(&md5, &core->name.len, sizeof(core->name.len));
+        ngx_md5_update(&md5, core->name.data, core->name.len);
+        ngx_md5_update(&md5, flags, sizeof(flags));
+        ngx_postgres_query_t *elts = location->queries.elts;
+        for (ngx_uint_t i = 0; i < location->queries.nelts; i++) {
+            ngx_postgres_query_t *query = &elts[i];
+            ngx_md5_update(&md5, &query->sql.len, sizeof(query->sql.len));
+            ngx_md5_update(&md5, query->sql.data, query->sql.len);
+            ngx_postgres_cache_output(&md5, &query->output);
+            ngx_uint_t *ids = query->ids.elts;
+            for (ngx_uint_t j = 0; j < query->ids.nelts; j++) ngx_postgres_cache_variable(r, &md5, ids[j]);
+            ngx_postgres_param_t *params = query->params.elts;
+            for (ngx_uint_t j = 0; j < query->params.nelts; j++) ngx_postgres_cache_variable(r, &md5, params[j].index);
+        }
+    }
+    ngx_md5_final(key, &md5);
+    return NGX_OK;
+}
+
+
+static void ngx_postgres_coalesce_release(ngx_postgres_cache_ctx_t *ctx, ngx_http_request_t *r, ngx_chain_t *chain) {
+    ngx_postgres_coalesce_t *pc = ctx->coalesce;
+    ngx_rbtree_delete(&ngx_postgres_coalesce_rbtree, &pc->sn.node);
+    ctx->coalesce = NULL;
+    ngx_postgres_cache_header_t h = {0};
+    if (r) {
+        h.charset = r->headers_out.charset.len;
+        h.type = r->headers_out.content_type.len;
+        for (ngx_chain_t *cl = chain; cl; cl = cl->next) h.size += cl->buf->last - cl->buf->pos;
+    }
+    while (!ngx_queue_empty(&pc->followers)) {
+        ngx_queue_t *queue = ngx_queue_head(&pc->followers);
+        ngx_queue_remove(queue);
+        ngx_postgres_cache_ctx_t *fctx = ngx_queue_data(queue, ngx_postgres_cache_ctx_t, queue);
+        ngx_http_request_t *fr = fctx->wait.data;
+        fctx->coalesce = NULL;
+        if (r && (fctx->data = ngx_pnalloc(fr->pool, h.type + h.charset + h.size + 1))) { // otherwise follower runs queries itself
+            u_char *p = ngx_cpymem(fctx->data, r->headers_out.content_type.data, h.type);
+            p = ngx_cpymem(p, r->headers_out.charset.data, h.charset);
+            for (ngx_chain_t *cl = chain; cl; cl = cl->next) p = ngx_cpymem(p, cl->buf->pos, cl->buf->last - cl->buf->pos);
+            fctx->h = h;
+        }
+        ngx_post_event(&fctx->wait, &ngx_posted_events);
+    }
+}
+
+
+static void ngx_postgres_cache_cleanup(void *data) {
+    ngx_postgres_cache_ctx_t *ctx = data;
+    if (ctx->wait.timer_set) ngx_del_timer(&ctx->wait);
+    if (ctx->wait.posted) ngx_delete_posted_event(&ctx->wait);
+    if (ctx->coalesce) {
+        if (ctx->leader) ngx_postgres_coalesce_release(ctx, NULL, NULL);
+        else ngx_queue_remove(&ctx->queue);
+    }
+    if (!ctx->lock) return;
+    ngx_postgres_cache_t *cache = ctx->cache;
+    ngx_shmtx_lock(&cache->shpool->mutex);
+    ngx_postgres_cache_node_t *pcn = ngx_postgres_cache_lookup(cache, ctx->key);
+    if (pcn && pcn->lock == ctx->lock) { // response was not stored, let a waiter fetch it
+        if (pcn->data) pcn->lock = 0;
+        else ngx_postgres_cache_delete(cache, pcn);
+    }
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+}
+
+
+static void ngx_postgres_cache_wait_handler(ngx_event_t *ev) {
+    ngx_http_request_t *r = ev->data;
+    ngx_connection_t *c = r->connection;
+    ngx_http_set_log_request(c->log, r);
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, c->log, 0, "%s", __func__);
+    ngx_postgres_cache_ctx_t *ctx = ngx_http_get_module_ctx(r, ngx_postgres_module);
+    ngx_http_finalize_request(r, ctx->data ? ngx_postgres_cache_send(r, &ctx->h, ctx->data) : ngx_postgres_handler(r));
+    ngx_http_run_posted_requests(c);
+}
+
+
+static ngx_postgres_cache_ctx_t *ngx_postgres_cache_ctx(ngx_http_request_t *r) {
+    ngx_postgres_cache_ctx_t *ctx = ngx_http_get_module_ctx(r, ngx_postgres_module);
+    if (ctx) return ctx;
+    if (!(ctx = ngx_pcalloc(r->pool, sizeof(*ctx)))) { ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "!ngx_pcalloc"); return NULL; }
+    if (ngx_postgres_cache_key(r, ctx->key) != NGX_OK) { ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "ngx_postgres_cache_key != NGX_OK"); return NULL; }
+    ngx_pool_cleanup_t *cln = ngx_pool_cleanup_add(r->pool, 0);
+    if (!cln) { ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "!ngx_pool_cleanup_add"); return NULL; }
+    cln->data = ctx;
+    cln->handler = ngx_postgres_cache_cleanup;
+    ngx_postgres_location_t *location = ngx_http_get_module_loc_conf(r, ngx_postgres_module);
+    if (location->cache.zone) ctx->cache = location->cache.zone->data;
+    ctx->start = ngx_current_msec;
+    ctx->wait.data = r;
+    ctx->wait.handler = ngx_postgres_cache_wait_handler;
+    ctx->wait.log = r->connection->log;
+    ngx_http_set_ctx(r, ctx, ngx_postgres_module);
+    return ctx;
+}
+
+
+static ngx_int_t ngx_postgres_cache_wait(ngx_http_request_t *r, ngx_postgres_cache_ctx_t *ctx) {
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "%s", __func__);
+    r->main->count++;
+    ngx_add_timer(&ctx->wait, 50);
+    return NGX_DONE;
+}
+
+
+ngx_int_t ngx_postgres_cache_handler(ngx_http_request_t *r) {
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "%s", __func__);
+    if (!(r->method & (NGX_HTTP_GET|NGX_HTTP_HEAD))) return NGX_DECLINED;
+    ngx_postgres_location_t *location = ngx_http_get_module_loc_conf(r, ngx_postgres_module);
+    ngx_postgres_cache_ctx_t *ctx = ngx_postgres_cache_ctx(r);
+    if (!ctx) return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    ngx_postgres_cache_t *cache = ctx->cache;
+    ngx_shmtx_lock(&cache->shpool->mutex);
+    ngx_postgres_cache_node_t *pcn = ngx_postgres_cache_lookup(cache, ctx->key);
+    if (pcn && pcn->data && !ngx_postgres_cache_stale(cache, &pcn->h, pcn->data + pcn->h.type + pcn->h.charset)) {
+        ngx_queue_remove(&pcn->queue);
+        ngx_queue_insert_head(&cache->sh->queue, &pcn->queue);
+        ngx_postgres_cache_header_t h = pcn->h;
+        size_t size = h.type + h.charset + h.tags + h.size;
+        u_char *data = ngx_pnalloc(r->pool, size + 1);
+        if (!data) { ngx_shmtx_unlock(&cache->shpool->mutex); ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "!ngx_pnalloc"); return NGX_HTTP_INTERNAL_SERVER_ERROR; }
+        ngx_memcpy(data, pcn->data, size);
+        ngx_shmtx_unlock(&cache->shpool->mutex);
+        ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "cache hit");
+        return ngx_postgres_cache_send(r, &h, data);
+    }
+    ngx_flag_t locked = ngx_postgres_cache_locked(pcn);
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+    if (locked) return ngx_current_msec - ctx->start < location->cache.lock ? ngx_postgres_cache_wait(r, ctx) : NGX_DECLINED;
+    if (cache->path.len) {
+        ngx_int_t rc = ngx_postgres_cache_read(r, ctx);
+        if (rc != NGX_DECLINED) return rc;
+    }
+    if (!location->cache.lock) return NGX_DECLINED;
+    ngx_shmtx_lock(&cache->shpool->mutex);
+    pcn = ngx_postgres_cache_lookup(cache, ctx->key);
+    if (ngx_postgres_cache_locked(pcn)) { ngx_shmtx_unlock(&cache->shpool->mutex); return ngx_postgres_cache_wait(r, ctx); } // another request took the lock meanwhile
+    if (pcn || (pcn = ngx_postgres_cache_alloc(cache, ctx->key, 0))) pcn->lock = ctx->lock = (ngx_current_msec + location->cache.lock) | 1;
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+    return NGX_DECLINED;
+}
+
+
+static ngx_int_t ngx_postgres_cache_tags(ngx_http_request_t *r, ngx_str_t *tags) {
+    ngx_postgres_location_t *location = ngx_http_get_module_loc_conf(r, ngx_postgres_module);
+    ngx_str_null(tags);
+    if (!location->cache.tag) return NGX_OK;
+    ngx_str_t value;
+    if (ngx_http_complex_value(r, location->cache.tag, &value) != NGX_OK) { ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "ngx_http_complex_value != NGX_OK"); return NGX_ERROR; }
+    if (!(tags->data = ngx_pnalloc(r->pool, value.len))) { ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "!ngx_pnalloc"); return NGX_ERROR; }
+    for (u_char *p = value.data, *last = value.data + value.len; p < last; p++) switch (*p) { // normalize to single space
+        case ' ': case ',': case '\t': case '\r': case '\n': if (tags->len && tags->data[tags->len - 1] != ' ') tags->data[tags->len++] = ' '; break;
+        default: tags->data[tags->len++] = *p; break;
+    }
+    if (tags->len && tags->data[tags->len - 1] == ' ') tags->len--;
+    return NGX_OK;
+}
+
+
+void ngx_postgres_cache_store(ngx_http_request_t *r, ngx_chain_t *chain) {
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "%s", __func__);
+    ngx_postgres_cache_ctx_t *ctx = ngx_http_get_module_ctx(r, ngx_postgres_module);
+    if (!ctx || r->method != NGX_HTTP_GET) return;
+    ngx_postgres_cache_header_t h = {.charset = r->headers_out.charset.len, .type = r->headers_out.content_type.len};
+    for (ngx_chain_t *cl = chain; cl; cl = cl->next) {
+        if (!ngx_buf_in_memory(cl->buf)) return;
+        h.size += cl->buf->last - cl->buf->pos;
+    }
+    ngx_str_t tags;
+    if (ngx_postgres_cache_tags(r, &tags) != NGX_OK) return;
+    h.tags = tags.len;
+    ngx_postgres_location_t *location = ngx_http_get_module_loc_conf(r, ngx_postgres_module);
+    h.expire = r->start_sec + location->cache.valid; // from request start, see ngx_postgres_cache_invalidate
+    h.start = (uint64_t)r->start_sec * 1000 + r->start_msec;
+    u_char *meta = ngx_pnalloc(r->pool, h.type + h.charset + h.tags);
+    if (!meta) { ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "!ngx_pnalloc"); return; }
+    u_char *p = ngx_cpymem(meta, r->headers_out.content_type.data, h.type);
+    p = ngx_cpymem(p, r->headers_out.charset.data, h.charset);
+    ngx_memcpy(p, tags.data, h.tags);
+    if (ngx_postgres_cache_insert(ctx->cache, ctx->key, &h, meta, chain) == NGX_OK) ctx->lock = 0;
+    else ngx_log_error(NGX_LOG_WARN, r->connection->log, 0, "response is too large for cache");
+    if (ctx->cache->path.len) ngx_postgres_cache_write(r, ctx, &h, meta, chain);
+}
+
+
+ngx_int_t ngx_postgres_cache_invalidate(ngx_shm_zone_t *zone, ngx_str_t *text, ngx_log_t *log) {
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, log, 0, "%s", __func__);
+    ngx_postgres_cache_t *cache = zone->data;
+    ngx_postgres_cache_shm_t *sh = cache->sh;
+    uint64_t now = ngx_postgres_cache_now();
+    ngx_shmtx_lock(&cache->shpool->mutex);
+    while (!ngx_queue_empty(&sh->tags)) { // entries expire at most valid after their request had started, so older tags match none
+        ngx_postgres_cache_tag_t *pct = ngx_queue_data(ngx_queue_head(&sh->tags), ngx_postgres_cache_tag_t, queue);
+        if (pct->time + (uint64_t)sh->valid * 1000 >= now) break;
+        ngx_rbtree_delete(&sh->tag_rbtree, &pct->sn.node);
+        ngx_queue_remove(&pct->queue);
+        ngx_slab_free_locked(cache->shpool, pct);
+    }
+    ngx_uint_t n = 0;
+    for (u_char *p = text->data, *last = text->data + text->len, *e; p < last; p = e + 1) {
+        for (e = p; e < last && *e != ' ' && *e != ',' && *e != '\t' && *e != '\r' && *e != '\n'; e++);
+        if (e == p) continue;
+        ngx_str_t tag = {e - p, p};
+        uint32_t hash = ngx_crc32_short(tag.data, tag.len);
+        ngx_postgres_cache_tag_t *pct = (ngx_postgres_cache_tag_t *)ngx_str_rbtree_lookup(&sh->tag_rbtree, &tag, hash);
+        if (pct) ngx_queue_remove(&pct->queue); else {
+            if (!(pct = ngx_postgres_cache_slab(cache, sizeof(*pct) + tag.len))) { ngx_log_error(NGX_LOG_WARN, log, 0, "no memory for tag \"%V\", cache flushed", &tag); sh->flush = now; n++; continue; }
+            pct->sn.node.key = hash;
+            pct->sn.str.data = (u_char *)(pct + 1);
+            pct->sn.str.len = tag.len;
+            ngx_memcpy(pct->sn.str.data, tag.data, tag.len);
+            ngx_rbtree_insert(&sh->tag_rbtree, &pct->sn.node);
+        }
+        pct->time = now;
+        ngx_queue_insert_tail(&sh->tags, &pct->queue);
+        n++;
+    }
+    if (!n) sh->flush = now; // empty payload invalidates everything
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+    return NGX_OK;
+}
+
+
+ngx_int_t ngx_postgres_coalesce_handler(ngx_http_request_t *r) {
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "%s", __func__);
+    if (!(r->method & (NGX_HTTP_GET|NGX_HTTP_HEAD))) return NGX_DECLINED;
+    ngx_postgres_cache_ctx_t *ctx = ngx_postgres_cache_ctx(r);
+    if (!ctx) return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    if (!ngx_postgres_coalesce_rbtree.root) ngx_rbtree_init(&ngx_postgres_coalesce_rbtree, &ngx_postgres_coalesce_sentinel, ngx_str_rbtree_insert_value);
+    ngx_postgres_location_t *location = ngx_http_get_module_loc_conf(r, ngx_postgres_module);
+    u_char buf[sizeof(ctx->key) + sizeof(location)]; // custom key may be shared by locations with other output
+    ngx_memcpy(ngx_cpymem(buf, ctx->key, sizeof(ctx->key)), &location, sizeof(location));
+    ngx_str_t key = {sizeof(buf), buf};
+    uint32_t hash;
+    ngx_memcpy(&hash, ctx->key, sizeof(hash));
+    ngx_postgres_coalesce_t *pc = (ngx_postgres_coalesce_t *)ngx_str_rbtree_lookup(&ngx_postgres_coalesce_rbtree, &key, hash);
+    if (pc) {
+        ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "coalesce follower");
+        ngx_queue_insert_tail(&pc->followers, &ctx->queue);
+        ctx->coalesce = pc;
+        r->main->count++;
+        return NGX_DONE;
+    }
+    if (!(pc = ngx_palloc(r->pool, sizeof(*pc) + key.len))) { ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "!ngx_palloc"); return NGX_HTTP_INTERNAL_SERVER_ERROR; }
+    pc->sn.node.key = hash;
+    pc->sn.str.data = (u_char *)(pc + 1);
+    pc->sn.str.len = key.len;
+    ngx_memcpy(pc->sn.str.data, key.data, key.len);
+    ngx_queue_init(&pc->followers);
+    ngx_rbtree_insert(&ngx_postgres_coalesce_rbtree, &pc->sn.node);
+    ctx->coalesce = pc;
+    ctx->leader = 1;
+    return NGX_DECLINED;
+}
+
+
+void ngx_postgres_coalesce_done(ngx_http_request_t *r, ngx_chain_t *chain) {
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "%s", __func__);
+    ngx_postgres_cache_ctx_t *ctx = ngx_http_get_module_ctx(r, ngx_postgres_module);
+    if (!ctx || !ctx->leader || !ctx->coalesce) return;
+    for (ngx_chain_t *cl = chain; cl; cl = cl->next) if (!ngx_buf_in_memory(cl->buf)) { ngx_postgres_coalesce_release(ctx, NULL, NULL); return; }
+    ngx_postgres_coalesce_release(ctx, r, chain);
+}
+
+
+static ngx_int_t ngx_postgres_cache_manager_noop(ngx_tree_ctx_t *ctx, ngx_str_t *path) {
+    return NGX_OK;
+}
+
+
+static void ngx_postgres_cache_manager_delete(ngx_str_t *name, ngx_log_t *log) {
+    if (ngx_delete_file(name->data) == NGX_FILE_ERROR && ngx_errno != NGX_ENOENT) ngx_log_error(NGX_LOG_CRIT, log, ngx_errno, ngx_delete_file_n " \"%V\" failed", name);
+}
+
+
+static ngx_int_t ngx_postgres_cache_manager_file(ngx_tree_ctx_t *ctx, ngx_str_t *path) {
+    ngx_postgres_cache_manager_t *pcm = ctx->data;
+    u_char *name = path->data + path->len;
+    while (name > path->data && name[-1] != '/') name--;
+    ngx_flag_t temp = ngx_strlchr(name, path->data + path->len, '.') != NULL; // named by key and pid while written
+    if (temp ? ctx->mtime + 60 < ngx_time() : ctx->mtime <= ngx_time()) { ngx_postgres_cache_manager_delete(path, ctx->log); return NGX_OK; } // mtime of file is its expire
+    if (temp) return NGX_OK;
+    ngx_postgres_cache_file_t *file = ngx_array_push(&pcm->files);
+    if (!file) { ngx_log_error(NGX_LOG_ERR, ctx->log, 0, "!ngx_array_push"); return NGX_ABORT; }
+    if (!(file->name.data = ngx_pstrdup(pcm->pool, path))) { ngx_log_error(NGX_LOG_ERR, ctx->log, 0, "!ngx_pstrdup"); return NGX_ABORT; }
+    file->name.len = path->len;
+    file->expire = ctx->mtime;
+    file->size = ctx->fs_size;
+    pcm->size += ctx->fs_size;
+    return NGX_OK;
+}
+
+
+static int ngx_postgres_cache_manager_cmp(const void *one, const void *two) {
+    const ngx_postgres_cache_file_t *a = one, *b = two;
+    return a->expire < b->expire ? -1 : a->expire > b->expire;
+}
+
+
+static ngx_msec_t ngx_postgres_cache_manager(void *data) { // in cache manager process, so blocking file operations do not stall requests
+    ngx_postgres_cache_t *cache = data;
+    ngx_log_t *log = ngx_cycle->log;
+    ngx_postgres_cache_manager_t pcm = {.size = 0};
+    if (!(pcm.pool = ngx_create_pool(4096, log))) { ngx_log_error(NGX_LOG_ERR, log, 0, "!ngx_create_pool"); return 10000; }
+    if (ngx_array_init(&pcm.files, pcm.pool, 64, sizeof(ngx_postgres_cache_file_t)) != NGX_OK) { ngx_log_error(NGX_LOG_ERR, log, 0, "ngx_array_init != NGX_OK"); goto destroy; }
+    ngx_tree_ctx_t tree = {
+        .file_handler = ngx_postgres_cache_manager_file,
+        .pre_tree_handler = ngx_postgres_cache_manager_noop,
+        .post_tree_handler = ngx_postgres_cache_manager_noop,
+        .spec_handler = ngx_postgres_cache_manager_noop,
+        .data = &pcm,
+        .log = log,
+    };
+    if (ngx_walk_tree(&tree, &cache->path) == NGX_ABORT || !cache->max || pcm.size <= cache->max) goto destroy;
+    ngx_postgres_cache_file_t *file = pcm.files.elts;
+    ngx_qsort(file, pcm.files.nelts, sizeof(*file), ngx_postgres_cache_manager_cmp);
+    for (ngx_uint_t i = 0; i < pcm.files.nelts && pcm.size > cache->max; i++) { // nearest expire goes first
+        ngx_postgres_cache_manager_delete(&file[i].name, log);
+        pcm.size -= file[i].size;
+    }
+destroy:
+    ngx_destroy_pool(pcm.pool);
+    return 10000;
+}
+
+
+ngx_int_t ngx_postgres_cache_init_zone(ngx_shm_zone_t *zone, void *data) {
+    ngx_postgres_cache_t *cache = zone->data;
+    if (data) {
+        ngx_postgres_cache_t *ocache = data;
+        cache->sh = ocache->sh;
+        cache->shpool = ocache->shpool;
+        return NGX_OK;
+    }
+    cache->shpool = (ngx_slab_pool_t *)zone->shm.addr;
+    if (zone->shm.exists) { cache->sh = cache->shpool->data; return NGX_OK; }
+    if (!(cache->sh = ngx_slab_alloc(cache->shpool, sizeof(*cache->sh)))) { ngx_log_error(NGX_LOG_EMERG, zone->shm.log, 0, "!ngx_slab_alloc"); return NGX_ERROR; }
+    ngx_rbtree_init(&cache->sh->rbtree, &cache->sh->sentinel, ngx_postgres_cache_rbtree_insert_value);
+    ngx_rbtree_init(&cache->sh->tag_rbtree, &cache->sh->tag_sentinel, ngx_str_rbtree_insert_value);
+    ngx_queue_init(&cache->sh->queue);
+    ngx_queue_init(&cache->sh->tags);
+    cache->sh->flush = 0;
+    cache->sh->valid = 0;
+    cache->shpool->data = cache->sh;
+    cache->shpool->log_nomem = 0; // eviction handles it
+    return NGX_OK;
+}
+
+
+char *ngx_postgres_cache_zone_conf(ngx_conf_t *cf, ngx_command_t *cmd, void *conf) {
+    ngx_str_t *elts = cf->args->elts;
+    ssize_t size = ngx_parse_size(&elts[2]);
+    if (size == NGX_ERROR) { ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "\"%V\" directive error: \"%V\" must be size", &cmd->name, &elts[2]); return NGX_CONF_ERROR; }
+    if (size < (ssize_t)(8 * ngx_pagesize)) { ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "\"%V\" directive error: \"%V\" must be at least %uz", &cmd->name, &elts[2], 8 * ngx_pagesize); return NGX_CONF_ERROR; }
+    ngx_postgres_cache_t *cache = ngx_pcalloc(cf->pool, sizeof(*cache));
+    if (!cache) { ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "\"%V\" directive error: !ngx_pcalloc", &cmd->name); return NGX_CONF_ERROR; }
+    for (ngx_uint_t i = 3; i < cf->args->nelts; i++) {
+        if (elts[i].len > sizeof("path=") - 1 && !ngx_strncasecmp(elts[i].data, (u_char *)"path=", sizeof("path=") - 1)) {
+            cache->path.len = elts[i].len - (sizeof("path=") - 1);
+            cache->path.data = &elts[i].data[sizeof("path=") - 1];
+            if (ngx_conf_full_name(cf->cycle, &cache->path, 0) != NGX_OK) { ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "\"%V\" directive error: ngx_conf_full_name != NGX_OK", &cmd->name); return NGX_CONF_ERROR; }
+            continue;
+        }
+        if (elts[i].len > sizeof("max_size=") - 1 && !ngx_strncasecmp(elts[i].data, (u_char *)"max_size=", sizeof("max_size=") - 1)) {
+            elts[i].len = elts[i].len - (sizeof("max_size=") - 1);
+            elts[i].data = &elts[i].data[sizeof("max_size=") - 1];
+            if ((cache->max = ngx_parse_offset(&elts[i])) == NGX_ERROR) { ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "\"%V\" directive error: \"max_size\" value \"%V\" must be size", &cmd->name, &elts[i]); return NGX_CONF_ERROR; }
+            continue;
+        }
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "\"%V\" directive error: invalid additional parameter \"%V\"", &cmd->name, &elts[i]);
+        return NGX_CONF_ERROR;
+    }
+    if (cache->max && !cache->path.len) { ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "\"%V\" directive error: \"max_size\" requires \"path\"", &cmd->name); return NGX_CONF_ERROR; }
+    if (cache->path.len) { // created at start and cleaned by cache manager
+        ngx_path_t *path = ngx_pcalloc(cf->pool, sizeof(*path));
+        if (!path) { ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "\"%V\" directive error: !ngx_pcalloc", &cmd->name); return NGX_CONF_ERROR; }
+        path->name = cache->path;
+        path->manager = ngx_postgres_cache_manager;
+        path->data = cache;
+        path->conf_file = cf->conf_file->file.name.data;
+        path->line = cf->conf_file->line;
+        if (ngx_add_path(cf, &path) != NGX_OK) { ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "\"%V\" directive error: ngx_add_path != NGX_OK", &cmd->name); return NGX_CONF_ERROR; }
+    }
+    ngx_shm_zone_t *zone = ngx_shared_memory_add(cf, &elts[1], size, &ngx_postgres_module);
+    if (!zone) { ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "\"%V\" directive error: !ngx_shared_memory_add", &cmd->name); return NGX_CONF_ERROR; }
+    if (zone->data) { ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "\"%V\" directive error: zone \"%V\" is already used", &cmd->name, &elts[1]); return NGX_CONF_ERROR; }
+    zone->init = ngx_postgres_cache_init_zone;
+    zone->data = cache;
+    return NGX_CONF_OK;
+}
+
+
+char *ngx_postgres_cache_conf(ngx_conf_t *cf, ngx_command_t *cmd, void *conf) {
+    ngx_postgres_location_t *location = conf;
+    if (location->cache.zone) return "duplicate";
+    ngx_str_t *elts = cf->args->elts;
+    if (!(location->cache.zone = ngx_shared_memory_add(cf, &elts[1], 0, &ngx_postgres_module))) { ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "\"%V\" directive error: !ngx_shared_memory_add", &cmd->name); return NGX_CONF_ERROR; }
+    location->cache.valid = 60;
+    for (ngx_uint_t i = 2; i < cf->args->nelts; i++) {
+        if (elts[i].len > sizeof("valid=") - 1 && !ngx_strncasecmp(elts[i].data, (u_char *)"valid=", sizeof("valid=") - 1)) {
+            elts[i].len = elts[i].len - (sizeof("valid=") - 1);
+            elts[i].data = &elts[i].data[sizeof("valid=") - 1];
+            time_t n = ngx_parse_time(&elts[i], 1);
+            if (n == NGX_ERROR) { ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "\"%V\" directive error: \"valid\" value \"%V\" must be time", &cmd->name, &elts[i]); return NGX_CONF_ERROR; }
+            if (n <= 0) { ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "\"%V\" directive error: \"valid\" value \"%V\" must be positive", &cmd->name, &elts[i]); return NGX_CONF_ERROR; }
+            location->cache.valid = n;
+            continue;
+        }
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "\"%V\" directive error: invalid additional parameter \"%V\"", &cmd->name, &elts[i]);
+        return NGX_CONF_ERROR;
+    }
+    return NGX_CONF_OK;
+}
+
+
+char *ngx_postgres_cache_lock_conf(ngx_conf_t *cf, ngx_command_t *cmd, void *conf) {
+    ngx_postgres_location_t *location = conf;
+    if (location->cache.lock != NGX_CONF_UNSET_MSEC) return "duplicate";
+    ngx_str_t *elts = cf->args->elts;
+    static const ngx_conf_enum_t e[] = {
+        { ngx_string("off"), 0 },
+        { ngx_string("no"), 0 },
+        { ngx_string("false"), 0 },
+        { ngx_string("on"), 1 },
+        { ngx_string("yes"), 1 },
+        { ngx_string("true"), 1 },
+        { ngx_null_string, 0 }
+    };
+    ngx_uint_t i;
+    for (i = 0; e[i].name.len; i++) if (e[i].name.len == elts[1].len && !ngx_strncasecmp(e[i].name.data, elts[1].data, elts[1].len)) break;
+    if (!e[i].name.len) { ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "\"%V\" directive error: value \"%V\" must be \"off\", \"no\", \"false\", \"on\", \"yes\" or \"true\"", &cmd->name, &elts[1]); return NGX_CONF_ERROR; }
+    location->cache.lock = e[i].value ? 5000 : 0;
+    for (ngx_uint_t i = 2; i < cf->args->nelts; i++) {
+        if (elts[i].len > sizeof("timeout=") - 1 && !ngx_strncasecmp(elts[i].data, (u_char *)"timeout=", sizeof("timeout=") - 1)) {
+            elts[i].len = elts[i].len - (sizeof("timeout=") - 1);
+            elts[i].data = &elts[i].data[sizeof("timeout=") - 1];
+            ngx_int_t n = ngx_parse_time(&elts[i], 0);
+            if (n == NGX_ERROR) { ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "\"%V\" directive error: \"timeout\" value \"%V\" must be time", &cmd->name, &elts[i]); return NGX_CONF_ERROR; }
+            if (n <= 0) { ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "\"%V\" directive error: \"timeout\" value \"%V\" must be positive", &cmd->name, &elts[i]); return NGX_CONF_ERROR; }
+            if (location->cache.lock) location->cache.lock = (ngx_msec_t)n;
+            continue;
+        }
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "\"%V\" directive error: invalid additional parameter \"%V\"", &cmd->name, &elts[i]);
+        return NGX_CONF_ERROR;
+    }
+    return NGX_CONF_OK;
+}
@@ -43,7 +43,7 @@ static ngx_int_t ngx_postgres_reinit_request(ngx_http_request_t *r) {
     ngx_postgres_data_t *pd = u->peer.data;
     ngx_postgres_common_t *pdc = &pd->common;
     ngx_connection_t *c = pdc->connection;
-    if (pdc->state != state_connect) {
+    if (pdc->state != state_connect && pdc->state != state_result) { // query sent on reused connection keeps its timeout
         if (c->read->timer_set) ngx_del_timer(c->read);
         if (c->write->timer_set) ngx_del_timer(c->write);
     }
@@ -58,7 +58,13 @@ static ngx_int_t ngx_postgres_reinit_request(ngx_http_request_t *r) {
 static void ngx_postgres_finalize_request(ngx_http_request_t *r, ngx_int_t rc) {
     ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "rc = %i", rc);
     ngx_http_upstream_t *u = r->upstream;
+#if (NGX_THREADS)
+    ngx_postgres_data_t *pd = u->peer.get == ngx_postgres_peer_get ? u->peer.data : NULL;
+    if (pd && pd->out.thread) ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "thread"); else // output is dropped by thread event handler
+#endif
     u->out_bufs = NULL;
+    ngx_postgres_location_t *location = ngx_http_get_module_loc_conf(r, ngx_postgres_module);
+    if (location->batch.max) ngx_postgres_batch_finalize(r, rc);
 }
 
 
@@ -66,6 +72,7 @@ ngx_int_t ngx_postgres_handler(ngx_http_request_t *r) {
     ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "%s", __func__);
     if (r->subrequest_in_memory) { ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "subrequest_in_memory"); return NGX_HTTP_INTERNAL_SERVER_ERROR; } // TODO: add support for subrequest in memory by emitting output into u->buffer instead
     ngx_postgres_location_t *location = ngx_http_get_module_loc_conf(r, ngx_postgres_module);
+    if (location->listen.channel.value.data) return ngx_postgres_listen_handler(r);
     if (!location->queries.elts) {
         ngx_http_core_loc_conf_t *core = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
         ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "missing \"postgres_query\" in location \"%V\"", &core->name);
@@ -73,6 +80,12 @@ ngx_int_t ngx_postgres_handler(ngx_http_request_t *r) {
     }
     ngx_int_t rc = ngx_http_discard_request_body(r);
     if (rc != NGX_OK) return rc;
+    if (location->async) return ngx_postgres_async_handler(r);
+    if (location->cache.zone && (rc = ngx_postgres_cache_handler(r)) != NGX_DECLINED) return rc;
+    if (location->coalesce && (rc = ngx_postgres_coalesce_handler(r)) != NGX_DECLINED) return rc;
+    if (location->batch.max && (rc = ngx_postgres_batch_handler(r)) != NGX_DECLINED) return rc;
+    if (location->pipeline && (rc = ngx_postgres_pipeline_handler(r)) != NGX_DECLINED) return rc;
+    if (location->parallel && (rc = ngx_postgres_parallel_handler(r)) != NGX_DECLINED) return rc;
     if (ngx_http_upstream_create(r) != NGX_OK) { ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "ngx_http_upstream_create != NGX_OK"); return NGX_HTTP_INTERNAL_SERVER_ERROR; }
     ngx_http_upstream_t *u = r->upstream;
     ngx_str_set(&u->schema, "postgres://");
@@ -6,12 +6,6 @@
 
 extern ngx_module_t ngx_postgres_module;
 
-typedef struct {
-    ngx_queue_t queue;
-    ngx_str_t channel;
-    ngx_str_t command;
-} ngx_postgres_listen_t;
-
 typedef enum {
     state_connect = 1,
     state_prepare,
@@ -45,6 +39,7 @@ typedef struct {
 #endif
     struct {
         ngx_flag_t reject;
+        ngx_flag_t transaction;
         ngx_log_t *log;
         ngx_msec_t timeout;
         ngx_queue_t queue;
@@ -56,24 +51,49 @@ typedef struct {
         ngx_flag_t deallocate;
         ngx_uint_t max;
     } prepare;
+    struct {
+        ngx_path_t *path;
+        ngx_uint_t max;
+        void *queue;
+    } async;
+    struct {
+        ngx_msec_t timeout;
+        void *queue;
+    } pipeline;
     struct {
         ngx_queue_t queue;
     } free;
     struct {
         ngx_log_t *log;
     } trace;
+    struct {
+        ngx_shm_zone_t *zone;
+        ngx_str_t channel;
+    } cache;
+    struct {
+        ngx_shm_zone_t *zone;
+        void *listener;
+    } listen;
+    struct {
+        ngx_flag_t listen; // used by postgres_listen
+        ngx_str_t channel;
+        ngx_str_t publication;
+        ngx_str_t slot;
+    } replication;
     ngx_http_upstream_init_peer_pt peer_init;
     ngx_http_upstream_init_pt init_upstream;
 } ngx_postgres_upstream_srv_conf_t;
 
 typedef struct {
+    struct {
+        ngx_pool_t *pool;
+        ngx_uint_t delivered;
+        ngx_uint_t dropped;
+    } notify;
     struct {
         ngx_queue_t *queue;
         ngx_uint_t size;
     } prepare;
-    struct {
-        ngx_queue_t *queue;
-    } listen;
     ngx_addr_t addr;
     ngx_connection_t *connection;
     ngx_postgres_upstream_srv_conf_t *pusc;
@@ -92,7 +112,9 @@ typedef struct {
     ngx_uint_t nfields;
     ngx_uint_t ntuples;
     ngx_uint_t nsingle;
+    ngx_uint_t section; // query of last envelope section plus one
     PGresult *res;
+    uint32_t schema; // crc of first arrow schema
 } ngx_postgres_result_t;
 
 typedef struct {
@@ -106,6 +128,16 @@ typedef struct {
         Oid *paramTypes;
         u_char **paramValues;
     } query;
+    struct {
+        ngx_flag_t commit;
+        ngx_flag_t wait;
+        ngx_http_event_handler_pt handler;
+        ngx_uint_t state;
+    } cursor;
+    struct {
+        ngx_int_t rc;
+        ngx_uint_t state;
+    } transaction;
     ngx_array_t variables;
     ngx_event_free_peer_pt peer_free;
     ngx_event_get_peer_pt peer_get;
@@ -113,8 +145,25 @@ typedef struct {
     ngx_event_save_peer_session_pt save_session;
     ngx_event_set_peer_session_pt set_session;
 #endif
+    struct {
+        ngx_chain_t *last;
+#if (NGX_THREADS)
+        ngx_event_handler_pt handler;
+        ngx_flag_t thread;
+        ngx_http_event_handler_pt read_event_handler;
+        ngx_http_event_handler_pt write_event_handler;
+        ngx_pool_t *pool;
+#endif
+        ngx_queue_t queue;
+        ngx_temp_file_t *temp;
+#if (NGX_THREADS)
+        ngx_thread_task_t *task;
+#endif
+        ngx_uint_t max;
+    } out;
     ngx_http_request_t *request;
     ngx_postgres_common_t common;
+    ngx_postgres_connect_t *connect;
     ngx_postgres_result_t result;
 #if (T_NGX_HTTP_DYNAMIC_RESOLVE)
     ngx_queue_t queue;
@@ -129,13 +178,29 @@ typedef struct {
 
 typedef ngx_int_t (*ngx_postgres_handler_pt) (ngx_postgres_data_t *pd);
 
+typedef struct {
+    ngx_uint_t index;
+    ngx_uint_t oid;
+} ngx_postgres_param_t;
+
 typedef struct {
     ngx_flag_t binary;
     ngx_flag_t header;
     ngx_flag_t single;
     ngx_flag_t string;
     ngx_postgres_handler_pt handler;
+    ngx_str_t format;
+    ngx_str_t head;
+    ngx_str_t name;
     ngx_str_t null;
+    ngx_str_t tail;
+#if (NGX_THREADS)
+    ngx_thread_pool_t *thread_pool;
+#endif
+    ngx_uint_t kernel;
+#if (NGX_THREADS)
+    ngx_uint_t threshold;
+#endif
     u_char delimiter;
     u_char escape;
     u_char quote;
@@ -154,37 +219,118 @@ typedef struct {
 } ngx_postgres_query_t;
 
 typedef struct {
+    struct {
+        ngx_int_t index;
+        ngx_msec_t window;
+        ngx_str_t column;
+        ngx_uint_t max;
+    } batch;
+    struct {
+        ngx_http_complex_value_t *key;
+        ngx_http_complex_value_t *tag;
+        ngx_msec_t lock;
+        ngx_shm_zone_t *zone;
+        time_t valid;
+    } cache;
+    struct {
+        ngx_flag_t enable;
+        ngx_http_complex_value_t *value;
+    } etag;
+    struct {
+        ngx_http_complex_value_t channel;
+        ngx_uint_t replay;
+    } listen;
     ngx_array_t queries;
     ngx_flag_t append;
+    ngx_flag_t coalesce;
+    ngx_flag_t envelope;
+    ngx_flag_t parallel;
     ngx_flag_t prepare;
     ngx_http_complex_value_t complex;
     ngx_http_upstream_conf_t upstream;
+    ngx_int_t cursor;
     ngx_msec_t timeout;
     ngx_postgres_output_t *output;
     ngx_postgres_query_t *query;
+    ngx_str_t transaction; // BEGIN statement
+    ngx_uint_t async;
     ngx_uint_t index;
+    ngx_uint_t pipeline;
 } ngx_postgres_location_t;
 
+char *ngx_postgres_async_conf(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+char *ngx_postgres_batch_conf(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+char *ngx_postgres_cache_conf(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+char *ngx_postgres_cache_lock_conf(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+char *ngx_postgres_cache_zone_conf(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+char *ngx_postgres_etag_conf(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+char *ngx_postgres_listen_conf(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+char *ngx_postgres_lookup_conf(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
 char *ngx_postgres_output_conf(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+char *ngx_postgres_pipeline_conf(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
 char *ngx_postgres_query_conf(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
 char *ngx_postgres_set_conf(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+char *ngx_postgres_transaction_conf(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
 char *PQerrorMessageMy(const PGconn *conn);
 char *PQresultErrorMessageMy(const PGresult *res);
 extern ngx_int_t ngx_http_push_stream_add_msg_to_channel_my(ngx_log_t *log, ngx_str_t *id, ngx_str_t *text, ngx_str_t *event_id, ngx_str_t *event_type, ngx_flag_t store_messages, ngx_pool_t *temp_pool) __attribute__((weak));
 extern ngx_int_t ngx_http_push_stream_delete_channel_my(ngx_log_t *log, ngx_str_t *id, u_char *text, size_t len, ngx_pool_t *temp_pool) __attribute__((weak));
+ngx_int_t ngx_postgres_async_handler(ngx_http_request_t *r);
+ngx_int_t ngx_postgres_async_init_process(ngx_cycle_t *cycle);
+ngx_int_t ngx_postgres_async_variable(ngx_http_request_t *r, ngx_http_variable_value_t *v, uintptr_t data);
+ngx_int_t ngx_postgres_batch_handler(ngx_http_request_t *r);
+ngx_int_t ngx_postgres_batch_retry(ngx_postgres_data_t *pd);
+ngx_int_t ngx_postgres_batch_split(ngx_postgres_data_t *pd);
+ngx_int_t ngx_postgres_cache_handler(ngx_http_request_t *r);
+ngx_int_t ngx_postgres_cache_invalidate(ngx_shm_zone_t *zone, ngx_str_t *text, ngx_log_t *log);
+ngx_int_t ngx_postgres_cache_init_zone(ngx_shm_zone_t *zone, void *data);
+ngx_int_t ngx_postgres_coalesce_handler(ngx_http_request_t *r);
+ngx_int_t ngx_postgres_connect_first(ngx_http_upstream_srv_conf_t *usc, ngx_postgres_connect_t **connect, ngx_addr_t **addr);
+ngx_int_t ngx_postgres_connect_start(ngx_postgres_common_t *common, const char **keywords, const char **values, ngx_msec_t timeout, ngx_log_t *log, ngx_event_handler_pt handler, void *data);
+ngx_int_t ngx_postgres_etag(ngx_http_request_t *r, ngx_chain_t *chain);
 ngx_int_t ngx_postgres_handler(ngx_http_request_t *r);
+ngx_int_t ngx_postgres_listen_add(ngx_postgres_data_t *pd, ngx_str_t *channel, ngx_str_t *command);
+ngx_int_t ngx_postgres_listen_handler(ngx_http_request_t *r);
+ngx_int_t ngx_postgres_listen_init_process(ngx_cycle_t *cycle);
+ngx_int_t ngx_postgres_listen_init_zone(ngx_shm_zone_t *zone, void *data);
+ngx_int_t ngx_postgres_listen_notify(ngx_postgres_common_t *common, ngx_str_t *channel, ngx_str_t *text, ngx_uint_t *subscribers);
+ngx_int_t ngx_postgres_listen_publish(ngx_postgres_upstream_srv_conf_t *pusc, ngx_str_t *channel, ngx_str_t *text, ngx_log_t *log, ngx_pool_t *pool);
+ngx_int_t ngx_postgres_listen_remove(ngx_postgres_common_t *common, ngx_str_t *channel);
+ngx_int_t ngx_postgres_output_arrow(ngx_postgres_data_t *pd);
+ngx_int_t ngx_postgres_output_cbor(ngx_postgres_data_t *pd);
 ngx_int_t ngx_postgres_output_chain(ngx_postgres_data_t *pd);
 ngx_int_t ngx_postgres_output_csv(ngx_postgres_data_t *pd);
+ngx_int_t ngx_postgres_output_envelope(ngx_conf_t *cf, ngx_postgres_location_t *location);
+ngx_int_t ngx_postgres_output_flush(ngx_postgres_data_t *pd);
 ngx_int_t ngx_postgres_output_json(ngx_postgres_data_t *pd);
+ngx_int_t ngx_postgres_output_msgpack(ngx_postgres_data_t *pd);
+ngx_int_t ngx_postgres_output_result(ngx_http_request_t *r, PGresult *res, ngx_str_t *charset);
 ngx_int_t ngx_postgres_output_text(ngx_postgres_data_t *pd);
+#if (NGX_THREADS)
+ngx_int_t ngx_postgres_output_thread(ngx_postgres_data_t *pd);
+#endif
 ngx_int_t ngx_postgres_output_value(ngx_postgres_data_t *pd);
+ngx_int_t ngx_postgres_parallel_done(ngx_postgres_data_t *pd);
+ngx_int_t ngx_postgres_parallel_handler(ngx_http_request_t *r);
+ngx_int_t ngx_postgres_parallel_query(ngx_http_request_t *r);
 ngx_int_t ngx_postgres_peer_get(ngx_peer_connection_t *pc, void *data);
 ngx_int_t ngx_postgres_peer_init(ngx_http_request_t *r, ngx_http_upstream_srv_conf_t *upstream_srv_conf);
+ngx_int_t ngx_postgres_peer_yield(ngx_postgres_data_t *pd);
+ngx_int_t ngx_postgres_pipeline_handler(ngx_http_request_t *r);
+ngx_int_t ngx_postgres_pipeline_init_process(ngx_cycle_t *cycle);
 ngx_int_t ngx_postgres_process_notify(ngx_postgres_common_t *common, ngx_flag_t send);
+ngx_int_t ngx_postgres_replication_init_module(ngx_cycle_t *cycle);
+ngx_int_t ngx_postgres_replication_init_process(ngx_cycle_t *cycle);
+ngx_int_t ngx_postgres_result_text(ngx_postgres_data_t *pd);
 ngx_int_t ngx_postgres_variable_add(ngx_conf_t *cf);
 ngx_int_t ngx_postgres_variable_error(ngx_postgres_data_t *pd);
 ngx_int_t ngx_postgres_variable_output(ngx_postgres_data_t *pd);
 ngx_int_t ngx_postgres_variable_set(ngx_postgres_data_t *pd);
+u_char *ngx_postgres_batch_array(ngx_http_request_t *r, ngx_uint_t index);
+void ngx_postgres_async_exit_process(ngx_cycle_t *cycle);
+void ngx_postgres_batch_finalize(ngx_http_request_t *r, ngx_int_t rc);
+void ngx_postgres_cache_store(ngx_http_request_t *r, ngx_chain_t *chain);
+void ngx_postgres_coalesce_done(ngx_http_request_t *r, ngx_chain_t *chain);
 void ngx_postgres_free_connection(ngx_postgres_common_t *common);
 void ngx_postgres_process_events(ngx_postgres_data_t *pd);
 
@@ -0,0 +1,719 @@
+#include "ngx_postgres_include.h"
+
+
+typedef struct {
+    ngx_str_t text;
+    ngx_uint_t id;
+    size_t size;
+} ngx_postgres_listen_event_t;
+
+typedef struct {
+    ngx_flag_t push;
+    ngx_postgres_listen_event_t *ring;
+    ngx_queue_t queue;
+    ngx_queue_t subscribers;
+    ngx_str_t channel;
+    ngx_str_t command;
+    ngx_uint_t hash;
+    ngx_uint_t id;
+    ngx_uint_t nring;
+} ngx_postgres_listen_t;
+
+typedef struct {
+    ngx_str_node_t sn;
+    ngx_queue_t queue;
+    ngx_str_t command;
+} ngx_postgres_listen_node_t;
+
+typedef struct {
+    ngx_atomic_t owner;
+    ngx_atomic_t version;
+    ngx_queue_t queue;
+    ngx_rbtree_node_t sentinel;
+    ngx_rbtree_t rbtree;
+} ngx_postgres_listen_shm_t;
+
+typedef struct {
+    ngx_atomic_uint_t version;
+    ngx_event_t sync;
+    ngx_event_t timeout;
+    ngx_flag_t connected; // at least once
+    ngx_flag_t flush; // cache after notifications could be lost
+    ngx_log_t *log;
+    ngx_postgres_common_t common;
+    ngx_postgres_connect_t *connect;
+    ngx_postgres_upstream_srv_conf_t *pusc;
+    ngx_queue_t *channels;
+    ngx_queue_t pending;
+    ngx_shm_zone_t *zone;
+    ngx_uint_t nbuckets;
+    ngx_uint_t nchannels;
+} ngx_postgres_listener_t;
+
+typedef struct {
+    ngx_chain_t *busy;
+    ngx_chain_t *free;
+    ngx_http_request_t *request;
+    ngx_postgres_listen_t *listen;
+    ngx_postgres_listener_t *pl;
+    ngx_queue_t queue;
+} ngx_postgres_subscriber_t;
+
+
+static ngx_postgres_listen_t *ngx_postgres_listen_find(ngx_postgres_listener_t *pl, ngx_str_t *channel, ngx_uint_t hash) {
+    ngx_queue_t *bucket = &pl->channels[hash & (pl->nbuckets - 1)];
+    for (ngx_queue_t *queue = ngx_queue_head(bucket); queue != ngx_queue_sentinel(bucket); queue = ngx_queue_next(queue)) {
+        ngx_postgres_listen_t *listen = ngx_queue_data(queue, ngx_postgres_listen_t, queue);
+        if (listen->hash == hash && listen->channel.len == channel->len && !ngx_strncmp(listen->channel.data, channel->data, channel->len)) return listen;
+    }
+    return NULL;
+}
+
+
+static ngx_int_t ngx_postgres_listen_grow(ngx_postgres_listener_t *pl) {
+    ngx_uint_t nbuckets = pl->nbuckets ? pl->nbuckets * 2 : 16;
+    ngx_queue_t *channels = ngx_alloc(nbuckets * sizeof(*channels), pl->log);
+    if (!channels) { ngx_log_error(NGX_LOG_ERR, pl->log, 0, "!ngx_alloc"); return NGX_ERROR; }
+    for (ngx_uint_t i = 0; i < nbuckets; i++) ngx_queue_init(&channels[i]);
+    for (ngx_uint_t i = 0; i < pl->nbuckets; i++) while (!ngx_queue_empty(&pl->channels[i])) {
+        ngx_queue_t *queue = ngx_queue_head(&pl->channels[i]);
+        ngx_postgres_listen_t *listen = ngx_queue_data(queue, ngx_postgres_listen_t, queue);
+        ngx_queue_remove(queue);
+        ngx_queue_insert_tail(&channels[listen->hash & (nbuckets - 1)], queue);
+    }
+    if (pl->channels) ngx_free(pl->channels);
+    pl->channels = channels;
+    pl->nbuckets = nbuckets;
+    return NGX_OK;
+}
+
+
+static ngx_postgres_listen_t *ngx_postgres_listen_insert(ngx_postgres_listener_t *pl, ngx_str_t *channel, ngx_str_t *command, ngx_uint_t hash) {
+    if (pl->nchannels >= pl->nbuckets && ngx_postgres_listen_grow(pl) != NGX_OK) { ngx_log_error(NGX_LOG_ERR, pl->log, 0, "ngx_postgres_listen_grow != NGX_OK"); return NULL; }
+    ngx_postgres_listen_t *listen = ngx_alloc(sizeof(*listen) + channel->len + command->len, pl->log);
+    if (!listen) { ngx_log_error(NGX_LOG_ERR, pl->log, 0, "!ngx_alloc"); return NULL; }
+    listen->channel.data = (u_char *)(listen + 1);
+    listen->channel.len = channel->len;
+    ngx_memcpy(listen->channel.data, channel->data, channel->len);
+    listen->command.data = listen->channel.data + channel->len;
+    listen->command.len = command->len;
+    ngx_memcpy(listen->command.data, command->data, command->len);
+    listen->hash = hash;
+    listen->id = 0;
+    listen->nring = 0;
+    listen->push = 0;
+    listen->ring = NULL;
+    ngx_queue_init(&listen->subscribers);
+    ngx_queue_insert_tail(&pl->channels[hash & (pl->nbuckets - 1)], &listen->queue);
+    pl->nchannels++;
+    return listen;
+}
+
+
+static ngx_flag_t ngx_postgres_listen_owner(ngx_postgres_listener_t *pl) {
+    if (!pl->zone) return 1;
+    ngx_postgres_listen_shm_t *sh = pl->zone->data;
+    ngx_pid_t owner = (ngx_pid_t)sh->owner;
+    if (owner == ngx_pid) return 1;
+    if (ngx_terminate || ngx_exiting) return 0;
+    if (owner && (kill(owner, 0) != -1 || ngx_errno != NGX_ESRCH)) return 0; // owner is alive
+    if (!ngx_atomic_cmp_set(&sh->owner, (ngx_atomic_uint_t)owner, (ngx_atomic_uint_t)ngx_pid)) return 0;
+    ngx_log_error(NGX_LOG_NOTICE, pl->log, 0, "listener owner %P -> %P", owner, ngx_pid);
+    pl->flush = 1; // nobody listened since old owner exited
+    pl->version = 0; // listen all shared channels
+    return 1;
+}
+
+
+static void ngx_postgres_listen_release(ngx_postgres_listener_t *pl) {
+    if (!pl->zone) return;
+    ngx_postgres_listen_shm_t *sh = pl->zone->data;
+    if (ngx_atomic_cmp_set(&sh->owner, (ngx_atomic_uint_t)ngx_pid, 0)) ngx_log_error(NGX_LOG_NOTICE, pl->log, 0, "listener owner %P released", ngx_pid);
+}
+
+
+static ngx_int_t ngx_postgres_listen_shm_add(ngx_postgres_listener_t *pl, ngx_str_t *channel, ngx_str_t *command, ngx_uint_t hash) {
+    ngx_slab_pool_t *shpool = (ngx_slab_pool_t *)pl->zone->shm.addr;
+    ngx_postgres_listen_shm_t *sh = pl->zone->data;
+    ngx_shmtx_lock(&shpool->mutex);
+    if (ngx_str_rbtree_lookup(&sh->rbtree, channel, hash)) { ngx_shmtx_unlock(&shpool->mutex); return NGX_OK; }
+    ngx_postgres_listen_node_t *node = ngx_slab_alloc_locked(shpool, sizeof(*node) + channel->len + command->len);
+    if (!node) { ngx_shmtx_unlock(&shpool->mutex); ngx_log_error(NGX_LOG_ERR, pl->log, 0, "!ngx_slab_alloc_locked"); return NGX_ERROR; }
+    node->sn.node.key = hash;
+    node->sn.str.data = (u_char *)(node + 1);
+    node->sn.str.len = channel->len;
+    ngx_memcpy(node->sn.str.data, channel->data, channel->len);
+    node->command.data = node->sn.str.data + channel->len;
+    node->command.len = command->len;
+    ngx_memcpy(node->command.data, command->data, command->len);
+    ngx_rbtree_insert(&sh->rbtree, &node->sn.node);
+    ngx_queue_insert_tail(&sh->queue, &node->queue);
+    sh->version++;
+    ngx_shmtx_unlock(&shpool->mutex);
+    return NGX_OK;
+}
+
+
+static void ngx_postgres_listen_shm_remove(ngx_postgres_listener_t *pl, ngx_str_t *channel, ngx_uint_t hash) {
+    ngx_slab_pool_t *shpool = (ngx_slab_pool_t *)pl->zone->shm.addr;
+    ngx_postgres_listen_shm_t *sh = pl->zone->data;
+    ngx_shmtx_lock(&shpool->mutex);
+    ngx_str_node_t *sn = ngx_str_rbtree_lookup(&sh->rbtree, channel, hash);
+    if (sn) {
+        ngx_postgres_listen_node_t *node = (ngx_postgres_listen_node_t *)sn;
+        ngx_rbtree_delete(&sh->rbtree, &sn->node);
+        ngx_queue_remove(&node->queue);
+        ngx_slab_free_locked(shpool, node);
+        sh->version++;
+    }
+    ngx_shmtx_unlock(&shpool->mutex);
+}
+
+
+static ngx_int_t ngx_postgres_listen_queue(ngx_postgres_listener_t *pl, u_char *data, size_t len) {
+    ngx_postgres_listen_t *command = ngx_alloc(sizeof(*command) + len, pl->log);
+    if (!command) { ngx_log_error(NGX_LOG_ERR, pl->log, 0, "!ngx_alloc"); return NGX_ERROR; }
+    command->command.data = (u_char *)(command + 1);
+    command->command.len = len;
+    ngx_memcpy(command->command.data, data, len);
+    ngx_str_null(&command->channel);
+    ngx_queue_insert_tail(&pl->pending, &command->queue);
+    return NGX_OK;
+}
+
+
+static ngx_int_t ngx_postgres_listen_delete(ngx_postgres_listener_t *pl, ngx_postgres_listen_t *listen) {
+    ngx_queue_remove(&listen->queue);
+    pl->nchannels--;
+    ngx_int_t rc = ngx_postgres_listen_queue(pl, listen->command.data, listen->command.len);
+    for (ngx_uint_t i = 0; i < listen->nring; i++) if (listen->ring[i].text.data) ngx_free(listen->ring[i].text.data);
+    if (listen->ring) ngx_free(listen->ring);
+    ngx_free(listen);
+    return rc;
+}
+
+
+static void ngx_postgres_listen_drop(ngx_postgres_subscriber_t *ps) {
+    ngx_connection_t *c = ps->request->connection;
+    c->error = 1; // finalized by ngx_postgres_listen_writer
+    ngx_post_event(c->write, &ngx_posted_events);
+}
+
+
+static void ngx_postgres_listen_event_handler(ngx_event_t *ev);
+
+
+static ngx_int_t ngx_postgres_listen_connect(ngx_postgres_listener_t *pl) {
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, pl->log, 0, "%s", __func__);
+    return ngx_postgres_connect_start(&pl->common, pl->connect->keywords, pl->connect->values, pl->connect->timeout, pl->log, ngx_postgres_listen_event_handler, pl);
+}
+
+
+static void ngx_postgres_listen_close(ngx_postgres_listener_t *pl) {
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, pl->log, 0, "%s", __func__);
+    ngx_postgres_common_t *plc = &pl->common;
+    if (plc->connection) ngx_postgres_free_connection(plc);
+    else if (plc->conn) { PQfinish(plc->conn); plc->conn = NULL; }
+    plc->connection = NULL;
+    plc->state = 0; // as before first connect
+    while (!ngx_queue_empty(&pl->pending)) { // channels are listened again after reconnect
+        ngx_queue_t *queue = ngx_queue_head(&pl->pending);
+        ngx_queue_remove(queue);
+        ngx_free(ngx_queue_data(queue, ngx_postgres_listen_t, queue));
+    }
+    if (ngx_terminate || ngx_exiting) {
+        for (ngx_uint_t i = 0; i < pl->nbuckets; i++) for (ngx_queue_t *queue = ngx_queue_head(&pl->channels[i]); queue != ngx_queue_sentinel(&pl->channels[i]); queue = ngx_queue_next(queue)) {
+            ngx_postgres_listen_t *listen = ngx_queue_data(queue, ngx_postgres_listen_t, queue);
+            for (ngx_queue_t *q = ngx_queue_head(&listen->subscribers); q != ngx_queue_sentinel(&listen->subscribers); q = ngx_queue_next(q)) ngx_postgres_listen_drop(ngx_queue_data(q, ngx_postgres_subscriber_t, queue));
+        }
+        ngx_postgres_listen_release(pl);
+        return;
+    }
+    if (!pl->timeout.timer_set) ngx_add_timer(&pl->timeout, pl->connect->timeout); // reconnect even if channels are registered later
+}
+
+
+static ngx_int_t ngx_postgres_listen_send(ngx_postgres_listener_t *pl) {
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, pl->log, 0, "%s", __func__);
+    ngx_postgres_common_t *plc = &pl->common;
+    if (!plc->conn) return pl->timeout.timer_set || !pl->nchannels ? NGX_OK : ngx_postgres_listen_connect(pl);
+    if (plc->state != state_idle || ngx_queue_empty(&pl->pending)) return NGX_OK;
+    size_t len = 0;
+    for (ngx_queue_t *queue = ngx_queue_head(&pl->pending); queue != ngx_queue_sentinel(&pl->pending); queue = ngx_queue_next(queue)) {
+        ngx_postgres_listen_t *command = ngx_queue_data(queue, ngx_postgres_listen_t, queue);
+        len += command->command.len + 2;
+    }
+    u_char *sql = ngx_alloc(len, pl->log);
+    if (!sql) { ngx_log_error(NGX_LOG_ERR, pl->log, 0, "!ngx_alloc"); return NGX_ERROR; }
+    u_char *p = sql;
+    while (!ngx_queue_empty(&pl->pending)) {
+        ngx_queue_t *queue = ngx_queue_head(&pl->pending);
+        ngx_postgres_listen_t *command = ngx_queue_data(queue, ngx_postgres_listen_t, queue);
+        if (p != sql) { *p++ = ';'; *p++ = '\n'; }
+        p = ngx_cpymem(p, command->command.data, command->command.len);
+        ngx_queue_remove(queue);
+        ngx_free(command);
+    }
+    *p = '\0';
+    if (!PQsendQuery(plc->conn, (const char *)sql)) { ngx_log_error(NGX_LOG_ERR, pl->log, 0, "!PQsendQuery(\"%s\") and %s", sql, PQerrorMessageMy(plc->conn)); ngx_free(sql); return NGX_ERROR; }
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, pl->log, 0, "PQsendQuery(\"%s\")", sql);
+    ngx_free(sql);
+    plc->state = state_result;
+    return NGX_OK;
+}
+
+
+static void ngx_postgres_listen_event_handler(ngx_event_t *ev) {
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ev->log, 0, "write = %s", ev->write ? "true" : "false");
+    ngx_connection_t *c = ev->data;
+    ngx_postgres_listener_t *pl = c->data;
+    ngx_postgres_common_t *plc = &pl->common;
+    if (c->close) { ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ev->log, 0, "close"); goto close; }
+    if (c->read->timedout) { ngx_log_error(NGX_LOG_ERR, ev->log, 0, "timedout"); goto close; }
+    if (c->write->timedout) { ngx_log_error(NGX_LOG_ERR, ev->log, 0, "timedout"); goto close; }
+    if (plc->state == state_connect) {
+again:
+        switch (PQconnectPoll(plc->conn)) {
+            case PGRES_POLLING_FAILED: ngx_log_error(NGX_LOG_ERR, ev->log, 0, "PQconnectPoll == PGRES_POLLING_FAILED and %s", PQerrorMessageMy(plc->conn)); goto close;
+            case PGRES_POLLING_OK: ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ev->log, 0, "PQconnectPoll == PGRES_POLLING_OK"); break;
+            case PGRES_POLLING_WRITING: if (PQstatus(plc->conn) == CONNECTION_MADE) goto again; return;
+            default: return;
+        }
+        if (c->write->timer_set) ngx_del_timer(c->write);
+        plc->state = state_idle;
+        if (pl->connected) pl->flush = 1; // notifications were lost while disconnected
+        pl->connected = 1;
+        for (ngx_uint_t i = 0; i < pl->nbuckets; i++) for (ngx_queue_t *queue = ngx_queue_head(&pl->channels[i]); queue != ngx_queue_sentinel(&pl->channels[i]); queue = ngx_queue_next(queue)) {
+            ngx_postgres_listen_t *listen = ngx_queue_data(queue, ngx_postgres_listen_t, queue);
+            if (ngx_postgres_listen_queue(pl, listen->command.data + 2, listen->command.len - 2) != NGX_OK) goto close; // LISTEN from UNLISTEN
+        }
+        if (ngx_postgres_listen_send(pl) != NGX_OK) goto close;
+        return;
+    }
+    if (ev->write) return;
+    if (!PQconsumeInput(plc->conn)) { ngx_log_error(NGX_LOG_ERR, ev->log, 0, "!PQconsumeInput and %s", PQerrorMessageMy(plc->conn)); goto close; }
+    if (PQisBusy(plc->conn)) { ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ev->log, 0, "PQisBusy"); return; }
+    for (PGresult *res; (res = PQgetResult(plc->conn)); PQclear(res)) switch(PQresultStatus(res)) {
+        case PGRES_FATAL_ERROR: ngx_log_error(NGX_LOG_ERR, ev->log, 0, "PQresultStatus == PGRES_FATAL_ERROR and %s", PQresultErrorMessageMy(res)); break;
+        default: ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ev->log, 0, "PQresultStatus == %s", PQresStatus(PQresultStatus(res))); break;
+    }
+    plc->state = state_idle;
+    if (pl->flush && pl->pusc->cache.zone) { // after channels are listened again
+        ngx_str_t all = ngx_null_string;
+        if (ngx_postgres_cache_invalidate(pl->pusc->cache.zone, &all, ev->log) != NGX_OK) goto close;
+        ngx_log_error(NGX_LOG_NOTICE, ev->log, 0, "cache zone \"%V\" flushed after reconnect", &pl->pusc->cache.zone->shm.name);
+    }
+    pl->flush = 0;
+    switch (ngx_postgres_process_notify(plc, 1)) {
+        case NGX_ERROR: goto close;
+        case NGX_AGAIN: return;
+        default: break;
+    }
+    if (ngx_postgres_listen_send(pl) == NGX_OK) return;
+close:
+    ngx_postgres_listen_close(pl);
+}
+
+
+static void ngx_postgres_listen_timeout(ngx_event_t *ev) {
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ev->log, 0, "%s", __func__);
+    ngx_postgres_listener_t *pl = ev->data;
+    if (ngx_postgres_listen_send(pl) != NGX_OK) ngx_postgres_listen_close(pl); // connects if any channel is listened
+}
+
+
+static void ngx_postgres_listen_sync(ngx_event_t *ev) {
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ev->log, 0, "%s", __func__);
+    ngx_postgres_listener_t *pl = ev->data;
+    ngx_slab_pool_t *shpool = (ngx_slab_pool_t *)pl->zone->shm.addr;
+    ngx_postgres_listen_shm_t *sh = pl->zone->data;
+    if (ngx_postgres_listen_owner(pl) && pl->version != sh->version) {
+        ngx_postgres_common_t *plc = &pl->common;
+        ngx_int_t rc = NGX_OK;
+        ngx_shmtx_lock(&shpool->mutex);
+        pl->version = sh->version;
+        for (ngx_queue_t *queue = ngx_queue_head(&sh->queue); queue != ngx_queue_sentinel(&sh->queue); queue = ngx_queue_next(queue)) {
+            ngx_postgres_listen_node_t *node = ngx_queue_data(queue, ngx_postgres_listen_node_t, queue);
+            ngx_postgres_listen_t *listen = ngx_postgres_listen_find(pl, &node->sn.str, node->sn.node.key);
+            if (listen) { listen->push = 1; continue; }
+            if (!(listen = ngx_postgres_listen_insert(pl, &node->sn.str, &node->command, node->sn.node.key))) { rc = NGX_ERROR; break; }
+            listen->push = 1;
+            if (plc->conn && plc->state != state_connect && ngx_postgres_listen_queue(pl, node->command.data + 2, node->command.len - 2) != NGX_OK) { rc = NGX_ERROR; break; }
+        }
+        ngx_shmtx_unlock(&shpool->mutex);
+        if (rc != NGX_OK) pl->version = 0; // retry on next sync
+        else if (ngx_postgres_listen_send(pl) != NGX_OK) ngx_postgres_listen_close(pl);
+    }
+    if (!ngx_terminate && !ngx_exiting) ngx_add_timer(ev, 100);
+}
+
+
+ngx_int_t ngx_postgres_listen_init_zone(ngx_shm_zone_t *zone, void *data) {
+    if (data) { zone->data = data; return NGX_OK; }
+    ngx_slab_pool_t *shpool = (ngx_slab_pool_t *)zone->shm.addr;
+    if (zone->shm.exists) { zone->data = shpool->data; return NGX_OK; }
+    ngx_postgres_listen_shm_t *sh = ngx_slab_alloc(shpool, sizeof(*sh));
+    if (!sh) { ngx_log_error(NGX_LOG_EMERG, zone->shm.log, 0, "!ngx_slab_alloc"); return NGX_ERROR; }
+    ngx_rbtree_init(&sh->rbtree, &sh->sentinel, ngx_str_rbtree_insert_value);
+    ngx_queue_init(&sh->queue);
+    sh->owner = 0;
+    sh->version = 1;
+    shpool->data = sh;
+    zone->data = sh;
+    return NGX_OK;
+}
+
+
+static ngx_postgres_listener_t *ngx_postgres_listener(ngx_postgres_upstream_srv_conf_t *pusc, ngx_postgres_connect_t *connect, ngx_addr_t *addr) {
+    ngx_postgres_listener_t *pl = ngx_pcalloc(ngx_cycle->pool, sizeof(*pl));
+    if (!pl) { ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, 0, "!ngx_pcalloc"); return NULL; }
+    pl->log = pusc->ps.log ? pusc->ps.log : ngx_cycle->log;
+    pl->connect = connect;
+    pl->pusc = pusc;
+    ngx_queue_init(&pl->pending);
+    if (ngx_postgres_listen_grow(pl) != NGX_OK) { ngx_log_error(NGX_LOG_ERR, pl->log, 0, "ngx_postgres_listen_grow != NGX_OK"); return NULL; }
+    ngx_postgres_common_t *plc = &pl->common;
+    if (!(plc->addr.sockaddr = ngx_pcalloc(ngx_cycle->pool, addr->socklen))) { ngx_log_error(NGX_LOG_ERR, pl->log, 0, "!ngx_pcalloc"); return NULL; }
+    ngx_memcpy(plc->addr.sockaddr, addr->sockaddr, addr->socklen);
+    plc->addr.socklen = addr->socklen;
+    pl->timeout.cancelable = 1;
+    pl->timeout.data = pl;
+    pl->timeout.handler = ngx_postgres_listen_timeout;
+    pl->timeout.log = pl->log;
+    if ((pl->zone = pusc->listen.zone)) {
+        pl->sync.cancelable = 1;
+        pl->sync.data = pl;
+        pl->sync.handler = ngx_postgres_listen_sync;
+        pl->sync.log = pl->log;
+        ngx_add_timer(&pl->sync, 100);
+    }
+    pusc->listen.listener = pl;
+    return pl;
+}
+
+
+static ngx_int_t ngx_postgres_listen_register(ngx_postgres_listener_t *pl, ngx_str_t *channel, ngx_str_t *command) {
+    ngx_uint_t hash = ngx_hash_key(channel->data, channel->len);
+    if (pl->zone) {
+        if (ngx_postgres_listen_shm_add(pl, channel, command, hash) != NGX_OK) { ngx_log_error(NGX_LOG_ERR, pl->log, 0, "ngx_postgres_listen_shm_add != NGX_OK"); return NGX_ERROR; }
+        if (!ngx_postgres_listen_owner(pl)) return NGX_OK; // owner listens on next sync
+    }
+    ngx_postgres_listen_t *listen = ngx_postgres_listen_find(pl, channel, hash);
+    if (listen) { listen->push = 1; return NGX_OK; }
+    if (!(listen = ngx_postgres_listen_insert(pl, channel, command, hash))) { ngx_log_error(NGX_LOG_ERR, pl->log, 0, "!ngx_postgres_listen_insert"); return NGX_ERROR; }
+    listen->push = 1;
+    ngx_postgres_common_t *plc = &pl->common;
+    if (plc->state == state_connect) return NGX_OK; // listened after connect
+    if (plc->conn && ngx_postgres_listen_queue(pl, command->data + 2, command->len - 2) != NGX_OK) { ngx_log_error(NGX_LOG_ERR, pl->log, 0, "ngx_postgres_listen_queue != NGX_OK"); return NGX_ERROR; }
+    if (ngx_postgres_listen_send(pl) != NGX_OK) ngx_postgres_listen_close(pl); // listened after reconnect
+    return NGX_OK;
+}
+
+
+ngx_int_t ngx_postgres_listen_add(ngx_postgres_data_t *pd, ngx_str_t *channel, ngx_str_t *command) {
+    ngx_http_request_t *r = pd->request;
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "%s", __func__);
+    ngx_postgres_common_t *pdc = &pd->common;
+    ngx_postgres_upstream_srv_conf_t *pusc = pdc->pusc;
+    ngx_postgres_listener_t *pl = pusc->listen.listener;
+    if (!pl && !(pl = ngx_postgres_listener(pusc, pd->connect, &pdc->addr))) { ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "!ngx_postgres_listener"); return NGX_ERROR; }
+    return ngx_postgres_listen_register(pl, channel, command);
+}
+
+
+ngx_int_t ngx_postgres_listen_remove(ngx_postgres_common_t *common, ngx_str_t *channel) {
+    ngx_connection_t *c = common->connection;
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, c->log, 0, "%s", __func__);
+    ngx_postgres_listener_t *pl = c->data;
+    ngx_uint_t hash = ngx_hash_key(channel->data, channel->len);
+    ngx_postgres_listen_t *listen = ngx_postgres_listen_find(pl, channel, hash);
+    if (!listen) return NGX_OK;
+    if (pl->zone) ngx_postgres_listen_shm_remove(pl, channel, hash);
+    listen->push = 0;
+    if (!ngx_queue_empty(&listen->subscribers)) return NGX_OK; // still streamed
+    return ngx_postgres_listen_delete(pl, listen);
+}
+
+
+static u_char *ngx_postgres_listen_eol(u_char *p, u_char *last) {
+    for (; p < last; p++) if (*p == '\r' || *p == '\n') return p; // event stream ends line on CRLF, CR and LF
+    return NULL;
+}
+
+
+static u_char *ngx_postgres_listen_bol(u_char *eol, u_char *last) {
+    return eol + (*eol == '\r' && eol + 1 < last && eol[1] == '\n' ? 2 : 1);
+}
+
+
+static ngx_int_t ngx_postgres_listen_write(ngx_postgres_subscriber_t *ps, ngx_uint_t id, ngx_str_t *text) {
+    ngx_http_request_t *r = ps->request;
+    ngx_postgres_location_t *location = ngx_http_get_module_loc_conf(r, ngx_postgres_module);
+    ngx_uint_t busy = 0;
+    for (ngx_chain_t *cl = ps->busy; cl; cl = cl->next) busy++;
+    if (busy >= location->upstream.bufs.num) { ngx_log_error(NGX_LOG_WARN, r->connection->log, 0, "busy = %ui", busy); return NGX_ERROR; } // slow client
+    u_char *p, *eol, *last = text->data + text->len;
+    size_t size = sizeof("id: -\n") - 1 + NGX_INT64_LEN + NGX_INT_T_LEN + sizeof("\n") - 1;
+    for (p = text->data; ; p = ngx_postgres_listen_bol(eol, last)) { // data field per line
+        eol = ngx_postgres_listen_eol(p, last);
+        size += sizeof("data: \n") - 1 + (eol ? eol : last) - p;
+        if (!eol) break;
+    }
+    ngx_chain_t *cl = ngx_chain_get_free_buf(r->pool, &ps->free);
+    if (!cl) { ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "!ngx_chain_get_free_buf"); return NGX_ERROR; }
+    ngx_buf_t *b = cl->buf;
+    if ((size_t)(b->end - b->start) < size) {
+        if (!(b->start = ngx_palloc(r->pool, size))) { ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "!ngx_palloc"); return NGX_ERROR; }
+        b->end = b->start + size;
+    }
+    b->pos = b->last = b->start;
+    b->flush = 1;
+    b->tag = (ngx_buf_tag_t)&ngx_postgres_module;
+    b->temporary = 1;
+    b->last = ngx_sprintf(b->last, "id: %P-%ui\n", ngx_pid, id);
+    for (p = text->data; ; p = ngx_postgres_listen_bol(eol, last)) {
+        eol = ngx_postgres_listen_eol(p, last);
+        b->last = ngx_cpymem(b->last, "data: ", sizeof("data: ") - 1);
+        b->last = ngx_cpymem(b->last, p, (eol ? eol : last) - p);
+        *b->last++ = '\n';
+        if (!eol) break;
+    }
+    *b->last++ = '\n';
+    ngx_int_t rc = ngx_http_output_filter(r, cl);
+    ngx_chain_update_chains(r->pool, &ps->free, &ps->busy, &cl, b->tag);
+    return rc == NGX_ERROR ? NGX_ERROR : NGX_OK;
+}
+
+
+static ngx_int_t ngx_postgres_listen_deliver(ngx_postgres_listen_t *listen, ngx_str_t *text, ngx_log_t *log, ngx_uint_t *subscribers) {
+    ngx_uint_t id = ++listen->id;
+    if (listen->nring) {
+        ngx_postgres_listen_event_t *event = &listen->ring[id % listen->nring];
+        if (event->size < text->len) {
+            if (event->text.data) ngx_free(event->text.data);
+            event->size = 0;
+            if (!(event->text.data = ngx_alloc(text->len, log))) { ngx_log_error(NGX_LOG_ERR, log, 0, "!ngx_alloc"); event->id = 0; return NGX_ERROR; }
+            event->size = text->len;
+        }
+        ngx_memcpy(event->text.data, text->data, text->len);
+        event->text.len = text->len;
+        event->id = id;
+    }
+    for (ngx_queue_t *queue = ngx_queue_head(&listen->subscribers); queue != ngx_queue_sentinel(&listen->subscribers); queue = ngx_queue_next(queue)) {
+        ngx_postgres_subscriber_t *ps = ngx_queue_data(queue, ngx_postgres_subscriber_t, queue);
+        if (ps->request->connection->error) continue;
+        if (ngx_postgres_listen_write(ps, id, text) == NGX_OK) (*subscribers)++; else ngx_postgres_listen_drop(ps);
+    }
+    return NGX_OK;
+}
+
+
+ngx_int_t ngx_postgres_listen_notify(ngx_postgres_common_t *common, ngx_str_t *channel, ngx_str_t *text, ngx_uint_t *subscribers) {
+    ngx_connection_t *c = common->connection;
+    ngx_postgres_listener_t *pl = c->data;
+    ngx_postgres_upstream_srv_conf_t *pusc = pl->pusc;
+    if (pusc->cache.zone && pusc->cache.channel.len == channel->len && !ngx_strncmp(pusc->cache.channel.data, channel->data, channel->len)) {
+        (*subscribers)++;
+        return ngx_postgres_cache_invalidate(pusc->cache.zone, text, c->log) == NGX_OK ? NGX_DONE : NGX_ERROR;
+    }
+    ngx_postgres_listen_t *listen = ngx_postgres_listen_find(pl, channel, ngx_hash_key(channel->data, channel->len));
+    if (!listen) return NGX_DONE; // already unlistened
+    if (ngx_postgres_listen_deliver(listen, text, c->log, subscribers) != NGX_OK) return NGX_ERROR;
+    return listen->push ? NGX_OK : NGX_DONE;
+}
+
+
+ngx_int_t ngx_postgres_listen_publish(ngx_postgres_upstream_srv_conf_t *pusc, ngx_str_t *channel, ngx_str_t *text, ngx_log_t *log, ngx_pool_t *pool) {
+    ngx_uint_t subscribers = 0;
+    ngx_postgres_listener_t *pl = pusc->listen.listener;
+    ngx_postgres_listen_t *listen = pl ? ngx_postgres_listen_find(pl, channel, ngx_hash_key(channel->data, channel->len)) : NULL;
+    if (listen && ngx_postgres_listen_deliver(listen, text, log, &subscribers) != NGX_OK) return NGX_ERROR;
+    if (ngx_http_push_stream_add_msg_to_channel_my) switch (ngx_http_push_stream_add_msg_to_channel_my(log, channel, text, NULL, NULL, 0, pool)) {
+        case NGX_ERROR: ngx_log_error(NGX_LOG_ERR, log, 0, "ngx_http_push_stream_add_msg_to_channel_my == NGX_ERROR"); return NGX_ERROR;
+        case NGX_OK: subscribers++; break;
+        default: break;
+    }
+    return subscribers ? NGX_OK : NGX_DECLINED;
+}
+
+
+static void ngx_postgres_listen_unsubscribe(void *data) {
+    ngx_postgres_subscriber_t *ps = data;
+    ngx_postgres_listen_t *listen = ps->listen;
+    ngx_queue_remove(&ps->queue);
+    if (!ngx_queue_empty(&listen->subscribers) || listen->push) return;
+    ngx_postgres_listener_t *pl = ps->pl;
+    if (ngx_postgres_listen_delete(pl, listen) != NGX_OK || ngx_postgres_listen_send(pl) != NGX_OK) ngx_postgres_listen_close(pl);
+}
+
+
+static void ngx_postgres_listen_writer(ngx_http_request_t *r) {
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "%s", __func__);
+    ngx_connection_t *c = r->connection;
+    if (c->error || c->write->timedout) { ngx_http_finalize_request(r, NGX_ERROR); return; }
+    ngx_postgres_subscriber_t *ps = ngx_http_get_module_ctx(r, ngx_postgres_module);
+    ngx_chain_t *out = NULL;
+    if (ngx_http_output_filter(r, NULL) == NGX_ERROR) { ngx_http_finalize_request(r, NGX_ERROR); return; }
+    ngx_chain_update_chains(r->pool, &ps->free, &ps->busy, &out, (ngx_buf_tag_t)&ngx_postgres_module);
+}
+
+
+static ngx_table_elt_t *ngx_postgres_listen_last_event_id(ngx_http_request_t *r) {
+    ngx_list_part_t *part = &r->headers_in.headers.part;
+    ngx_table_elt_t *header = part->elts;
+    for (ngx_uint_t i = 0; ; i++) {
+        if (i >= part->nelts) {
+            if (!(part = part->next)) return NULL;
+            header = part->elts;
+            i = 0;
+        }
+        if (header[i].key.len == sizeof("Last-Event-ID") - 1 && !ngx_strncasecmp(header[i].key.data, (u_char *)"Last-Event-ID", sizeof("Last-Event-ID") - 1)) return &header[i];
+    }
+}
+
+
+static ngx_int_t ngx_postgres_listen_replay(ngx_postgres_subscriber_t *ps) {
+    ngx_http_request_t *r = ps->request;
+    ngx_postgres_listen_t *listen = ps->listen;
+    ngx_table_elt_t *header = ngx_postgres_listen_last_event_id(r);
+    if (!header || !listen->nring) return NGX_DECLINED;
+    u_char *dash = ngx_strlchr(header->value.data, header->value.data + header->value.len, '-');
+    if (!dash) return NGX_DECLINED;
+    ngx_int_t pid = ngx_atoi(header->value.data, dash - header->value.data);
+    ngx_int_t id = ngx_atoi(dash + 1, header->value.data + header->value.len - dash - 1);
+    if (pid != ngx_pid || id == NGX_ERROR || (ngx_uint_t)id >= listen->id) return NGX_DECLINED; // ids are per worker
+    ngx_uint_t i = listen->id - (ngx_uint_t)id > listen->nring ? listen->id - listen->nring + 1 : (ngx_uint_t)id + 1;
+    for (; i <= listen->id; i++) {
+        ngx_postgres_listen_event_t *event = &listen->ring[i % listen->nring];
+        if (event->id != i) continue;
+        if (ngx_postgres_listen_write(ps, event->id, &event->text) != NGX_OK) return NGX_ERROR;
+    }
+    return NGX_OK;
+}
+
+
+static ngx_int_t ngx_postgres_listen_command(ngx_str_t *channel, ngx_str_t *command, ngx_pool_t *pool) {
+    command->len = sizeof("UNLISTEN \"\"") - 1 + channel->len;
+    for (u_char *p = channel->data; p < channel->data + channel->len; p++) if (*p == '"') command->len++;
+    if (!(command->data = ngx_pnalloc(pool, command->len))) { ngx_log_error(NGX_LOG_ERR, pool->log, 0, "!ngx_pnalloc"); return NGX_ERROR; }
+    u_char *last = ngx_cpymem(command->data, "UNLISTEN \"", sizeof("UNLISTEN \"") - 1);
+    for (u_char *p = channel->data; p < channel->data + channel->len; p++) { if (*p == '"') *last++ = '"'; *last++ = *p; } // quote identifier
+    *last = '"';
+    return NGX_OK;
+}
+
+
+ngx_int_t ngx_postgres_listen_handler(ngx_http_request_t *r) {
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "%s", __func__);
+    if (!(r->method & (NGX_HTTP_GET|NGX_HTTP_HEAD))) return NGX_HTTP_NOT_ALLOWED;
+    ngx_int_t rc = ngx_http_discard_request_body(r);
+    if (rc != NGX_OK) return rc;
+    ngx_postgres_location_t *location = ngx_http_get_module_loc_conf(r, ngx_postgres_module);
+    ngx_http_upstream_srv_conf_t *usc = location->upstream.upstream;
+    if (!usc) { ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "\"postgres_listen\" requires \"postgres_pass\" without variables"); return NGX_HTTP_INTERNAL_SERVER_ERROR; }
+    ngx_str_t channel;
+    if (ngx_http_complex_value(r, &location->listen.channel, &channel) != NGX_OK) { ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "ngx_http_complex_value != NGX_OK"); return NGX_HTTP_INTERNAL_SERVER_ERROR; }
+    if (!channel.len || ngx_strlchr(channel.data, channel.data + channel.len, '\0')) { ngx_log_error(NGX_LOG_INFO, r->connection->log, 0, "invalid channel \"%V\"", &channel); return NGX_HTTP_BAD_REQUEST; }
+    ngx_postgres_upstream_srv_conf_t *pusc = ngx_http_conf_upstream_srv_conf(usc, ngx_postgres_module);
+    ngx_postgres_listener_t *pl = pusc->listen.listener;
+    if (!pl) {
+        ngx_postgres_connect_t *connect;
+        ngx_addr_t *addr;
+        if (ngx_postgres_connect_first(usc, &connect, &addr) != NGX_OK) { ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "ngx_postgres_connect_first != NGX_OK"); return NGX_HTTP_INTERNAL_SERVER_ERROR; }
+        if (!(pl = ngx_postgres_listener(pusc, connect, addr))) { ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "!ngx_postgres_listener"); return NGX_HTTP_INTERNAL_SERVER_ERROR; }
+    }
+    ngx_uint_t hash = ngx_hash_key(channel.data, channel.len);
+    ngx_postgres_listen_t *listen = ngx_postgres_listen_find(pl, &channel, hash);
+    if (!listen) {
+        ngx_str_t command;
+        if (ngx_postgres_listen_command(&channel, &command, r->pool) != NGX_OK) { ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "ngx_postgres_listen_command != NGX_OK"); return NGX_HTTP_INTERNAL_SERVER_ERROR; }
+        if (!(listen = ngx_postgres_listen_insert(pl, &channel, &command, hash))) { ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "!ngx_postgres_listen_insert"); return NGX_HTTP_INTERNAL_SERVER_ERROR; }
+        ngx_postgres_common_t *plc = &pl->common;
+        if (plc->conn && plc->state != state_connect && ngx_postgres_listen_queue(pl, command.data + 2, command.len - 2) != NGX_OK) { ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "ngx_postgres_listen_queue != NGX_OK"); return NGX_HTTP_INTERNAL_SERVER_ERROR; }
+        if (ngx_postgres_listen_send(pl) != NGX_OK) ngx_postgres_listen_close(pl); // listened after reconnect
+    }
+    if (location->listen.replay && !listen->nring) {
+        if (!(listen->ring = ngx_calloc(location->listen.replay * sizeof(*listen->ring), r->connection->log))) { ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "!ngx_calloc"); return NGX_HTTP_INTERNAL_SERVER_ERROR; }
+        listen->nring = location->listen.replay;
+    }
+    ngx_postgres_subscriber_t *ps = ngx_pcalloc(r->pool, sizeof(*ps));
+    if (!ps) { ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "!ngx_pcalloc"); return NGX_HTTP_INTERNAL_SERVER_ERROR; }
+    ngx_pool_cleanup_t *cln = ngx_pool_cleanup_add(r->pool, 0);
+    if (!cln) { ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "!ngx_pool_cleanup_add"); return NGX_HTTP_INTERNAL_SERVER_ERROR; }
+    ps->listen = listen;
+    ps->pl = pl;
+    ps->request = r;
+    ngx_queue_insert_tail(&listen->subscribers, &ps->queue);
+    cln->data = ps;
+    cln->handler = ngx_postgres_listen_unsubscribe;
+    ngx_http_set_ctx(r, ps, ngx_postgres_module);
+    ngx_table_elt_t *h = ngx_list_push(&r->headers_out.headers);
+    if (!h) { ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "!ngx_list_push"); return NGX_HTTP_INTERNAL_SERVER_ERROR; }
+    h->hash = 1;
+    ngx_str_set(&h->key, "Cache-Control");
+    ngx_str_set(&h->value, "no-cache");
+    ngx_str_set(&r->headers_out.content_type, "text/event-stream");
+    r->headers_out.content_type_len = r->headers_out.content_type.len;
+    r->headers_out.content_length_n = -1;
+    r->headers_out.status = NGX_HTTP_OK;
+    rc = ngx_http_send_header(r);
+    if (rc == NGX_ERROR || rc > NGX_OK || r->header_only) return rc;
+    switch (ngx_postgres_listen_replay(ps)) {
+        case NGX_ERROR: return NGX_ERROR;
+        case NGX_DECLINED: if (ngx_http_send_special(r, NGX_HTTP_FLUSH) == NGX_ERROR) return NGX_ERROR; break;
+        default: break;
+    }
+    r->read_event_handler = ngx_http_test_reading;
+    r->write_event_handler = ngx_postgres_listen_writer;
+    r->main->count++;
+    return NGX_DONE;
+}
+
+
+ngx_int_t ngx_postgres_listen_init_process(ngx_cycle_t *cycle) {
+    if (ngx_process != NGX_PROCESS_WORKER && ngx_process != NGX_PROCESS_SINGLE) return NGX_OK;
+    ngx_http_upstream_main_conf_t *umcf = ngx_http_cycle_get_module_main_conf(cycle, ngx_http_upstream_module);
+    if (!umcf) return NGX_OK;
+    ngx_http_upstream_srv_conf_t **usc = umcf->upstreams.elts;
+    for (ngx_uint_t i = 0; i < umcf->upstreams.nelts; i++) {
+        if (!usc[i]->srv_conf || !usc[i]->srv_conf[ngx_postgres_module.ctx_index]) continue;
+        ngx_postgres_upstream_srv_conf_t *pusc = ngx_http_conf_upstream_srv_conf(usc[i], ngx_postgres_module);
+        if (!pusc->cache.zone) continue;
+        if (pusc->cache.zone->init != ngx_postgres_cache_init_zone) { ngx_log_error(NGX_LOG_ERR, cycle->log, 0, "\"postgres_cache_invalidate\" zone \"%V\" must be defined by \"postgres_cache_zone\"", &pusc->cache.zone->shm.name); continue; }
+        ngx_postgres_listener_t *pl = pusc->listen.listener;
+        if (!pl) {
+            ngx_postgres_connect_t *connect;
+            ngx_addr_t *addr;
+            if (ngx_postgres_connect_first(usc[i], &connect, &addr) != NGX_OK) { ngx_log_error(NGX_LOG_ERR, cycle->log, 0, "ngx_postgres_connect_first != NGX_OK"); continue; }
+            if (!(pl = ngx_postgres_listener(pusc, connect, addr))) { ngx_log_error(NGX_LOG_ERR, cycle->log, 0, "!ngx_postgres_listener"); continue; }
+        }
+        ngx_str_t command;
+        if (ngx_postgres_listen_command(&pusc->cache.channel, &command, cycle->pool) != NGX_OK) { ngx_log_error(NGX_LOG_ERR, cycle->log, 0, "ngx_postgres_listen_command != NGX_OK"); continue; }
+        if (ngx_postgres_listen_register(pl, &pusc->cache.channel, &command) != NGX_OK) ngx_log_error(NGX_LOG_ERR, cycle->log, 0, "ngx_postgres_listen_register != NGX_OK");
+    }
+    return NGX_OK;
+}
+
+
+char *ngx_postgres_listen_conf(ngx_conf_t *cf, ngx_command_t *cmd, void *conf) {
+    ngx_postgres_location_t *location = conf;
+    if (location->listen.channel.value.data) return "duplicate";
+    ngx_str_t *elts = cf->args->elts;
+    if (!elts[1].len) return "error: empty channel";
+    ngx_http_compile_complex_value_t ccv = {cf, &elts[1], &location->listen.channel, 0, 0, 0};
+    if (ngx_http_compile_complex_value(&ccv) != NGX_OK) { ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "\"%V\" directive error: ngx_http_compile_complex_value != NGX_OK", &cmd->name); return NGX_CONF_ERROR; }
+    location->listen.replay = 16;
+    for (ngx_uint_t i = 2; i < cf->args->nelts; i++) {
+        if (elts[i].len > sizeof("replay=") - 1 && !ngx_strncasecmp(elts[i].data, (u_char *)"replay=", sizeof("replay=") - 1)) {
+            elts[i].len = elts[i].len - (sizeof("replay=") - 1);
+            elts[i].data = &elts[i].data[sizeof("replay=") - 1];
+            ngx_int_t n = ngx_atoi(elts[i].data, elts[i].len);
+            if (n == NGX_ERROR) { ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "\"%V\" directive error: \"replay\" value \"%V\" must be number", &cmd->name, &elts[i]); return NGX_CONF_ERROR; }
+            location->listen.replay = (ngx_uint_t)n;
+            continue;
+        }
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "\"%V\" directive error: invalid additional parameter \"%V\"", &cmd->name, &elts[i]);
+        return NGX_CONF_ERROR;
+    }
+    return NGX_CONF_OK;
+}
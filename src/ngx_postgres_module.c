@@ -7,6 +7,24 @@ static ngx_int_t ngx_postgres_preconfiguration(ngx_conf_t *cf) {
 }
 
 
+static ngx_int_t ngx_postgres_init_module(ngx_cycle_t *cycle) {
+    return ngx_postgres_replication_init_module(cycle);
+}
+
+
+static ngx_int_t ngx_postgres_init_process(ngx_cycle_t *cycle) {
+    if (ngx_postgres_async_init_process(cycle) != NGX_OK) return NGX_ERROR;
+    if (ngx_postgres_listen_init_process(cycle) != NGX_OK) return NGX_ERROR;
+    if (ngx_postgres_pipeline_init_process(cycle) != NGX_OK) return NGX_ERROR;
+    return ngx_postgres_replication_init_process(cycle);
+}
+
+
+static void ngx_postgres_exit_process(ngx_cycle_t *cycle) {
+    ngx_postgres_async_exit_process(cycle);
+}
+
+
 static void ngx_postgres_srv_conf_cleanup(void *data) {
     ngx_postgres_upstream_srv_conf_t *pusc = data;
     while (!ngx_queue_empty(&pusc->ps.queue)) {
@@ -34,6 +52,14 @@ static void *ngx_postgres_create_srv_conf(ngx_conf_t *cf) {
 static void *ngx_postgres_create_loc_conf(ngx_conf_t *cf) {
     ngx_postgres_location_t *location = ngx_pcalloc(cf->pool, sizeof(*location));
     if (!location) { ngx_log_error(NGX_LOG_EMERG, cf->log, 0, "!ngx_pcalloc"); return NULL; }
+    location->async = NGX_CONF_UNSET_UINT;
+    location->pipeline = NGX_CONF_UNSET_UINT;
+    location->cache.lock = NGX_CONF_UNSET_MSEC;
+    location->coalesce = NGX_CONF_UNSET;
+    location->envelope = NGX_CONF_UNSET;
+    location->parallel = NGX_CONF_UNSET;
+    location->cursor = NGX_CONF_UNSET;
+    location->etag.enable = NGX_CONF_UNSET;
     location->upstream.buffering = NGX_CONF_UNSET;
     location->upstream.buffer_size = NGX_CONF_UNSET_SIZE;
     location->upstream.busy_buffers_size_conf = NGX_CONF_UNSET_SIZE;
@@ -76,8 +102,38 @@ static ngx_str_t ngx_postgres_hide_headers[] = {
 static char *ngx_postgres_merge_loc_conf(ngx_conf_t *cf, void *parent, void *child) {
     ngx_postgres_location_t *prev = parent;
     ngx_postgres_location_t *conf = child;
+    if (!conf->cache.key) conf->cache.key = prev->cache.key;
+    if (!conf->cache.tag) conf->cache.tag = prev->cache.tag;
+    if (!conf->cache.zone) {
+        conf->cache.valid = prev->cache.valid;
+        conf->cache.zone = prev->cache.zone;
+    }
+    if (conf->cache.zone && conf->cache.zone->init != ngx_postgres_cache_init_zone) { ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "\"postgres_cache\" zone \"%V\" must be defined by \"postgres_cache_zone\"", &conf->cache.zone->shm.name); return NGX_CONF_ERROR; }
+    ngx_conf_merge_msec_value(conf->cache.lock, prev->cache.lock, 0);
+    ngx_conf_merge_value(conf->coalesce, prev->coalesce, 0);
+    ngx_conf_merge_value(conf->envelope, prev->envelope, 0);
+    ngx_conf_merge_value(conf->parallel, prev->parallel, 0);
+    ngx_conf_merge_uint_value(conf->async, prev->async, 0);
+    ngx_conf_merge_uint_value(conf->pipeline, prev->pipeline, 0);
+    if (conf->etag.enable == NGX_CONF_UNSET) conf->etag = prev->etag;
+    if (conf->etag.enable == NGX_CONF_UNSET) conf->etag.enable = 0;
+    ngx_conf_merge_value(conf->cursor, prev->cursor, 0);
+    if (!conf->batch.max) conf->batch = prev->batch;
     if (!conf->complex.value.data) conf->complex = prev->complex;
+    if (!conf->transaction.data) conf->transaction = prev->transaction;
+    if (!conf->listen.channel.value.data) conf->listen = prev->listen;
     if (!conf->queries.elts) conf->queries = prev->queries;
+    if (conf->batch.max && conf->queries.elts) {
+        const char *name = conf->batch.column.len ? "postgres_lookup" : "postgres_batch";
+        if (conf->cache.zone || conf->coalesce) { ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "\"%s\" can not be combined with \"postgres_cache\" or \"postgres_coalesce\"", name); return NGX_CONF_ERROR; }
+        if (conf->queries.nelts != 1) { ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "\"%s\" requires single \"postgres_query\"", name); return NGX_CONF_ERROR; }
+        if (conf->complex.value.data) { ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "\"%s\" requires \"postgres_pass\" without variables", name); return NGX_CONF_ERROR; } // upstream of leader runs query of every request
+        ngx_postgres_query_t *query = conf->queries.elts;
+        ngx_postgres_param_t *param = query->params.elts;
+        ngx_uint_t i;
+        for (i = 0; i < query->params.nelts; i++) if (!conf->batch.column.len || param[i].index == (ngx_uint_t)conf->batch.index) break;
+        if (i == query->params.nelts) { ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, conf->batch.column.len ? "\"%s\" variable must be a parameter of \"postgres_query\"" : "\"%s\" requires parameters in \"postgres_query\"", name); return NGX_CONF_ERROR; }
+    }
     if (!conf->upstream.upstream) conf->upstream = prev->upstream;
     if (conf->upstream.store == NGX_CONF_UNSET) {
         ngx_conf_merge_value(conf->upstream.store, prev->upstream.store, 0);
@@ -118,6 +174,54 @@ static char *ngx_postgres_merge_loc_conf(ngx_conf_t *cf, void *parent, void *chi
     if (conf->upstream.max_temp_file_size != 0 && conf->upstream.max_temp_file_size < size) { ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "\"postgres_max_temp_file_size\" must be equal to zero to disable temporary files usage or must be equal to or greater than the maximum of the value of \"postgres_buffer_size\" and one of the \"postgres_buffers\""); return NGX_CONF_ERROR; }
     if (conf->upstream.next_upstream & NGX_HTTP_UPSTREAM_FT_OFF) conf->upstream.next_upstream = NGX_CONF_BITMASK_SET|NGX_HTTP_UPSTREAM_FT_OFF;
     if (ngx_conf_merge_path_value(cf, &conf->upstream.temp_path, prev->upstream.temp_path, &ngx_postgres_temp_path) != NGX_OK) return NGX_CONF_ERROR;
+    if (conf->async && conf->queries.elts) {
+        if (!conf->upstream.upstream || conf->complex.value.data) { ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "\"postgres_async\" requires \"postgres_pass\" without variables"); return NGX_CONF_ERROR; }
+        if (conf->batch.max || conf->cache.zone || conf->coalesce) { ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "\"postgres_async\" can not be combined with \"postgres_batch\", \"postgres_lookup\", \"postgres_cache\" or \"postgres_coalesce\""); return NGX_CONF_ERROR; }
+        ngx_postgres_query_t *query = conf->queries.elts;
+        for (ngx_uint_t i = 0; i < conf->queries.nelts; i++) if (query[i].ids.nelts) { ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "\"postgres_async\" does not support identifier parameters in \"postgres_query\""); return NGX_CONF_ERROR; } // quoted by connection
+        ngx_http_upstream_srv_conf_t *usc = conf->upstream.upstream;
+        if (!usc->srv_conf || !usc->srv_conf[ngx_postgres_module.ctx_index]) { ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "\"postgres_async\" requires upstream \"%V\" with \"postgres_server\"", &usc->host); return NGX_CONF_ERROR; }
+        ngx_postgres_upstream_srv_conf_t *pusc = ngx_http_conf_upstream_srv_conf(usc, ngx_postgres_module);
+        if (!pusc->async.path) pusc->async.path = conf->upstream.temp_path; // spool of first location
+        if (pusc->async.max < conf->async) pusc->async.max = conf->async;
+    }
+    if (conf->cursor && conf->queries.elts) {
+        if (conf->cursor < 0) { ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "\"postgres_cursor\" must be positive"); return NGX_CONF_ERROR; }
+        if (conf->async || conf->batch.max || conf->cache.zone || conf->coalesce || conf->etag.enable) { ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "\"postgres_cursor\" can not be combined with \"postgres_async\", \"postgres_batch\", \"postgres_lookup\", \"postgres_cache\", \"postgres_coalesce\" or \"postgres_etag\""); return NGX_CONF_ERROR; } // they need whole response
+        if (conf->queries.nelts != 1) { ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "\"postgres_cursor\" requires single \"postgres_query\""); return NGX_CONF_ERROR; }
+        ngx_postgres_query_t *query = conf->queries.elts;
+        if (query->output.handler != ngx_postgres_output_text && query->output.handler != ngx_postgres_output_csv) { ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "\"postgres_cursor\" requires \"postgres_output\" text or csv"); return NGX_CONF_ERROR; }
+    }
+    if (conf->pipeline && conf->queries.elts) {
+        if (!conf->upstream.upstream || conf->complex.value.data) { ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "\"postgres_pipeline\" requires \"postgres_pass\" without variables"); return NGX_CONF_ERROR; }
+        if (conf->async || conf->batch.max || conf->cache.zone || conf->coalesce || conf->cursor || conf->etag.enable) { ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "\"postgres_pipeline\" can not be combined with \"postgres_async\", \"postgres_batch\", \"postgres_lookup\", \"postgres_cache\", \"postgres_coalesce\", \"postgres_cursor\" or \"postgres_etag\""); return NGX_CONF_ERROR; }
+        if (conf->queries.nelts != 1) { ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "\"postgres_pipeline\" requires single \"postgres_query\""); return NGX_CONF_ERROR; } // one sync point per request
+        ngx_postgres_query_t *query = conf->queries.elts;
+        if (query->ids.nelts) { ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "\"postgres_pipeline\" does not support identifier parameters in \"postgres_query\""); return NGX_CONF_ERROR; } // quoted by connection
+        ngx_http_upstream_srv_conf_t *usc = conf->upstream.upstream;
+        if (!usc->srv_conf || !usc->srv_conf[ngx_postgres_module.ctx_index]) { ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "\"postgres_pipeline\" requires upstream \"%V\" with \"postgres_server\"", &usc->host); return NGX_CONF_ERROR; }
+        ngx_postgres_upstream_srv_conf_t *pusc = ngx_http_conf_upstream_srv_conf(usc, ngx_postgres_module);
+        if (pusc->pipeline.timeout < conf->upstream.read_timeout) pusc->pipeline.timeout = conf->upstream.read_timeout;
+    }
+    if (conf->envelope && conf->queries.elts && ngx_postgres_output_envelope(cf, conf) != NGX_OK) return NGX_CONF_ERROR;
+    if (conf->transaction.len && conf->queries.elts && (conf->async || conf->batch.max || conf->parallel || conf->pipeline)) { ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "\"postgres_transaction\" can not be combined with \"postgres_async\", \"postgres_batch\", \"postgres_lookup\", \"postgres_parallel\" or \"postgres_pipeline\""); return NGX_CONF_ERROR; } // they do not run queries on own connection
+    if (conf->parallel && conf->queries.elts) {
+        if (conf->async || conf->batch.max || conf->cache.zone || conf->coalesce || conf->cursor || conf->etag.enable || conf->pipeline) { ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "\"postgres_parallel\" can not be combined with \"postgres_async\", \"postgres_batch\", \"postgres_lookup\", \"postgres_cache\", \"postgres_coalesce\", \"postgres_cursor\", \"postgres_etag\" or \"postgres_pipeline\""); return NGX_CONF_ERROR; }
+        if (conf->listen.channel.value.data) { ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "\"postgres_parallel\" can not be combined with \"postgres_listen\""); return NGX_CONF_ERROR; }
+        ngx_postgres_query_t *query = conf->queries.elts;
+        for (ngx_uint_t i = 0; i < conf->queries.nelts; i++) if (query[i].variables.nelts) { ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "\"postgres_parallel\" can not be combined with \"postgres_set\""); return NGX_CONF_ERROR; } // set in subrequest, never seen by main request
+    }
+    if ((conf->cache.zone || conf->coalesce) && conf->queries.elts) {
+        ngx_postgres_query_t *query = conf->queries.elts;
+        for (ngx_uint_t i = 0; i < conf->queries.nelts; i++) if (query[i].variables.nelts) { ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "\"%s\" can not be combined with \"postgres_set\"", conf->cache.zone ? "postgres_cache" : "postgres_coalesce"); return NGX_CONF_ERROR; } // not kept with response, so unset on hit or in follower
+    }
+    if (conf->listen.channel.value.data && conf->upstream.upstream) {
+        ngx_http_upstream_srv_conf_t *usc = conf->upstream.upstream;
+        if (usc->srv_conf && usc->srv_conf[ngx_postgres_module.ctx_index]) {
+            ngx_postgres_upstream_srv_conf_t *pusc = ngx_http_conf_upstream_srv_conf(usc, ngx_postgres_module);
+            pusc->replication.listen = 1; // checked against worker_processes in ngx_postgres_replication_init_module
+        }
+    }
     ngx_hash_init_t hash;
     hash.max_size = 512;
     hash.bucket_size = ngx_align(64, ngx_cacheline_size);
@@ -402,6 +506,19 @@ static char *ngx_postgres_keepalive_conf(ngx_conf_t *cf, ngx_command_t *cmd, voi
             pusc->ps.timeout = (ngx_msec_t)n;
             continue;
         }
+        if (elts[i].len > sizeof("pooling=") - 1 && !ngx_strncasecmp(elts[i].data, (u_char *)"pooling=", sizeof("pooling=") - 1)) {
+            elts[i].len = elts[i].len - (sizeof("pooling=") - 1);
+            elts[i].data = &elts[i].data[sizeof("pooling=") - 1];
+            static const ngx_conf_enum_t e[] = {
+                { ngx_string("session"), 0 },
+                { ngx_string("transaction"), 1 },
+                { ngx_null_string, 0 }
+            };
+            ngx_uint_t j;
+            for (j = 0; e[j].name.len; j++) if (e[j].name.len == elts[i].len && !ngx_strncasecmp(e[j].name.data, elts[i].data, elts[i].len)) { pusc->ps.transaction = e[j].value; break; }
+            if (!e[j].name.len) { ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "\"%V\" directive error: \"pooling\" value \"%V\" must be \"session\" or \"transaction\"", &cmd->name, &elts[i]); return NGX_CONF_ERROR; }
+            continue;
+        }
         if (elts[i].len > sizeof("requests=") - 1 && !ngx_strncasecmp(elts[i].data, (u_char *)"requests=", sizeof("requests=") - 1)) {
             elts[i].len = elts[i].len - (sizeof("requests=") - 1);
             elts[i].data = &elts[i].data[sizeof("requests=") - 1];
@@ -418,6 +535,60 @@ static char *ngx_postgres_keepalive_conf(ngx_conf_t *cf, ngx_command_t *cmd, voi
 }
 
 
+static char *ngx_postgres_cache_invalidate_conf(ngx_conf_t *cf, ngx_command_t *cmd, void *conf) {
+    ngx_postgres_upstream_srv_conf_t *pusc = conf;
+    if (pusc->cache.zone) return "duplicate";
+    ngx_str_t *elts = cf->args->elts;
+    if (!elts[2].len) return "error: empty channel";
+    if (!(pusc->cache.zone = ngx_shared_memory_add(cf, &elts[1], 0, &ngx_postgres_module))) { ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "\"%V\" directive error: !ngx_shared_memory_add", &cmd->name); return NGX_CONF_ERROR; }
+    pusc->cache.channel = elts[2];
+    return NGX_CONF_OK;
+}
+
+
+static char *ngx_postgres_listen_zone_conf(ngx_conf_t *cf, ngx_command_t *cmd, void *conf) {
+    ngx_postgres_upstream_srv_conf_t *pusc = conf;
+    if (pusc->listen.zone) return "duplicate";
+    ngx_str_t *elts = cf->args->elts;
+    ssize_t size = ngx_parse_size(&elts[2]);
+    if (size == NGX_ERROR) { ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "\"%V\" directive error: \"%V\" must be size", &cmd->name, &elts[2]); return NGX_CONF_ERROR; }
+    if (size < (ssize_t)(8 * ngx_pagesize)) { ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "\"%V\" directive error: \"%V\" must be at least %uz", &cmd->name, &elts[2], 8 * ngx_pagesize); return NGX_CONF_ERROR; }
+    if (!(pusc->listen.zone = ngx_shared_memory_add(cf, &elts[1], size, &ngx_postgres_module))) { ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "\"%V\" directive error: !ngx_shared_memory_add", &cmd->name); return NGX_CONF_ERROR; }
+    if (pusc->listen.zone->data) { ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "\"%V\" directive error: zone \"%V\" is already used", &cmd->name, &elts[1]); return NGX_CONF_ERROR; }
+    pusc->listen.zone->init = ngx_postgres_listen_init_zone;
+    pusc->listen.zone->data = pusc;
+    return NGX_CONF_OK;
+}
+
+
+static char *ngx_postgres_replication_conf(ngx_conf_t *cf, ngx_command_t *cmd, void *conf) {
+    ngx_postgres_upstream_srv_conf_t *pusc = conf;
+    if (pusc->replication.slot.len) return "duplicate";
+    ngx_str_t *elts = cf->args->elts;
+    for (ngx_uint_t i = 1; i < cf->args->nelts; i++) {
+        if (elts[i].len > sizeof("slot=") - 1 && !ngx_strncasecmp(elts[i].data, (u_char *)"slot=", sizeof("slot=") - 1)) {
+            pusc->replication.slot.len = elts[i].len - (sizeof("slot=") - 1);
+            pusc->replication.slot.data = &elts[i].data[sizeof("slot=") - 1];
+            continue;
+        }
+        if (elts[i].len > sizeof("publication=") - 1 && !ngx_strncasecmp(elts[i].data, (u_char *)"publication=", sizeof("publication=") - 1)) {
+            pusc->replication.publication.len = elts[i].len - (sizeof("publication=") - 1);
+            pusc->replication.publication.data = &elts[i].data[sizeof("publication=") - 1];
+            continue;
+        }
+        if (elts[i].len > sizeof("channel=") - 1 && !ngx_strncasecmp(elts[i].data, (u_char *)"channel=", sizeof("channel=") - 1)) {
+            pusc->replication.channel.len = elts[i].len - (sizeof("channel=") - 1);
+            pusc->replication.channel.data = &elts[i].data[sizeof("channel=") - 1];
+            continue;
+        }
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "\"%V\" directive error: invalid additional parameter \"%V\"", &cmd->name, &elts[i]);
+        return NGX_CONF_ERROR;
+    }
+    if (!pusc->replication.slot.len || !pusc->replication.publication.len) { ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "\"%V\" directive error: \"slot\" and \"publication\" are required", &cmd->name); return NGX_CONF_ERROR; }
+    return NGX_CONF_OK;
+}
+
+
 static char *ngx_postgres_prepare_conf(ngx_conf_t *cf, ngx_command_t *cmd, void *conf) {
     ngx_postgres_upstream_srv_conf_t *pusc = conf;
     if (!pusc->ps.max) return "works only with \"postgres_keepalive\"";
@@ -637,12 +808,24 @@ static ngx_command_t ngx_postgres_commands[] = {
     .conf = NGX_HTTP_SRV_CONF_OFFSET,
     .offset = 0,
     .post = NULL },
+  { .name = ngx_string("postgres_cache_invalidate"),
+    .type = NGX_HTTP_UPS_CONF|NGX_CONF_TAKE2,
+    .set = ngx_postgres_cache_invalidate_conf,
+    .conf = NGX_HTTP_SRV_CONF_OFFSET,
+    .offset = 0,
+    .post = NULL },
   { .name = ngx_string("postgres_keepalive"),
     .type = NGX_HTTP_UPS_CONF|NGX_CONF_TAKE12|NGX_CONF_TAKE3|NGX_CONF_TAKE4,
     .set = ngx_postgres_keepalive_conf,
     .conf = NGX_HTTP_SRV_CONF_OFFSET,
     .offset = 0,
     .post = NULL },
+  { .name = ngx_string("postgres_listen_zone"),
+    .type = NGX_HTTP_UPS_CONF|NGX_CONF_TAKE2,
+    .set = ngx_postgres_listen_zone_conf,
+    .conf = NGX_HTTP_SRV_CONF_OFFSET,
+    .offset = 0,
+    .post = NULL },
   { .name = ngx_string("postgres_prepare"),
     .type = NGX_HTTP_UPS_CONF|NGX_CONF_TAKE12,
     .set = ngx_postgres_prepare_conf,
@@ -657,6 +840,12 @@ static ngx_command_t ngx_postgres_commands[] = {
     .offset = 0,
     .post = NULL },
 #endif
+  { .name = ngx_string("postgres_replication"),
+    .type = NGX_HTTP_UPS_CONF|NGX_CONF_TAKE23,
+    .set = ngx_postgres_replication_conf,
+    .conf = NGX_HTTP_SRV_CONF_OFFSET,
+    .offset = 0,
+    .post = NULL },
   { .name = ngx_string("postgres_server"),
     .type = NGX_HTTP_UPS_CONF|NGX_CONF_1MORE,
     .set = ngx_postgres_server_conf,
@@ -670,12 +859,103 @@ static ngx_command_t ngx_postgres_commands[] = {
     .offset = 0,
     .post = NULL },
 
+  { .name = ngx_string("postgres_async"),
+    .type = NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE12,
+    .set = ngx_postgres_async_conf,
+    .conf = NGX_HTTP_LOC_CONF_OFFSET,
+    .offset = 0,
+    .post = NULL },
+  { .name = ngx_string("postgres_batch"),
+    .type = NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_NOARGS|NGX_CONF_TAKE12,
+    .set = ngx_postgres_batch_conf,
+    .conf = NGX_HTTP_LOC_CONF_OFFSET,
+    .offset = 0,
+    .post = NULL },
+  { .name = ngx_string("postgres_pipeline"),
+    .type = NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE12,
+    .set = ngx_postgres_pipeline_conf,
+    .conf = NGX_HTTP_LOC_CONF_OFFSET,
+    .offset = 0,
+    .post = NULL },
+  { .name = ngx_string("postgres_cache_zone"),
+    .type = NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE23,
+    .set = ngx_postgres_cache_zone_conf,
+    .conf = NGX_HTTP_MAIN_CONF_OFFSET,
+    .offset = 0,
+    .post = NULL },
+
+  { .name = ngx_string("postgres_cache"),
+    .type = NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE12,
+    .set = ngx_postgres_cache_conf,
+    .conf = NGX_HTTP_LOC_CONF_OFFSET,
+    .offset = 0,
+    .post = NULL },
+  { .name = ngx_string("postgres_cache_key"),
+    .type = NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+    .set = ngx_http_set_complex_value_slot,
+    .conf = NGX_HTTP_LOC_CONF_OFFSET,
+    .offset = offsetof(ngx_postgres_location_t, cache.key),
+    .post = NULL },
+  { .name = ngx_string("postgres_cache_tag"),
+    .type = NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+    .set = ngx_http_set_complex_value_slot,
+    .conf = NGX_HTTP_LOC_CONF_OFFSET,
+    .offset = offsetof(ngx_postgres_location_t, cache.tag),
+    .post = NULL },
+  { .name = ngx_string("postgres_cache_lock"),
+    .type = NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE12,
+    .set = ngx_postgres_cache_lock_conf,
+    .conf = NGX_HTTP_LOC_CONF_OFFSET,
+    .offset = 0,
+    .post = NULL },
+  { .name = ngx_string("postgres_coalesce"),
+    .type = NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_FLAG,
+    .set = ngx_conf_set_flag_slot,
+    .conf = NGX_HTTP_LOC_CONF_OFFSET,
+    .offset = offsetof(ngx_postgres_location_t, coalesce),
+    .post = NULL },
+  { .name = ngx_string("postgres_envelope"),
+    .type = NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_FLAG,
+    .set = ngx_conf_set_flag_slot,
+    .conf = NGX_HTTP_LOC_CONF_OFFSET,
+    .offset = offsetof(ngx_postgres_location_t, envelope),
+    .post = NULL },
+  { .name = ngx_string("postgres_parallel"),
+    .type = NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_FLAG,
+    .set = ngx_conf_set_flag_slot,
+    .conf = NGX_HTTP_LOC_CONF_OFFSET,
+    .offset = offsetof(ngx_postgres_location_t, parallel),
+    .post = NULL },
+  { .name = ngx_string("postgres_cursor"),
+    .type = NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+    .set = ngx_conf_set_num_slot,
+    .conf = NGX_HTTP_LOC_CONF_OFFSET,
+    .offset = offsetof(ngx_postgres_location_t, cursor),
+    .post = NULL },
+  { .name = ngx_string("postgres_etag"),
+    .type = NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+    .set = ngx_postgres_etag_conf,
+    .conf = NGX_HTTP_LOC_CONF_OFFSET,
+    .offset = 0,
+    .post = NULL },
+  { .name = ngx_string("postgres_lookup"),
+    .type = NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE234,
+    .set = ngx_postgres_lookup_conf,
+    .conf = NGX_HTTP_LOC_CONF_OFFSET,
+    .offset = 0,
+    .post = NULL },
   { .name = ngx_string("postgres_output"),
     .type = NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_HTTP_LIF_CONF|NGX_CONF_1MORE,
     .set = ngx_postgres_output_conf,
     .conf = NGX_HTTP_LOC_CONF_OFFSET,
     .offset = 0,
     .post = NULL },
+  { .name = ngx_string("postgres_listen"),
+    .type = NGX_HTTP_LOC_CONF|NGX_HTTP_LIF_CONF|NGX_CONF_TAKE12,
+    .set = ngx_postgres_listen_conf,
+    .conf = NGX_HTTP_LOC_CONF_OFFSET,
+    .offset = 0,
+    .post = NULL },
   { .name = ngx_string("postgres_pass"),
     .type = NGX_HTTP_LOC_CONF|NGX_HTTP_LIF_CONF|NGX_CONF_1MORE,
     .set = ngx_postgres_pass_conf,
@@ -712,6 +992,12 @@ static ngx_command_t ngx_postgres_commands[] = {
     .conf = NGX_HTTP_LOC_CONF_OFFSET,
     .offset = 0,
     .post = NULL },
+  { .name = ngx_string("postgres_transaction"),
+    .type = NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1234,
+    .set = ngx_postgres_transaction_conf,
+    .conf = NGX_HTTP_LOC_CONF_OFFSET,
+    .offset = 0,
+    .post = NULL },
 
   { .name = ngx_string("postgres_bind"),
     .type = NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE12,
@@ -866,11 +1152,11 @@ ngx_module_t ngx_postgres_module = {
     .commands = ngx_postgres_commands,
     .type = NGX_HTTP_MODULE,
     .init_master = NULL,
-    .init_module = NULL,
-    .init_process = NULL,
+    .init_module = ngx_postgres_init_module,
+    .init_process = ngx_postgres_init_process,
     .init_thread = NULL,
     .exit_thread = NULL,
-    .exit_process = NULL,
+    .exit_process = ngx_postgres_exit_process,
     .exit_master = NULL,
     NGX_MODULE_V1_PADDING
 };
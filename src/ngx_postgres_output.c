@@ -1,21 +1,139 @@
+#include <float.h>
+#include <math.h>
 #include <postgresql/server/catalog/pg_type_d.h>
 #include "ngx_postgres_include.h"
 
 
-static ngx_buf_t *ngx_postgres_buffer(ngx_http_request_t *r, size_t size) {
+typedef struct {
+    ngx_queue_t queue;
+    size_t size;
+} ngx_postgres_chunk_t;
+
+
+static ngx_queue_t ngx_postgres_chunks; // per-worker free list
+static ngx_uint_t ngx_postgres_nchunks;
+
+
+static void ngx_postgres_chunk_cleanup(void *data) {
+    ngx_postgres_data_t *pd = data;
+    while (!ngx_queue_empty(&pd->out.queue)) {
+        ngx_queue_t *queue = ngx_queue_head(&pd->out.queue);
+        ngx_queue_remove(queue);
+        if (ngx_postgres_nchunks < pd->out.max) { ngx_queue_insert_head(&ngx_postgres_chunks, queue); ngx_postgres_nchunks++; }
+        else ngx_free(ngx_queue_data(queue, ngx_postgres_chunk_t, queue));
+    }
+}
+
+
+static u_char *ngx_postgres_chunk(ngx_postgres_data_t *pd, size_t *size) {
+    ngx_http_request_t *r = pd->request;
+#if (NGX_THREADS)
+    if (pd->out.thread) return ngx_palloc(pd->out.pool, *size);
+#endif
+    ngx_postgres_location_t *location = ngx_http_get_module_loc_conf(r, ngx_postgres_module);
+    if (*size > location->upstream.bufs.size) return ngx_palloc(r->pool, *size);
+    if (!pd->out.queue.next) {
+        ngx_pool_cleanup_t *cln = ngx_pool_cleanup_add(r->pool, 0);
+        if (!cln) { ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "!ngx_pool_cleanup_add"); return NULL; }
+        cln->handler = ngx_postgres_chunk_cleanup;
+        cln->data = pd;
+        ngx_queue_init(&pd->out.queue);
+        pd->out.max = location->upstream.bufs.num;
+    }
+    if (!ngx_postgres_chunks.next) ngx_queue_init(&ngx_postgres_chunks);
+    ngx_postgres_chunk_t *chunk = NULL;
+    while (!ngx_queue_empty(&ngx_postgres_chunks)) {
+        ngx_queue_t *queue = ngx_queue_head(&ngx_postgres_chunks);
+        ngx_queue_remove(queue);
+        ngx_postgres_nchunks--;
+        chunk = ngx_queue_data(queue, ngx_postgres_chunk_t, queue);
+        if (chunk->size == location->upstream.bufs.size) break;
+        ngx_free(chunk);
+        chunk = NULL;
+    }
+    if (!chunk) {
+        if (!(chunk = ngx_alloc(sizeof(*chunk) + location->upstream.bufs.size, r->connection->log))) { ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "!ngx_alloc"); return NULL; }
+        chunk->size = location->upstream.bufs.size;
+    }
+    ngx_queue_insert_tail(&pd->out.queue, &chunk->queue);
+    *size = chunk->size;
+    return (u_char *)(chunk + 1);
+}
+
+
+static ngx_int_t ngx_postgres_spill(ngx_postgres_data_t *pd) {
+    ngx_http_request_t *r = pd->request;
     ngx_http_upstream_t *u = r->upstream;
-    ngx_chain_t *cl, **ll;
-    for (cl = u->out_bufs, ll = &u->out_bufs; cl; cl = cl->next) ll = &cl->next;
+    ngx_postgres_location_t *location = ngx_http_get_module_loc_conf(r, ngx_postgres_module);
+    if (!location->upstream.max_temp_file_size || location->cursor || location->cache.zone || location->coalesce || location->etag.enable) return NGX_OK; // whole response is needed in memory
+#if (NGX_THREADS)
+    if (pd->out.thread) return NGX_OK;
+#endif
+    ngx_chain_t *file = u->out_bufs && u->out_bufs->buf->in_file ? u->out_bufs : NULL;
+    ngx_chain_t *chain = file ? file->next : u->out_bufs;
+    off_t size = 0;
+    for (ngx_chain_t *cl = chain; cl; cl = cl->next) size += ngx_buf_size(cl->buf);
+    if (size <= (off_t)(location->upstream.bufs.num * location->upstream.bufs.size)) return NGX_OK;
+    ngx_temp_file_t *tf = pd->out.temp;
+    if (!tf) {
+        if (!(tf = ngx_pcalloc(r->pool, sizeof(*tf)))) { ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "!ngx_pcalloc"); return NGX_ERROR; }
+        tf->file.fd = NGX_INVALID_FILE;
+        tf->file.log = r->connection->log;
+        tf->path = location->upstream.temp_path;
+        tf->pool = r->pool;
+        tf->warn = "an output is buffered to a temporary file";
+        pd->out.temp = tf;
+    }
+    if (tf->offset + size > (off_t)location->upstream.max_temp_file_size) return NGX_OK; // keep rest in memory
+    if (ngx_write_chain_to_temp_file(tf, chain) == NGX_ERROR) { ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "ngx_write_chain_to_temp_file == NGX_ERROR"); return NGX_ERROR; }
+    if (!file) {
+        if (!(file = ngx_alloc_chain_link(r->pool))) { ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "!ngx_alloc_chain_link"); return NGX_ERROR; }
+        if (!(file->buf = ngx_calloc_buf(r->pool))) { ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "!ngx_calloc_buf"); return NGX_ERROR; }
+        file->buf->file = &tf->file;
+        file->buf->file_pos = tf->offset - size;
+        file->buf->flush = 1;
+        file->buf->in_file = 1;
+        u->out_bufs = file;
+    }
+    file->buf->file_last = tf->offset;
+    file->next = NULL;
+    pd->out.last = file;
+    for (ngx_chain_t *cl = chain; cl; cl = cl->next) {
+        ngx_buf_t *b = cl->buf;
+        if ((size_t)(b->end - b->start) > location->upstream.bufs.size && ngx_pfree(r->pool, b->start) == NGX_OK) b->start = b->end = NULL; // allocated for single result
+        b->pos = b->last;
+    }
+    ngx_chain_update_chains(r->pool, &u->free_bufs, &u->busy_bufs, &chain, u->output.tag); // memory buffers are free for next rows
+    return NGX_OK;
+}
+
+
+static ngx_buf_t *ngx_postgres_buffer(ngx_postgres_data_t *pd, size_t size) {
+    ngx_http_request_t *r = pd->request;
+    ngx_http_upstream_t *u = r->upstream;
+    if (!u->out_bufs) pd->out.last = NULL;
+    ngx_chain_t *cl = pd->out.last;
+    if (cl && !cl->buf->in_file && (size_t)(cl->buf->end - cl->buf->last) >= size) return cl->buf;
+    if (ngx_postgres_spill(pd) != NGX_OK) { ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "ngx_postgres_spill != NGX_OK"); return NULL; }
+#if (NGX_THREADS)
+    if (pd->out.thread) { // request pool is not thread safe
+        if (!(cl = ngx_alloc_chain_link(pd->out.pool))) { ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "!ngx_alloc_chain_link"); return NULL; }
+        if (!(cl->buf = ngx_calloc_buf(pd->out.pool))) { ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "!ngx_calloc_buf"); return NULL; }
+        cl->next = NULL;
+    } else
+#endif
     if (!(cl = ngx_chain_get_free_buf(r->pool, &u->free_bufs))) { ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "!ngx_chain_get_free_buf"); return NULL; }
-    *ll = cl;
+    if (pd->out.last) pd->out.last->next = cl; else u->out_bufs = cl;
+    pd->out.last = cl;
     cl->buf->flush = 1;
     cl->buf->memory = 1;
     ngx_buf_t *b = cl->buf;
-    if (b->start) ngx_pfree(r->pool, b->start);
-    if (!(b->start = ngx_palloc(r->pool, size))) { ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "!ngx_palloc"); return NULL; }
+    if (!b->start || (size_t)(b->end - b->start) < size) {
+        if (!(b->start = ngx_postgres_chunk(pd, &size))) { ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "!ngx_postgres_chunk"); return NULL; }
+        b->end = b->start + size;
+    }
     b->pos = b->start;
     b->last = b->start;
-    b->end = b->last + size;
     b->temporary = 1;
     b->tag = u->output.tag;
     return b;
@@ -46,10 +164,11 @@ ngx_int_t ngx_postgres_output_value(ngx_postgres_data_t *pd) {
         ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "\"postgres_output value\" received empty value in location \"%V\"", &core->name);
         return NGX_HTTP_INTERNAL_SERVER_ERROR;
     }
-    ngx_buf_t *b = ngx_postgres_buffer(r, size);
+    ngx_buf_t *b = ngx_postgres_buffer(pd, size);
     if (!b) { ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "!ngx_postgres_buffer"); return NGX_ERROR; }
+    u_char *end = b->last + size;
     b->last = ngx_copy(b->last, PQgetvalue(res, 0, 0), size);
-    if (b->last != b->end) { ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "b->last != b->end"); return NGX_ERROR; }
+    if (b->last != end) { ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "b->last != end"); return NGX_ERROR; }
     return NGX_DONE;
 }
 
@@ -254,6 +373,264 @@ static ngx_flag_t ngx_postgres_oid_is_string(Oid oid) {
 }
 
 
+static uint64_t ngx_postgres_be(const u_char *p, size_t len) {
+    uint64_t n = 0;
+    while (len--) n = (n << 8) | *p++;
+    return n;
+}
+
+
+static u_char *ngx_postgres_itoa(u_char *d, int64_t n) {
+    u_char buf[NGX_INT64_LEN], *p = buf + sizeof(buf);
+    uint64_t u = n < 0 ? 0 - (uint64_t)n : (uint64_t)n;
+    do { *--p = '0' + u % 10; } while (u /= 10);
+    if (n < 0) *d++ = '-';
+    return ngx_copy(d, p, buf + sizeof(buf) - p);
+}
+
+
+static u_char *ngx_postgres_pad(u_char *d, ngx_uint_t n, size_t width) {
+    for (u_char *p = d + width; p > d; n /= 10) *--p = '0' + n % 10;
+    return d + width;
+}
+
+
+static u_char *ngx_postgres_dtoa(u_char *d, double f, ngx_flag_t single) {
+    if (isnan(f)) return ngx_copy(d, "NaN", sizeof("NaN") - 1);
+    if (isinf(f)) return f < 0 ? ngx_copy(d, "-Infinity", sizeof("-Infinity") - 1) : ngx_copy(d, "Infinity", sizeof("Infinity") - 1);
+    int len = 0;
+    for (int precision = single ? FLT_DIG : DBL_DIG; precision <= (single ? FLT_DECIMAL_DIG : DBL_DECIMAL_DIG); precision++) {
+        len = snprintf((char *)d, 32, "%.*g", precision, f);
+        if (single ? strtof((char *)d, NULL) == (float)f : strtod((char *)d, NULL) == f) break;
+    }
+    return d + len;
+}
+
+
+static u_char *ngx_postgres_numeric(u_char *d, const u_char *p, size_t len) {
+    if (len < 8) return NULL;
+    int ndigits = (int16_t)ngx_postgres_be(p, 2), weight = (int16_t)ngx_postgres_be(p + 2, 2), dscale = ngx_postgres_be(p + 6, 2);
+    switch (ngx_postgres_be(p + 4, 2)) {
+        case 0x0000: break;
+        case 0x4000: *d++ = '-'; break;
+        case 0xc000: return ngx_copy(d, "NaN", sizeof("NaN") - 1);
+        case 0xd000: return ngx_copy(d, "Infinity", sizeof("Infinity") - 1);
+        case 0xf000: return ngx_copy(d, "-Infinity", sizeof("-Infinity") - 1);
+        default: return NULL;
+    }
+    if (len != 8 + 2 * (size_t)ndigits) return NULL;
+    p += 8;
+    if (weight < 0) *d++ = '0'; else for (int i = 0; i <= weight; i++) {
+        ngx_uint_t digit = i < ndigits ? ngx_postgres_be(p + 2 * i, 2) : 0;
+        d = i ? ngx_postgres_pad(d, digit, 4) : ngx_postgres_itoa(d, digit);
+    }
+    if (dscale <= 0) return d;
+    *d++ = '.';
+    u_char *last = d + dscale;
+    for (int i = weight + 1; d < last; i++) d = ngx_postgres_pad(d, i >= 0 && i < ndigits ? ngx_postgres_be(p + 2 * i, 2) : 0, 4);
+    return last;
+}
+
+
+static u_char *ngx_postgres_date(u_char *d, int32_t date) {
+    uint32_t julian = date + 2451545 + 32044, quad = julian / 146097, extra = (julian - quad * 146097) * 4 + 3; // j2date() from postgres
+    julian += 60 + quad * 3 + extra / 146097;
+    quad = julian / 1461;
+    julian -= quad * 1461;
+    int32_t year = julian * 4 / 1461;
+    julian = (year ? (julian + 305) % 365 : (julian + 306) % 366) + 123;
+    year += (int32_t)quad * 4 - 4800;
+    quad = julian * 2141 / 65536;
+    int32_t y = year > 0 ? year : 1 - year;
+    d = y > 9999 ? ngx_postgres_itoa(d, y) : ngx_postgres_pad(d, y, 4);
+    *d++ = '-';
+    d = ngx_postgres_pad(d, (quad + 10) % 12 + 1, 2);
+    *d++ = '-';
+    d = ngx_postgres_pad(d, julian - 7834 * quad / 256, 2);
+    return year > 0 ? d : ngx_copy(d, " BC", sizeof(" BC") - 1);
+}
+
+
+static u_char *ngx_postgres_time(u_char *d, int64_t time) {
+    d = ngx_postgres_pad(d, time / 3600000000, 2);
+    *d++ = ':';
+    d = ngx_postgres_pad(d, time / 60000000 % 60, 2);
+    *d++ = ':';
+    d = ngx_postgres_pad(d, time / 1000000 % 60, 2);
+    ngx_uint_t usec = time % 1000000;
+    if (!usec) return d;
+    *d++ = '.';
+    d = ngx_postgres_pad(d, usec, 6);
+    while (d[-1] == '0') d--;
+    return d;
+}
+
+
+static u_char *ngx_postgres_timestamp(u_char *d, int64_t timestamp) {
+    if (timestamp == INT64_MAX) return ngx_copy(d, "infinity", sizeof("infinity") - 1);
+    if (timestamp == INT64_MIN) return ngx_copy(d, "-infinity", sizeof("-infinity") - 1);
+    int64_t date = timestamp / 86400000000, time = timestamp % 86400000000;
+    if (time < 0) { time += 86400000000; date--; }
+    u_char *bc = NULL;
+    d = ngx_postgres_date(d, date);
+    if (d[-1] == 'C') { d -= sizeof(" BC") - 1; bc = d; }
+    *d++ = ' ';
+    d = ngx_postgres_time(d, time);
+    return bc ? ngx_copy(d, " BC", sizeof(" BC") - 1) : d;
+}
+
+
+static u_char *ngx_postgres_hex(u_char *d, const u_char *p, size_t len) {
+    static const u_char hex[] = "0123456789abcdef";
+    while (len--) { *d++ = hex[*p >> 4]; *d++ = hex[*p++ & 0xf]; }
+    return d;
+}
+
+
+ngx_int_t ngx_postgres_result_text(ngx_postgres_data_t *pd) {
+    ngx_http_request_t *r = pd->request;
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "%s", __func__);
+    PGresult *res = pd->result.res;
+    int ntuples = PQntuples(res), nfields = PQnfields(res);
+    size_t size = 0;
+    u_char *buf = NULL;
+    for (int col = 0; col < nfields; col++) {
+        if (!PQfformat(res, col)) continue;
+        Oid oid = PQftype(res, col);
+        for (int row = 0; row < ntuples; row++) {
+            if (PQgetisnull(res, row, col)) continue;
+            u_char *value = (u_char *)PQgetvalue(res, row, col);
+            size_t len = PQgetlength(res, row, col);
+            size_t need = 2 * len + sizeof("\\x") - 1; // bytea and unknown types
+            switch (oid) {
+                case NUMERICOID: if (len >= 8) need = 4 * (len + 4 * ngx_max((int16_t)ngx_postgres_be(value + 2, 2), 0)) + ngx_postgres_be(value + 6, 2) + sizeof("-0.") + 4; break;
+                case DATEOID:
+                case FLOAT4OID:
+                case FLOAT8OID:
+                case TIMEOID:
+                case TIMESTAMPOID:
+                case TIMESTAMPTZOID: need = 64; break;
+            }
+            if (need > size) {
+                if (!(buf = ngx_pnalloc(r->pool, size = ngx_max(need, 256)))) { ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "!ngx_pnalloc"); return NGX_ERROR; }
+            }
+            u_char *last = NULL;
+            switch (oid) {
+                case BOOLOID: if (len == 1) { *buf = *value ? 't' : 'f'; last = buf + 1; } break;
+                case INT2OID: if (len == 2) last = ngx_postgres_itoa(buf, (int16_t)ngx_postgres_be(value, 2)); break;
+                case INT4OID: if (len == 4) last = ngx_postgres_itoa(buf, (int32_t)ngx_postgres_be(value, 4)); break;
+                case INT8OID: if (len == 8) last = ngx_postgres_itoa(buf, (int64_t)ngx_postgres_be(value, 8)); break;
+                case CIDOID:
+                case OIDOID:
+                case XIDOID: if (len == 4) last = ngx_postgres_itoa(buf, (uint32_t)ngx_postgres_be(value, 4)); break;
+                case FLOAT4OID: if (len == 4) {
+                    uint32_t n = ngx_postgres_be(value, 4);
+                    float f;
+                    ngx_memcpy(&f, &n, sizeof(f));
+                    last = ngx_postgres_dtoa(buf, f, 1);
+                } break;
+                case FLOAT8OID: if (len == 8) {
+                    uint64_t n = ngx_postgres_be(value, 8);
+                    double f;
+                    ngx_memcpy(&f, &n, sizeof(f));
+                    last = ngx_postgres_dtoa(buf, f, 0);
+                } break;
+                case NUMERICOID: last = ngx_postgres_numeric(buf, value, len); break;
+                case UUIDOID: if (len == 16) {
+                    last = buf;
+                    for (ngx_uint_t i = 0; i < 16; i += 2) {
+                        if (i == 4 || i == 6 || i == 8 || i == 10) *last++ = '-';
+                        last = ngx_postgres_hex(last, value + i, 2);
+                    }
+                } break;
+                case DATEOID: if (len == 4) {
+                    int32_t date = ngx_postgres_be(value, 4);
+                    if (date == INT32_MAX) last = ngx_copy(buf, "infinity", sizeof("infinity") - 1);
+                    else if (date == INT32_MIN) last = ngx_copy(buf, "-infinity", sizeof("-infinity") - 1);
+                    else last = ngx_postgres_date(buf, date);
+                } break;
+                case TIMEOID: if (len == 8) last = ngx_postgres_time(buf, ngx_postgres_be(value, 8)); break;
+                case TIMESTAMPOID: if (len == 8) last = ngx_postgres_timestamp(buf, ngx_postgres_be(value, 8)); break;
+                case TIMESTAMPTZOID: if (len == 8) { // rendered in UTC
+                    int64_t timestamp = ngx_postgres_be(value, 8);
+                    last = ngx_postgres_timestamp(buf, timestamp);
+                    if (timestamp != INT64_MAX && timestamp != INT64_MIN) last = ngx_copy(last, "+00", sizeof("+00") - 1);
+                } break;
+                case JSONBOID: if (len && *value == 1 && !PQsetvalue(res, row, col, (char *)value + 1, len - 1)) { ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "!PQsetvalue"); return NGX_ERROR; } continue;
+                case BPCHAROID:
+                case CHAROID:
+                case JSONOID:
+                case NAMEOID:
+                case TEXTOID:
+                case UNKNOWNOID:
+                case VARCHAROID:
+                case XMLOID: continue;
+                default: ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "binary oid = %uD rendered as hex", oid); break;
+            }
+            if (!last) last = ngx_postgres_hex(ngx_copy(buf, "\\x", sizeof("\\x") - 1), value, len);
+            if (!PQsetvalue(res, row, col, (char *)buf, last - buf)) { ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "!PQsetvalue"); return NGX_ERROR; }
+        }
+    }
+    return NGX_OK;
+}
+
+
+static ngx_inline size_t ngx_postgres_kernel_size(PGresult *res, ngx_postgres_output_t *output, u_char *raw, ngx_flag_t quote, ngx_flag_t escape) {
+    ngx_uint_t ntuples = PQntuples(res), nfields = PQnfields(res);
+    size_t size = ntuples * (nfields - 1); // value delimiters
+    for (ngx_uint_t row = 0; row < ntuples; row++) for (ngx_uint_t col = 0; col < nfields; col++) {
+        if (PQgetisnull(res, row, col)) { size += output->null.len; continue; }
+        int len = PQgetlength(res, row, col);
+        if (raw[col]) { size += len; continue; }
+        if (quote) size += 2;
+        if (escape) size += ngx_postgres_count((u_char *)PQgetvalue(res, row, col), len, output->escape);
+        else size += len;
+    }
+    return size;
+}
+
+
+static ngx_inline u_char *ngx_postgres_kernel_write(u_char *d, PGresult *res, ngx_postgres_output_t *output, u_char *raw, ngx_flag_t newline, ngx_flag_t quote, ngx_flag_t escape) {
+    ngx_uint_t ntuples = PQntuples(res), nfields = PQnfields(res);
+    for (ngx_uint_t row = 0; row < ntuples; row++) {
+        if (newline || row > 0) *d++ = '\n';
+        for (ngx_uint_t col = 0; col < nfields; col++) {
+            if (col > 0) *d++ = output->delimiter;
+            if (PQgetisnull(res, row, col)) { d = ngx_copy(d, output->null.data, output->null.len); continue; }
+            int len = PQgetlength(res, row, col);
+            u_char *value = (u_char *)PQgetvalue(res, row, col);
+            if (raw[col]) { d = ngx_copy(d, value, len); continue; }
+            if (quote) *d++ = output->quote;
+            if (escape) d = ngx_postgres_escape(d, value, len, output->escape);
+            else d = ngx_copy(d, value, len);
+            if (quote) *d++ = output->quote;
+        }
+    }
+    return d;
+}
+
+
+static size_t ngx_postgres_size_plain(PGresult *res, ngx_postgres_output_t *output, u_char *raw) { return ngx_postgres_kernel_size(res, output, raw, 0, 0); }
+static size_t ngx_postgres_size_escape(PGresult *res, ngx_postgres_output_t *output, u_char *raw) { return ngx_postgres_kernel_size(res, output, raw, 0, 1); }
+static size_t ngx_postgres_size_quote(PGresult *res, ngx_postgres_output_t *output, u_char *raw) { return ngx_postgres_kernel_size(res, output, raw, 1, 0); }
+static size_t ngx_postgres_size_quote_escape(PGresult *res, ngx_postgres_output_t *output, u_char *raw) { return ngx_postgres_kernel_size(res, output, raw, 1, 1); }
+static u_char *ngx_postgres_write_plain(u_char *d, PGresult *res, ngx_postgres_output_t *output, u_char *raw, ngx_flag_t newline) { return ngx_postgres_kernel_write(d, res, output, raw, newline, 0, 0); }
+static u_char *ngx_postgres_write_escape(u_char *d, PGresult *res, ngx_postgres_output_t *output, u_char *raw, ngx_flag_t newline) { return ngx_postgres_kernel_write(d, res, output, raw, newline, 0, 1); }
+static u_char *ngx_postgres_write_quote(u_char *d, PGresult *res, ngx_postgres_output_t *output, u_char *raw, ngx_flag_t newline) { return ngx_postgres_kernel_write(d, res, output, raw, newline, 1, 0); }
+static u_char *ngx_postgres_write_quote_escape(u_char *d, PGresult *res, ngx_postgres_output_t *output, u_char *raw, ngx_flag_t newline) { return ngx_postgres_kernel_write(d, res, output, raw, newline, 1, 1); }
+
+
+static const struct {
+    size_t (*size) (PGresult *res, ngx_postgres_output_t *output, u_char *raw);
+    u_char *(*write) (u_char *d, PGresult *res, ngx_postgres_output_t *output, u_char *raw, ngx_flag_t newline);
+} ngx_postgres_kernels[] = { // indexed by (quote ? 2 : 0) | (escape ? 1 : 0)
+    { ngx_postgres_size_plain, ngx_postgres_write_plain },
+    { ngx_postgres_size_escape, ngx_postgres_write_escape },
+    { ngx_postgres_size_quote, ngx_postgres_write_quote },
+    { ngx_postgres_size_quote_escape, ngx_postgres_write_quote_escape },
+};
+
+
 static ngx_int_t ngx_postgres_output_text_csv(ngx_postgres_data_t *pd) {
     ngx_http_request_t *r = pd->request;
     ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "%s", __func__);
@@ -268,7 +645,8 @@ static ngx_int_t ngx_postgres_output_text_csv(ngx_postgres_data_t *pd) {
     ngx_postgres_query_t *elts = location->queries.elts;
     ngx_postgres_query_t *query = &elts[pd->query.index];
     ngx_postgres_output_t *output = &query->output;
-    if (output->header && !u->out_bufs) {
+    ngx_flag_t first = !u->out_bufs && !r->header_sent; // header was sent with previous cursor batch
+    if (output->header && first) {
         size += result->nfields - 1; // header delimiters
         for (ngx_uint_t col = 0; col < result->nfields; col++) {
             int len = ngx_strlen(PQfname(res, col));
@@ -294,29 +672,16 @@ static ngx_int_t ngx_postgres_output_text_csv(ngx_postgres_data_t *pd) {
             if (output->quote) size++;
         }
     }
-    size += result->ntuples * (result->nfields - 1); // value delimiters
-    for (ngx_uint_t row = 0; row < result->ntuples; row++) {
-        if (output->header || u->out_bufs || row > 0) size++;
-        for (ngx_uint_t col = 0; col < result->nfields; col++) {
-            int len = PQgetlength(res, row, col);
-            if (PQgetisnull(res, row, col)) size += output->null.len; else {
-                if (!ngx_postgres_oid_is_string(PQftype(res, col)) && output->string) {
-                    size += len;
-                } else {
-                    if (output->quote) size++;
-                    if (len) {
-                        if (output->escape) size += ngx_postgres_count((u_char *)PQgetvalue(res, row, col), len, output->escape);
-                        else size += len;
-                    }
-                    if (output->quote) size++;
-                }
-            }
-        }
-    }
+    u_char raw[result->nfields]; // columns written without quote and escape
+    for (ngx_uint_t col = 0; col < result->nfields; col++) raw[col] = output->string && !ngx_postgres_oid_is_string(PQftype(res, col));
+    ngx_flag_t newline = output->header || !first;
+    size += result->ntuples - (newline ? 0 : 1); // row delimiters
+    size += ngx_postgres_kernels[output->kernel].size(res, output, raw);
     if (!size) return NGX_DONE;
-    ngx_buf_t *b = ngx_postgres_buffer(r, size);
+    ngx_buf_t *b = ngx_postgres_buffer(pd, size);
     if (!b) { ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "!ngx_postgres_buffer"); return NGX_ERROR; }
-    if (output->header && !u->out_bufs->next) {
+    u_char *end = b->last + size;
+    if (output->header && first) {
         for (ngx_uint_t col = 0; col < result->nfields; col++) {
             int len = ngx_strlen(PQfname(res, col));
             if (col > 0) *b->last++ = output->delimiter;
@@ -342,26 +707,8 @@ static ngx_int_t ngx_postgres_output_text_csv(ngx_postgres_data_t *pd) {
             if (output->quote) *b->last++ = output->quote;
         }
     }
-    for (ngx_uint_t row = 0; row < result->ntuples; row++) {
-        if (output->header || u->out_bufs->next || row > 0) *b->last++ = '\n';
-        for (ngx_uint_t col = 0; col < result->nfields; col++) {
-            int len = PQgetlength(res, row, col);
-            if (col > 0) *b->last++ = output->delimiter;
-            if (PQgetisnull(res, row, col)) b->last = ngx_copy(b->last, output->null.data, output->null.len); else {
-                if (!ngx_postgres_oid_is_string(PQftype(res, col)) && output->string) {
-                    if (len) b->last = ngx_copy(b->last, (u_char *)PQgetvalue(res, row, col), len);
-                } else {
-                    if (output->quote) *b->last++ = output->quote;
-                    if (len) {
-                        if (output->escape) b->last = ngx_postgres_escape(b->last, (u_char *)PQgetvalue(res, row, col), len, output->escape);
-                        else b->last = ngx_copy(b->last, (u_char *)PQgetvalue(res, row, col), len);
-                    }
-                    if (output->quote) *b->last++ = output->quote;
-                }
-            }
-        }
-    }
-    if (b->last != b->end) { ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "b->last != b->end"); return NGX_ERROR; }
+    b->last = ngx_postgres_kernels[output->kernel].write(b->last, res, output, raw, newline);
+    if (b->last != end) { ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "b->last != end"); return NGX_ERROR; }
     return NGX_DONE;
 }
 
@@ -384,6 +731,28 @@ ngx_int_t ngx_postgres_output_csv(ngx_postgres_data_t *pd) {
 }
 
 
+static ngx_int_t ngx_postgres_output_section(ngx_postgres_data_t *pd) {
+    ngx_http_request_t *r = pd->request;
+    ngx_postgres_result_t *result = &pd->result;
+    if (result->section == pd->query.index + 1) { ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "\"postgres_envelope\" requires single statement in \"postgres_query\""); return NGX_ERROR; } // second head would break envelope
+    result->section = pd->query.index + 1;
+    return NGX_OK;
+}
+
+
+static ngx_int_t ngx_postgres_output_empty(ngx_postgres_data_t *pd, ngx_postgres_output_t *output, u_char *data, size_t len) {
+    ngx_http_request_t *r = pd->request;
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "%s", __func__);
+    size_t size = output->head.len + len + output->tail.len; // section of envelope for result without rows
+    ngx_buf_t *b = ngx_postgres_buffer(pd, size);
+    if (!b) { ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "!ngx_postgres_buffer"); return NGX_ERROR; }
+    b->last = ngx_copy(b->last, output->head.data, output->head.len);
+    b->last = ngx_copy(b->last, data, len);
+    b->last = ngx_copy(b->last, output->tail.data, output->tail.len);
+    return NGX_DONE;
+}
+
+
 ngx_int_t ngx_postgres_output_json(ngx_postgres_data_t *pd) {
     ngx_http_request_t *r = pd->request;
     ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "%s", __func__);
@@ -392,13 +761,18 @@ ngx_int_t ngx_postgres_output_json(ngx_postgres_data_t *pd) {
     ngx_http_upstream_t *u = r->upstream;
     size_t size = 0;
     ngx_postgres_location_t *location = ngx_http_get_module_loc_conf(r, ngx_postgres_module);
+    ngx_postgres_query_t *elts = location->queries.elts;
+    ngx_postgres_output_t *output = &elts[pd->query.index].output;
     ngx_postgres_result_t *result = &pd->result;
     PGresult *res = result->res;
     result->ntuples = PQntuples(res);
     result->nfields = PQnfields(res);
-    if (!result->ntuples || !result->nfields) return NGX_DONE;
-    if (result->ntuples == 1 && result->nfields == 1 && (PQftype(res, 0) == JSONOID || PQftype(res, 0) == JSONBOID)) size = PQgetlength(res, 0, 0); else {
-        if (result->ntuples > 1) size += 2; // [] + \0
+    if (location->envelope && ngx_postgres_output_section(pd) != NGX_OK) return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    if (!result->ntuples || !result->nfields) return location->envelope ? ngx_postgres_output_empty(pd, output, (u_char *)"[]", sizeof("[]") - 1) : NGX_DONE;
+    ngx_flag_t array = result->ntuples > 1 || location->envelope; // section of envelope is always array
+    if (location->envelope) size += output->head.len + output->tail.len;
+    if (result->ntuples == 1 && result->nfields == 1 && (PQftype(res, 0) == JSONOID || PQftype(res, 0) == JSONBOID)) size += PQgetlength(res, 0, 0); else {
+        if (array) size += 2; // [] + \0
         for (ngx_uint_t row = 0; row < result->ntuples; row++) {
             size += sizeof("{}") - 1;
             for (ngx_uint_t col = 0; col < result->nfields; col++) {
@@ -426,10 +800,12 @@ ngx_int_t ngx_postgres_output_json(ngx_postgres_data_t *pd) {
         size += result->ntuples - 1;                      /* row delimiters */
     }
     if (!size) return NGX_DONE;
-    ngx_buf_t *b = ngx_postgres_buffer(r, size);
+    ngx_buf_t *b = ngx_postgres_buffer(pd, size);
     if (!b) { ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "!ngx_postgres_buffer"); return NGX_ERROR; }
+    u_char *end = b->last + size;
+    if (location->envelope) b->last = ngx_copy(b->last, output->head.data, output->head.len);
     if (result->ntuples == 1 && result->nfields == 1 && (PQftype(res, 0) == JSONOID || PQftype(res, 0) == JSONBOID)) b->last = ngx_copy(b->last, PQgetvalue(res, 0, 0), PQgetlength(res, 0, 0)); else { /* fill data */
-        if (result->ntuples > 1) b->last = ngx_copy(b->last, "[", sizeof("[") - 1);
+        if (array) b->last = ngx_copy(b->last, "[", sizeof("[") - 1);
         for (ngx_uint_t row = 0; row < result->ntuples; row++) {
             if (row > 0) b->last = ngx_copy(b->last, ",", 1);
             b->last = ngx_copy(b->last, "{", sizeof("{") - 1);
@@ -463,31 +839,673 @@ ngx_int_t ngx_postgres_output_json(ngx_postgres_data_t *pd) {
             }
             b->last = ngx_copy(b->last, "}", sizeof("}") - 1);
         }
-        if (result->ntuples > 1) b->last = ngx_copy(b->last, "]", sizeof("]") - 1);
+        if (array) b->last = ngx_copy(b->last, "]", sizeof("]") - 1);
     }
-    if (b->last != b->end) { ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "b->last != b->end"); return NGX_ERROR; }
+    if (location->envelope) b->last = ngx_copy(b->last, output->tail.data, output->tail.len);
+    if (b->last != end) { ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "b->last != end"); return NGX_ERROR; }
     return NGX_DONE;
 }
 
 
-ngx_int_t ngx_postgres_output_chain(ngx_postgres_data_t *pd) {
+static ngx_str_t *ngx_postgres_fnames(ngx_postgres_data_t *pd) {
+    ngx_http_request_t *r = pd->request;
+    ngx_postgres_result_t *result = &pd->result;
+    PGresult *res = result->res;
+    ngx_postgres_location_t *location = ngx_http_get_module_loc_conf(r, ngx_postgres_module);
+    ngx_str_t *name = ngx_palloc(r->pool, result->nfields * sizeof(*name));
+    if (!name) { ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "!ngx_palloc"); return NULL; }
+    for (ngx_uint_t col = 0; col < result->nfields; col++) {
+        name[col].data = (u_char *)PQfname(res, col);
+        name[col].len = ngx_strlen(name[col].data);
+        if (!location->append || ngx_strstr(name[col].data, "::")) continue;
+        Oid oid = PQftype(res, col);
+        const char *type = PQftypeMy(oid);
+        u_char *p = ngx_pnalloc(r->pool, name[col].len + sizeof("::") - 1 + (type ? ngx_strlen(type) : NGX_INT32_LEN));
+        if (!p) { ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "!ngx_pnalloc"); return NULL; }
+        u_char *last = type ? ngx_sprintf(p, "%V::%s", &name[col], type) : ngx_sprintf(p, "%V::%uD", &name[col], oid);
+        name[col].data = p;
+        name[col].len = last - p;
+    }
+    return name;
+}
+
+
+enum {
+    pack_uint = 0,
+    pack_nint,
+    pack_bytes,
+    pack_text,
+    pack_array,
+    pack_map
+};
+
+
+static void ngx_postgres_pack_be(u_char *d, uint64_t n, size_t len) {
+    while (len--) { d[len] = (u_char)n; n >>= 8; }
+}
+
+
+static size_t ngx_postgres_pack_head(u_char *d, ngx_flag_t cbor, u_char major, uint64_t n) {
+    size_t len;
+    u_char c;
+    if (cbor) {
+        if (n < 24) { if (d) *d = (major << 5) | n; return 1; }
+        if (n <= 0xff) { c = 24; len = 1; }
+        else if (n <= 0xffff) { c = 25; len = 2; }
+        else if (n <= 0xffffffff) { c = 26; len = 4; }
+        else { c = 27; len = 8; }
+        c |= major << 5;
+    } else switch (major) {
+        case pack_bytes:
+            if (n <= 0xff) { c = 0xc4; len = 1; }
+            else if (n <= 0xffff) { c = 0xc5; len = 2; }
+            else { c = 0xc6; len = 4; }
+            break;
+        case pack_text:
+            if (n < 32) { if (d) *d = 0xa0 | n; return 1; }
+            if (n <= 0xff) { c = 0xd9; len = 1; }
+            else if (n <= 0xffff) { c = 0xda; len = 2; }
+            else { c = 0xdb; len = 4; }
+            break;
+        case pack_array:
+            if (n < 16) { if (d) *d = 0x90 | n; return 1; }
+            if (n <= 0xffff) { c = 0xdc; len = 2; }
+            else { c = 0xdd; len = 4; }
+            break;
+        default:
+            if (n < 16) { if (d) *d = 0x80 | n; return 1; }
+            if (n <= 0xffff) { c = 0xde; len = 2; }
+            else { c = 0xdf; len = 4; }
+            break;
+    }
+    if (d) { *d = c; ngx_postgres_pack_be(d + 1, n, len); }
+    return len + 1;
+}
+
+
+static size_t ngx_postgres_pack_int(u_char *d, ngx_flag_t cbor, int64_t n) {
+    if (cbor) return n < 0 ? ngx_postgres_pack_head(d, cbor, pack_nint, ~(uint64_t)n) : ngx_postgres_pack_head(d, cbor, pack_uint, n);
+    size_t len;
+    u_char c;
+    if (n >= 0) {
+        if (n < 128) { if (d) *d = n; return 1; }
+        if (n <= 0xff) { c = 0xcc; len = 1; }
+        else if (n <= 0xffff) { c = 0xcd; len = 2; }
+        else if (n <= 0xffffffff) { c = 0xce; len = 4; }
+        else { c = 0xcf; len = 8; }
+    } else {
+        if (n >= -32) { if (d) *d = (u_char)n; return 1; }
+        if (n >= INT8_MIN) { c = 0xd0; len = 1; }
+        else if (n >= INT16_MIN) { c = 0xd1; len = 2; }
+        else if (n >= INT32_MIN) { c = 0xd2; len = 4; }
+        else { c = 0xd3; len = 8; }
+    }
+    if (d) { *d = c; ngx_postgres_pack_be(d + 1, (uint64_t)n, len); }
+    return len + 1;
+}
+
+
+static size_t ngx_postgres_pack_float(u_char *d, ngx_flag_t cbor, double f) {
+    uint64_t n;
+    if (d) { ngx_memcpy(&n, &f, sizeof(n)); *d = cbor ? 0xfb : 0xcb; ngx_postgres_pack_be(d + 1, n, sizeof(n)); }
+    return 1 + sizeof(n);
+}
+
+
+static ngx_int_t ngx_postgres_pack_atoi(u_char *s, size_t len, int64_t *n) {
+    ngx_flag_t minus = len && *s == '-';
+    if (minus) { s++; len--; }
+    if (!len || len >= NGX_INT64_LEN) return NGX_ERROR;
+    uint64_t value;
+    for (value = 0; len--; s++) {
+        if (*s < '0' || *s > '9') return NGX_ERROR;
+        value = value * 10 + (*s - '0');
+    }
+    if (value > (uint64_t)INT64_MAX + minus) return NGX_ERROR;
+    *n = minus ? (int64_t)(0 - value) : (int64_t)value;
+    return NGX_OK;
+}
+
+
+static size_t ngx_postgres_pack_value(u_char *d, ngx_flag_t cbor, PGresult *res, int row, int col) {
+    if (PQgetisnull(res, row, col)) { if (d) *d = cbor ? 0xf6 : 0xc0; return 1; }
+    u_char *value = (u_char *)PQgetvalue(res, row, col);
+    size_t len = PQgetlength(res, row, col);
+    switch (PQftype(res, col)) {
+        case BOOLOID: switch (value[0]) {
+            case 't': case 'T': if (d) *d = cbor ? 0xf5 : 0xc3; return 1;
+            case 'f': case 'F': if (d) *d = cbor ? 0xf4 : 0xc2; return 1;
+        } break;
+        case CIDOID:
+        case INT2OID:
+        case INT4OID:
+        case INT8OID:
+        case OIDOID:
+        case XIDOID: {
+            int64_t n;
+            if (ngx_postgres_pack_atoi(value, len, &n) == NGX_OK) return ngx_postgres_pack_int(d, cbor, n);
+        } break;
+        case FLOAT4OID:
+        case FLOAT8OID: {
+            char *end;
+            double f = strtod((char *)value, &end);
+            if (len && end == (char *)value + len) return ngx_postgres_pack_float(d, cbor, f);
+        } break;
+        case BYTEAOID: if (len >= 2 && value[0] == '\\' && value[1] == 'x' && !(len % 2)) { // bytea_output = hex
+            size_t size = ngx_postgres_pack_head(d, cbor, pack_bytes, (len - 2) / 2);
+            if (d) for (u_char *p = value + 2, *q = d + size; p < value + len; p += 2) *q++ = (u_char)ngx_hextoi(p, 2);
+            return size + (len - 2) / 2;
+        } break;
+    }
+    size_t size = ngx_postgres_pack_head(d, cbor, pack_text, len);
+    if (d) ngx_memcpy(d + size, value, len);
+    return size + len;
+}
+
+
+static ngx_int_t ngx_postgres_output_pack(ngx_postgres_data_t *pd, ngx_flag_t cbor) {
     ngx_http_request_t *r = pd->request;
     ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "%s", __func__);
+    ngx_postgres_location_t *location = ngx_http_get_module_loc_conf(r, ngx_postgres_module);
+    ngx_postgres_query_t *elts = location->queries.elts;
+    ngx_postgres_output_t *output = &elts[pd->query.index].output;
+    ngx_postgres_result_t *result = &pd->result;
+    PGresult *res = result->res;
+    result->ntuples = PQntuples(res);
+    result->nfields = PQnfields(res);
+    if (location->envelope && ngx_postgres_output_section(pd) != NGX_OK) return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    if (!result->ntuples || !result->nfields) {
+        if (!location->envelope) return NGX_DONE;
+        u_char empty[1];
+        return ngx_postgres_output_empty(pd, output, empty, ngx_postgres_pack_head(empty, cbor, pack_array, 0));
+    }
+    ngx_str_t *name = ngx_postgres_fnames(pd);
+    if (!name) { ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "!ngx_postgres_fnames"); return NGX_ERROR; }
+    size_t size = ngx_postgres_pack_head(NULL, cbor, pack_array, result->ntuples);
+    if (location->envelope) size += output->head.len;
+    for (ngx_uint_t row = 0; row < result->ntuples; row++) {
+        size += ngx_postgres_pack_head(NULL, cbor, pack_map, result->nfields);
+        for (ngx_uint_t col = 0; col < result->nfields; col++) {
+            size += ngx_postgres_pack_head(NULL, cbor, pack_text, name[col].len) + name[col].len;
+            size += ngx_postgres_pack_value(NULL, cbor, res, row, col);
+        }
+    }
+    ngx_buf_t *b = ngx_postgres_buffer(pd, size);
+    if (!b) { ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "!ngx_postgres_buffer"); return NGX_ERROR; }
+    u_char *end = b->last + size;
+    if (location->envelope) b->last = ngx_copy(b->last, output->head.data, output->head.len);
+    b->last += ngx_postgres_pack_head(b->last, cbor, pack_array, result->ntuples);
+    for (ngx_uint_t row = 0; row < result->ntuples; row++) {
+        b->last += ngx_postgres_pack_head(b->last, cbor, pack_map, result->nfields);
+        for (ngx_uint_t col = 0; col < result->nfields; col++) {
+            b->last += ngx_postgres_pack_head(b->last, cbor, pack_text, name[col].len);
+            b->last = ngx_copy(b->last, name[col].data, name[col].len);
+            b->last += ngx_postgres_pack_value(b->last, cbor, res, row, col);
+        }
+    }
+    if (b->last != end) { ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "b->last != end"); return NGX_ERROR; }
+    return NGX_DONE;
+}
+
+
+ngx_int_t ngx_postgres_output_msgpack(ngx_postgres_data_t *pd) {
+    ngx_http_request_t *r = pd->request;
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "%s", __func__);
+    ngx_str_set(&r->headers_out.content_type, "application/x-msgpack");
+    r->headers_out.content_type_len = r->headers_out.content_type.len;
+    return ngx_postgres_output_pack(pd, 0);
+}
+
+
+ngx_int_t ngx_postgres_output_cbor(ngx_postgres_data_t *pd) {
+    ngx_http_request_t *r = pd->request;
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "%s", __func__);
+    ngx_str_set(&r->headers_out.content_type, "application/cbor");
+    r->headers_out.content_type_len = r->headers_out.content_type.len;
+    return ngx_postgres_output_pack(pd, 1);
+}
+
+
+enum {
+    arrow_int = 2,
+    arrow_float = 3,
+    arrow_binary = 4,
+    arrow_utf8 = 5,
+    arrow_bool = 6
+};
+
+
+typedef struct {
+    size_t nulls;
+    size_t size;
+    u_char sign;
+    u_char type;
+    u_char width;
+} ngx_postgres_arrow_t;
+
+
+#define ngx_postgres_arrow_align(n) (((n) + 7) & ~(size_t)7)
+
+
+static u_char *ngx_postgres_arrow_le(u_char *d, uint64_t n, size_t len) {
+    for (; len--; n >>= 8) *d++ = (u_char)n;
+    return d;
+}
+
+
+static void ngx_postgres_arrow_pad(ngx_buf_t *b, size_t align, size_t offset) {
+    while ((size_t)(b->last - b->start + offset) % align) *b->last++ = 0;
+}
+
+
+static void ngx_postgres_arrow_offset(u_char *d, u_char *target) {
+    ngx_postgres_arrow_le(d, target - d, 4);
+}
+
+
+static u_char *ngx_postgres_arrow_table(ngx_buf_t *b, const uint16_t *vtable, size_t n, size_t align) {
+    ngx_postgres_arrow_pad(b, 2, 0);
+    u_char *v = b->last;
+    for (size_t i = 0; i < n; i++) b->last = ngx_postgres_arrow_le(b->last, vtable[i], 2);
+    ngx_postgres_arrow_pad(b, align, 0);
+    u_char *t = b->last;
+    ngx_memzero(t, vtable[1]);
+    ngx_postgres_arrow_le(t, t - v, 4);
+    b->last += vtable[1];
+    return t;
+}
+
+
+static u_char *ngx_postgres_arrow_message(ngx_buf_t *b, u_char type, size_t body) {
+    static const uint16_t vtable[] = { 12, 24, 20, 22, 16, 8 }; // version, header_type, header, bodyLength
+    b->last = b->start + 4;
+    u_char *t = ngx_postgres_arrow_table(b, vtable, sizeof(vtable) / sizeof(vtable[0]), 8);
+    ngx_postgres_arrow_offset(b->start, t);
+    ngx_postgres_arrow_le(t + 8, body, 8);
+    ngx_postgres_arrow_le(t + 20, 4, 2); // MetadataVersion.V5
+    t[22] = type;
+    return t + 16;
+}
+
+
+static void ngx_postgres_arrow_schema(ngx_buf_t *b, ngx_postgres_arrow_t *column, ngx_str_t *name, ngx_uint_t nfields) {
+    static const uint16_t schema[] = { 8, 8, 0, 4 }; // endianness, fields
+    static const uint16_t field[] = { 16, 20, 4, 16, 17, 8, 0, 12 }; // name, nullable, type_type, type, dictionary, children
+    static const uint16_t integer[] = { 8, 12, 4, 8 }; // bitWidth, is_signed
+    static const uint16_t floating[] = { 6, 8, 4 }; // precision
+    static const uint16_t empty[] = { 4, 4 };
+    u_char *header = ngx_postgres_arrow_message(b, 1, 0);
+    u_char *t = ngx_postgres_arrow_table(b, schema, sizeof(schema) / sizeof(schema[0]), 4);
+    ngx_postgres_arrow_offset(header, t);
+    ngx_postgres_arrow_offset(t + 4, b->last);
+    b->last = ngx_postgres_arrow_le(b->last, nfields, 4);
+    u_char *fields = b->last;
+    b->last += 4 * nfields;
+    for (ngx_uint_t col = 0; col < nfields; col++) {
+        u_char *f = ngx_postgres_arrow_table(b, field, sizeof(field) / sizeof(field[0]), 4);
+        ngx_postgres_arrow_offset(fields + 4 * col, f);
+        f[16] = 1;
+        f[17] = column[col].type;
+        ngx_postgres_arrow_pad(b, 4, 0);
+        ngx_postgres_arrow_offset(f + 4, b->last);
+        b->last = ngx_postgres_arrow_le(b->last, name[col].len, 4);
+        b->last = ngx_copy(b->last, name[col].data, name[col].len);
+        *b->last++ = '\0';
+        switch (column[col].type) {
+            case arrow_int:
+                t = ngx_postgres_arrow_table(b, integer, sizeof(integer) / sizeof(integer[0]), 4);
+                ngx_postgres_arrow_le(t + 4, column[col].width * 8, 4);
+                t[8] = column[col].sign;
+                break;
+            case arrow_float:
+                t = ngx_postgres_arrow_table(b, floating, sizeof(floating) / sizeof(floating[0]), 4);
+                ngx_postgres_arrow_le(t + 4, column[col].width == 4 ? 1 : 2, 2); // Precision.SINGLE or Precision.DOUBLE
+                break;
+            default: t = ngx_postgres_arrow_table(b, empty, sizeof(empty) / sizeof(empty[0]), 4); break;
+        }
+        ngx_postgres_arrow_offset(f + 8, t);
+        ngx_postgres_arrow_pad(b, 4, 0);
+        ngx_postgres_arrow_offset(f + 12, b->last);
+        b->last = ngx_postgres_arrow_le(b->last, 0, 4);
+    }
+    ngx_postgres_arrow_pad(b, 8, 0);
+}
+
+
+static void ngx_postgres_arrow_batch(ngx_buf_t *b, ngx_postgres_arrow_t *column, ngx_uint_t ntuples, ngx_uint_t nfields, size_t body) {
+    static const uint16_t batch[] = { 10, 24, 8, 16, 20 }; // length, nodes, buffers
+    u_char *header = ngx_postgres_arrow_message(b, 3, body);
+    u_char *t = ngx_postgres_arrow_table(b, batch, sizeof(batch) / sizeof(batch[0]), 8);
+    ngx_postgres_arrow_offset(header, t);
+    ngx_postgres_arrow_le(t + 8, ntuples, 8);
+    ngx_postgres_arrow_pad(b, 8, 4);
+    ngx_postgres_arrow_offset(t + 16, b->last);
+    b->last = ngx_postgres_arrow_le(b->last, nfields, 4);
+    for (ngx_uint_t col = 0; col < nfields; col++) {
+        b->last = ngx_postgres_arrow_le(b->last, ntuples, 8);
+        b->last = ngx_postgres_arrow_le(b->last, column[col].nulls, 8);
+    }
+    ngx_uint_t nbuffers = 0;
+    for (ngx_uint_t col = 0; col < nfields; col++) nbuffers += column[col].width ? 2 : 3;
+    ngx_postgres_arrow_pad(b, 8, 4);
+    ngx_postgres_arrow_offset(t + 20, b->last);
+    b->last = ngx_postgres_arrow_le(b->last, nbuffers, 4);
+    size_t offset = 0, len;
+    for (ngx_uint_t col = 0; col < nfields; col++) {
+        len = column[col].nulls ? (ntuples + 7) / 8 : 0;
+        b->last = ngx_postgres_arrow_le(b->last, offset, 8);
+        b->last = ngx_postgres_arrow_le(b->last, len, 8);
+        offset += ngx_postgres_arrow_align(len);
+        switch (column[col].type) {
+            case arrow_bool: len = (ntuples + 7) / 8; break;
+            case arrow_binary:
+            case arrow_utf8: len = (ntuples + 1) * 4; break;
+            default: len = ntuples * column[col].width; break;
+        }
+        b->last = ngx_postgres_arrow_le(b->last, offset, 8);
+        b->last = ngx_postgres_arrow_le(b->last, len, 8);
+        offset += ngx_postgres_arrow_align(len);
+        if (column[col].width) continue;
+        b->last = ngx_postgres_arrow_le(b->last, offset, 8);
+        b->last = ngx_postgres_arrow_le(b->last, column[col].size, 8);
+        offset += ngx_postgres_arrow_align(column[col].size);
+    }
+    ngx_postgres_arrow_pad(b, 8, 0);
+}
+
+
+static size_t ngx_postgres_arrow_value(u_char *d, ngx_postgres_arrow_t *column, PGresult *res, int row, int col) {
+    u_char *value = (u_char *)PQgetvalue(res, row, col);
+    size_t len = PQgetlength(res, row, col);
+    if (column->type == arrow_binary && len >= 2 && value[0] == '\\' && value[1] == 'x' && !(len % 2)) { // bytea_output = hex
+        if (d) for (u_char *p = value + 2; p < value + len; p += 2) *d++ = (u_char)ngx_hextoi(p, 2);
+        return (len - 2) / 2;
+    }
+    if (d) ngx_memcpy(d, value, len);
+    return len;
+}
+
+
+ngx_int_t ngx_postgres_output_arrow(ngx_postgres_data_t *pd) {
+    ngx_http_request_t *r = pd->request;
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "%s", __func__);
+    ngx_str_set(&r->headers_out.content_type, "application/vnd.apache.arrow.stream");
+    r->headers_out.content_type_len = r->headers_out.content_type.len;
     ngx_http_upstream_t *u = r->upstream;
-    if (!r->header_sent) {
-        r->headers_out.status = NGX_HTTP_OK;
-        if (!r->headers_out.content_type.data) {
-            ngx_http_core_loc_conf_t *core = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
-            r->headers_out.content_type = core->default_type;
-            r->headers_out.content_type_len = core->default_type.len;
+    ngx_postgres_result_t *result = &pd->result;
+    PGresult *res = result->res;
+    result->ntuples = PQntuples(res);
+    result->nfields = PQnfields(res);
+    if (!result->nfields) return NGX_DONE;
+    ngx_str_t *name = ngx_postgres_fnames(pd);
+    if (!name) { ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "!ngx_postgres_fnames"); return NGX_ERROR; }
+    ngx_postgres_arrow_t *column = ngx_pcalloc(r->pool, result->nfields * sizeof(*column));
+    if (!column) { ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "!ngx_pcalloc"); return NGX_ERROR; }
+    size_t body = 0, names = 0;
+    uint32_t crc;
+    ngx_crc32_init(crc);
+    for (ngx_uint_t col = 0; col < result->nfields; col++) {
+        Oid oid = PQftype(res, col);
+        ngx_crc32_update(&crc, (u_char *)&oid, sizeof(oid));
+        ngx_crc32_update(&crc, (u_char *)&name[col].len, sizeof(name[col].len));
+        ngx_crc32_update(&crc, name[col].data, name[col].len);
+        switch (oid) {
+            case BOOLOID: column[col].type = arrow_bool; column[col].width = 1; break;
+            case INT2OID: column[col].type = arrow_int; column[col].width = 2; column[col].sign = 1; break;
+            case INT4OID: column[col].type = arrow_int; column[col].width = 4; column[col].sign = 1; break;
+            case INT8OID: column[col].type = arrow_int; column[col].width = 8; column[col].sign = 1; break;
+            case CIDOID:
+            case OIDOID:
+            case XIDOID: column[col].type = arrow_int; column[col].width = 4; break;
+            case FLOAT4OID: column[col].type = arrow_float; column[col].width = 4; break;
+            case FLOAT8OID: column[col].type = arrow_float; column[col].width = 8; break;
+            case BYTEAOID: column[col].type = arrow_binary; break;
+            default: column[col].type = arrow_utf8; break;
+        }
+        for (ngx_uint_t row = 0; row < result->ntuples; row++) {
+            if (PQgetisnull(res, row, col)) column[col].nulls++;
+            else if (!column[col].width) column[col].size += ngx_postgres_arrow_value(NULL, &column[col], res, row, col);
+        }
+        names += name[col].len;
+        if (column[col].nulls) body += ngx_postgres_arrow_align((result->ntuples + 7) / 8);
+        switch (column[col].type) {
+            case arrow_bool: body += ngx_postgres_arrow_align((result->ntuples + 7) / 8); break;
+            case arrow_binary:
+            case arrow_utf8: body += ngx_postgres_arrow_align((result->ntuples + 1) * 4) + ngx_postgres_arrow_align(column[col].size); break;
+            default: body += ngx_postgres_arrow_align(result->ntuples * column[col].width); break;
+        }
+    }
+    ngx_crc32_final(crc);
+    ngx_buf_t schema = {0}, batch = {0};
+    ngx_flag_t first = !u->out_bufs;
+    if (first) result->schema = crc;
+    else if (result->schema != crc) { ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "arrow stream can not carry results with different columns"); return NGX_HTTP_INTERNAL_SERVER_ERROR; }
+    if (!(batch.start = ngx_palloc(r->pool, 256 + 64 * result->nfields))) { ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "!ngx_palloc"); return NGX_ERROR; }
+    ngx_postgres_arrow_batch(&batch, column, result->ntuples, result->nfields, body);
+    size_t size = batch.last - batch.start + 8 + body + (first ? 8 : 0);
+    if (first) {
+        if (!(schema.start = ngx_palloc(r->pool, 256 + 96 * result->nfields + names))) { ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "!ngx_palloc"); return NGX_ERROR; }
+        ngx_postgres_arrow_schema(&schema, column, name, result->nfields);
+        size += schema.last - schema.start;
+    }
+    ngx_buf_t *b = ngx_postgres_buffer(pd, size);
+    if (!b) { ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "!ngx_postgres_buffer"); return NGX_ERROR; }
+    u_char *end = b->last + size;
+    if (first) {
+        b->last = ngx_postgres_arrow_le(b->last, 0xffffffff, 4);
+        b->last = ngx_postgres_arrow_le(b->last, schema.last - schema.start, 4);
+        b->last = ngx_copy(b->last, schema.start, schema.last - schema.start);
+    }
+    b->last = ngx_postgres_arrow_le(b->last, 0xffffffff, 4);
+    b->last = ngx_postgres_arrow_le(b->last, batch.last - batch.start, 4);
+    b->last = ngx_copy(b->last, batch.start, batch.last - batch.start);
+    ngx_memzero(b->last, body);
+    for (ngx_uint_t col = 0; col < result->nfields; col++) {
+        u_char *validity = b->last;
+        if (column[col].nulls) b->last += ngx_postgres_arrow_align((result->ntuples + 7) / 8);
+        u_char *data = b->last;
+        switch (column[col].type) {
+            case arrow_bool: b->last += ngx_postgres_arrow_align((result->ntuples + 7) / 8); break;
+            case arrow_binary:
+            case arrow_utf8: b->last += ngx_postgres_arrow_align((result->ntuples + 1) * 4); break;
+            default: b->last += ngx_postgres_arrow_align(result->ntuples * column[col].width); break;
+        }
+        u_char *p = b->last;
+        for (ngx_uint_t row = 0; row < result->ntuples; row++) {
+            if (!column[col].width) ngx_postgres_arrow_le(data + 4 * row, p - b->last, 4);
+            if (PQgetisnull(res, row, col)) continue;
+            if (column[col].nulls) validity[row >> 3] |= 1 << (row & 7);
+            u_char *value = (u_char *)PQgetvalue(res, row, col);
+            switch (column[col].type) {
+                case arrow_bool: if (value[0] == 't' || value[0] == 'T') data[row >> 3] |= 1 << (row & 7); break;
+                case arrow_int: {
+                    int64_t n;
+                    if (ngx_postgres_pack_atoi(value, PQgetlength(res, row, col), &n) == NGX_OK) ngx_postgres_arrow_le(data + row * column[col].width, n, column[col].width);
+                } break;
+                case arrow_float: {
+                    double f = strtod((char *)value, NULL);
+                    if (column[col].width == 4) {
+                        float g = f;
+                        uint32_t n;
+                        ngx_memcpy(&n, &g, sizeof(n));
+                        ngx_postgres_arrow_le(data + row * 4, n, 4);
+                    } else {
+                        uint64_t n;
+                        ngx_memcpy(&n, &f, sizeof(n));
+                        ngx_postgres_arrow_le(data + row * 8, n, 8);
+                    }
+                } break;
+                default: p += ngx_postgres_arrow_value(p, &column[col], res, row, col); break;
+            }
+        }
+        if (column[col].width) continue;
+        ngx_postgres_arrow_le(data + 4 * result->ntuples, p - b->last, 4);
+        b->last += ngx_postgres_arrow_align(column[col].size);
+    }
+    if (b->last != end) { ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "b->last != end"); return NGX_ERROR; }
+    return NGX_DONE;
+}
+
+
+#if (NGX_THREADS)
+typedef struct {
+    ngx_int_t rc;
+    ngx_postgres_data_t *pd;
+    ngx_postgres_handler_pt handler;
+} ngx_postgres_thread_t;
+
+
+static void ngx_postgres_output_thread_cleanup(void *data) {
+    ngx_pool_t *pool = data;
+    ngx_destroy_pool(pool);
+}
+
+
+static void ngx_postgres_output_thread_handler(void *data, ngx_log_t *log) {
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, log, 0, "%s", __func__);
+    ngx_postgres_thread_t *thread = data;
+    thread->rc = thread->handler(thread->pd);
+}
+
+
+static void ngx_postgres_output_thread_busy_handler(ngx_event_t *ev) {
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ev->log, 0, "%s", __func__); // handled when thread is done
+}
+
+
+static void ngx_postgres_output_thread_event_handler(ngx_event_t *ev) {
+    ngx_postgres_data_t *pd = ev->data;
+    ngx_http_request_t *r = pd->request;
+    ngx_connection_t *c = r->connection;
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, c->log, 0, "%s", __func__);
+    ngx_http_set_log_request(c->log, r);
+    ngx_http_upstream_t *u = r->upstream;
+    ngx_postgres_thread_t *thread = pd->out.task->ctx;
+    pd->out.thread = 0;
+    PQclear(pd->result.res);
+    pd->result.res = NULL;
+    r->read_event_handler = pd->out.read_event_handler;
+    r->write_event_handler = pd->out.write_event_handler;
+    ngx_connection_t *pc = pd->common.connection;
+    if (u->cleanup) pc->read->handler = pc->write->handler = pd->out.handler;
+    if (!u->cleanup) { ngx_log_debug0(NGX_LOG_DEBUG_HTTP, c->log, 0, "upstream already finalized"); u->out_bufs = NULL; }
+    else if (thread->rc >= NGX_HTTP_SPECIAL_RESPONSE) ngx_http_upstream_finalize_request(r, u, thread->rc);
+    else if (thread->rc != NGX_DONE) ngx_http_upstream_next(r, u, NGX_HTTP_UPSTREAM_FT_ERROR);
+    else if (pc->read->timedout || pc->write->timedout) pd->out.handler(pc->read->timedout ? pc->read : pc->write); // timed out while thread ran
+    else ngx_postgres_process_events(pd);
+    ngx_http_finalize_request(r, NGX_DONE);
+    ngx_http_run_posted_requests(c);
+}
+
+
+ngx_int_t ngx_postgres_output_thread(ngx_postgres_data_t *pd) {
+    ngx_http_request_t *r = pd->request;
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "%s", __func__);
+    ngx_postgres_location_t *location = ngx_http_get_module_loc_conf(r, ngx_postgres_module);
+    ngx_postgres_query_t *elts = location->queries.elts;
+    ngx_postgres_query_t *query = &elts[pd->query.index];
+    ngx_postgres_output_t *output = &query->output;
+    if (!output->thread_pool || (ngx_uint_t)PQntuples(pd->result.res) < output->threshold) return NGX_DECLINED;
+    if (!pd->out.pool) {
+        ngx_pool_cleanup_t *cln = ngx_pool_cleanup_add(r->pool, 0);
+        if (!cln) { ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "!ngx_pool_cleanup_add"); return NGX_ERROR; }
+        if (!(pd->out.pool = ngx_create_pool(NGX_DEFAULT_POOL_SIZE, r->connection->log))) { ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "!ngx_create_pool"); return NGX_ERROR; }
+        cln->handler = ngx_postgres_output_thread_cleanup;
+        cln->data = pd->out.pool;
+    }
+    if (!pd->out.task) {
+        if (!(pd->out.task = ngx_thread_task_alloc(r->pool, sizeof(ngx_postgres_thread_t)))) { ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "!ngx_thread_task_alloc"); return NGX_ERROR; }
+        pd->out.task->handler = ngx_postgres_output_thread_handler;
+        pd->out.task->event.handler = ngx_postgres_output_thread_event_handler;
+        pd->out.task->event.data = pd;
+    }
+    ngx_postgres_thread_t *thread = pd->out.task->ctx;
+    thread->handler = output->handler;
+    thread->pd = pd;
+    thread->rc = NGX_ERROR;
+    pd->out.thread = 1;
+    if (ngx_thread_task_post(output->thread_pool, pd->out.task) != NGX_OK) { ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "ngx_thread_task_post != NGX_OK"); pd->out.thread = 0; return NGX_ERROR; }
+    ngx_connection_t *c = pd->common.connection;
+    pd->out.handler = c->read->handler; // neither timeout nor error of connection may finalize upstream while thread writes output
+    c->read->handler = c->write->handler = ngx_postgres_output_thread_busy_handler;
+    pd->out.read_event_handler = r->read_event_handler; // nor client abort
+    pd->out.write_event_handler = r->write_event_handler;
+    r->read_event_handler = ngx_http_block_reading;
+    r->write_event_handler = ngx_http_request_empty_handler;
+    r->main->count++;
+    return NGX_AGAIN;
+}
+#endif
+
+
+ngx_int_t ngx_postgres_etag(ngx_http_request_t *r, ngx_chain_t *chain) {
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "%s", __func__);
+    ngx_postgres_location_t *location = ngx_http_get_module_loc_conf(r, ngx_postgres_module);
+    ngx_str_t etag;
+    if (location->etag.value) {
+        ngx_str_t value;
+        if (ngx_http_complex_value(r, location->etag.value, &value) != NGX_OK) { ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "ngx_http_complex_value != NGX_OK"); return NGX_ERROR; }
+        if (!value.len) return NGX_OK;
+        if (value.data[0] == '"' || (value.len > 2 && value.data[0] == 'W' && value.data[1] == '/')) etag = value; else {
+            etag.len = value.len + 2;
+            if (!(etag.data = ngx_pnalloc(r->pool, etag.len))) { ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "!ngx_pnalloc"); return NGX_ERROR; }
+            *ngx_cpymem(etag.data + 1, value.data, value.len) = '"';
+            etag.data[0] = '"';
+        }
+    } else {
+        uint32_t crc;
+        off_t size = 0;
+        ngx_crc32_init(crc);
+        for (ngx_chain_t *cl = chain; cl; cl = cl->next) {
+            ngx_crc32_update(&crc, cl->buf->pos, cl->buf->last - cl->buf->pos);
+            size += cl->buf->last - cl->buf->pos;
         }
-        r->headers_out.content_type_lowcase = NULL;
-        ngx_postgres_common_t *pdc = &pd->common;
-        if (pdc->charset.len) r->headers_out.charset = pdc->charset;
-        ngx_http_clear_content_length(r);
+        ngx_crc32_final(crc);
+        if (!(etag.data = ngx_pnalloc(r->pool, sizeof("\"-\"") - 1 + NGX_OFF_T_LEN + 8))) { ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "!ngx_pnalloc"); return NGX_ERROR; }
+        etag.len = ngx_sprintf(etag.data, "\"%xO-%08xD\"", size, crc) - etag.data; // like static files, length and checksum instead of mtime
+    }
+    ngx_table_elt_t *h = ngx_list_push(&r->headers_out.headers);
+    if (!h) { ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "!ngx_list_push"); return NGX_ERROR; }
+    h->hash = 1;
+    ngx_str_set(&h->key, "ETag");
+    h->value = etag;
+    r->headers_out.etag = h; // If-None-Match and If-Match are checked by not_modified filter
+    return NGX_OK;
+}
+
+
+static ngx_int_t ngx_postgres_output_header(ngx_postgres_data_t *pd) {
+    ngx_http_request_t *r = pd->request;
+    ngx_http_upstream_t *u = r->upstream;
+    r->headers_out.status = NGX_HTTP_OK;
+    if (!r->headers_out.content_type.data) {
+        ngx_http_core_loc_conf_t *core = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
+        r->headers_out.content_type = core->default_type;
+        r->headers_out.content_type_len = core->default_type.len;
+    }
+    r->headers_out.content_type_lowcase = NULL;
+    ngx_postgres_common_t *pdc = &pd->common;
+    if (pdc->charset.len) r->headers_out.charset = pdc->charset;
+    ngx_http_clear_content_length(r);
+    if (ngx_postgres_spill(pd) != NGX_OK) { ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "ngx_postgres_spill != NGX_OK"); return NGX_ERROR; }
+    ngx_postgres_location_t *location = ngx_http_get_module_loc_conf(r, ngx_postgres_module);
+    if (location->cursor) r->headers_out.content_length_n = -1; else { // length of rest of batches is unknown
         r->headers_out.content_length_n = 0;
-        if (u->out_bufs) for (ngx_chain_t *chain = u->out_bufs; chain; chain = chain->next) r->headers_out.content_length_n += chain->buf->end - chain->buf->start;
-        ngx_int_t rc = ngx_http_send_header(r);
+        if (u->out_bufs) for (ngx_chain_t *chain = u->out_bufs; chain; chain = chain->next) r->headers_out.content_length_n += ngx_buf_size(chain->buf);
+    }
+    if (location->cache.zone) ngx_postgres_cache_store(r, u->out_bufs);
+    if (location->coalesce) ngx_postgres_coalesce_done(r, u->out_bufs);
+    if (location->etag.enable && ngx_postgres_etag(r, u->out_bufs) != NGX_OK) return NGX_ERROR;
+    return ngx_http_send_header(r);
+}
+
+
+ngx_int_t ngx_postgres_output_chain(ngx_postgres_data_t *pd) {
+    ngx_http_request_t *r = pd->request;
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "%s", __func__);
+    ngx_http_upstream_t *u = r->upstream;
+    if (!r->header_sent) {
+        ngx_int_t rc = ngx_postgres_output_header(pd);
         if (rc == NGX_ERROR || rc > NGX_OK || r->header_only) return rc;
     }
     ngx_int_t rc = ngx_http_output_filter(r, u->out_bufs);
@@ -498,6 +1516,62 @@ ngx_int_t ngx_postgres_output_chain(ngx_postgres_data_t *pd) {
 }
 
 
+ngx_int_t ngx_postgres_output_result(ngx_http_request_t *r, PGresult *res, ngx_str_t *charset) {
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "%s", __func__);
+    ngx_postgres_location_t *location = ngx_http_get_module_loc_conf(r, ngx_postgres_module);
+    if (ngx_http_upstream_create(r) != NGX_OK) { ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "ngx_http_upstream_create != NGX_OK"); return NGX_HTTP_INTERNAL_SERVER_ERROR; }
+    ngx_http_upstream_t *u = r->upstream; // only for output buffers, never started
+    u->output.tag = (ngx_buf_tag_t)&ngx_postgres_module;
+    u->conf = &location->upstream;
+    ngx_postgres_data_t *pd = ngx_pcalloc(r->pool, sizeof(*pd));
+    if (!pd) { ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "!ngx_pcalloc"); return NGX_HTTP_INTERNAL_SERVER_ERROR; }
+    pd->request = r;
+    pd->common.charset = *charset;
+    pd->result.res = res;
+    u->peer.data = pd; // for variables, peer is never connected
+    u->peer.get = ngx_postgres_peer_get;
+    ngx_postgres_query_t *query = location->queries.elts;
+    if (location->index) { // postgres_set
+        if (ngx_array_init(&pd->variables, r->pool, location->index, sizeof(ngx_str_t)) != NGX_OK) { ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "ngx_array_init != NGX_OK"); return NGX_HTTP_INTERNAL_SERVER_ERROR; }
+        ngx_memzero(pd->variables.elts, location->index * pd->variables.size);
+        pd->variables.nelts = location->index;
+    }
+    if (ngx_postgres_variable_set(pd) != NGX_OK) { ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "ngx_postgres_variable_set != NGX_OK"); return NGX_HTTP_INTERNAL_SERVER_ERROR; }
+    if (query->output.handler && ngx_postgres_variable_output(pd) != NGX_OK) { ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "ngx_postgres_variable_output != NGX_OK"); return NGX_HTTP_INTERNAL_SERVER_ERROR; }
+    ngx_int_t rc = query->output.handler ? query->output.handler(pd) : NGX_DONE;
+    if (rc != NGX_DONE) return rc;
+    if ((rc = ngx_postgres_output_chain(pd)) != NGX_OK) return rc;
+    return r->header_only ? NGX_OK : ngx_http_send_special(r, NGX_HTTP_LAST);
+}
+
+
+ngx_int_t ngx_postgres_output_flush(ngx_postgres_data_t *pd) {
+    ngx_http_request_t *r = pd->request;
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "%s", __func__);
+    ngx_http_upstream_t *u = r->upstream;
+    if (!r->header_sent) {
+        ngx_int_t rc = ngx_postgres_output_header(pd);
+        if (rc == NGX_ERROR || rc > NGX_OK) return NGX_ERROR;
+    }
+    if (r->header_only) { // rows are dropped
+        for (ngx_chain_t *cl = u->out_bufs; cl; cl = cl->next) cl->buf->pos = cl->buf->last;
+        ngx_chain_update_chains(r->pool, &u->free_bufs, &u->busy_bufs, &u->out_bufs, u->output.tag);
+        return NGX_OK;
+    }
+    ngx_int_t rc = ngx_http_output_filter(r, u->out_bufs);
+    if (rc == NGX_ERROR) return NGX_ERROR;
+    u->header_sent = 1;
+    ngx_chain_update_chains(r->pool, &u->free_bufs, &u->busy_bufs, &u->out_bufs, u->output.tag);
+    if (!u->busy_bufs) return NGX_OK;
+    ngx_connection_t *c = r->connection;
+    ngx_http_core_loc_conf_t *core = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
+    if (ngx_handle_write_event(c->write, core->send_lowat) != NGX_OK) return NGX_ERROR;
+    if (!c->write->ready) ngx_add_timer(c->write, core->send_timeout);
+    else if (c->write->timer_set) ngx_del_timer(c->write);
+    return NGX_AGAIN;
+}
+
+
 char *ngx_postgres_output_conf(ngx_conf_t *cf, ngx_command_t *cmd, void *conf) {
     ngx_postgres_location_t *location = conf;
     ngx_postgres_query_t *query = location->query;
@@ -516,14 +1590,21 @@ char *ngx_postgres_output_conf(ngx_conf_t *cf, ngx_command_t *cmd, void *conf) {
         { ngx_string("value"), 0, ngx_postgres_output_value },
         { ngx_string("binary"), 1, ngx_postgres_output_value },
         { ngx_string("json"), 0, ngx_postgres_output_json },
+        { ngx_string("msgpack"), 0, ngx_postgres_output_msgpack },
+        { ngx_string("cbor"), 0, ngx_postgres_output_cbor },
+        { ngx_string("arrow"), 0, ngx_postgres_output_arrow },
         { ngx_null_string, 0, NULL }
     };
     ngx_uint_t i;
     for (i = 0; h[i].name.len; i++) if (h[i].name.len == elts[1].len && !ngx_strncasecmp(h[i].name.data, elts[1].data, elts[1].len)) { output->handler = h[i].handler; break; }
-    if (!h[i].name.len) { ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "\"%V\" directive error: format \"%V\" must be \"text\", \"csv\", \"value\", \"binary\" or \"json\"", &cmd->name, &elts[1]); return NGX_CONF_ERROR; }
+    if (!h[i].name.len) { ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "\"%V\" directive error: format \"%V\" must be \"text\", \"csv\", \"value\", \"binary\", \"json\", \"msgpack\", \"cbor\" or \"arrow\"", &cmd->name, &elts[1]); return NGX_CONF_ERROR; }
     output->binary = h[i].binary;
+    output->format = h[i].name;
     output->header = 1;
     output->string = 1;
+#if (NGX_THREADS)
+    output->threshold = 1000;
+#endif
     if (output->handler == ngx_postgres_output_text) {
         output->delimiter = '\t';
         ngx_str_set(&output->null, "\\N");
@@ -598,6 +1679,37 @@ char *ngx_postgres_output_conf(ngx_conf_t *cf, ngx_command_t *cmd, void *conf) {
                 continue;
             }
         }
+#if (NGX_THREADS)
+        if (output->handler == ngx_postgres_output_text || output->handler == ngx_postgres_output_csv || output->handler == ngx_postgres_output_json) {
+            if (elts[i].len > sizeof("thread_pool=") - 1 && !ngx_strncasecmp(elts[i].data, (u_char *)"thread_pool=", sizeof("thread_pool=") - 1)) {
+                elts[i].len = elts[i].len - (sizeof("thread_pool=") - 1);
+                elts[i].data = &elts[i].data[sizeof("thread_pool=") - 1];
+                if (!(output->thread_pool = ngx_thread_pool_add(cf, &elts[i]))) { ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "\"%V\" directive error: !ngx_thread_pool_add", &cmd->name); return NGX_CONF_ERROR; }
+                continue;
+            }
+            if (elts[i].len > sizeof("thread_threshold=") - 1 && !ngx_strncasecmp(elts[i].data, (u_char *)"thread_threshold=", sizeof("thread_threshold=") - 1)) {
+                elts[i].len = elts[i].len - (sizeof("thread_threshold=") - 1);
+                elts[i].data = &elts[i].data[sizeof("thread_threshold=") - 1];
+                ngx_int_t n = ngx_atoi(elts[i].data, elts[i].len);
+                if (n == NGX_ERROR) { ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "\"%V\" directive error: \"thread_threshold\" value \"%V\" must be number", &cmd->name, &elts[i]); return NGX_CONF_ERROR; }
+                output->threshold = (ngx_uint_t)n;
+                continue;
+            }
+        }
+#endif
+        if ((output->handler == ngx_postgres_output_json || output->handler == ngx_postgres_output_msgpack || output->handler == ngx_postgres_output_cbor) && elts[i].len > sizeof("name=") - 1 && !ngx_strncasecmp(elts[i].data, (u_char *)"name=", sizeof("name=") - 1)) {
+            elts[i].len = elts[i].len - (sizeof("name=") - 1);
+            elts[i].data = &elts[i].data[sizeof("name=") - 1];
+            output->name = elts[i];
+            continue;
+        }
+        if (output->handler != ngx_postgres_output_value && elts[i].len > sizeof("binary=") - 1 && !ngx_strncasecmp(elts[i].data, (u_char *)"binary=", sizeof("binary=") - 1)) {
+            elts[i].len = elts[i].len - (sizeof("binary=") - 1);
+            elts[i].data = &elts[i].data[sizeof("binary=") - 1];
+            for (j = 0; e[j].name.len; j++) if (e[j].name.len == elts[i].len && !ngx_strncasecmp(e[j].name.data, elts[i].data, elts[i].len)) { output->binary = e[j].value; break; }
+            if (!e[j].name.len) { ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "\"%V\" directive error: \"binary\" value \"%V\" must be \"off\", \"no\", \"false\", \"on\", \"yes\" or \"true\"", &cmd->name, &elts[i]); return NGX_CONF_ERROR; }
+            continue;
+        }
         if (elts[i].len > sizeof("append=") - 1 && !ngx_strncasecmp(elts[i].data, (u_char *)"append=", sizeof("append=") - 1)) {
             elts[i].len = elts[i].len - (sizeof("append=") - 1);
             elts[i].data = &elts[i].data[sizeof("append=") - 1];
@@ -608,5 +1720,74 @@ char *ngx_postgres_output_conf(ngx_conf_t *cf, ngx_command_t *cmd, void *conf) {
         ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "\"%V\" directive error: invalid additional parameter \"%V\"", &cmd->name, &elts[i]);
         return NGX_CONF_ERROR;
     }
+    output->kernel = (output->quote ? 2 : 0) | (output->escape ? 1 : 0);
+    return NGX_CONF_OK;
+}
+
+
+ngx_int_t ngx_postgres_output_envelope(ngx_conf_t *cf, ngx_postgres_location_t *location) {
+    ngx_postgres_query_t *query = location->queries.elts;
+    ngx_postgres_handler_pt handler = NULL;
+    ngx_uint_t last = 0, n = 0;
+    for (ngx_uint_t i = 0; i < location->queries.nelts; i++) {
+        ngx_postgres_output_t *output = &query[i].output;
+        if (!output->handler) continue; // query without output has no section
+        if (output->handler != ngx_postgres_output_json && output->handler != ngx_postgres_output_msgpack && output->handler != ngx_postgres_output_cbor) { ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "\"postgres_envelope\" requires \"postgres_output\" json, msgpack or cbor"); return NGX_ERROR; }
+        if (handler && output->handler != handler) { ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "\"postgres_envelope\" requires same \"postgres_output\" format for all queries"); return NGX_ERROR; }
+        handler = output->handler;
+        if (!output->name.len) {
+            if (!(output->name.data = ngx_pnalloc(cf->pool, sizeof("q") - 1 + NGX_INT_T_LEN))) { ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "!ngx_pnalloc"); return NGX_ERROR; }
+            output->name.len = ngx_sprintf(output->name.data, "q%ui", i + 1) - output->name.data;
+        }
+        last = i;
+        n++;
+    }
+    if (!n) { ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "\"postgres_envelope\" requires \"postgres_output\""); return NGX_ERROR; }
+    ngx_flag_t cbor = handler == ngx_postgres_output_cbor;
+    for (ngx_uint_t i = 0, j = 0; i < location->queries.nelts; i++) {
+        ngx_postgres_output_t *output = &query[i].output;
+        if (!output->handler) continue;
+        ngx_str_t *name = &output->name;
+        size_t size = handler == ngx_postgres_output_json ? sizeof(",\"\":") - 1 + name->len + ngx_escape_json(NULL, name->data, name->len) : ngx_postgres_pack_head(NULL, cbor, pack_map, n) + ngx_postgres_pack_head(NULL, cbor, pack_text, name->len) + name->len;
+        if (!(output->head.data = ngx_pnalloc(cf->pool, size))) { ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "!ngx_pnalloc"); return NGX_ERROR; }
+        u_char *p = output->head.data;
+        if (handler == ngx_postgres_output_json) {
+            *p++ = j ? ',' : '{';
+            *p++ = '"';
+            p = (u_char *)ngx_escape_json(p, name->data, name->len);
+            *p++ = '"';
+            *p++ = ':';
+            if (i == last) ngx_str_set(&output->tail, "}");
+        } else { // map of arrays needs no end
+            if (!j) p += ngx_postgres_pack_head(p, cbor, pack_map, n);
+            p += ngx_postgres_pack_head(p, cbor, pack_text, name->len);
+            p = ngx_copy(p, name->data, name->len);
+        }
+        output->head.len = p - output->head.data;
+        j++;
+    }
+    return NGX_OK;
+}
+
+
+char *ngx_postgres_etag_conf(ngx_conf_t *cf, ngx_command_t *cmd, void *conf) {
+    ngx_postgres_location_t *location = conf;
+    if (location->etag.enable != NGX_CONF_UNSET) return "duplicate";
+    ngx_str_t *elts = cf->args->elts;
+    static const ngx_conf_enum_t e[] = {
+        { ngx_string("off"), 0 },
+        { ngx_string("no"), 0 },
+        { ngx_string("false"), 0 },
+        { ngx_string("on"), 1 },
+        { ngx_string("yes"), 1 },
+        { ngx_string("true"), 1 },
+        { ngx_null_string, 0 }
+    };
+    for (ngx_uint_t i = 0; e[i].name.len; i++) if (e[i].name.len == elts[1].len && !ngx_strncasecmp(e[i].name.data, elts[1].data, elts[1].len)) { location->etag.enable = e[i].value; return NGX_CONF_OK; }
+    if (!elts[1].len) return "error: empty value";
+    if (!(location->etag.value = ngx_palloc(cf->pool, sizeof(*location->etag.value)))) { ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "\"%V\" directive error: !ngx_palloc", &cmd->name); return NGX_CONF_ERROR; }
+    ngx_http_compile_complex_value_t ccv = {cf, &elts[1], location->etag.value, 0, 0, 0};
+    if (ngx_http_compile_complex_value(&ccv) != NGX_OK) { ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "\"%V\" directive error: ngx_http_compile_complex_value != NGX_OK", &cmd->name); return NGX_CONF_ERROR; }
+    location->etag.enable = 1;
     return NGX_CONF_OK;
 }
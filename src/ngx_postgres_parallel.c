@@ -0,0 +1,107 @@
+#include "ngx_postgres_include.h"
+
+
+typedef struct ngx_postgres_parallel_s ngx_postgres_parallel_t;
+
+struct ngx_postgres_parallel_s {
+    ngx_chain_t *out;
+    ngx_flag_t done;
+    ngx_int_t rc;
+    ngx_postgres_parallel_t *main; // of part
+    ngx_postgres_parallel_t *part; // of main
+    ngx_str_t charset;
+    ngx_str_t content_type;
+    ngx_uint_t index;
+    ngx_uint_t n;
+};
+
+
+static void ngx_postgres_parallel_wait_handler(ngx_http_request_t *r) {
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "%s", __func__);
+    ngx_postgres_parallel_t *ctx = ngx_http_get_module_ctx(r, ngx_postgres_module);
+    if (ctx->done || ctx->n) return;
+    ctx->done = 1;
+    r->write_event_handler = ngx_http_request_empty_handler;
+    ngx_postgres_location_t *location = ngx_http_get_module_loc_conf(r, ngx_postgres_module);
+    ngx_chain_t *out = NULL, **last = &out;
+    r->headers_out.content_length_n = 0;
+    for (ngx_uint_t i = 0; i < location->queries.nelts; i++) { // in order of queries
+        ngx_postgres_parallel_t *part = &ctx->part[i];
+        if (part->rc != NGX_OK) return ngx_http_finalize_request(r, part->rc); // first failed query answers whole request
+        if (part->content_type.len) r->headers_out.content_type = part->content_type;
+        if (part->charset.len && !r->headers_out.charset.len) r->headers_out.charset = part->charset;
+        for (*last = part->out; *last; last = &(*last)->next) r->headers_out.content_length_n += ngx_buf_size((*last)->buf);
+    }
+    r->headers_out.status = NGX_HTTP_OK;
+    if (!r->headers_out.content_type.data) {
+        ngx_http_core_loc_conf_t *core = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
+        r->headers_out.content_type = core->default_type;
+    }
+    r->headers_out.content_type_len = r->headers_out.content_type.len;
+    r->headers_out.content_type_lowcase = NULL;
+    ngx_int_t rc = ngx_http_send_header(r);
+    if (rc == NGX_ERROR || rc > NGX_OK || r->header_only) return ngx_http_finalize_request(r, rc);
+    if (out && (rc = ngx_http_output_filter(r, out)) == NGX_ERROR) return ngx_http_finalize_request(r, rc);
+    ngx_http_finalize_request(r, ngx_http_send_special(r, NGX_HTTP_LAST));
+}
+
+
+static ngx_int_t ngx_postgres_parallel_post_handler(ngx_http_request_t *r, void *data, ngx_int_t rc) {
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "%s rc = %i", __func__, rc);
+    ngx_postgres_parallel_t *part = data;
+    if (part->done) return NGX_OK;
+    part->done = 1;
+    part->rc = rc;
+    if (!--part->main->n) ngx_http_post_request(r->parent, NULL); // background subrequest does not wake parent itself
+    return rc == NGX_ERROR ? rc : NGX_OK; // error page of part must not be sent
+}
+
+
+ngx_int_t ngx_postgres_parallel_done(ngx_postgres_data_t *pd) {
+    ngx_http_request_t *r = pd->request;
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "%s", __func__);
+    ngx_postgres_parallel_t *part = ngx_http_get_module_ctx(r, ngx_postgres_module);
+    if (!part || !part->main) { ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "!part"); return NGX_ERROR; }
+    ngx_http_upstream_t *u = r->upstream;
+    part->out = u->out_bufs; // buffers are allocated from pool of main request
+    u->out_bufs = NULL;
+    part->charset = pd->common.charset;
+    part->content_type = r->headers_out.content_type;
+    return NGX_OK;
+}
+
+
+ngx_int_t ngx_postgres_parallel_query(ngx_http_request_t *r) {
+    ngx_postgres_parallel_t *part = ngx_http_get_module_ctx(r, ngx_postgres_module);
+    return part && part->main ? (ngx_int_t)part->index : NGX_DECLINED;
+}
+
+
+ngx_int_t ngx_postgres_parallel_handler(ngx_http_request_t *r) {
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "%s", __func__);
+    ngx_postgres_parallel_t *ctx = ngx_http_get_module_ctx(r, ngx_postgres_module);
+    if (ctx && ctx->main) return NGX_DECLINED; // part runs its query on pooled connection
+    ngx_postgres_location_t *location = ngx_http_get_module_loc_conf(r, ngx_postgres_module);
+    if (!(ctx = ngx_pcalloc(r->pool, sizeof(*ctx)))) { ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "!ngx_pcalloc"); return NGX_HTTP_INTERNAL_SERVER_ERROR; }
+    if (!(ctx->part = ngx_pcalloc(r->pool, location->queries.nelts * sizeof(*ctx->part)))) { ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "!ngx_pcalloc"); return NGX_HTTP_INTERNAL_SERVER_ERROR; }
+    ngx_http_set_ctx(r, ctx, ngx_postgres_module);
+    for (ngx_uint_t i = 0; i < location->queries.nelts; i++) {
+        ngx_postgres_parallel_t *part = &ctx->part[i];
+        part->index = i;
+        part->main = ctx;
+        part->rc = NGX_HTTP_INTERNAL_SERVER_ERROR;
+        ngx_http_post_subrequest_t *ps = ngx_palloc(r->pool, sizeof(*ps));
+        if (!ps) { ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "!ngx_palloc"); ctx->done = 1; return ctx->n ? NGX_ERROR : NGX_HTTP_INTERNAL_SERVER_ERROR; }
+        ps->handler = ngx_postgres_parallel_post_handler;
+        ps->data = part;
+        ngx_http_request_t *sr;
+        if (ngx_http_subrequest(r, &r->uri, &r->args, &sr, ps, NGX_HTTP_SUBREQUEST_BACKGROUND) != NGX_OK) { ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "ngx_http_subrequest != NGX_OK"); ctx->done = 1; return ctx->n ? NGX_ERROR : NGX_HTTP_INTERNAL_SERVER_ERROR; }
+        sr->method = r->method; // ngx_http_subrequest makes it GET
+        sr->method_name = r->method_name;
+        ngx_http_set_ctx(sr, part, ngx_postgres_module);
+        ctx->n++;
+    }
+    r->write_event_handler = ngx_postgres_parallel_wait_handler;
+    r->main->count++;
+    return NGX_DONE;
+}
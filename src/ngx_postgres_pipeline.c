@@ -0,0 +1,305 @@
+#include "ngx_postgres_include.h"
+
+
+typedef struct ngx_postgres_pipeline_ctx_s ngx_postgres_pipeline_ctx_t;
+
+typedef struct {
+    ngx_int_t rc;
+    ngx_postgres_pipeline_ctx_t *ctx; // NULL when request is gone
+    ngx_queue_t queue;
+    PGresult *res;
+} ngx_postgres_pipeline_job_t;
+
+struct ngx_postgres_pipeline_ctx_s {
+    ngx_event_t wait;
+    ngx_flag_t alone;
+    ngx_int_t rc;
+    ngx_postgres_pipeline_job_t *job;
+    ngx_str_t charset;
+    PGresult *res;
+};
+
+typedef struct {
+    ngx_event_t timeout;
+    ngx_log_t *log;
+    ngx_postgres_common_t common;
+    ngx_postgres_connect_t *connect;
+    ngx_postgres_upstream_srv_conf_t *pusc;
+    ngx_queue_t queue; // results come back in this order
+    ngx_uint_t n;
+} ngx_postgres_pipeline_t;
+
+
+#ifdef LIBPQ_HAS_PIPELINING
+static void ngx_postgres_pipeline_event_handler(ngx_event_t *ev);
+
+
+static ngx_int_t ngx_postgres_pipeline_connect(ngx_postgres_pipeline_t *pp) {
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, pp->log, 0, "%s", __func__);
+    return ngx_postgres_connect_start(&pp->common, pp->connect->keywords, pp->connect->values, pp->connect->timeout, pp->log, ngx_postgres_pipeline_event_handler, pp);
+}
+
+
+static void ngx_postgres_pipeline_done(ngx_postgres_pipeline_t *pp, ngx_postgres_pipeline_job_t *job) {
+    ngx_queue_remove(&job->queue);
+    pp->n--;
+    ngx_postgres_pipeline_ctx_t *ctx = job->ctx;
+    if (!ctx) { if (job->res) PQclear(job->res); ngx_free(job); return; }
+    ctx->job = NULL;
+    ctx->res = job->res;
+    ctx->rc = job->rc;
+    if (!ctx->res && !ctx->rc) ctx->alone = 1; // run query itself on pooled connection
+    ngx_post_event(&ctx->wait, &ngx_posted_events);
+    ngx_free(job);
+}
+
+
+static void ngx_postgres_pipeline_close(ngx_postgres_pipeline_t *pp, ngx_int_t rc) {
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, pp->log, 0, "%s", __func__);
+    ngx_postgres_common_t *ppc = &pp->common;
+    if (ppc->connection) ngx_postgres_free_connection(ppc);
+    ppc->connection = NULL;
+    ppc->state = 0;
+    while (!ngx_queue_empty(&pp->queue)) { // statements in flight are lost with connection
+        ngx_postgres_pipeline_job_t *job = ngx_queue_data(ngx_queue_head(&pp->queue), ngx_postgres_pipeline_job_t, queue);
+        if (job->res) PQclear(job->res);
+        job->res = NULL;
+        job->rc = rc;
+        ngx_postgres_pipeline_done(pp, job);
+    }
+    if (ngx_terminate || ngx_exiting || pp->timeout.timer_set) return;
+    ngx_add_timer(&pp->timeout, pp->connect->timeout);
+}
+
+
+static ngx_int_t ngx_postgres_pipeline_send(ngx_postgres_pipeline_t *pp, const char *sql, int nParams, const Oid *paramTypes, const char *const *paramValues, int format) {
+    ngx_postgres_common_t *ppc = &pp->common;
+    if (!PQsendQueryParams(ppc->conn, sql, nParams, paramTypes, paramValues, NULL, NULL, format)) { ngx_log_error(NGX_LOG_ERR, pp->log, 0, "!PQsendQueryParams(\"%s\") and %s", sql, PQerrorMessageMy(ppc->conn)); return NGX_ERROR; }
+    if (!PQpipelineSync(ppc->conn)) { ngx_log_error(NGX_LOG_ERR, pp->log, 0, "!PQpipelineSync and %s", PQerrorMessageMy(ppc->conn)); return NGX_ERROR; } // own sync point, so error of one request does not abort others
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, pp->log, 0, "PQsendQueryParams(\"%s\")", sql);
+    ngx_postgres_pipeline_job_t *job = ngx_calloc(sizeof(*job), pp->log);
+    if (!job) { ngx_log_error(NGX_LOG_ERR, pp->log, 0, "!ngx_calloc"); return NGX_ERROR; }
+    ngx_queue_insert_tail(&pp->queue, &job->queue);
+    pp->n++;
+    if (PQflush(ppc->conn) == -1) { ngx_log_error(NGX_LOG_ERR, pp->log, 0, "PQflush == -1 and %s", PQerrorMessageMy(ppc->conn)); return NGX_ERROR; } // rest is flushed on write event
+    ngx_connection_t *c = ppc->connection;
+    if (!c->read->timer_set) ngx_add_timer(c->read, pp->pusc->pipeline.timeout);
+    return NGX_OK;
+}
+
+
+static void ngx_postgres_pipeline_event_handler(ngx_event_t *ev) {
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ev->log, 0, "write = %s", ev->write ? "true" : "false");
+    ngx_connection_t *c = ev->data;
+    ngx_postgres_pipeline_t *pp = c->data;
+    ngx_postgres_common_t *ppc = &pp->common;
+    if (c->close) { ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ev->log, 0, "close"); goto close; }
+    if (c->read->timedout) { ngx_log_error(NGX_LOG_ERR, ev->log, 0, "timedout"); return ngx_postgres_pipeline_close(pp, NGX_HTTP_GATEWAY_TIME_OUT); }
+    if (c->write->timedout) { ngx_log_error(NGX_LOG_ERR, ev->log, 0, "timedout"); goto close; }
+    if (ppc->state == state_connect) {
+again:
+        switch (PQconnectPoll(ppc->conn)) {
+            case PGRES_POLLING_FAILED: ngx_log_error(NGX_LOG_ERR, ev->log, 0, "PQconnectPoll == PGRES_POLLING_FAILED and %s", PQerrorMessageMy(ppc->conn)); goto close;
+            case PGRES_POLLING_OK: ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ev->log, 0, "PQconnectPoll == PGRES_POLLING_OK"); break;
+            case PGRES_POLLING_WRITING: if (PQstatus(ppc->conn) == CONNECTION_MADE) goto again; return;
+            default: return;
+        }
+        if (c->write->timer_set) ngx_del_timer(c->write);
+        if (!PQenterPipelineMode(ppc->conn)) { ngx_log_error(NGX_LOG_ERR, ev->log, 0, "!PQenterPipelineMode and %s", PQerrorMessageMy(ppc->conn)); goto close; }
+        if (ngx_postgres_pipeline_send(pp, "SET default_transaction_read_only TO on", 0, NULL, NULL, 0) != NGX_OK) goto close; // writes fail instead of running out of order
+        ppc->state = state_idle;
+        return;
+    }
+    if (ev->write) {
+        if (PQflush(ppc->conn) == -1) { ngx_log_error(NGX_LOG_ERR, ev->log, 0, "PQflush == -1 and %s", PQerrorMessageMy(ppc->conn)); goto close; }
+        return;
+    }
+    if (!PQconsumeInput(ppc->conn)) { ngx_log_error(NGX_LOG_ERR, ev->log, 0, "!PQconsumeInput and %s", PQerrorMessageMy(ppc->conn)); goto close; }
+    for (ngx_flag_t end = 0; !ngx_queue_empty(&pp->queue) && !PQisBusy(ppc->conn); ) {
+        ngx_postgres_pipeline_job_t *job = ngx_queue_data(ngx_queue_head(&pp->queue), ngx_postgres_pipeline_job_t, queue);
+        PGresult *res = PQgetResult(ppc->conn);
+        if (!res) { if (end) break; end = 1; continue; } // end of statement, its sync point follows
+        end = 0;
+        switch (PQresultStatus(res)) {
+            case PGRES_PIPELINE_SYNC: PQclear(res); ngx_postgres_pipeline_done(pp, job); if (c->read->timer_set) ngx_del_timer(c->read); continue;
+            case PGRES_COMMAND_OK:
+            case PGRES_TUPLES_OK: if (job->res) PQclear(job->res); job->res = res; continue;
+            case PGRES_FATAL_ERROR: ngx_log_error(NGX_LOG_ERR, ev->log, 0, "PQresultStatus == PGRES_FATAL_ERROR and %s", PQresultErrorMessageMy(res)); job->rc = NGX_HTTP_INTERNAL_SERVER_ERROR; break;
+            default: ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ev->log, 0, "PQresultStatus == %s", PQresStatus(PQresultStatus(res))); break;
+        }
+        PQclear(res);
+    }
+    if (pp->n && !c->read->timer_set) ngx_add_timer(c->read, pp->pusc->pipeline.timeout); // no progress
+    if (ngx_postgres_process_notify(ppc, 0) == NGX_ERROR) goto close;
+    if (PQstatus(ppc->conn) != CONNECTION_BAD) return;
+close:
+    ngx_postgres_pipeline_close(pp, 0);
+}
+
+
+static void ngx_postgres_pipeline_timeout(ngx_event_t *ev) {
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ev->log, 0, "%s", __func__);
+    ngx_postgres_pipeline_t *pp = ev->data;
+    if (ngx_postgres_pipeline_connect(pp) != NGX_OK) ngx_postgres_pipeline_close(pp, 0);
+}
+
+
+static void ngx_postgres_pipeline_cleanup(void *data) {
+    ngx_postgres_pipeline_ctx_t *ctx = data;
+    if (ctx->wait.posted) ngx_delete_posted_event(&ctx->wait);
+    if (ctx->job) ctx->job->ctx = NULL; // result is dropped when it comes
+    if (ctx->res) PQclear(ctx->res);
+}
+
+
+static void ngx_postgres_pipeline_wait_handler(ngx_event_t *ev) {
+    ngx_http_request_t *r = ev->data;
+    ngx_connection_t *c = r->connection;
+    ngx_http_set_log_request(c->log, r);
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, c->log, 0, "%s", __func__);
+    ngx_postgres_pipeline_ctx_t *ctx = ngx_http_get_module_ctx(r, ngx_postgres_module);
+    ngx_http_finalize_request(r, ctx->res ? ngx_postgres_output_result(r, ctx->res, &ctx->charset) : ctx->rc ? ctx->rc : ngx_postgres_handler(r));
+    ngx_http_run_posted_requests(c);
+}
+
+
+ngx_int_t ngx_postgres_pipeline_handler(ngx_http_request_t *r) {
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "%s", __func__);
+    ngx_postgres_pipeline_ctx_t *ctx = ngx_http_get_module_ctx(r, ngx_postgres_module);
+    if (ctx && ctx->alone) return NGX_DECLINED;
+    ngx_postgres_location_t *location = ngx_http_get_module_loc_conf(r, ngx_postgres_module);
+    ngx_postgres_upstream_srv_conf_t *pusc = ngx_http_conf_upstream_srv_conf(location->upstream.upstream, ngx_postgres_module);
+    ngx_postgres_pipeline_t *pp = pusc->pipeline.queue;
+    if (!pp || pp->common.state != state_idle || pp->n >= location->pipeline) return NGX_DECLINED; // overflow goes to pooled connections
+    ngx_postgres_query_t *query = location->queries.elts;
+    ngx_str_t sql = {query->sql.len - query->percent, NULL};
+    if (!(sql.data = ngx_pnalloc(r->pool, sql.len + 1))) { ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "!ngx_pnalloc"); return NGX_HTTP_INTERNAL_SERVER_ERROR; }
+    if (ngx_snprintf(sql.data, sql.len, (char *)query->sql.data) != sql.data + sql.len) { ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "ngx_snprintf"); return NGX_HTTP_INTERNAL_SERVER_ERROR; }
+    sql.data[sql.len] = '\0';
+    ngx_postgres_param_t *param = query->params.elts;
+    Oid *paramTypes = NULL;
+    u_char **paramValues = NULL;
+    if (query->params.nelts) {
+        if (!(paramTypes = ngx_pnalloc(r->pool, query->params.nelts * sizeof(Oid)))) { ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "!ngx_pnalloc"); return NGX_HTTP_INTERNAL_SERVER_ERROR; }
+        if (!(paramValues = ngx_pnalloc(r->pool, query->params.nelts * sizeof(char *)))) { ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "!ngx_pnalloc"); return NGX_HTTP_INTERNAL_SERVER_ERROR; }
+    }
+    for (ngx_uint_t i = 0; i < query->params.nelts; i++) {
+        paramTypes[i] = param[i].oid;
+        ngx_http_variable_value_t *value = ngx_http_get_indexed_variable(r, param[i].index);
+        if (!value || !value->data || !value->len) { paramValues[i] = NULL; continue; }
+        if (!(paramValues[i] = ngx_pnalloc(r->pool, value->len + 1))) { ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "!ngx_pnalloc"); return NGX_HTTP_INTERNAL_SERVER_ERROR; }
+        (void)ngx_cpystrn(paramValues[i], value->data, value->len + 1);
+    }
+    if (!ctx) {
+        if (!(ctx = ngx_pcalloc(r->pool, sizeof(*ctx)))) { ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "!ngx_pcalloc"); return NGX_HTTP_INTERNAL_SERVER_ERROR; }
+        ngx_pool_cleanup_t *cln = ngx_pool_cleanup_add(r->pool, 0);
+        if (!cln) { ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "!ngx_pool_cleanup_add"); return NGX_HTTP_INTERNAL_SERVER_ERROR; }
+        cln->data = ctx;
+        cln->handler = ngx_postgres_pipeline_cleanup;
+        ctx->wait.data = r;
+        ctx->wait.handler = ngx_postgres_pipeline_wait_handler;
+        ctx->wait.log = r->connection->log;
+        ngx_http_set_ctx(r, ctx, ngx_postgres_module);
+    }
+    ngx_postgres_output_t *output = &query->output;
+    if (ngx_postgres_pipeline_send(pp, (const char *)sql.data, query->params.nelts, paramTypes, (const char *const *)paramValues, output->binary && output->handler == ngx_postgres_output_value) != NGX_OK) { // other outputs need text values
+        ngx_postgres_pipeline_close(pp, 0);
+        return NGX_DECLINED;
+    }
+    ctx->job = ngx_queue_data(ngx_queue_last(&pp->queue), ngx_postgres_pipeline_job_t, queue);
+    ctx->job->ctx = ctx;
+    const char *charset = PQparameterStatus(pp->common.conn, "client_encoding");
+    if (charset) {
+        if (!ngx_strcasecmp((u_char *)charset, (u_char *)"utf8")) ngx_str_set(&ctx->charset, "utf-8");
+        else if (!ngx_strcasecmp((u_char *)charset, (u_char *)"windows1251")) ngx_str_set(&ctx->charset, "windows-1251");
+        else if (!ngx_strcasecmp((u_char *)charset, (u_char *)"koi8r")) ngx_str_set(&ctx->charset, "koi8-r");
+        else if ((ctx->charset.data = ngx_pnalloc(r->pool, ngx_strlen(charset)))) ctx->charset.len = ngx_cpymem(ctx->charset.data, charset, ngx_strlen(charset)) - ctx->charset.data;
+    }
+    r->main->count++;
+    return NGX_DONE;
+}
+
+
+static ngx_postgres_pipeline_t *ngx_postgres_pipeline(ngx_cycle_t *cycle, ngx_http_upstream_srv_conf_t *usc) {
+    ngx_postgres_upstream_srv_conf_t *pusc = ngx_http_conf_upstream_srv_conf(usc, ngx_postgres_module);
+    ngx_postgres_connect_t *connect;
+    ngx_addr_t *addr;
+    if (ngx_postgres_connect_first(usc, &connect, &addr) != NGX_OK) { ngx_log_error(NGX_LOG_ERR, cycle->log, 0, "ngx_postgres_connect_first != NGX_OK"); return NULL; }
+    ngx_postgres_pipeline_t *pp = ngx_pcalloc(cycle->pool, sizeof(*pp));
+    if (!pp) { ngx_log_error(NGX_LOG_ERR, cycle->log, 0, "!ngx_pcalloc"); return NULL; }
+    pp->log = pusc->ps.log ? pusc->ps.log : cycle->log;
+    pp->connect = connect;
+    pp->pusc = pusc;
+    ngx_queue_init(&pp->queue);
+    ngx_postgres_common_t *ppc = &pp->common;
+    if (!(ppc->addr.sockaddr = ngx_pcalloc(cycle->pool, addr->socklen))) { ngx_log_error(NGX_LOG_ERR, pp->log, 0, "!ngx_pcalloc"); return NULL; }
+    ngx_memcpy(ppc->addr.sockaddr, addr->sockaddr, addr->socklen);
+    ppc->addr.socklen = addr->socklen;
+    pp->timeout.cancelable = 1;
+    pp->timeout.data = pp;
+    pp->timeout.handler = ngx_postgres_pipeline_timeout;
+    pp->timeout.log = pp->log;
+    pusc->pipeline.queue = pp;
+    return pp;
+}
+#else
+ngx_int_t ngx_postgres_pipeline_handler(ngx_http_request_t *r) {
+    return NGX_DECLINED;
+}
+#endif
+
+
+ngx_int_t ngx_postgres_pipeline_init_process(ngx_cycle_t *cycle) {
+#ifdef LIBPQ_HAS_PIPELINING
+    if (ngx_process != NGX_PROCESS_WORKER && ngx_process != NGX_PROCESS_SINGLE) return NGX_OK;
+    ngx_http_upstream_main_conf_t *umcf = ngx_http_cycle_get_module_main_conf(cycle, ngx_http_upstream_module);
+    if (!umcf) return NGX_OK;
+    ngx_http_upstream_srv_conf_t **usc = umcf->upstreams.elts;
+    for (ngx_uint_t i = 0; i < umcf->upstreams.nelts; i++) {
+        if (!usc[i]->srv_conf || !usc[i]->srv_conf[ngx_postgres_module.ctx_index]) continue;
+        ngx_postgres_upstream_srv_conf_t *pusc = ngx_http_conf_upstream_srv_conf(usc[i], ngx_postgres_module);
+        if (!pusc->pipeline.timeout) continue;
+        ngx_postgres_pipeline_t *pp = ngx_postgres_pipeline(cycle, usc[i]);
+        if (!pp) { ngx_log_error(NGX_LOG_ERR, cycle->log, 0, "!ngx_postgres_pipeline"); continue; }
+        if (ngx_postgres_pipeline_connect(pp) != NGX_OK) ngx_postgres_pipeline_close(pp, 0);
+    }
+#endif
+    return NGX_OK;
+}
+
+
+char *ngx_postgres_pipeline_conf(ngx_conf_t *cf, ngx_command_t *cmd, void *conf) {
+    ngx_postgres_location_t *location = conf;
+    if (location->pipeline != NGX_CONF_UNSET_UINT) return "duplicate";
+    ngx_str_t *elts = cf->args->elts;
+    static const ngx_conf_enum_t e[] = {
+        { ngx_string("off"), 0 },
+        { ngx_string("no"), 0 },
+        { ngx_string("false"), 0 },
+        { ngx_string("on"), 1 },
+        { ngx_string("yes"), 1 },
+        { ngx_string("true"), 1 },
+        { ngx_null_string, 0 }
+    };
+    ngx_uint_t i;
+    for (i = 0; e[i].name.len; i++) if (e[i].name.len == elts[1].len && !ngx_strncasecmp(e[i].name.data, elts[1].data, elts[1].len)) break;
+    if (!e[i].name.len) { ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "\"%V\" directive error: value \"%V\" must be \"off\", \"no\", \"false\", \"on\", \"yes\" or \"true\"", &cmd->name, &elts[1]); return NGX_CONF_ERROR; }
+#ifndef LIBPQ_HAS_PIPELINING
+    if (e[i].value) { ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "\"%V\" directive error: libpq is built without pipeline mode", &cmd->name); return NGX_CONF_ERROR; }
+#endif
+    location->pipeline = e[i].value ? 64 : 0;
+    for (ngx_uint_t i = 2; i < cf->args->nelts; i++) {
+        if (elts[i].len > sizeof("depth=") - 1 && !ngx_strncasecmp(elts[i].data, (u_char *)"depth=", sizeof("depth=") - 1)) {
+            elts[i].len = elts[i].len - (sizeof("depth=") - 1);
+            elts[i].data = &elts[i].data[sizeof("depth=") - 1];
+            ngx_int_t n = ngx_atoi(elts[i].data, elts[i].len);
+            if (n == NGX_ERROR) { ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "\"%V\" directive error: \"depth\" value \"%V\" must be number", &cmd->name, &elts[i]); return NGX_CONF_ERROR; }
+            if (n <= 0) { ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "\"%V\" directive error: \"depth\" value \"%V\" must be positive", &cmd->name, &elts[i]); return NGX_CONF_ERROR; }
+            if (location->pipeline) location->pipeline = (ngx_uint_t)n;
+            continue;
+        }
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "\"%V\" directive error: invalid additional parameter \"%V\"", &cmd->name, &elts[i]);
+        return NGX_CONF_ERROR;
+    }
+    return NGX_CONF_OK;
+}
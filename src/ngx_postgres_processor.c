@@ -15,7 +15,7 @@ static ngx_int_t ngx_postgres_done(ngx_postgres_data_t *pd, ngx_int_t rc) {
         if (c->read->timer_set) ngx_del_timer(c->read);
         if (c->write->timer_set) ngx_del_timer(c->write);
     }
-    if (rc == NGX_OK) rc = ngx_postgres_output_chain(pd);
+    if (rc == NGX_OK) rc = location->parallel ? ngx_postgres_parallel_done(pd) : ngx_postgres_output_chain(pd); // part of parallel leaves output to main request
     ngx_http_upstream_finalize_request(r, u, rc);
     return NGX_DONE;
 }
@@ -26,6 +26,83 @@ typedef struct {
     ngx_uint_t hash;
 } ngx_postgres_prepare_t;
 
+enum {
+    cursor_begin = 1,
+    cursor_declare,
+    cursor_fetch,
+    cursor_close
+};
+
+enum {
+    transaction_begin = 1,
+    transaction_open,
+    transaction_end
+};
+
+
+static ngx_int_t ngx_postgres_send(ngx_postgres_data_t *pd, ngx_str_t *sql, ngx_flag_t params, ngx_flag_t binary) {
+    ngx_http_request_t *r = pd->request;
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "%s", __func__);
+    ngx_postgres_common_t *pdc = &pd->common;
+    if ((params && pd->query.nParams) || binary) { // simple query protocol always returns text
+        int nParams = params ? pd->query.nParams : 0;
+        if (!PQsendQueryParams(pdc->conn, (const char *)sql->data, nParams, nParams ? pd->query.paramTypes : NULL, nParams ? (const char *const *)pd->query.paramValues : NULL, NULL, NULL, binary)) { ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "!PQsendQueryParams(\"%V\") and %s", sql, PQerrorMessageMy(pdc->conn)); return NGX_ERROR; }
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "PQsendQueryParams(\"%V\")", sql);
+    } else {
+        if (!PQsendQuery(pdc->conn, (const char *)sql->data)) { ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "!PQsendQuery(\"%V\") and %s", sql, PQerrorMessageMy(pdc->conn)); return NGX_ERROR; }
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "PQsendQuery(\"%V\")", sql);
+    }
+    ngx_postgres_location_t *location = ngx_http_get_module_loc_conf(r, ngx_postgres_module);
+    ngx_postgres_query_t *elts = location->queries.elts;
+    ngx_postgres_query_t *query = &elts[pd->query.index];
+    ngx_connection_t *c = pdc->connection;
+    if (location->timeout) {
+        if (!c->read->timer_set) ngx_add_timer(c->read, location->timeout);
+        if (!c->write->timer_set) ngx_add_timer(c->write, location->timeout);
+    } else if (query->timeout) {
+        ngx_add_timer(c->read, query->timeout);
+        ngx_add_timer(c->write, query->timeout);
+    }
+    pdc->state = state_result;
+    return NGX_DONE;
+}
+
+
+static ngx_int_t ngx_postgres_cursor_send(ngx_postgres_data_t *pd, ngx_str_t *sql, ngx_uint_t state) {
+    ngx_postgres_location_t *location = ngx_http_get_module_loc_conf(pd->request, ngx_postgres_module);
+    ngx_postgres_query_t *elts = location->queries.elts;
+    pd->cursor.state = state;
+    return ngx_postgres_send(pd, sql, state == cursor_declare, state == cursor_fetch && elts[pd->query.index].output.binary); // rows of cursor come with FETCH
+}
+
+
+static ngx_int_t ngx_postgres_transaction_end(ngx_postgres_data_t *pd, ngx_int_t rc) {
+    ngx_http_request_t *r = pd->request;
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "%s", __func__);
+    ngx_postgres_common_t *pdc = &pd->common;
+    ngx_str_t sql = ngx_string("COMMIT");
+    if (rc != NGX_DONE || PQtransactionStatus(pdc->conn) != PQTRANS_INTRANS) ngx_str_set(&sql, "ROLLBACK");
+    pd->transaction.rc = rc == NGX_DONE ? NGX_OK : rc; // response after end of transaction
+    pd->transaction.state = transaction_end;
+    return ngx_postgres_send(pd, &sql, 0, 0);
+}
+
+
+static ngx_int_t ngx_postgres_cursor_open(ngx_postgres_data_t *pd) {
+    ngx_http_request_t *r = pd->request;
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "%s", __func__);
+    ngx_postgres_common_t *pdc = &pd->common;
+    if (PQtransactionStatus(pdc->conn) == PQTRANS_IDLE) { // cursor lives until end of transaction
+        ngx_str_t sql = ngx_string("BEGIN");
+        pd->cursor.commit = 1;
+        return ngx_postgres_cursor_send(pd, &sql, cursor_begin);
+    }
+    ngx_str_t sql = {sizeof("DECLARE ngx_postgres NO SCROLL CURSOR FOR ") - 1 + pd->query.sql.len, NULL};
+    if (!(sql.data = ngx_pnalloc(r->pool, sql.len + 1))) { ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "!ngx_pnalloc"); return NGX_ERROR; }
+    *ngx_snprintf(sql.data, sql.len, "DECLARE ngx_postgres NO SCROLL CURSOR FOR %V", &pd->query.sql) = '\0';
+    return ngx_postgres_cursor_send(pd, &sql, cursor_declare);
+}
+
 
 static ngx_int_t ngx_postgres_query(ngx_postgres_data_t *pd) {
     ngx_http_request_t *r = pd->request;
@@ -66,10 +143,10 @@ static ngx_int_t ngx_postgres_query(ngx_postgres_data_t *pd) {
                     ids[i] = id;
                     if (!i && query->listen && ngx_http_push_stream_add_msg_to_channel_my && ngx_http_push_stream_delete_channel_my) {
                         channel.len = value->len;
-                        if (!(channel.data = ngx_pnalloc(c->pool, channel.len))) { ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "!ngx_pnalloc"); return NGX_ERROR; }
+                        if (!(channel.data = ngx_pnalloc(r->pool, channel.len))) { ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "!ngx_pnalloc"); return NGX_ERROR; }
                         ngx_memcpy(channel.data, value->data, value->len);
                         command.len = sizeof("UNLISTEN ") - 1 + id.len;
-                        if (!(command.data = ngx_pnalloc(c->pool, command.len))) { ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "!ngx_pnalloc"); return NGX_ERROR; }
+                        if (!(command.data = ngx_pnalloc(r->pool, command.len))) { ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "!ngx_pnalloc"); return NGX_ERROR; }
                         command.len = ngx_snprintf(command.data, command.len, "UNLISTEN %V", &id) - command.data;
                     }
                 }
@@ -89,28 +166,20 @@ static ngx_int_t ngx_postgres_query(ngx_postgres_data_t *pd) {
         *last = '\0';
     //    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "sql = `%V`", &sql);
         pd->query.sql = sql; /* set $postgres_query */
-        if (pusc->ps.max) {
-            if (query->listen && channel.data && command.data) {
-                if (!pdc->listen.queue) {
-                    if (!(pdc->listen.queue = ngx_pcalloc(c->pool, sizeof(ngx_queue_t)))) { ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "!ngx_pcalloc"); return NGX_ERROR; }
-                    ngx_queue_init(pdc->listen.queue);
-                }
-                for (ngx_queue_t *queue = ngx_queue_head(pdc->listen.queue); queue != ngx_queue_sentinel(pdc->listen.queue); queue = ngx_queue_next(queue)) {
-                    ngx_postgres_listen_t *listen = ngx_queue_data(queue, ngx_postgres_listen_t, queue);
-                    if (listen->channel.len == channel.len && !ngx_strncmp(listen->channel.data, channel.data, channel.len)) goto cont;
-                }
-                ngx_postgres_listen_t *listen = ngx_pcalloc(c->pool, sizeof(*listen));
-                if (!listen) { ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "!ngx_pcalloc"); return NGX_ERROR; }
-                listen->channel = channel;
-                listen->command = command;
-                ngx_queue_insert_tail(pdc->listen.queue, &listen->queue);
-                cont:;
-            } else if (prepare) {
-                if (!(pd->query.stmtName.data = ngx_pnalloc(r->pool, 31 + 1))) { ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "ngx_pnalloc"); return NGX_ERROR; }
-                u_char *last = ngx_snprintf(pd->query.stmtName.data, 31, "ngx_%ul", (unsigned long)(pd->query.hash = ngx_hash_key(sql.data, sql.len)));
-                *last = '\0';
-                pd->query.stmtName.len = last - pd->query.stmtName.data;
+        if (query->listen && channel.data && command.data) { // LISTEN is owned by per-worker listener connection
+            if (ngx_postgres_listen_add(pd, &channel, &command) != NGX_OK) { ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "ngx_postgres_listen_add != NGX_OK"); return NGX_ERROR; }
+            pdc->state = state_idle;
+            if (!location->parallel && pd->query.index < location->queries.nelts - 1) {
+                pd->query.index++;
+                return ngx_postgres_query(pd);
             }
+            return ngx_postgres_done(pd, NGX_OK);
+        }
+        if (pusc->ps.max && prepare) {
+            if (!(pd->query.stmtName.data = ngx_pnalloc(r->pool, 31 + 1))) { ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "ngx_pnalloc"); return NGX_ERROR; }
+            u_char *last = ngx_snprintf(pd->query.stmtName.data, 31, "ngx_%ul", (unsigned long)(pd->query.hash = ngx_hash_key(sql.data, sql.len)));
+            *last = '\0';
+            pd->query.stmtName.len = last - pd->query.stmtName.data;
         }
         pdc->state = prepare ? state_prepare : state_query;
     }
@@ -134,9 +203,14 @@ static ngx_int_t ngx_postgres_query(ngx_postgres_data_t *pd) {
     }
     ngx_int_t rc = ngx_postgres_process_notify(pdc, 0);
     if (rc != NGX_OK) return rc;
+    if (location->transaction.len && !pd->transaction.state) { // statements of location run inside one transaction
+        pd->transaction.state = transaction_begin;
+        return ngx_postgres_send(pd, &location->transaction, 0, 0);
+    }
+    if (location->cursor && pd->cursor.state <= cursor_begin) return ngx_postgres_cursor_open(pd);
     ngx_uint_t hash = 0;
     if (!prepare) {
-        if (pd->query.nParams) {
+        if (pd->query.nParams || query->output.binary) { // simple query protocol always returns text
             if (!PQsendQueryParams(pdc->conn, (const char *)pd->query.sql.data, pd->query.nParams, pd->query.paramTypes, (const char *const *)pd->query.paramValues, NULL, NULL, query->output.binary)) { ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "!PQsendQueryParams(\"%V\") and %s", &pd->query.sql, PQerrorMessageMy(pdc->conn)); return NGX_ERROR; }
             ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "PQsendQueryParams(\"%V\")", &pd->query.sql);
         } else {
@@ -188,7 +262,7 @@ static ngx_int_t ngx_postgres_query(ngx_postgres_data_t *pd) {
         default: ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "pdc->state == %i", pdc->state); return NGX_ERROR;
     }
     ngx_postgres_output_t *output = &query->output;
-    if (output->handler == ngx_postgres_output_text || output->handler == ngx_postgres_output_csv) if (output->single && !PQsetSingleRowMode(pdc->conn)) ngx_log_error(NGX_LOG_WARN, r->connection->log, 0, "!PQsetSingleRowMode and %s", PQerrorMessageMy(pdc->conn));
+    if (output->handler == ngx_postgres_output_text || output->handler == ngx_postgres_output_csv) if (output->single && !location->batch.max && !PQsetSingleRowMode(pdc->conn)) ngx_log_error(NGX_LOG_WARN, r->connection->log, 0, "!PQsetSingleRowMode and %s", PQerrorMessageMy(pdc->conn));
     if (location->timeout) {
         if (!c->read->timer_set) ngx_add_timer(c->read, location->timeout);
         if (!c->write->timer_set) ngx_add_timer(c->write, location->timeout);
@@ -251,10 +325,95 @@ again:
 }
 
 
+static ngx_int_t ngx_postgres_cursor_close(ngx_postgres_data_t *pd) {
+    ngx_str_t sql = ngx_string("CLOSE ngx_postgres");
+    if (pd->cursor.commit) ngx_str_set(&sql, "CLOSE ngx_postgres; COMMIT"); // transaction was begun for cursor
+    pd->cursor.commit = 0;
+    return ngx_postgres_cursor_send(pd, &sql, cursor_close);
+}
+
+
+static ngx_int_t ngx_postgres_transaction_result(ngx_postgres_data_t *pd) {
+    ngx_http_request_t *r = pd->request;
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "%s", __func__);
+    ngx_postgres_common_t *pdc = &pd->common;
+    ngx_int_t rc = NGX_OK;
+    for (; (pd->result.res = PQgetResult(pdc->conn)); PQclear(pd->result.res)) {
+        if (PQresultStatus(pd->result.res) == PGRES_FATAL_ERROR) {
+            ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "PQresultStatus == PGRES_FATAL_ERROR and %s", PQresultErrorMessageMy(pd->result.res));
+            ngx_postgres_variable_error(pd);
+            rc = NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
+        if (!PQconsumeInput(pdc->conn)) { ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "!PQconsumeInput and %s", PQerrorMessageMy(pdc->conn)); PQclear(pd->result.res); return NGX_ERROR; }
+        if (PQisBusy(pdc->conn)) { ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "PQisBusy"); PQclear(pd->result.res); return NGX_AGAIN; }
+    }
+    ngx_int_t rc2 = ngx_postgres_process_notify(pdc, 0);
+    if (rc2 != NGX_OK) return rc2;
+    pdc->state = state_idle;
+    if (pd->transaction.state == transaction_end) return ngx_postgres_done(pd, rc == NGX_OK ? pd->transaction.rc : rc);
+    if (rc != NGX_OK) return ngx_postgres_done(pd, rc); // BEGIN failed, nothing to end
+    pd->transaction.state = transaction_open;
+    return ngx_postgres_query(pd);
+}
+
+
+static void ngx_postgres_cursor_writer(ngx_http_request_t *r);
+
+
+static ngx_int_t ngx_postgres_cursor_next(ngx_postgres_data_t *pd) {
+    ngx_http_request_t *r = pd->request;
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "%s", __func__);
+    ngx_postgres_common_t *pdc = &pd->common;
+    ngx_postgres_location_t *location = ngx_http_get_module_loc_conf(r, ngx_postgres_module);
+    switch (pd->cursor.state) {
+        case cursor_begin: pdc->state = state_idle; return ngx_postgres_query(pd);
+        case cursor_declare: break;
+        case cursor_fetch:
+            if (pd->result.ntuples == (ngx_uint_t)location->cursor) { // more rows may follow
+                switch (ngx_postgres_output_flush(pd)) {
+                    case NGX_ERROR: ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "ngx_postgres_output_flush == NGX_ERROR"); return NGX_ERROR;
+                    case NGX_AGAIN: // fetch after client takes sent rows
+                        pd->cursor.handler = r->write_event_handler;
+                        pd->cursor.wait = 1;
+                        r->write_event_handler = ngx_postgres_cursor_writer;
+                        pdc->state = state_idle;
+                        return NGX_DONE;
+                    default: break;
+                }
+                if (!r->header_only) break;
+            }
+            return ngx_postgres_cursor_close(pd);
+        default: pd->cursor.state = 0; return NGX_DECLINED; // closed
+    }
+    u_char buf[sizeof("FETCH FORWARD  FROM ngx_postgres") + NGX_INT_T_LEN];
+    ngx_str_t sql = {0, buf};
+    sql.len = ngx_snprintf(buf, sizeof(buf) - 1, "FETCH FORWARD %i FROM ngx_postgres", location->cursor) - buf;
+    buf[sql.len] = '\0';
+    return ngx_postgres_cursor_send(pd, &sql, cursor_fetch);
+}
+
+
+static void ngx_postgres_cursor_writer(ngx_http_request_t *r) {
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "%s", __func__);
+    ngx_connection_t *c = r->connection;
+    ngx_http_upstream_t *u = r->upstream;
+    ngx_postgres_data_t *pd = u->peer.data;
+    if (c->write->timedout) { c->timedout = 1; ngx_log_error(NGX_LOG_INFO, c->log, NGX_ETIMEDOUT, "client timed out"); return ngx_http_upstream_finalize_request(r, u, NGX_HTTP_REQUEST_TIME_OUT); }
+    r->write_event_handler = pd->cursor.handler;
+    pd->cursor.wait = 0;
+    ngx_int_t rc = ngx_postgres_cursor_next(pd);
+    if (rc >= NGX_HTTP_SPECIAL_RESPONSE) return ngx_http_upstream_finalize_request(r, u, rc);
+    if (rc == NGX_ERROR) return ngx_http_upstream_finalize_request(r, u, NGX_ERROR);
+}
+
+
 static ngx_int_t ngx_postgres_result(ngx_postgres_data_t *pd) {
     ngx_http_request_t *r = pd->request;
     ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "%s", __func__);
     ngx_postgres_common_t *pdc = &pd->common;
+#if (NGX_THREADS)
+    if (pd->out.thread) { ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "thread"); return NGX_AGAIN; }
+#endif
     if (!PQconsumeInput(pdc->conn)) { ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "!PQconsumeInput and %s", PQerrorMessageMy(pdc->conn)); return NGX_ERROR; }
     if (PQisBusy(pdc->conn)) { ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "PQisBusy"); return NGX_AGAIN; }
     ngx_postgres_location_t *location = ngx_http_get_module_loc_conf(r, ngx_postgres_module);
@@ -265,7 +424,9 @@ static ngx_int_t ngx_postgres_result(ngx_postgres_data_t *pd) {
         if (c->read->timer_set) ngx_del_timer(c->read);
         if (c->write->timer_set) ngx_del_timer(c->write);
     }
+    if (pd->transaction.state == transaction_begin || pd->transaction.state == transaction_end) return ngx_postgres_transaction_result(pd);
     ngx_int_t rc = NGX_DONE;
+    ngx_flag_t fatal = 0; // statement did not run
     const char *value;
     ngx_postgres_output_t *output = &query->output;
     for (; (pd->result.res = PQgetResult(pdc->conn)); PQclear(pd->result.res)) {
@@ -273,11 +434,18 @@ static ngx_int_t ngx_postgres_result(ngx_postgres_data_t *pd) {
             case PGRES_FATAL_ERROR:
                 ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "PQresultStatus == PGRES_FATAL_ERROR and %s", PQresultErrorMessageMy(pd->result.res));
                 ngx_postgres_variable_error(pd);
+                fatal = 1;
                 rc = NGX_HTTP_INTERNAL_SERVER_ERROR;
                 break;
             case PGRES_COMMAND_OK:
             case PGRES_TUPLES_OK:
-                if (ngx_postgres_variable_set(pd) != NGX_OK) {
+                if (output->binary && output->handler != ngx_postgres_output_value && ngx_postgres_result_text(pd) != NGX_OK) {
+                    ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "ngx_postgres_result_text != NGX_OK");
+                    rc = NGX_HTTP_INTERNAL_SERVER_ERROR;
+                } else if (location->batch.max && ngx_postgres_batch_split(pd) != NGX_OK) {
+                    ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "ngx_postgres_batch_split != NGX_OK");
+                    rc = NGX_HTTP_INTERNAL_SERVER_ERROR;
+                } else if (ngx_postgres_variable_set(pd) != NGX_OK) {
                     ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "ngx_postgres_variable_set != NGX_OK");
                     rc = NGX_HTTP_INTERNAL_SERVER_ERROR;
                 } else if (output->handler && ngx_postgres_variable_output(pd) != NGX_OK) {
@@ -285,8 +453,21 @@ static ngx_int_t ngx_postgres_result(ngx_postgres_data_t *pd) {
                     rc = NGX_HTTP_INTERNAL_SERVER_ERROR;
                 } // fall through
             case PGRES_SINGLE_TUPLE:
-                if (PQresultStatus(pd->result.res) == PGRES_SINGLE_TUPLE) pd->result.nsingle++;
-                if (rc == NGX_DONE && output->handler) rc = output->handler(pd); // fall through
+                if (PQresultStatus(pd->result.res) == PGRES_SINGLE_TUPLE) {
+                    pd->result.nsingle++;
+                    if (output->binary && ngx_postgres_result_text(pd) != NGX_OK) {
+                        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "ngx_postgres_result_text != NGX_OK");
+                        rc = NGX_HTTP_INTERNAL_SERVER_ERROR;
+                    }
+                }
+                if (rc == NGX_DONE && output->handler) {
+#if (NGX_THREADS)
+                    if ((rc = ngx_postgres_output_thread(pd)) == NGX_AGAIN) return NGX_AGAIN; // result is owned by thread task now
+                    if (rc == NGX_DECLINED) rc = output->handler(pd);
+#else
+                    rc = output->handler(pd);
+#endif
+                } // fall through
             default:
                 if ((value = PQcmdStatus(pd->result.res)) && ngx_strlen(value)) { ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "%s and %s", PQresStatus(PQresultStatus(pd->result.res)), value); }
                 else { ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, PQresStatus(PQresultStatus(pd->result.res))); }
@@ -297,21 +478,22 @@ static ngx_int_t ngx_postgres_result(ngx_postgres_data_t *pd) {
     }
     ngx_int_t rc2 = ngx_postgres_process_notify(pdc, 0);
     if (rc2 != NGX_OK) return rc2;
-    if (rc == NGX_DONE && pd->query.index < location->queries.nelts - 1) {
+    if (rc == NGX_DONE && pd->cursor.state && (rc2 = ngx_postgres_cursor_next(pd)) != NGX_DECLINED) return rc2;
+    if (rc == NGX_HTTP_INTERNAL_SERVER_ERROR && fatal && location->batch.max && (rc2 = ngx_postgres_batch_retry(pd)) != NGX_DECLINED) { // run own values alone
+        if (rc2 != NGX_OK) return rc2;
         pdc->state = state_idle;
-        pd->query.index++;
         return NGX_AGAIN;
     }
-    if (PQtransactionStatus(pdc->conn) != PQTRANS_IDLE) {
-        ngx_log_error(NGX_LOG_WARN, r->connection->log, 0, "PQtransactionStatus != PQTRANS_IDLE");
-        ngx_postgres_query_t *query = location->query = ngx_array_push(&location->queries);
-        if (!query) { ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "!ngx_array_push"); return NGX_ERROR; }
-        ngx_memzero(query, sizeof(*query));
-        ngx_str_set(&query->sql, "COMMIT");
+    if (rc == NGX_DONE && !location->parallel && pd->query.index < location->queries.nelts - 1) { // part of parallel runs only its own query
         pdc->state = state_idle;
         pd->query.index++;
+        if (pdc->pusc->ps.transaction && PQtransactionStatus(pdc->conn) == PQTRANS_IDLE) return ngx_postgres_peer_yield(pd); // next statement may run on other connection
         return NGX_AGAIN;
     }
+    if (PQtransactionStatus(pdc->conn) != PQTRANS_IDLE && (rc == NGX_DONE || rc >= NGX_HTTP_SPECIAL_RESPONSE)) {
+        if (!pd->transaction.state) ngx_log_error(NGX_LOG_WARN, r->connection->log, 0, "PQtransactionStatus != PQTRANS_IDLE"); // left open by queries
+        return ngx_postgres_transaction_end(pd, rc);
+    }
     return rc == NGX_DONE ? ngx_postgres_done(pd, NGX_OK) : rc;
 }
 
@@ -322,6 +504,7 @@ void ngx_postgres_process_events(ngx_postgres_data_t *pd) {
     ngx_http_upstream_t *u = r->upstream;
     ngx_postgres_common_t *pdc = &pd->common;
     ngx_postgres_handler_pt handler;
+    if (pd->cursor.wait) { ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "cursor.wait"); return; }
     switch (pdc->state) {
         case state_connect: ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "state == state_connect"); handler = ngx_postgres_connect; break;
         case state_idle: ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "state == state_idle"); handler = ngx_postgres_query; break;
@@ -331,6 +514,71 @@ void ngx_postgres_process_events(ngx_postgres_data_t *pd) {
     }
     ngx_int_t rc = handler(pd);
     if (rc >= NGX_HTTP_SPECIAL_RESPONSE) return ngx_http_upstream_finalize_request(r, u, rc);
+    if (rc == NGX_ERROR && pd->transaction.state == transaction_end) return ngx_http_upstream_finalize_request(r, u, NGX_HTTP_BAD_GATEWAY); // COMMIT may be done, so statements never run again
     if (rc == NGX_ERROR) return ngx_http_upstream_next(r, u, NGX_HTTP_UPSTREAM_FT_ERROR);
     return;
 }
+
+
+char *ngx_postgres_transaction_conf(ngx_conf_t *cf, ngx_command_t *cmd, void *conf) {
+    ngx_postgres_location_t *location = conf;
+    if (location->transaction.data) return "duplicate";
+    ngx_str_t *elts = cf->args->elts;
+    static const ngx_conf_enum_t e[] = {
+        { ngx_string("off"), 0 },
+        { ngx_string("no"), 0 },
+        { ngx_string("false"), 0 },
+        { ngx_string("on"), 1 },
+        { ngx_string("yes"), 1 },
+        { ngx_string("true"), 1 },
+        { ngx_null_string, 0 }
+    };
+    static const ngx_conf_enum_t l[] = {
+        { ngx_string("read_committed"), 1 },
+        { ngx_string("repeatable_read"), 2 },
+        { ngx_string("serializable"), 3 },
+        { ngx_null_string, 0 }
+    };
+    static const ngx_str_t level[] = { ngx_null_string, ngx_string(" ISOLATION LEVEL READ COMMITTED"), ngx_string(" ISOLATION LEVEL REPEATABLE READ"), ngx_string(" ISOLATION LEVEL SERIALIZABLE") };
+    ngx_uint_t i;
+    for (i = 0; e[i].name.len; i++) if (e[i].name.len == elts[1].len && !ngx_strncasecmp(e[i].name.data, elts[1].data, elts[1].len)) break;
+    if (!e[i].name.len) { ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "\"%V\" directive error: value \"%V\" must be \"off\", \"no\", \"false\", \"on\", \"yes\" or \"true\"", &cmd->name, &elts[1]); return NGX_CONF_ERROR; }
+    ngx_flag_t enable = e[i].value;
+    ngx_flag_t deferrable = 0;
+    ngx_flag_t read_only = 0;
+    ngx_uint_t isolation = 0;
+    ngx_uint_t j;
+    for (ngx_uint_t i = 2; i < cf->args->nelts; i++) {
+        if (elts[i].len > sizeof("isolation=") - 1 && !ngx_strncasecmp(elts[i].data, (u_char *)"isolation=", sizeof("isolation=") - 1)) {
+            elts[i].len = elts[i].len - (sizeof("isolation=") - 1);
+            elts[i].data = &elts[i].data[sizeof("isolation=") - 1];
+            for (j = 0; l[j].name.len; j++) if (l[j].name.len == elts[i].len && !ngx_strncasecmp(l[j].name.data, elts[i].data, elts[i].len)) { isolation = l[j].value; break; }
+            if (!l[j].name.len) { ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "\"%V\" directive error: \"isolation\" value \"%V\" must be \"read_committed\", \"repeatable_read\" or \"serializable\"", &cmd->name, &elts[i]); return NGX_CONF_ERROR; }
+            continue;
+        }
+        if (elts[i].len > sizeof("read_only=") - 1 && !ngx_strncasecmp(elts[i].data, (u_char *)"read_only=", sizeof("read_only=") - 1)) {
+            elts[i].len = elts[i].len - (sizeof("read_only=") - 1);
+            elts[i].data = &elts[i].data[sizeof("read_only=") - 1];
+            for (j = 0; e[j].name.len; j++) if (e[j].name.len == elts[i].len && !ngx_strncasecmp(e[j].name.data, elts[i].data, elts[i].len)) { read_only = e[j].value; break; }
+            if (!e[j].name.len) { ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "\"%V\" directive error: \"read_only\" value \"%V\" must be \"off\", \"no\", \"false\", \"on\", \"yes\" or \"true\"", &cmd->name, &elts[i]); return NGX_CONF_ERROR; }
+            continue;
+        }
+        if (elts[i].len > sizeof("deferrable=") - 1 && !ngx_strncasecmp(elts[i].data, (u_char *)"deferrable=", sizeof("deferrable=") - 1)) {
+            elts[i].len = elts[i].len - (sizeof("deferrable=") - 1);
+            elts[i].data = &elts[i].data[sizeof("deferrable=") - 1];
+            for (j = 0; e[j].name.len; j++) if (e[j].name.len == elts[i].len && !ngx_strncasecmp(e[j].name.data, elts[i].data, elts[i].len)) { deferrable = e[j].value; break; }
+            if (!e[j].name.len) { ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "\"%V\" directive error: \"deferrable\" value \"%V\" must be \"off\", \"no\", \"false\", \"on\", \"yes\" or \"true\"", &cmd->name, &elts[i]); return NGX_CONF_ERROR; }
+            continue;
+        }
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "\"%V\" directive error: invalid additional parameter \"%V\"", &cmd->name, &elts[i]);
+        return NGX_CONF_ERROR;
+    }
+    if (!enable) { ngx_str_set(&location->transaction, ""); return NGX_CONF_OK; } // set, but off
+    if (deferrable && (!read_only || isolation != 3)) return "\"deferrable\" requires \"read_only=on\" and \"isolation=serializable\""; // ignored by database otherwise
+    size_t len = sizeof("BEGIN READ ONLY DEFERRABLE") - 1 + level[isolation].len;
+    if (!(location->transaction.data = ngx_pnalloc(cf->pool, len + 1))) { ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "\"%V\" directive error: !ngx_pnalloc", &cmd->name); return NGX_CONF_ERROR; }
+    u_char *last = ngx_snprintf(location->transaction.data, len, "BEGIN%V%s%s", &level[isolation], read_only ? " READ ONLY" : "", deferrable ? " DEFERRABLE" : "");
+    *last = '\0';
+    location->transaction.len = last - location->transaction.data;
+    return NGX_CONF_OK;
+}
@@ -0,0 +1,403 @@
+#include "ngx_postgres_include.h"
+
+
+typedef struct {
+    ngx_array_t columns;
+    ngx_str_t channel;
+    ngx_str_t schema;
+    ngx_str_t table;
+    uint32_t relid;
+} ngx_postgres_relation_t;
+
+typedef struct {
+    ngx_array_t relations;
+    ngx_event_t status;
+    ngx_event_t timeout;
+    ngx_log_t *log;
+    ngx_pool_t *pool;
+    ngx_pool_t *temp;
+    ngx_postgres_common_t common;
+    ngx_postgres_connect_t *connect;
+    ngx_postgres_upstream_srv_conf_t *pusc;
+    const char **keywords;
+    const char **values;
+    ngx_msec_t receive; // wal_sender_timeout
+    ngx_str_t sql;
+    uint64_t lsn;
+} ngx_postgres_replication_t;
+
+
+static const char *ngx_postgres_replication_setting = "SELECT setting FROM pg_settings WHERE name = 'wal_sender_timeout'";
+
+
+static u_char *ngx_postgres_replication_uint(u_char *p, u_char *last, size_t size, uint64_t *value) {
+    if ((size_t)(last - p) < size) return NULL;
+    for (*value = 0; size--; p++) *value = *value << 8 | *p;
+    return p;
+}
+
+
+static u_char *ngx_postgres_replication_put(u_char *p, uint64_t value) {
+    for (ngx_uint_t i = 8; i--; value >>= 8) p[i] = value & 0xff;
+    return p + 8;
+}
+
+
+static u_char *ngx_postgres_replication_string(u_char *p, u_char *last, ngx_str_t *value) {
+    u_char *end = ngx_strlchr(p, last, '\0');
+    if (!end) return NULL;
+    value->data = p;
+    value->len = end - p;
+    return end + 1;
+}
+
+
+static ngx_postgres_relation_t *ngx_postgres_replication_relation(ngx_postgres_replication_t *pr, uint32_t relid) {
+    ngx_postgres_relation_t *relation = pr->relations.elts;
+    for (ngx_uint_t i = 0; i < pr->relations.nelts; i++) if (relation[i].relid == relid) return &relation[i];
+    return NULL;
+}
+
+
+static u_char *ngx_postgres_replication_relation_message(ngx_postgres_replication_t *pr, u_char *p, u_char *last) {
+    uint64_t relid, ncols, skip;
+    ngx_str_t schema, table;
+    if (!(p = ngx_postgres_replication_uint(p, last, 4, &relid))) return NULL;
+    if (!(p = ngx_postgres_replication_string(p, last, &schema))) return NULL;
+    if (!(p = ngx_postgres_replication_string(p, last, &table))) return NULL;
+    if (!(p = ngx_postgres_replication_uint(p, last, 1, &skip))) return NULL; // replica identity
+    if (!(p = ngx_postgres_replication_uint(p, last, 2, &ncols))) return NULL;
+    ngx_postgres_relation_t *relation = ngx_postgres_replication_relation(pr, (uint32_t)relid);
+    if (!relation && !(relation = ngx_array_push(&pr->relations))) { ngx_log_error(NGX_LOG_ERR, pr->log, 0, "!ngx_array_push"); return NULL; }
+    ngx_memzero(relation, sizeof(*relation));
+    relation->relid = (uint32_t)relid;
+    if (ngx_array_init(&relation->columns, pr->pool, ncols ? ncols : 1, sizeof(ngx_str_t)) != NGX_OK) { ngx_log_error(NGX_LOG_ERR, pr->log, 0, "ngx_array_init != NGX_OK"); return NULL; }
+    for (ngx_uint_t i = 0; i < ncols; i++) {
+        ngx_str_t name, *column;
+        if (!(p = ngx_postgres_replication_uint(p, last, 1, &skip))) return NULL; // flags
+        if (!(p = ngx_postgres_replication_string(p, last, &name))) return NULL;
+        if (!(p = ngx_postgres_replication_uint(p, last, 8, &skip))) return NULL; // type oid and modifier
+        if (!(column = ngx_array_push(&relation->columns))) { ngx_log_error(NGX_LOG_ERR, pr->log, 0, "!ngx_array_push"); return NULL; }
+        if (!(column->data = ngx_pstrdup(pr->pool, &name))) { ngx_log_error(NGX_LOG_ERR, pr->log, 0, "!ngx_pstrdup"); return NULL; }
+        column->len = name.len;
+    }
+    ngx_str_t *channel = &pr->pusc->replication.channel;
+    relation->channel.len = channel->len + schema.len + sizeof(".") - 1 + table.len;
+    if (!(relation->channel.data = ngx_pnalloc(pr->pool, relation->channel.len))) { ngx_log_error(NGX_LOG_ERR, pr->log, 0, "!ngx_pnalloc"); return NULL; }
+    ngx_snprintf(relation->channel.data, relation->channel.len, "%V%V.%V", channel, &schema, &table);
+    relation->schema.data = relation->channel.data + channel->len;
+    relation->schema.len = schema.len;
+    relation->table.data = relation->schema.data + schema.len + 1;
+    relation->table.len = table.len;
+    return p;
+}
+
+
+static u_char *ngx_postgres_replication_tuple(ngx_postgres_relation_t *relation, u_char *p, u_char *last, u_char **out, size_t *size) {
+    uint64_t ncols, kind, len;
+    if (!(p = ngx_postgres_replication_uint(p, last, 2, &ncols))) return NULL;
+    ngx_str_t *column = relation->columns.elts;
+    ngx_flag_t first = 1;
+    if (out) *(*out)++ = '{'; else *size += sizeof("{}") - 1;
+    for (ngx_uint_t i = 0; i < ncols; i++) {
+        if (!(p = ngx_postgres_replication_uint(p, last, 1, &kind))) return NULL;
+        if (kind == 'u') continue; // unchanged toasted value
+        if (kind != 'n' && kind != 't') return NULL;
+        ngx_str_t value = ngx_null_string;
+        if (kind == 't') {
+            if (!(p = ngx_postgres_replication_uint(p, last, 4, &len)) || (uint64_t)(last - p) < len) return NULL;
+            value.data = p;
+            value.len = (size_t)len;
+            p += len;
+        }
+        ngx_str_t name = ngx_null_string;
+        if (i < relation->columns.nelts) name = column[i];
+        if (!out) {
+            *size += (first ? 0 : sizeof(",") - 1) + sizeof("\"\":") - 1 + name.len + ngx_escape_json(NULL, name.data, name.len);
+            *size += kind == 'n' ? sizeof("null") - 1 : sizeof("\"\"") - 1 + value.len + ngx_escape_json(NULL, value.data, value.len);
+        } else {
+            if (!first) *(*out)++ = ',';
+            *(*out)++ = '"';
+            *out = (u_char *)ngx_escape_json(*out, name.data, name.len);
+            *out = ngx_copy(*out, "\":", sizeof("\":") - 1);
+            if (kind == 'n') *out = ngx_copy(*out, "null", sizeof("null") - 1); else {
+                *(*out)++ = '"';
+                *out = (u_char *)ngx_escape_json(*out, value.data, value.len);
+                *(*out)++ = '"';
+            }
+        }
+        first = 0;
+    }
+    if (out) *(*out)++ = '}';
+    return p;
+}
+
+
+static ngx_int_t ngx_postgres_replication_change(ngx_postgres_replication_t *pr, u_char type, u_char *p, u_char *last) {
+    uint64_t relid, kind;
+    if (!(p = ngx_postgres_replication_uint(p, last, 4, &relid))) return NGX_ERROR;
+    ngx_postgres_relation_t *relation = ngx_postgres_replication_relation(pr, (uint32_t)relid);
+    if (!relation) { ngx_log_error(NGX_LOG_ERR, pr->log, 0, "unknown relation %uL", relid); return NGX_ERROR; }
+    u_char *old = NULL, *new = NULL;
+    if (!(p = ngx_postgres_replication_uint(p, last, 1, &kind))) return NGX_ERROR;
+    if (kind == 'K' || kind == 'O') {
+        old = p;
+        size_t size = 0;
+        if (!(p = ngx_postgres_replication_tuple(relation, p, last, NULL, &size))) return NGX_ERROR;
+        if (type != 'D' && !(p = ngx_postgres_replication_uint(p, last, 1, &kind))) return NGX_ERROR;
+    }
+    if (type != 'D') {
+        if (kind != 'N') return NGX_ERROR;
+        new = p;
+    }
+    const char *op = type == 'I' ? "insert" : type == 'U' ? "update" : "delete";
+    size_t size = sizeof("{\"op\":\"\",\"schema\":\"\",\"table\":\"\"}") - 1 + ngx_strlen(op);
+    size += relation->schema.len + ngx_escape_json(NULL, relation->schema.data, relation->schema.len);
+    size += relation->table.len + ngx_escape_json(NULL, relation->table.data, relation->table.len);
+    if (old) { size += sizeof(",\"old\":") - 1; if (!ngx_postgres_replication_tuple(relation, old, last, NULL, &size)) return NGX_ERROR; }
+    if (new) { size += sizeof(",\"new\":") - 1; if (!ngx_postgres_replication_tuple(relation, new, last, NULL, &size)) return NGX_ERROR; }
+    ngx_str_t text = {size, ngx_pnalloc(pr->temp, size)};
+    if (!text.data) { ngx_log_error(NGX_LOG_ERR, pr->log, 0, "!ngx_pnalloc"); return NGX_ERROR; }
+    u_char *out = ngx_sprintf(text.data, "{\"op\":\"%s\",\"schema\":\"", op);
+    out = (u_char *)ngx_escape_json(out, relation->schema.data, relation->schema.len);
+    out = ngx_copy(out, "\",\"table\":\"", sizeof("\",\"table\":\"") - 1);
+    out = (u_char *)ngx_escape_json(out, relation->table.data, relation->table.len);
+    *out++ = '"';
+    if (old) { out = ngx_copy(out, ",\"old\":", sizeof(",\"old\":") - 1); ngx_postgres_replication_tuple(relation, old, last, &out, NULL); }
+    if (new) { out = ngx_copy(out, ",\"new\":", sizeof(",\"new\":") - 1); ngx_postgres_replication_tuple(relation, new, last, &out, NULL); }
+    *out++ = '}';
+    if (out != text.data + text.len) { ngx_log_error(NGX_LOG_ERR, pr->log, 0, "out != text.data + text.len"); return NGX_ERROR; }
+    switch (ngx_postgres_listen_publish(pr->pusc, &relation->channel, &text, pr->log, pr->temp)) {
+        case NGX_ERROR: return NGX_ERROR;
+        case NGX_DECLINED: ngx_log_debug1(NGX_LOG_DEBUG_HTTP, pr->log, 0, "no subscribers for \"%V\"", &relation->channel); break;
+        default: break;
+    }
+    if (!pr->pusc->cache.zone) return NGX_OK;
+    ngx_str_t tag = {relation->schema.len + sizeof(".") - 1 + relation->table.len, relation->schema.data}; // schema.table
+    return ngx_postgres_cache_invalidate(pr->pusc->cache.zone, &tag, pr->log);
+}
+
+
+static ngx_int_t ngx_postgres_replication_message(ngx_postgres_replication_t *pr, u_char *p, u_char *last) {
+    uint64_t flags, lsn;
+    u_char type = *p++;
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, pr->log, 0, "type = %c", type);
+    switch (type) {
+        case 'R': return ngx_postgres_replication_relation_message(pr, p, last) ? NGX_OK : NGX_ERROR;
+        case 'I': case 'U': case 'D': return ngx_postgres_replication_change(pr, type, p, last);
+        case 'C':
+            if (!(p = ngx_postgres_replication_uint(p, last, 1, &flags)) || !(p = ngx_postgres_replication_uint(p, last, 8, &lsn)) || !ngx_postgres_replication_uint(p, last, 8, &lsn)) return NGX_ERROR;
+            pr->lsn = lsn; // end of commit
+            return NGX_OK;
+        default: return NGX_OK; // begin, origin, type and truncate
+    }
+}
+
+
+static ngx_msec_t ngx_postgres_replication_interval(ngx_postgres_replication_t *pr) {
+    return pr->receive && pr->receive / 2 < 10000 ? ngx_max(pr->receive / 2, 1) : 10000; // server replies before it times out
+}
+
+
+static ngx_int_t ngx_postgres_replication_feedback(ngx_postgres_replication_t *pr, ngx_flag_t reply) {
+    ngx_postgres_common_t *prc = &pr->common;
+    u_char buf[1 + 8 + 8 + 8 + 8 + 1], *p = buf;
+    *p++ = 'r';
+    p = ngx_postgres_replication_put(p, pr->lsn); // written
+    p = ngx_postgres_replication_put(p, pr->lsn); // flushed
+    p = ngx_postgres_replication_put(p, pr->lsn); // applied
+    p = ngx_postgres_replication_put(p, (uint64_t)(ngx_time() - 946684800) * 1000000); // since 2000-01-01
+    *p = reply ? 1 : 0; // keepalive is requested to check receiving
+    if (PQputCopyData(prc->conn, (const char *)buf, sizeof(buf)) != 1) { ngx_log_error(NGX_LOG_ERR, pr->log, 0, "PQputCopyData != 1 and %s", PQerrorMessageMy(prc->conn)); return NGX_ERROR; }
+    if (PQflush(prc->conn) == -1) { ngx_log_error(NGX_LOG_ERR, pr->log, 0, "PQflush == -1 and %s", PQerrorMessageMy(prc->conn)); return NGX_ERROR; }
+    return NGX_OK;
+}
+
+
+static ngx_int_t ngx_postgres_replication_copy(ngx_postgres_replication_t *pr) {
+    ngx_postgres_common_t *prc = &pr->common;
+    ngx_int_t rc = NGX_OK;
+    ngx_flag_t received = 0;
+    for (char *buf; rc == NGX_OK; PQfreemem(buf)) {
+        int len = PQgetCopyData(prc->conn, &buf, 1);
+        if (!len) break;
+        received = 1;
+        if (len == -1) { ngx_log_error(NGX_LOG_ERR, pr->log, 0, "PQgetCopyData == -1"); rc = NGX_ERROR; break; }
+        if (len == -2) { ngx_log_error(NGX_LOG_ERR, pr->log, 0, "PQgetCopyData == -2 and %s", PQerrorMessageMy(prc->conn)); rc = NGX_ERROR; break; }
+        u_char *p = (u_char *)buf, *last = p + len;
+        uint64_t lsn, time, reply;
+        switch (*p++) {
+            case 'w': // XLogData
+                if (!(p = ngx_postgres_replication_uint(p, last, 8, &lsn)) || !(p = ngx_postgres_replication_uint(p, last, 8, &lsn)) || !(p = ngx_postgres_replication_uint(p, last, 8, &time)) || p == last) { rc = NGX_ERROR; break; }
+                if ((rc = ngx_postgres_replication_message(pr, p, last)) != NGX_OK) ngx_log_error(NGX_LOG_ERR, pr->log, 0, "invalid pgoutput message");
+                break;
+            case 'k': // keepalive
+                if (!(p = ngx_postgres_replication_uint(p, last, 8, &lsn)) || !(p = ngx_postgres_replication_uint(p, last, 8, &time)) || !ngx_postgres_replication_uint(p, last, 1, &reply)) { rc = NGX_ERROR; break; }
+                ngx_log_debug1(NGX_LOG_DEBUG_HTTP, pr->log, 0, "keepalive, reply = %uL", reply);
+                if (reply) rc = ngx_postgres_replication_feedback(pr, 0);
+                break;
+            default: break;
+        }
+    }
+    ngx_reset_pool(pr->temp);
+    if (received && pr->receive) ngx_add_timer(prc->connection->read, pr->receive);
+    return rc;
+}
+
+
+static void ngx_postgres_replication_close(ngx_postgres_replication_t *pr) {
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, pr->log, 0, "%s", __func__);
+    ngx_postgres_common_t *prc = &pr->common;
+    if (prc->connection) ngx_postgres_free_connection(prc);
+    prc->connection = NULL;
+    if (pr->status.timer_set) ngx_del_timer(&pr->status);
+    if (ngx_terminate || ngx_exiting || pr->timeout.timer_set) return;
+    ngx_add_timer(&pr->timeout, pr->connect->timeout);
+}
+
+
+static void ngx_postgres_replication_handler(ngx_event_t *ev) {
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ev->log, 0, "write = %s", ev->write ? "true" : "false");
+    ngx_connection_t *c = ev->data;
+    ngx_postgres_replication_t *pr = c->data;
+    ngx_postgres_common_t *prc = &pr->common;
+    if (c->close) { ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ev->log, 0, "close"); goto close; }
+    if (c->read->timedout) { ngx_log_error(NGX_LOG_ERR, ev->log, 0, "timedout"); goto close; }
+    if (c->write->timedout) { ngx_log_error(NGX_LOG_ERR, ev->log, 0, "timedout"); goto close; }
+    if (prc->state == state_connect) {
+again:
+        switch (PQconnectPoll(prc->conn)) {
+            case PGRES_POLLING_FAILED: ngx_log_error(NGX_LOG_ERR, ev->log, 0, "PQconnectPoll == PGRES_POLLING_FAILED and %s", PQerrorMessageMy(prc->conn)); goto close;
+            case PGRES_POLLING_OK: ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ev->log, 0, "PQconnectPoll == PGRES_POLLING_OK"); break;
+            case PGRES_POLLING_WRITING: if (PQstatus(prc->conn) == CONNECTION_MADE) goto again; return;
+            default: return;
+        }
+        if (c->write->timer_set) ngx_del_timer(c->write);
+        if (!PQsendQuery(prc->conn, ngx_postgres_replication_setting)) { ngx_log_error(NGX_LOG_ERR, ev->log, 0, "!PQsendQuery(\"%s\") and %s", ngx_postgres_replication_setting, PQerrorMessageMy(prc->conn)); goto close; }
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ev->log, 0, "PQsendQuery(\"%s\")", ngx_postgres_replication_setting);
+        prc->state = state_prepare; // wal_sender_timeout is asked before stream
+        return;
+    }
+    if (ev->write) {
+        if (prc->state == state_result && PQflush(prc->conn) == -1) { ngx_log_error(NGX_LOG_ERR, ev->log, 0, "PQflush == -1 and %s", PQerrorMessageMy(prc->conn)); goto close; }
+        return;
+    }
+    if (!PQconsumeInput(prc->conn)) { ngx_log_error(NGX_LOG_ERR, ev->log, 0, "!PQconsumeInput and %s", PQerrorMessageMy(prc->conn)); goto close; }
+    if (prc->state == state_prepare) {
+        for (PGresult *res; !PQisBusy(prc->conn) && (res = PQgetResult(prc->conn)); PQclear(res)) switch (PQresultStatus(res)) {
+            case PGRES_TUPLES_OK: pr->receive = PQntuples(res) == 1 ? (ngx_msec_t)ngx_max(ngx_atoi((u_char *)PQgetvalue(res, 0, 0), PQgetlength(res, 0, 0)), 0) : 0; break; // milliseconds, zero disables
+            default: ngx_log_error(NGX_LOG_ERR, ev->log, 0, "PQresultStatus == %s and %s", PQresStatus(PQresultStatus(res)), PQresultErrorMessageMy(res)); break;
+        }
+        if (PQisBusy(prc->conn)) { ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ev->log, 0, "PQisBusy"); return; }
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ev->log, 0, "wal_sender_timeout = %M", pr->receive);
+        if (!PQsendQuery(prc->conn, (const char *)pr->sql.data)) { ngx_log_error(NGX_LOG_ERR, ev->log, 0, "!PQsendQuery(\"%V\") and %s", &pr->sql, PQerrorMessageMy(prc->conn)); goto close; }
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ev->log, 0, "PQsendQuery(\"%V\")", &pr->sql);
+        prc->state = state_query;
+        return;
+    }
+    if (prc->state == state_query) {
+        if (PQisBusy(prc->conn)) { ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ev->log, 0, "PQisBusy"); return; }
+        PGresult *res = PQgetResult(prc->conn);
+        if (PQresultStatus(res) != PGRES_COPY_BOTH) { ngx_log_error(NGX_LOG_ERR, ev->log, 0, "PQresultStatus == %s and %s", PQresStatus(PQresultStatus(res)), PQresultErrorMessageMy(res)); PQclear(res); goto close; }
+        PQclear(res);
+        prc->state = state_result;
+        if (pr->receive) ngx_add_timer(c->read, pr->receive); // status requests reply, so silence means dead connection
+        ngx_add_timer(&pr->status, ngx_postgres_replication_interval(pr));
+    }
+    if (ngx_postgres_replication_copy(pr) == NGX_OK) return;
+close:
+    ngx_postgres_replication_close(pr);
+}
+
+
+static void ngx_postgres_replication_status(ngx_event_t *ev) {
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ev->log, 0, "%s", __func__);
+    ngx_postgres_replication_t *pr = ev->data;
+    if (ngx_postgres_replication_feedback(pr, pr->receive != 0) != NGX_OK) { ngx_postgres_replication_close(pr); return; }
+    ngx_add_timer(ev, ngx_postgres_replication_interval(pr));
+}
+
+
+static void ngx_postgres_replication_timeout(ngx_event_t *ev) {
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ev->log, 0, "%s", __func__);
+    ngx_postgres_replication_t *pr = ev->data;
+    ngx_postgres_common_t *prc = &pr->common;
+    ngx_reset_pool(pr->pool); // relations are sent again on every stream
+    if (ngx_array_init(&pr->relations, pr->pool, 4, sizeof(ngx_postgres_relation_t)) != NGX_OK) { ngx_log_error(NGX_LOG_ERR, ev->log, 0, "ngx_array_init != NGX_OK"); ngx_postgres_replication_close(pr); return; }
+    if (ngx_postgres_connect_start(prc, pr->keywords, pr->values, pr->connect->timeout, pr->log, ngx_postgres_replication_handler, pr) != NGX_OK) ngx_postgres_replication_close(pr);
+}
+
+
+static ngx_int_t ngx_postgres_replication_start(ngx_cycle_t *cycle, ngx_http_upstream_srv_conf_t *usc) {
+    ngx_postgres_upstream_srv_conf_t *pusc = ngx_http_conf_upstream_srv_conf(usc, ngx_postgres_module);
+    ngx_postgres_connect_t *connect;
+    ngx_addr_t *addr;
+    if (ngx_postgres_connect_first(usc, &connect, &addr) != NGX_OK) { ngx_log_error(NGX_LOG_ERR, cycle->log, 0, "ngx_postgres_connect_first != NGX_OK"); return NGX_ERROR; }
+    ngx_postgres_replication_t *pr = ngx_pcalloc(cycle->pool, sizeof(*pr));
+    if (!pr) { ngx_log_error(NGX_LOG_ERR, cycle->log, 0, "!ngx_pcalloc"); return NGX_ERROR; }
+    pr->connect = connect;
+    pr->log = pusc->ps.log ? pusc->ps.log : cycle->log;
+    pr->pusc = pusc;
+    if (!(pr->pool = ngx_create_pool(4096, pr->log))) { ngx_log_error(NGX_LOG_ERR, cycle->log, 0, "!ngx_create_pool"); return NGX_ERROR; }
+    if (!(pr->temp = ngx_create_pool(4096, pr->log))) { ngx_log_error(NGX_LOG_ERR, cycle->log, 0, "!ngx_create_pool"); return NGX_ERROR; }
+    ngx_uint_t n;
+    for (n = 0; connect->keywords[n]; n++);
+    if (!(pr->keywords = ngx_pcalloc(cycle->pool, (n + 2) * sizeof(const char *)))) { ngx_log_error(NGX_LOG_ERR, cycle->log, 0, "!ngx_pcalloc"); return NGX_ERROR; }
+    if (!(pr->values = ngx_pcalloc(cycle->pool, (n + 2) * sizeof(const char *)))) { ngx_log_error(NGX_LOG_ERR, cycle->log, 0, "!ngx_pcalloc"); return NGX_ERROR; }
+    ngx_memcpy(pr->keywords, connect->keywords, n * sizeof(const char *));
+    ngx_memcpy(pr->values, connect->values, n * sizeof(const char *));
+    pr->keywords[n] = "replication";
+    pr->values[n] = "database";
+    ngx_str_t *slot = &pusc->replication.slot;
+    ngx_str_t *publication = &pusc->replication.publication;
+    pr->sql.len = sizeof("START_REPLICATION SLOT  LOGICAL 0/0 (proto_version '1', publication_names '')") - 1 + slot->len + publication->len;
+    if (!(pr->sql.data = ngx_pnalloc(cycle->pool, pr->sql.len + 1))) { ngx_log_error(NGX_LOG_ERR, cycle->log, 0, "!ngx_pnalloc"); return NGX_ERROR; }
+    *ngx_snprintf(pr->sql.data, pr->sql.len, "START_REPLICATION SLOT %V LOGICAL 0/0 (proto_version '1', publication_names '%V')", slot, publication) = '\0';
+    ngx_postgres_common_t *prc = &pr->common;
+    if (!(prc->addr.sockaddr = ngx_pcalloc(cycle->pool, addr->socklen))) { ngx_log_error(NGX_LOG_ERR, cycle->log, 0, "!ngx_pcalloc"); return NGX_ERROR; }
+    ngx_memcpy(prc->addr.sockaddr, addr->sockaddr, addr->socklen);
+    prc->addr.socklen = addr->socklen;
+    pr->status.cancelable = 1;
+    pr->status.data = pr;
+    pr->status.handler = ngx_postgres_replication_status;
+    pr->status.log = pr->log;
+    pr->timeout.cancelable = 1;
+    pr->timeout.data = pr;
+    pr->timeout.handler = ngx_postgres_replication_timeout;
+    pr->timeout.log = pr->log;
+    ngx_add_timer(&pr->timeout, 1); // connect when event loop starts
+    return NGX_OK;
+}
+
+
+ngx_int_t ngx_postgres_replication_init_module(ngx_cycle_t *cycle) {
+    ngx_core_conf_t *ccf = (ngx_core_conf_t *)ngx_get_conf(cycle->conf_ctx, ngx_core_module);
+    if (!ccf->master || ccf->worker_processes <= 1) return NGX_OK;
+    ngx_http_upstream_main_conf_t *umcf = ngx_http_cycle_get_module_main_conf(cycle, ngx_http_upstream_module);
+    if (!umcf) return NGX_OK;
+    ngx_http_upstream_srv_conf_t **usc = umcf->upstreams.elts;
+    for (ngx_uint_t i = 0; i < umcf->upstreams.nelts; i++) {
+        if (!usc[i]->srv_conf || !usc[i]->srv_conf[ngx_postgres_module.ctx_index]) continue;
+        ngx_postgres_upstream_srv_conf_t *pusc = ngx_http_conf_upstream_srv_conf(usc[i], ngx_postgres_module);
+        if (!pusc->replication.slot.len || !pusc->replication.listen) continue;
+        ngx_log_error(NGX_LOG_EMERG, cycle->log, 0, "\"postgres_replication\" of upstream \"%V\" can not be combined with \"postgres_listen\" when \"worker_processes\" is more than 1", &usc[i]->host); // changes reach only clients of first worker
+        return NGX_ERROR;
+    }
+    return NGX_OK;
+}
+
+
+ngx_int_t ngx_postgres_replication_init_process(ngx_cycle_t *cycle) {
+    if (ngx_process != NGX_PROCESS_WORKER && ngx_process != NGX_PROCESS_SINGLE) return NGX_OK;
+    if (ngx_worker) return NGX_OK; // slot has only one consumer
+    ngx_http_upstream_main_conf_t *umcf = ngx_http_cycle_get_module_main_conf(cycle, ngx_http_upstream_module);
+    if (!umcf) return NGX_OK;
+    ngx_http_upstream_srv_conf_t **usc = umcf->upstreams.elts;
+    for (ngx_uint_t i = 0; i < umcf->upstreams.nelts; i++) {
+        if (!usc[i]->srv_conf || !usc[i]->srv_conf[ngx_postgres_module.ctx_index]) continue;
+        ngx_postgres_upstream_srv_conf_t *pusc = ngx_http_conf_upstream_srv_conf(usc[i], ngx_postgres_module);
+        if (!pusc->replication.slot.len) continue;
+        if (ngx_postgres_replication_start(cycle, usc[i]) != NGX_OK) ngx_log_error(NGX_LOG_ERR, cycle->log, 0, "ngx_postgres_replication_start != NGX_OK");
+    }
+    return NGX_OK;
+}
@@ -63,103 +63,52 @@ static void ngx_postgres_request_handler(ngx_event_t *ev) {
 #endif
 
 
-static u_char *ngx_postgres_listen(ngx_postgres_data_t *pd, ngx_postgres_save_t *ps) {
-    ngx_http_request_t *r = pd->request;
-    ngx_postgres_common_t *pdc = &pd->common;
-    ngx_connection_t *c = pdc->connection;
-    u_char *listen = NULL;
-    ngx_array_t *array = NULL;
-    size_t len = 0;
-    if (pdc->listen.queue) while (!ngx_queue_empty(pdc->listen.queue)) {
-        ngx_queue_t *queue = ngx_queue_head(pdc->listen.queue);
-        ngx_postgres_listen_t *pdl = ngx_queue_data(queue, ngx_postgres_listen_t, queue);
-        ngx_postgres_common_t *psc = &ps->common;
-        if (!psc->listen.queue) {
-            if (!(psc->listen.queue = ngx_pcalloc(c->pool, sizeof(ngx_queue_t)))) { ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "!ngx_pcalloc"); return NULL; }
-            ngx_queue_init(psc->listen.queue);
-        }
-        for (ngx_queue_t *queue = ngx_queue_head(psc->listen.queue); queue != ngx_queue_sentinel(psc->listen.queue); queue = ngx_queue_next(queue)) {
-            ngx_postgres_listen_t *psl = ngx_queue_data(queue, ngx_postgres_listen_t, queue);
-            if (psl->channel.len == pdl->channel.len && !ngx_strncmp(psl->channel.data, pdl->channel.data, pdl->channel.len)) goto cont;
-        }
-        if (!array && !(array = ngx_array_create(r->pool, 1, sizeof(ngx_postgres_listen_t)))) { ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "!ngx_array_create"); return NULL; }
-        ngx_postgres_listen_t *psl = ngx_array_push(array);
-        if (!psl) { ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "!ngx_array_push"); return NULL; }
-        if (!(psl->channel.data = ngx_pstrdup(c->pool, &pdl->channel))) { ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "!ngx_pstrdup"); return NULL; }
-        psl->channel.len = pdl->channel.len;
-        if (!(psl->command.data = ngx_pstrdup(c->pool, &pdl->command))) { ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "!ngx_pstrdup"); return NULL; }
-        psl->command.len = pdl->command.len;
-        len += pdl->command.len - 2;
-        ngx_queue_insert_tail(psc->listen.queue, &psl->queue);
-cont:
-        ngx_queue_remove(&pdl->queue);
-    }
-    if (len && array && array->nelts) {
-        listen = ngx_pnalloc(r->pool, len + 2 * array->nelts - 1);
-        if (!listen) { ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "!ngx_pnalloc"); return NULL; }
-        ngx_postgres_listen_t *elts = array->elts;
-        u_char *p = listen;
-        for (ngx_uint_t i = 0; i < array->nelts; i++) {
-            if (i) { *p++ = ';'; *p++ = '\n'; }
-            p = ngx_cpymem(p, elts[i].command.data + 2, elts[i].command.len - 2);
-        }
-        *p = '\0';
-    }
-    return listen;
-}
-
-
 ngx_int_t ngx_postgres_process_notify(ngx_postgres_common_t *common, ngx_flag_t send) {
     ngx_connection_t *c = common->connection;
     ngx_log_debug1(NGX_LOG_DEBUG_HTTP, c->log, 0, "%s", __func__);
-    ngx_array_t *array = NULL;
-    size_t len = 0;
-    for (PGnotify *notify; (notify = PQnotifies(common->conn)); PQfreemem(notify)) {
-        ngx_log_debug3(NGX_LOG_DEBUG_HTTP, c->log, 0, "relname=%s, extra=%s, be_pid=%i", notify->relname, notify->extra, notify->be_pid);
-        if (!ngx_http_push_stream_add_msg_to_channel_my) continue;
-        ngx_str_t id = { ngx_strlen(notify->relname), (u_char *) notify->relname };
-        ngx_str_t text = { ngx_strlen(notify->extra), (u_char *) notify->extra };
-        ngx_pool_t *temp_pool = ngx_create_pool(4096 + id.len + text.len, c->log);
-        if (!temp_pool) { ngx_log_error(NGX_LOG_ERR, c->log, 0, "!ngx_create_pool"); if (array) ngx_array_destroy(array); PQfreemem(notify); return NGX_ERROR; }
-        switch (ngx_http_push_stream_add_msg_to_channel_my(c->log, &id, &text, NULL, NULL, 0, temp_pool)) {
-            case NGX_ERROR: ngx_log_error(NGX_LOG_ERR, c->log, 0, "ngx_http_push_stream_add_msg_to_channel_my == NGX_ERROR"); if (array) ngx_array_destroy(array); PQfreemem(notify); return NGX_ERROR;
-            case NGX_DECLINED:
-                ngx_log_error(NGX_LOG_WARN, c->log, 0, "ngx_http_push_stream_add_msg_to_channel_my == NGX_DECLINED");
-                if (send && common->listen.queue) for (ngx_queue_t *queue = ngx_queue_head(common->listen.queue); queue != ngx_queue_sentinel(common->listen.queue); queue = ngx_queue_next(queue)) {
-                    ngx_postgres_listen_t *listen = ngx_queue_data(queue, ngx_postgres_listen_t, queue);
-                    if (id.len == listen->channel.len && !ngx_strncmp(id.data, listen->channel.data, id.len)) {
-                        if (!array && !(array = ngx_array_create(c->pool, 1, sizeof(ngx_str_t)))) { ngx_log_error(NGX_LOG_ERR, c->log, 0, "!ngx_array_create"); if (array) ngx_array_destroy(array); PQfreemem(notify); return NGX_ERROR; }
-                        ngx_str_t *unlisten = ngx_array_push(array);
-                        if (!unlisten) { ngx_log_error(NGX_LOG_ERR, c->log, 0, "!ngx_array_push"); if (array) ngx_array_destroy(array); PQfreemem(notify); return NGX_ERROR; }
-                        *unlisten = listen->command;
-                        len += unlisten->len;
-                        ngx_queue_remove(&listen->queue);
-                        break;
-                    }
-                }
-                break;
-            case NGX_OK: ngx_log_debug0(NGX_LOG_DEBUG_HTTP, c->log, 0, "ngx_http_push_stream_add_msg_to_channel_my == NGX_OK"); break;
-            default: ngx_log_error(NGX_LOG_ERR, c->log, 0, "ngx_http_push_stream_add_msg_to_channel_my == unknown"); break;
-        }
-        ngx_destroy_pool(temp_pool);
-        if (!PQconsumeInput(common->conn)) { ngx_log_error(NGX_LOG_ERR, c->log, 0, "!PQconsumeInput and %s", PQerrorMessageMy(common->conn)); if (array) ngx_array_destroy(array); PQfreemem(notify); return NGX_ERROR; }
-        if (PQisBusy(common->conn)) { ngx_log_debug0(NGX_LOG_DEBUG_HTTP, c->log, 0, "PQisBusy"); if (array) ngx_array_destroy(array); PQfreemem(notify); return NGX_AGAIN; }
-    }
-    if (send && len && array && array->nelts) {
-        u_char *unlisten = ngx_pnalloc(c->pool, len + 2 * array->nelts - 1);
-        if (!unlisten) { ngx_log_error(NGX_LOG_ERR, c->log, 0, "!ngx_pnalloc"); if (array) ngx_array_destroy(array); return NGX_ERROR; }
-        ngx_str_t *elts = array->elts;
-        u_char *p = unlisten;
-        for (ngx_uint_t i = 0; i < array->nelts; i++) {
-            if (i) { *p++ = ';'; *p++ = '\n'; }
-            p = ngx_cpymem(p, elts[i].data, elts[i].len);
+    for (PGnotify *notify; (notify = PQnotifies(common->conn)); ) {
+        if (!common->notify.pool && !(common->notify.pool = ngx_create_pool(4096, c->log))) { ngx_log_error(NGX_LOG_ERR, c->log, 0, "!ngx_create_pool"); PQfreemem(notify); return NGX_ERROR; }
+        ngx_array_t batch;
+        if (ngx_array_init(&batch, common->notify.pool, 16, sizeof(notify)) != NGX_OK) { ngx_log_error(NGX_LOG_ERR, c->log, 0, "ngx_array_init != NGX_OK"); PQfreemem(notify); return NGX_ERROR; }
+        ngx_int_t rc = NGX_OK;
+        do {
+            PGnotify **elt = ngx_array_push(&batch);
+            if (!elt) { ngx_log_error(NGX_LOG_ERR, c->log, 0, "!ngx_array_push"); PQfreemem(notify); rc = NGX_ERROR; break; }
+            *elt = notify;
+        } while ((notify = PQnotifies(common->conn)));
+        ngx_uint_t delivered = 0, dropped = 0;
+        PGnotify **elts = batch.elts;
+        for (ngx_uint_t i = 0; i < batch.nelts; PQfreemem(elts[i++])) {
+            if (rc != NGX_OK) continue; // only free the rest of batch
+            ngx_log_debug3(NGX_LOG_DEBUG_HTTP, c->log, 0, "relname=%s, extra=%s, be_pid=%i", elts[i]->relname, elts[i]->extra, elts[i]->be_pid);
+            ngx_str_t id = { ngx_strlen(elts[i]->relname), (u_char *) elts[i]->relname };
+            ngx_str_t text = { ngx_strlen(elts[i]->extra), (u_char *) elts[i]->extra };
+            ngx_uint_t subscribers = 0;
+            switch (send ? ngx_postgres_listen_notify(common, &id, &text, &subscribers) : NGX_OK) {
+                case NGX_ERROR: ngx_log_error(NGX_LOG_ERR, c->log, 0, "ngx_postgres_listen_notify == NGX_ERROR"); rc = NGX_ERROR; continue;
+                case NGX_DONE: if (subscribers) delivered++; else dropped++; continue; // streamed only
+                default: break;
+            }
+            if (!ngx_http_push_stream_add_msg_to_channel_my) { if (subscribers) delivered++; else dropped++; continue; }
+            switch (ngx_http_push_stream_add_msg_to_channel_my(c->log, &id, &text, NULL, NULL, 0, common->notify.pool)) {
+                case NGX_ERROR: ngx_log_error(NGX_LOG_ERR, c->log, 0, "ngx_http_push_stream_add_msg_to_channel_my == NGX_ERROR"); rc = NGX_ERROR; break;
+                case NGX_DECLINED:
+                    ngx_log_error(NGX_LOG_WARN, c->log, 0, "ngx_http_push_stream_add_msg_to_channel_my == NGX_DECLINED");
+                    if (subscribers) delivered++; else dropped++;
+                    if (send && ngx_postgres_listen_remove(common, &id) != NGX_OK) { ngx_log_error(NGX_LOG_ERR, c->log, 0, "ngx_postgres_listen_remove != NGX_OK"); rc = NGX_ERROR; }
+                    break;
+                case NGX_OK: ngx_log_debug0(NGX_LOG_DEBUG_HTTP, c->log, 0, "ngx_http_push_stream_add_msg_to_channel_my == NGX_OK"); delivered++; break;
+                default: ngx_log_error(NGX_LOG_ERR, c->log, 0, "ngx_http_push_stream_add_msg_to_channel_my == unknown"); dropped++; break;
+            }
         }
-        *p = '\0';
-        if (!PQsendQuery(common->conn, (const char *)unlisten)) { ngx_log_error(NGX_LOG_ERR, c->log, 0, "!PQsendQuery(\"%s\") and %s", unlisten, PQerrorMessageMy(common->conn)); if (array) ngx_array_destroy(array); ngx_pfree(c->pool, unlisten); return NGX_ERROR; }
-        else { ngx_log_debug1(NGX_LOG_DEBUG_HTTP, c->log, 0, "PQsendQuery(\"%s\")", unlisten); }
-        ngx_pfree(c->pool, unlisten);
+        ngx_reset_pool(common->notify.pool);
+        common->notify.delivered += delivered;
+        common->notify.dropped += dropped;
+        ngx_log_debug4(NGX_LOG_DEBUG_HTTP, c->log, 0, "delivered = %ui/%ui, dropped = %ui/%ui", delivered, common->notify.delivered, dropped, common->notify.dropped);
+        if (rc != NGX_OK) return rc;
+        if (!PQconsumeInput(common->conn)) { ngx_log_error(NGX_LOG_ERR, c->log, 0, "!PQconsumeInput and %s", PQerrorMessageMy(common->conn)); return NGX_ERROR; }
+        if (PQisBusy(common->conn)) { ngx_log_debug0(NGX_LOG_DEBUG_HTTP, c->log, 0, "PQisBusy"); return NGX_AGAIN; }
     }
-    if (array) ngx_array_destroy(array);
     return NGX_OK;
 }
 
@@ -179,7 +128,7 @@ static void ngx_postgres_save_handler(ngx_event_t *ev) {
         case PGRES_FATAL_ERROR: ngx_log_error(NGX_LOG_ERR, ev->log, 0, "PQresultStatus == PGRES_FATAL_ERROR and %s", PQresultErrorMessageMy(res)); break;
         default: ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ev->log, 0, "PQresultStatus == %s", PQresStatus(PQresultStatus(res))); break;
     }
-    if (ngx_postgres_process_notify(psc, 1) != NGX_ERROR) return;
+    if (ngx_postgres_process_notify(psc, 0) != NGX_ERROR) return;
 close:
     ngx_postgres_free_connection(psc);
     ngx_queue_remove(&ps->queue);
@@ -232,13 +181,11 @@ static void ngx_postgres_free_peer(ngx_http_request_t *r) {
     if (c->requests >= pusc->ps.requests) { ngx_log_error(NGX_LOG_WARN, r->connection->log, 0, "requests = %i", c->requests); return; }
     if (ngx_terminate) { ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "ngx_terminate"); return; }
     if (ngx_exiting) { ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "ngx_exiting"); return; }
-    u_char *listen = NULL;
     ngx_postgres_save_t *ps;
     if (ngx_queue_empty(&pusc->free.queue)) {
         ngx_log_error(NGX_LOG_WARN, r->connection->log, 0, "ngx_queue_empty(free)");
         ngx_queue_t *queue = ngx_queue_last(&pusc->ps.queue);
         ps = ngx_queue_data(queue, ngx_postgres_save_t, queue);
-        if (ngx_http_push_stream_add_msg_to_channel_my && ngx_http_push_stream_delete_channel_my) listen = ngx_postgres_listen(pd, ps);
         ngx_postgres_common_t *psc = &ps->common;
         ngx_postgres_free_connection(psc);
     } else {
@@ -255,11 +202,6 @@ static void ngx_postgres_free_peer(ngx_http_request_t *r) {
         if (!PQcancel(cancel, err, 256)) { ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "!PQcancel and %s", err); PQfreeCancel(cancel); }
         PQfreeCancel(cancel);
     }
-    if (listen) {
-        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "listen = %s", listen);
-        if (!PQsendQuery(pdc->conn, (const char *)listen)) { ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "!PQsendQuery(\"%s\") and %s", listen, PQerrorMessageMy(pdc->conn)); }
-        else { ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "PQsendQuery(\"%s\")", listen); }
-    }
 #if (T_NGX_HTTP_DYNAMIC_RESOLVE)
     if (!ngx_queue_empty(&pusc->pd.queue)) {
         ngx_queue_t *queue = ngx_queue_head(&pusc->pd.queue);
@@ -287,6 +229,14 @@ static void ngx_postgres_peer_free(ngx_peer_connection_t *pc, void *data, ngx_ui
     if (pc->connection) ngx_postgres_free_connection(pdc);
     pc->connection = NULL;
     pd->peer_free(pc, pd->peer_data, state);
+    if (!pd->transaction.state) return;
+    pd->query.index = 0; // transaction is rolled back with its connection, so next upstream runs all statements again in new one
+    pd->result.section = 0;
+    pd->transaction.state = 0;
+#if (NGX_THREADS)
+    if (pd->out.thread) return; // output is dropped by thread event handler
+#endif
+    r->upstream->out_bufs = NULL; // output of rolled back statements
 }
 
 
@@ -319,6 +269,7 @@ ngx_int_t ngx_postgres_peer_get(ngx_peer_connection_t *pc, void *data) {
 exit:
     if (i == array->nelts) { ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "connect not found"); return NGX_BUSY; } // and ngx_http_upstream_next(r, u, NGX_HTTP_UPSTREAM_FT_NOLIVE) and return
 #endif
+    pd->connect = connect;
     ngx_http_upstream_t *u = r->upstream;
 #if (HAVE_NGX_UPSTREAM_TIMEOUT_FIELDS)
     u->connect_timeout = connect->timeout;
@@ -404,10 +355,38 @@ invalid:
 }
 
 
-typedef struct {
-    ngx_uint_t index;
-    ngx_uint_t oid;
-} ngx_postgres_param_t;
+ngx_int_t ngx_postgres_peer_yield(ngx_postgres_data_t *pd) {
+    ngx_http_request_t *r = pd->request;
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "%s", __func__);
+    ngx_http_upstream_t *u = r->upstream;
+    ngx_peer_connection_t *pc = &u->peer;
+    ngx_postgres_free_peer(r);
+    if (pc->connection) return NGX_AGAIN; // not saved, so run next statement on it
+    pd->peer_free(pc, pd->peer_data, 0);
+    pc->sockaddr = NULL; // freed, so neither ngx_http_upstream_next nor finalize frees it again when no next peer is got
+    pc->name = NULL;
+    ngx_postgres_common_t *pdc = &pd->common;
+    ngx_postgres_upstream_srv_conf_t *pusc = pdc->pusc;
+    ngx_memzero(pdc, sizeof(*pdc)); // prepared statements and charset belonged to saved connection
+    pdc->pusc = pusc;
+    u->request_sent = 1; // force to reinit_request after waiting in queue
+    switch (ngx_event_connect_peer(pc)) {
+        case NGX_AGAIN: break;
+#if (T_NGX_HTTP_DYNAMIC_RESOLVE)
+        case NGX_YIELD: ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "NGX_YIELD"); return NGX_DONE; // connected by ngx_postgres_free_peer of other request
+#endif
+        default: ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "ngx_event_connect_peer != NGX_AGAIN"); return NGX_ERROR;
+    }
+    ngx_connection_t *c = pc->connection;
+    c->requests++;
+    if (u->reinit_request(r) != NGX_OK) { ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "reinit_request != NGX_OK"); return NGX_ERROR; }
+#if (HAVE_NGX_UPSTREAM_TIMEOUT_FIELDS)
+    if (pdc->state == state_connect) ngx_add_timer(c->write, u->connect_timeout);
+#else
+    if (pdc->state == state_connect) ngx_add_timer(c->write, u->conf->connect_timeout);
+#endif
+    return NGX_DONE;
+}
 
 
 #if (NGX_HTTP_SSL)
@@ -448,15 +427,21 @@ ngx_int_t ngx_postgres_peer_init(ngx_http_request_t *r, ngx_http_upstream_srv_co
     ngx_postgres_location_t *location = ngx_http_get_module_loc_conf(r, ngx_postgres_module);
     ngx_postgres_query_t *elts = location->queries.elts;
     ngx_uint_t nelts = 0;
+    ngx_int_t index = location->parallel ? ngx_postgres_parallel_query(r) : NGX_DECLINED;
+    if (index != NGX_DECLINED) pd->query.index = index;
     for (ngx_uint_t i = 0; i < location->queries.nelts; i++) {
         ngx_postgres_query_t *query = &elts[i];
-        if (query->params.nelts) {
+        if (query->params.nelts && (index == NGX_DECLINED || i == (ngx_uint_t)index)) {
             ngx_postgres_param_t *param = query->params.elts;
             pd->query.nParams = query->params.nelts;
             if (!(pd->query.paramTypes = ngx_pnalloc(r->pool, query->params.nelts * sizeof(Oid)))) { ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "!ngx_pnalloc"); return NGX_ERROR; }
             if (!(pd->query.paramValues = ngx_pnalloc(r->pool, query->params.nelts * sizeof(char *)))) { ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "!ngx_pnalloc"); return NGX_ERROR; }
             for (ngx_uint_t i = 0; i < query->params.nelts; i++) {
                 pd->query.paramTypes[i] = param[i].oid;
+                if (location->batch.max && (!location->batch.column.len || param[i].index == (ngx_uint_t)location->batch.index)) { // array of values of batched requests
+                    if (!(pd->query.paramValues[i] = ngx_postgres_batch_array(r, param[i].index))) { ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "!ngx_postgres_batch_array"); return NGX_ERROR; }
+                    continue;
+                }
                 ngx_http_variable_value_t *value = ngx_http_get_indexed_variable(r, param[i].index);
                 if (!value || !value->data || !value->len) pd->query.paramValues[i] = NULL; else {
                     if (!(pd->query.paramValues[i] = ngx_pnalloc(r->pool, value->len + 1))) { ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "!ngx_pnalloc"); return NGX_ERROR; }
@@ -480,7 +465,11 @@ void ngx_postgres_free_connection(ngx_postgres_common_t *common) {
     ngx_connection_t *c = common->connection;
     ngx_log_debug1(NGX_LOG_DEBUG_HTTP, c->log, 0, "%s", __func__);
     ngx_postgres_upstream_srv_conf_t *pusc = common->pusc;
-    pusc->ps.size--;
+    if (pusc) pusc->ps.size--; // listener is not counted
+    if (common->notify.pool) {
+        ngx_destroy_pool(common->notify.pool);
+        common->notify.pool = NULL;
+    }
     if (!c) {
         if (common->conn) {
             PQfinish(common->conn);
@@ -489,15 +478,6 @@ void ngx_postgres_free_connection(ngx_postgres_common_t *common) {
         return;
     }
     if (common->conn) {
-        if (!c->close && common->listen.queue && ngx_http_push_stream_delete_channel_my) {
-            while (!ngx_queue_empty(common->listen.queue)) {
-                ngx_queue_t *queue = ngx_queue_head(common->listen.queue);
-                ngx_postgres_listen_t *listen = ngx_queue_data(queue, ngx_postgres_listen_t, queue);
-                ngx_log_error(NGX_LOG_INFO, c->log, 0, "delete channel = %V", &listen->channel);
-                ngx_http_push_stream_delete_channel_my(c->log, &listen->channel, (u_char *)"channel unlisten", sizeof("channel unlisten") - 1, c->pool);
-                ngx_queue_remove(&listen->queue);
-            }
-        }
         PQfinish(common->conn);
         common->conn = NULL;
     }
@@ -520,6 +500,75 @@ void ngx_postgres_free_connection(ngx_postgres_common_t *common) {
 }
 
 
+ngx_int_t ngx_postgres_connect_start(ngx_postgres_common_t *common, const char **keywords, const char **values, ngx_msec_t timeout, ngx_log_t *log, ngx_event_handler_pt handler, void *data) {
+    u_char addr[NGX_SOCKADDR_STRLEN + 1];
+    size_t len = ngx_sock_ntop(common->addr.sockaddr, common->addr.socklen, addr, NGX_SOCKADDR_STRLEN, 0);
+    if (!len) { ngx_log_error(NGX_LOG_ERR, log, 0, "!ngx_sock_ntop"); return NGX_ERROR; }
+    addr[len] = '\0';
+    const char *host = values[0];
+    values[0] = (const char *)addr + (common->addr.sockaddr->sa_family == AF_UNIX ? 5 : 0);
+    common->conn = PQconnectStartParams(keywords, values, 0);
+    values[0] = host;
+    if (PQstatus(common->conn) == CONNECTION_BAD || PQsetnonblocking(common->conn, 1) == -1) {
+        ngx_log_error(NGX_LOG_ERR, log, 0, "PQstatus == CONNECTION_BAD or PQsetnonblocking == -1 and %s", PQerrorMessageMy(common->conn));
+        PQfinish(common->conn);
+        common->conn = NULL;
+        return NGX_ERROR;
+    }
+    int fd;
+    ngx_connection_t *c;
+    if ((fd = PQsocket(common->conn)) == -1 || !(c = ngx_get_connection(fd, log))) {
+        ngx_log_error(NGX_LOG_ERR, log, 0, "PQsocket == -1 or !ngx_get_connection");
+        PQfinish(common->conn);
+        common->conn = NULL;
+        return NGX_ERROR;
+    }
+    common->connection = c;
+    c->data = data;
+    c->idle = 1;
+    c->log = log;
+    c->number = ngx_atomic_fetch_add(ngx_connection_counter, 1);
+    c->read->handler = handler;
+    c->read->log = log;
+    c->write->handler = handler;
+    c->write->log = log;
+    if (ngx_event_flags & NGX_USE_RTSIG_EVENT) {
+        if (ngx_add_conn(c) != NGX_OK) { ngx_log_error(NGX_LOG_ERR, log, 0, "ngx_add_conn != NGX_OK"); goto invalid; }
+    } else if (ngx_event_flags & NGX_USE_CLEAR_EVENT) {
+        if (ngx_add_event(c->read, NGX_READ_EVENT, NGX_CLEAR_EVENT) != NGX_OK) { ngx_log_error(NGX_LOG_ERR, log, 0, "ngx_add_event != NGX_OK"); goto invalid; }
+        if (ngx_add_event(c->write, NGX_WRITE_EVENT, NGX_CLEAR_EVENT) != NGX_OK) { ngx_log_error(NGX_LOG_ERR, log, 0, "ngx_add_event != NGX_OK"); goto invalid; }
+    } else if (ngx_event_flags & NGX_USE_LEVEL_EVENT) {
+        if (ngx_add_event(c->read, NGX_READ_EVENT, NGX_LEVEL_EVENT) != NGX_OK) { ngx_log_error(NGX_LOG_ERR, log, 0, "ngx_add_event != NGX_OK"); goto invalid; }
+        if (ngx_add_event(c->write, NGX_WRITE_EVENT, NGX_LEVEL_EVENT) != NGX_OK) { ngx_log_error(NGX_LOG_ERR, log, 0, "ngx_add_event != NGX_OK"); goto invalid; }
+    } else { ngx_log_error(NGX_LOG_ERR, log, 0, "ngx_event_flags not NGX_USE_RTSIG_EVENT or NGX_USE_CLEAR_EVENT or NGX_USE_LEVEL_EVENT"); goto invalid; }
+    ngx_add_timer(c->write, timeout);
+    common->state = state_connect;
+    return NGX_OK;
+invalid:
+    ngx_postgres_free_connection(common);
+    common->connection = NULL;
+    return NGX_ERROR;
+}
+
+
+ngx_int_t ngx_postgres_connect_first(ngx_http_upstream_srv_conf_t *usc, ngx_postgres_connect_t **connect, ngx_addr_t **addr) {
+#if (T_NGX_HTTP_DYNAMIC_RESOLVE)
+    ngx_http_upstream_server_t *us = usc->servers && usc->servers->nelts ? usc->servers->elts : NULL;
+    if (!us || !us->naddrs) return NGX_DECLINED; // not resolved yet
+    *connect = us->data;
+    *addr = &us->addrs[0];
+#else
+    ngx_postgres_upstream_srv_conf_t *pusc = ngx_http_conf_upstream_srv_conf(usc, ngx_postgres_module);
+    ngx_array_t *array = pusc->connect;
+    if (!array || !array->nelts) return NGX_DECLINED;
+    *connect = array->elts;
+    if (!(*connect)->naddrs) return NGX_DECLINED;
+    *addr = &(*connect)->addrs[0];
+#endif
+    return NGX_OK;
+}
+
+
 static ngx_flag_t is_variable_character(u_char p) {
     return ((p >= '0' && p <= '9') || (p >= 'a' && p <= 'z') || (p >= 'A' && p <= 'Z') || p == '_');
 }
@@ -277,12 +277,13 @@ ngx_int_t ngx_postgres_variable_set(ngx_postgres_data_t *pd) {
         }
     } else if (variable[i].handler) {
         ngx_http_upstream_t *u = r->upstream;
-        ngx_chain_t *chain = u->out_bufs;
+        ngx_chain_t *chain = u->out_bufs, *last = pd->out.last;
         u->out_bufs = NULL;
         if (variable[i].handler(pd) != NGX_DONE) { ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "!handler"); return NGX_ERROR; }
-        elts[variable[i].index].len = u->out_bufs->buf->end - u->out_bufs->buf->start;
-        elts[variable[i].index].data = u->out_bufs->buf->start;
+        elts[variable[i].index].len = u->out_bufs->buf->last - u->out_bufs->buf->pos;
+        elts[variable[i].index].data = u->out_bufs->buf->pos;
         u->out_bufs = chain;
+        pd->out.last = last;
     } else {
 //        ngx_log_debug5(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "row = %i, col = %i, field = %s, required = %s, index = %i", variable[i].row, variable[i].col, variable[i].field ? variable[i].field : (u_char *)"(null)", variable[i].required ? "true" : "false", variable[i].index);
         if (variable[i].field) {
@@ -373,6 +374,18 @@ static ngx_http_variable_t ngx_postgres_module_variables[] = {
     .data = 0,
     .flags = NGX_HTTP_VAR_NOCACHEABLE|NGX_HTTP_VAR_NOHASH,
     .index = 0 },
+  { .name = ngx_string("postgres_async_dropped"),
+    .set_handler = NULL,
+    .get_handler = ngx_postgres_async_variable,
+    .data = 0,
+    .flags = NGX_HTTP_VAR_NOCACHEABLE|NGX_HTTP_VAR_NOHASH,
+    .index = 0 },
+  { .name = ngx_string("postgres_async_failed"),
+    .set_handler = NULL,
+    .get_handler = ngx_postgres_async_variable,
+    .data = 1,
+    .flags = NGX_HTTP_VAR_NOCACHEABLE|NGX_HTTP_VAR_NOHASH,
+    .index = 0 },
     ngx_http_null_variable
 };
 
@@ -0,0 +1,230 @@
+# vi:filetype=perl
+
+use lib 'lib';
+use Test::Nginx::Socket;
+
+repeat_each(2);
+
+plan tests => repeat_each() * (blocks() * 3);
+
+$ENV{TEST_NGINX_POSTGRESQL_HOST} ||= '127.0.0.1';
+$ENV{TEST_NGINX_POSTGRESQL_PORT} ||= 5432;
+
+our $http_config = <<'_EOC_';
+    upstream database {
+        postgres_server  $TEST_NGINX_POSTGRESQL_HOST:$TEST_NGINX_POSTGRESQL_PORT
+                         dbname=ngx_test user=ngx_test password=ngx_test
+                         connect_timeout=1;
+    }
+
+    upstream down {
+        postgres_server  127.0.0.1:1
+                         dbname=ngx_test user=ngx_test password=ngx_test
+                         connect_timeout=1;
+    }
+_EOC_
+
+no_shuffle();
+run_tests();
+
+__DATA__
+
+=== TEST 1: async - statement runs after response
+--- http_config eval: $::http_config
+--- config
+    default_type  text/plain;
+
+    location /t {
+        echo_location        /init;
+        echo_location        /hit "v=1";
+        echo_location        /hit "v=2";
+        echo_sleep           0.5;
+        echo_location        /count;
+    }
+
+    location /init {
+        postgres_pass        database;
+        postgres_query       "DROP TABLE IF EXISTS async";
+        postgres_query       "CREATE TABLE async (v integer)";
+    }
+
+    location /hit {
+        postgres_pass        database;
+        postgres_query       "INSERT INTO async (v) VALUES ($arg_v::INT4OID)";
+        postgres_async       on;
+    }
+
+    location /count {
+        postgres_pass        database;
+        postgres_query       "SELECT count(*) FROM async";
+        postgres_output      value;
+    }
+--- request
+GET /t
+--- error_code: 200
+--- response_body chomp
+2
+--- timeout: 10
+--- no_error_log
+[alert]
+
+
+
+=== TEST 2: async - accepted without body
+--- http_config eval: $::http_config
+--- config
+    location /hit {
+        postgres_pass        database;
+        postgres_query       "SELECT 1";
+        postgres_async       on;
+    }
+--- request
+GET /hit
+--- error_code: 202
+--- response_body
+--- timeout: 10
+--- no_error_log
+[alert]
+
+
+
+=== TEST 3: async - spooled when database is down
+--- http_config eval: $::http_config
+--- config
+    location /hit {
+        postgres_pass        down;
+        postgres_query       "SELECT 1";
+        postgres_async       on;
+        add_header           X-Async-Dropped $postgres_async_dropped always;
+    }
+--- request
+GET /hit
+--- error_code: 202
+--- response_headers
+X-Async-Dropped: 0
+--- timeout: 10
+--- no_error_log
+[alert]
+
+
+
+=== TEST 4: async - spooled when queue is full and replayed in order
+--- http_config eval: $::http_config
+--- config
+    default_type  text/plain;
+
+    location /t {
+        echo_location        /init;
+        echo_location        /hit "v=1";
+        echo_location        /hit "v=2";
+        echo_location        /hit "v=3";
+        echo_sleep           0.5;
+        echo_location        /list;
+    }
+
+    location /init {
+        postgres_pass        database;
+        postgres_query       "DROP TABLE IF EXISTS async";
+        postgres_query       "CREATE TABLE async (id serial, v integer)";
+    }
+
+    location /hit {
+        postgres_pass        database;
+        postgres_query       "INSERT INTO async (v) VALUES ($arg_v::INT4OID)";
+        postgres_async       on queue=1;
+    }
+
+    location /list {
+        postgres_pass        database;
+        postgres_query       "SELECT string_agg(v::text, ',' ORDER BY id) FROM async";
+        postgres_output      value;
+    }
+--- request
+GET /t
+--- error_code: 200
+--- response_body chomp
+1,2,3
+--- timeout: 10
+--- error_log eval
+qr/async spool "[^"]+" replayed/
+
+
+
+=== TEST 5: async - replayed after reconnect
+--- http_config eval: $::http_config
+--- config
+    default_type  text/plain;
+
+    location /t {
+        echo_location        /init;
+        echo_location        /hit "v=1";
+        echo_sleep           0.5;
+        echo_location        /kill;
+        echo_sleep           0.2;
+        echo_location        /hit "v=2";
+        echo_sleep           2;
+        echo_location        /count;
+    }
+
+    location /init {
+        postgres_pass        database;
+        postgres_query       "DROP TABLE IF EXISTS async";
+        postgres_query       "CREATE TABLE async (v integer)";
+    }
+
+    location /hit {
+        postgres_pass        database;
+        postgres_query       "INSERT INTO async (v) VALUES ($arg_v::INT4OID)";
+        postgres_async       on;
+    }
+
+    location /kill {
+        postgres_pass        database;
+        postgres_query       "SELECT count(pg_terminate_backend(pid)) FROM pg_stat_activity WHERE query LIKE 'INSERT INTO async %'";
+    }
+
+    location /count {
+        postgres_pass        database;
+        postgres_query       "SELECT count(*) FROM async";
+        postgres_output      value;
+    }
+--- request
+GET /t
+--- error_code: 200
+--- response_body chomp
+2
+--- timeout: 10
+--- error_log eval
+qr/async spool "[^"]+" replayed/
+
+
+
+=== TEST 6: async - failed statement is counted
+--- http_config eval: $::http_config
+--- config
+    default_type  text/plain;
+
+    location /t {
+        echo_location        /hit "v=x";
+        echo_sleep           0.5;
+        echo_location        /failed;
+    }
+
+    location /hit {
+        postgres_pass        database;
+        postgres_query       "SELECT $arg_v::INT4OID";
+        postgres_async       on;
+    }
+
+    location /failed {
+        postgres_pass        database;
+        postgres_query       "SELECT $postgres_async_failed::INT4OID";
+        postgres_output      value;
+    }
+--- request
+GET /t
+--- error_code: 200
+--- response_body_like: ^[1-9]\d*$
+--- timeout: 10
+--- error_log
+PQresultStatus == PGRES_FATAL_ERROR
@@ -0,0 +1,117 @@
+# vi:filetype=perl
+
+use lib 'lib';
+use Test::Nginx::Socket;
+
+repeat_each(2);
+
+plan tests => repeat_each() * (blocks() * 3 - 1);
+
+$ENV{TEST_NGINX_POSTGRESQL_HOST} ||= '127.0.0.1';
+$ENV{TEST_NGINX_POSTGRESQL_PORT} ||= 5432;
+
+our $http_config = <<'_EOC_';
+    upstream database {
+        postgres_server  $TEST_NGINX_POSTGRESQL_HOST:$TEST_NGINX_POSTGRESQL_PORT
+                         dbname=ngx_test user=ngx_test password=ngx_test;
+    }
+_EOC_
+
+no_shuffle();
+run_tests();
+
+__DATA__
+
+=== TEST 1: batch - concurrent inserts are written once
+--- http_config eval: $::http_config
+--- config
+    default_type  text/plain;
+
+    location /t {
+        echo_location        /init;
+        echo_location_async  /insert "v=1";
+        echo_location_async  /insert "v=2";
+        echo_location_async  /insert "v=3";
+        echo_sleep           0.5;
+        echo_location        /count;
+    }
+
+    location /init {
+        postgres_pass        database;
+        postgres_query       "DROP TABLE IF EXISTS batch";
+        postgres_query       "CREATE TABLE batch (v integer)";
+    }
+
+    location /insert {
+        postgres_pass        database;
+        postgres_query       "INSERT INTO batch SELECT unnest($arg_v::INT4ARRAYOID)";
+        postgres_batch       window=100ms;
+    }
+
+    location /count {
+        postgres_pass        database;
+        postgres_query       "SELECT count(*) FROM batch";
+        postgres_output      value;
+    }
+--- request
+GET /t
+--- error_code: 200
+--- response_body chomp
+3
+--- timeout: 10
+--- no_error_log
+[error]
+
+
+
+=== TEST 2: batch - rows can not be told apart
+--- http_config eval: $::http_config
+--- config
+    location /t {
+        echo_location_async  /count "v=1";
+        echo_location_async  /count "v=2";
+        echo_sleep           0.5;
+    }
+
+    location /count {
+        postgres_pass        database;
+        postgres_query       "SELECT count(*) FROM unnest($arg_v::INT4ARRAYOID)";
+        postgres_batch       window=100ms;
+        postgres_output      value;
+    }
+--- request
+GET /t
+--- error_code: 200
+--- timeout: 10
+--- error_log
+"postgres_batch" statement returned 1 rows for 2 requests
+
+
+
+=== TEST 3: lookup - requests with other values of other parameters are not batched together
+--- http_config eval: $::http_config
+--- config
+    default_type  text/plain;
+
+    location /t {
+        echo_location_async  /lookup "id=1&tenant=a";
+        echo_location_async  /lookup "id=1&tenant=b";
+        echo_location_async  /lookup "id=1&tenant=a";
+    }
+
+    location /lookup {
+        postgres_pass        database;
+        postgres_query       "SELECT id, tenant FROM (VALUES (1::int8, 'a'), (1::int8, 'b')) AS v(id, tenant) WHERE id = ANY($arg_id::INT8ARRAYOID) AND tenant = $arg_tenant::TEXTOID";
+        postgres_lookup      $arg_id id window=100ms;
+        postgres_output      text;
+    }
+--- request
+GET /t
+--- error_code: 200
+--- response_body eval
+"1\x{0a}a".
+"1\x{0a}b".
+"1\x{0a}a"
+--- timeout: 10
+--- no_error_log
+[error]
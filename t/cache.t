@@ -0,0 +1,188 @@
+# vi:filetype=perl
+
+use lib 'lib';
+use Test::Nginx::Socket;
+
+repeat_each(2);
+
+plan tests => repeat_each() * (blocks() * 3 - 2 * 1);
+
+$ENV{TEST_NGINX_POSTGRESQL_HOST} ||= '127.0.0.1';
+$ENV{TEST_NGINX_POSTGRESQL_PORT} ||= 5432;
+
+our $http_config = <<'_EOC_';
+    upstream database {
+        postgres_server  $TEST_NGINX_POSTGRESQL_HOST:$TEST_NGINX_POSTGRESQL_PORT
+                         dbname=ngx_test user=ngx_test password=ngx_test;
+    }
+
+    postgres_cache_zone  cache 1m;
+_EOC_
+
+run_tests();
+
+__DATA__
+
+=== TEST 1: cache - sanity
+--- http_config eval: $::http_config
+--- config
+    location /postgres {
+        postgres_pass       database;
+        postgres_query      "select 'test' as echo";
+        postgres_output     json;
+        postgres_cache      cache;
+    }
+--- request
+GET /postgres
+--- error_code: 200
+--- response_headers
+Content-Type: application/json
+--- response_body chomp
+{"echo":"test"}
+--- timeout: 10
+
+
+
+=== TEST 2: cache - same query with different output in other location
+--- http_config eval: $::http_config
+--- config
+    default_type  text/plain;
+
+    location /t {
+        echo_location       /json;
+        echo_location       /value;
+    }
+
+    location /json {
+        postgres_pass       database;
+        postgres_query      "select 'test' as echo";
+        postgres_output     json;
+        postgres_cache      cache;
+    }
+
+    location /value {
+        postgres_pass       database;
+        postgres_query      "select 'test' as echo";
+        postgres_output     value;
+        postgres_cache      cache;
+    }
+--- request
+GET /t
+--- error_code: 200
+--- response_headers
+Content-Type: text/plain
+--- response_body chomp
+{"echo":"test"}test
+--- timeout: 10
+
+
+
+=== TEST 3: coalesce - same key in other location
+--- http_config eval: $::http_config
+--- config
+    default_type  text/plain;
+
+    location /t {
+        echo_location_async /json;
+        echo_location_async /value;
+    }
+
+    location /json {
+        postgres_pass       database;
+        postgres_query      "select 'test' as echo from pg_sleep(0.1)";
+        postgres_output     json;
+        postgres_cache_key  "echo";
+        postgres_coalesce   on;
+    }
+
+    location /value {
+        postgres_pass       database;
+        postgres_query      "select 'test' as echo from pg_sleep(0.1)";
+        postgres_output     value;
+        postgres_cache_key  "echo";
+        postgres_coalesce   on;
+    }
+--- request
+GET /t
+--- error_code: 200
+--- response_headers
+Content-Type: text/plain
+--- response_body chomp
+{"echo":"test"}test
+--- timeout: 10
+
+
+
+=== TEST 4: cache - invalidated by notification
+--- http_config
+    postgres_cache_zone  cache 1m;
+
+    upstream database {
+        postgres_server            $TEST_NGINX_POSTGRESQL_HOST:$TEST_NGINX_POSTGRESQL_PORT
+                                   dbname=ngx_test user=ngx_test password=ngx_test;
+        postgres_cache_invalidate  cache cache_inval;
+    }
+--- config
+    default_type  text/plain;
+
+    location /t {
+        echo_location       /get;
+        echo                "";
+        echo_location       /notify;
+        echo_sleep          0.5;
+        echo_location       /get;
+    }
+
+    location /get {
+        postgres_pass       database;
+        postgres_query      "select (random() * 1000000000)::int8";
+        postgres_output     value;
+        postgres_cache      cache;
+        postgres_cache_tag  test;
+    }
+
+    location /notify {
+        postgres_pass       database;
+        postgres_query      "notify cache_inval, 'test'";
+        postgres_output     none;
+    }
+--- request
+GET /t
+--- error_code: 200
+--- response_headers
+Content-Type: text/plain
+--- response_body_like chomp
+^(\d+)\n(?!\1$)\d+$
+--- timeout: 10
+
+
+
+=== TEST 5: cache - postgres_set is rejected
+--- http_config eval: $::http_config
+--- config
+    location /postgres {
+        postgres_pass       database;
+        postgres_query      "select 1";
+        postgres_output     value;
+        postgres_set        $test 0 0;
+        postgres_cache      cache;
+    }
+--- must_die
+--- error_log
+"postgres_cache" can not be combined with "postgres_set"
+
+
+
+=== TEST 6: coalesce - postgres_set is rejected
+--- http_config eval: $::http_config
+--- config
+    location /postgres {
+        postgres_pass       database;
+        postgres_query      "select 1";
+        postgres_output     value;
+        postgres_set        $test 0 0;
+        postgres_coalesce   on;
+    }
+--- must_die
+--- error_log
+"postgres_coalesce" can not be combined with "postgres_set"
@@ -0,0 +1,75 @@
+# vi:filetype=perl
+
+use lib 'lib';
+use Test::Nginx::Socket;
+
+repeat_each(2);
+
+plan tests => repeat_each() * (blocks() * 2 - 1);
+
+$ENV{TEST_NGINX_POSTGRESQL_HOST} ||= '127.0.0.1';
+$ENV{TEST_NGINX_POSTGRESQL_PORT} ||= 5432;
+
+our $http_config = <<'_EOC_';
+    upstream database {
+        postgres_server     $TEST_NGINX_POSTGRESQL_HOST:$TEST_NGINX_POSTGRESQL_PORT
+                            dbname=ngx_test user=ngx_test password=ngx_test;
+        postgres_keepalive  save=1 pooling=transaction;
+    }
+_EOC_
+
+run_tests();
+
+__DATA__
+
+=== TEST 1: transaction pooling - next statement on reused connection keeps timeout
+--- http_config eval: $::http_config
+--- config
+    location /postgres {
+        postgres_pass            database;
+        postgres_query           "select 1";
+        postgres_query           "select pg_sleep(2)";
+        postgres_result_timeout  500ms;
+    }
+--- request
+GET /postgres
+--- error_code: 504
+--- timeout: 10
+
+
+
+=== TEST 2: transaction pooling - connection is returned to pool between statements
+--- http_config eval: $::http_config
+--- config
+    location /postgres {
+        postgres_pass   database;
+        postgres_query  "select 1";
+        postgres_query  "select 2";
+    }
+--- request
+GET /postgres
+--- error_code: 200
+--- grep_error_log eval: qr/ngx_postgres_peer_yield/
+--- grep_error_log_out
+ngx_postgres_peer_yield
+--- timeout: 10
+
+
+
+=== TEST 3: transaction pooling - connection inside transaction is kept
+--- http_config eval: $::http_config
+--- config
+    location /postgres {
+        postgres_pass   database;
+        postgres_query  "BEGIN";
+        postgres_query  "select 1";
+        postgres_query  "COMMIT";
+        postgres_query  "select 2";
+    }
+--- request
+GET /postgres
+--- error_code: 200
+--- grep_error_log eval: qr/ngx_postgres_peer_yield/
+--- grep_error_log_out
+ngx_postgres_peer_yield
+--- timeout: 10
@@ -0,0 +1,174 @@
+# vi:filetype=perl
+
+use lib 'lib';
+use Test::Nginx::Socket;
+
+repeat_each(2);
+
+plan tests => repeat_each() * (blocks() * 3);
+
+$ENV{TEST_NGINX_POSTGRESQL_HOST} ||= '127.0.0.1';
+$ENV{TEST_NGINX_POSTGRESQL_PORT} ||= 5432;
+
+our $http_config = <<'_EOC_';
+    upstream database {
+        postgres_server  $TEST_NGINX_POSTGRESQL_HOST:$TEST_NGINX_POSTGRESQL_PORT
+                         dbname=ngx_test user=ngx_test password=ngx_test;
+    }
+_EOC_
+
+our $http_config_down = <<'_EOC_';
+    upstream database {
+        postgres_server  127.0.0.1:1
+                         dbname=ngx_test user=ngx_test password=ngx_test;
+    }
+_EOC_
+
+our $http_config_zone = <<'_EOC_';
+    upstream database {
+        postgres_server       $TEST_NGINX_POSTGRESQL_HOST:$TEST_NGINX_POSTGRESQL_PORT
+                              dbname=ngx_test user=ngx_test password=ngx_test;
+        postgres_listen_zone  listen 1m;
+    }
+_EOC_
+
+run_tests();
+
+__DATA__
+
+=== TEST 1: listen - notifications of query without push_stream
+--- http_config eval: $::http_config
+--- config
+    location /postgres {
+        postgres_pass       database;
+        postgres_query      "LISTEN test; NOTIFY test, 'a'; NOTIFY test, 'b'";
+    }
+--- request
+GET /postgres
+--- error_code: 200
+--- response_body eval
+""
+--- timeout: 10
+--- no_error_log
+[error]
+
+
+
+=== TEST 2: listen - channels shared through zone
+--- http_config eval: $::http_config_zone
+--- config
+    location /listen {
+        postgres_pass       database;
+        postgres_listen     test;
+    }
+--- request
+GET /listen
+--- error_code: 200
+--- response_headers
+Content-Type: text/event-stream
+--- response_body eval
+""
+--- timeout: 1
+--- abort
+
+
+
+=== TEST 3: listen - notification is sent as event
+--- http_config eval: $::http_config
+--- config
+    default_type  text/plain;
+
+    location /t {
+        echo_location_async  /listen;
+        echo_sleep           0.5;
+        echo_location_async  /notify;
+    }
+
+    location /listen {
+        postgres_pass        database;
+        postgres_listen      test;
+    }
+
+    location /notify {
+        postgres_pass        database;
+        postgres_query       "NOTIFY test, 'hello'";
+    }
+--- request
+GET /t
+--- error_code: 200
+--- response_headers
+Content-Type: text/plain
+--- response_body_like
+^id: \d+-\d+\ndata: hello\n\n$
+--- timeout: 2
+--- abort
+
+
+
+=== TEST 4: listen - sanity
+--- http_config eval: $::http_config
+--- config
+    location /listen {
+        postgres_pass       database;
+        postgres_listen     test;
+    }
+--- request
+GET /listen
+--- error_code: 200
+--- response_headers
+Content-Type: text/event-stream
+--- response_body eval
+""
+--- timeout: 1
+--- abort
+
+
+
+=== TEST 5: listen - database is down
+--- http_config eval: $::http_config_down
+--- config
+    location /listen {
+        postgres_pass       database;
+        postgres_listen     test;
+    }
+--- request
+GET /listen
+--- error_code: 200
+--- response_headers
+Content-Type: text/event-stream
+--- error_log
+PQconnectPoll == PGRES_POLLING_FAILED
+--- timeout: 1
+--- abort
+
+
+
+=== TEST 6: listen - carriage return in notification ends data line
+--- http_config eval: $::http_config
+--- config
+    default_type  text/plain;
+
+    location /t {
+        echo_location_async  /listen;
+        echo_sleep           0.5;
+        echo_location_async  /notify;
+    }
+
+    location /listen {
+        postgres_pass        database;
+        postgres_listen      test;
+    }
+
+    location /notify {
+        postgres_pass        database;
+        postgres_query       "NOTIFY test, 'a\rid: x\r\nb\r\rc'";
+    }
+--- request
+GET /t
+--- error_code: 200
+--- response_headers
+Content-Type: text/plain
+--- response_body_like
+^id: \d+-\d+\ndata: a\ndata: id: x\ndata: b\ndata: \ndata: c\n\n$
+--- timeout: 2
+--- abort
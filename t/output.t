@@ -5,7 +5,7 @@ use Test::Nginx::Socket;
 
 repeat_each(2);
 
-plan tests => repeat_each() * (blocks() * 3 - 4 * 2);
+plan tests => repeat_each() * (blocks() * 3 - 5 * 2 - 1 * 1);
 
 $ENV{TEST_NGINX_POSTGRESQL_HOST} ||= '127.0.0.1';
 $ENV{TEST_NGINX_POSTGRESQL_PORT} ||= 5432;
@@ -445,3 +445,484 @@ GET /postgres
 GET /postgres
 --- error_code: 500
 --- timeout: 10
+
+
+
+=== TEST 20: msgpack - sanity
+--- http_config eval: $::http_config
+--- config
+    location /postgres {
+        postgres_pass       database;
+        postgres_query      "select 'a'::text as s, 1::int4 as i, true as b, null as n";
+        postgres_output     msgpack;
+    }
+--- request
+GET /postgres
+--- error_code: 200
+--- response_headers
+Content-Type: application/x-msgpack
+--- response_body eval
+"\x{91}\x{84}".
+"\x{a1}s\x{a1}a".
+"\x{a1}i\x{01}".
+"\x{a1}b\x{c3}".
+"\x{a1}n\x{c0}"
+--- timeout: 10
+
+
+
+=== TEST 21: cbor - sanity
+--- http_config eval: $::http_config
+--- config
+    location /postgres {
+        postgres_pass       database;
+        postgres_query      "select 'a'::text as s, -1::int4 as i, false as b, null as n";
+        postgres_output     cbor;
+    }
+--- request
+GET /postgres
+--- error_code: 200
+--- response_headers
+Content-Type: application/cbor
+--- response_body eval
+"\x{81}\x{a4}".
+"\x{61}s\x{61}a".
+"\x{61}i\x{20}".
+"\x{61}b\x{f4}".
+"\x{61}n\x{f6}"
+--- timeout: 10
+
+
+
+=== TEST 22: text - rows over several small buffers
+--- http_config eval: $::http_config
+--- config
+    location /postgres {
+        postgres_pass                database;
+        postgres_query               "select generate_series(1, 1000)";
+        postgres_output              text;
+        postgres_buffer_size         1k;
+        postgres_buffers             8 1k;
+        postgres_busy_buffers_size   2k;
+        postgres_max_temp_file_size  0;
+    }
+--- request
+GET /postgres
+--- error_code: 200
+--- response_headers
+Content-Type: text/plain
+--- response_body eval
+join("\x{0a}", 1 .. 1000)
+--- timeout: 10
+
+
+
+=== TEST 23: text - rendered in thread pool
+--- http_config eval: $::http_config
+--- config
+    location /postgres {
+        postgres_pass       database;
+        postgres_query      "select generate_series(1, 1000)";
+        postgres_output     text thread_pool=default thread_threshold=100;
+    }
+--- request
+GET /postgres
+--- error_code: 200
+--- response_headers
+Content-Type: text/plain
+--- response_body eval
+join("\x{0a}", 1 .. 1000)
+--- timeout: 10
+
+
+
+=== TEST 24: csv - quote and escape
+--- http_config eval: $::http_config
+--- config
+    location /postgres {
+        postgres_pass       database;
+        postgres_query      "select 'a\"b' as s, 1 as n, null as z";
+        postgres_output     csv header=off;
+    }
+--- request
+GET /postgres
+--- error_code: 200
+--- response_headers
+Content-Type: text/csv
+--- response_body eval
+'"a""b",1,'
+--- timeout: 10
+
+
+
+=== TEST 25: csv - quote and escape of every column
+--- http_config eval: $::http_config
+--- config
+    location /postgres {
+        postgres_pass       database;
+        postgres_query      "select 'a\"b' as s, 1 as n";
+        postgres_output     csv header=off string=off;
+    }
+--- request
+GET /postgres
+--- error_code: 200
+--- response_headers
+Content-Type: text/csv
+--- response_body eval
+'"a""b","1"'
+--- timeout: 10
+
+
+
+=== TEST 26: csv - quote without escape
+--- http_config eval: $::http_config
+--- config
+    location /postgres {
+        postgres_pass       database;
+        postgres_query      "select 'a\"b' as s, 1 as n";
+        postgres_output     csv header=off quote=| escape=;
+    }
+--- request
+GET /postgres
+--- error_code: 200
+--- response_headers
+Content-Type: text/csv
+--- response_body eval
+'|a"b|,1'
+--- timeout: 10
+
+
+
+=== TEST 27: csv - escape without quote
+--- http_config eval: $::http_config
+--- config
+    location /postgres {
+        postgres_pass       database;
+        postgres_query      "select 'a\"b' as s, 1 as n";
+        postgres_output     csv header=off quote= 'escape="';
+    }
+--- request
+GET /postgres
+--- error_code: 200
+--- response_headers
+Content-Type: text/csv
+--- response_body eval
+'a""b,1'
+--- timeout: 10
+
+
+
+=== TEST 28: text - fetched through cursor
+--- http_config eval: $::http_config
+--- config
+    location /postgres {
+        postgres_pass       database;
+        postgres_query      "select generate_series(1, 1000)";
+        postgres_output     text;
+        postgres_cursor     100;
+    }
+--- request
+GET /postgres
+--- error_code: 200
+--- response_headers
+Transfer-Encoding: chunked
+--- response_body eval
+join("\x{0a}", 1 .. 1000)
+--- timeout: 10
+
+
+
+=== TEST 29: text - output over all buffers goes to temporary file
+--- http_config eval: $::http_config
+--- config
+    location /postgres {
+        postgres_pass                database;
+        postgres_query               "select generate_series(1, 1000)";
+        postgres_output              text;
+        postgres_buffer_size         1k;
+        postgres_buffers             2 1k;
+        postgres_busy_buffers_size   1k;
+    }
+--- request
+GET /postgres
+--- error_code: 200
+--- response_headers
+Content-Type: text/plain
+--- response_body eval
+join("\x{0a}", 1 .. 1000)
+--- timeout: 10
+
+
+
+=== TEST 30: arrow - results with same columns
+--- http_config eval: $::http_config
+--- config
+    location /postgres {
+        postgres_pass       database;
+        postgres_query      "select 1::int4 as i; select 2::int4 as i";
+        postgres_output     arrow;
+    }
+--- request
+GET /postgres
+--- error_code: 200
+--- response_headers
+Content-Type: application/vnd.apache.arrow.stream
+--- response_body_like eval
+qr/^\xff\xff\xff\xff/
+--- timeout: 10
+
+
+
+=== TEST 31: arrow - results with different columns
+--- http_config eval: $::http_config
+--- config
+    location /postgres {
+        postgres_pass       database;
+        postgres_query      "select 1::int4 as i; select 'a'::text as s";
+        postgres_output     arrow;
+    }
+--- request
+GET /postgres
+--- error_code: 500
+--- timeout: 10
+
+
+
+=== TEST 32: text - binary results without params
+--- http_config eval: $::http_config
+--- config
+    default_type  text/plain;
+
+    location /postgres {
+        postgres_pass       database;
+        postgres_query      "select 3::int4, true, 1.5::float8";
+        postgres_output     text binary=on;
+    }
+--- request
+GET /postgres
+--- error_code: 200
+--- response_headers
+Content-Type: text/plain
+--- response_body eval
+"3".
+"\x{0a}".  # new line - delimiter
+"t".
+"\x{0a}".  # new line - delimiter
+"1.5"
+--- timeout: 10
+
+
+
+=== TEST 33: text - binary results with params
+--- http_config eval: $::http_config
+--- config
+    default_type  text/plain;
+
+    location /postgres {
+        postgres_pass       database;
+        postgres_query      "select $arg_i::INT4OID + 1, true, 1.5::float8";
+        postgres_output     text binary=on;
+    }
+--- request
+GET /postgres?i=2
+--- error_code: 200
+--- response_headers
+Content-Type: text/plain
+--- response_body eval
+"3".
+"\x{0a}".  # new line - delimiter
+"t".
+"\x{0a}".  # new line - delimiter
+"1.5"
+--- timeout: 10
+
+
+
+=== TEST 34: etag - tag of body
+--- http_config eval: $::http_config
+--- config
+    default_type  text/plain;
+
+    location /postgres {
+        postgres_pass       database;
+        postgres_query      "select 'test'";
+        postgres_output     value;
+        postgres_etag       on;
+    }
+--- request
+GET /postgres
+--- error_code: 200
+--- response_headers
+ETag: "4-d87f7e0c"
+--- response_body chomp
+test
+--- timeout: 10
+
+
+
+=== TEST 35: etag - not modified
+--- http_config eval: $::http_config
+--- config
+    default_type  text/plain;
+
+    location /postgres {
+        postgres_pass       database;
+        postgres_query      "select 'test'";
+        postgres_output     value;
+        postgres_etag       on;
+    }
+--- request
+GET /postgres
+--- more_headers
+If-None-Match: W/"0-00000000", "4-d87f7e0c"
+--- error_code: 304
+--- response_headers
+ETag: "4-d87f7e0c"
+--- response_body
+--- timeout: 10
+
+
+
+=== TEST 36: envelope - json of several queries
+--- http_config eval: $::http_config
+--- config
+    location /postgres {
+        postgres_pass       database;
+        postgres_query      "select 1 as id, 'a' as name";
+        postgres_output     json name=user;
+        postgres_query      "select 1 as id where false";
+        postgres_output     json name=orders;
+        postgres_query      "select 2 as id union all select 3";
+        postgres_output     json;
+        postgres_envelope   on;
+    }
+--- request
+GET /postgres
+--- error_code: 200
+--- response_headers
+Content-Type: application/json
+--- response_body_filters eval
+use JSON::PP; sub { JSON::PP->new->canonical->encode(JSON::PP::decode_json($_[0])) }
+--- response_body chomp
+{"orders":[],"q3":[{"id":2},{"id":3}],"user":[{"id":1,"name":"a"}]}
+--- timeout: 10
+
+
+
+=== TEST 37: envelope - several statements in one query
+--- http_config eval: $::http_config
+--- config
+    location /postgres {
+        postgres_pass       database;
+        postgres_query      "select 1 as id; select 2 as id";
+        postgres_output     json;
+        postgres_envelope   on;
+    }
+--- request
+GET /postgres
+--- error_code: 500
+--- timeout: 10
+--- error_log
+"postgres_envelope" requires single statement in "postgres_query"
+
+
+
+=== TEST 38: text - binary numeric as text results
+--- http_config eval: $::http_config
+--- config
+    default_type  text/plain;
+
+    location /t {
+        echo_location       /text;
+        echo                "";
+        echo                "---";
+        echo_location       /binary;
+    }
+
+    location /text {
+        postgres_pass       database;
+        postgres_query      "select 'NaN'::numeric, -1234.5678, 0.0001230, 0.00000001, round(123456, -2), 1e20::numeric, 0::numeric(10,2)";
+        postgres_output     text;
+    }
+
+    location /binary {
+        postgres_pass       database;
+        postgres_query      "select 'NaN'::numeric, -1234.5678, 0.0001230, 0.00000001, round(123456, -2), 1e20::numeric, 0::numeric(10,2)";
+        postgres_output     text binary=on;
+    }
+--- request
+GET /t
+--- error_code: 200
+--- response_headers
+Content-Type: text/plain
+--- response_body_like
+(?s)\A(.+)\n---\n\1\z
+--- timeout: 10
+
+
+
+=== TEST 39: text - binary date and time as text results
+--- http_config eval: $::http_config
+--- config
+    default_type  text/plain;
+
+    location /t {
+        echo_location       /text;
+        echo                "";
+        echo                "---";
+        echo_location       /binary;
+    }
+
+    location /text {
+        postgres_pass       database;
+        postgres_query      "select 'infinity'::date, '-infinity'::date, '1999-12-31'::date, '1900-01-01'::date, '0089-04-04 BC'::date, '23:59:59.999999'::time, '12:30:00.5'::time, 'infinity'::timestamp, '-infinity'::timestamp, '1999-12-31 23:59:59.5'::timestamp, '1970-01-01'::timestamp, '0001-01-01 BC'::timestamp";
+        postgres_output     text;
+    }
+
+    location /binary {
+        postgres_pass       database;
+        postgres_query      "select 'infinity'::date, '-infinity'::date, '1999-12-31'::date, '1900-01-01'::date, '0089-04-04 BC'::date, '23:59:59.999999'::time, '12:30:00.5'::time, 'infinity'::timestamp, '-infinity'::timestamp, '1999-12-31 23:59:59.5'::timestamp, '1970-01-01'::timestamp, '0001-01-01 BC'::timestamp";
+        postgres_output     text binary=on;
+    }
+--- request
+GET /t
+--- error_code: 200
+--- response_headers
+Content-Type: text/plain
+--- response_body_like
+(?s)\A(.+)\n---\n\1\z
+--- timeout: 10
+
+
+
+=== TEST 40: text - binary uuid as text results
+--- http_config eval: $::http_config
+--- config
+    default_type  text/plain;
+
+    location /t {
+        echo_location       /text;
+        echo                "";
+        echo                "---";
+        echo_location       /binary;
+    }
+
+    location /text {
+        postgres_pass       database;
+        postgres_query      "select 'a0eebc99-9c0b-4ef8-bb6d-6bb9bd380a11'::uuid, '00000000-0000-0000-0000-000000000000'::uuid";
+        postgres_output     text;
+    }
+
+    location /binary {
+        postgres_pass       database;
+        postgres_query      "select 'a0eebc99-9c0b-4ef8-bb6d-6bb9bd380a11'::uuid, '00000000-0000-0000-0000-000000000000'::uuid";
+        postgres_output     text binary=on;
+    }
+--- request
+GET /t
+--- error_code: 200
+--- response_headers
+Content-Type: text/plain
+--- response_body_like
+(?s)\A(.+)\n---\n\1\z
+--- timeout: 10
@@ -0,0 +1,86 @@
+# vi:filetype=perl
+
+use lib 'lib';
+use Test::Nginx::Socket;
+
+repeat_each(2);
+
+plan tests => repeat_each() * (blocks() * 3 - 1 * 1);
+
+$ENV{TEST_NGINX_POSTGRESQL_HOST} ||= '127.0.0.1';
+$ENV{TEST_NGINX_POSTGRESQL_PORT} ||= 5432;
+
+our $http_config = <<'_EOC_';
+    upstream database {
+        postgres_server  $TEST_NGINX_POSTGRESQL_HOST:$TEST_NGINX_POSTGRESQL_PORT
+                         dbname=ngx_test user=ngx_test password=ngx_test;
+    }
+_EOC_
+
+run_tests();
+
+__DATA__
+
+=== TEST 1: parallel - outputs in order of queries
+--- http_config eval: $::http_config
+--- config
+    default_type  text/plain;
+
+    location /postgres {
+        postgres_pass       database;
+        postgres_query      "select 'a' from pg_sleep(0.2)";
+        postgres_output     value;
+        postgres_query      "select 'b'";
+        postgres_output     value;
+        postgres_parallel   on;
+    }
+--- request
+GET /postgres
+--- error_code: 200
+--- response_headers
+Content-Type: text/plain
+--- response_body chomp
+ab
+--- timeout: 10
+
+
+
+=== TEST 2: parallel - queries see method of request
+--- http_config eval: $::http_config
+--- config
+    default_type  text/plain;
+
+    location /postgres {
+        postgres_pass       database;
+        postgres_query      "select $request_method::TEXTOID";
+        postgres_output     value;
+        postgres_query      "select $request_method::TEXTOID";
+        postgres_output     value;
+        postgres_parallel   on;
+    }
+--- request
+POST /postgres
+--- error_code: 200
+--- response_headers
+Content-Type: text/plain
+--- response_body chomp
+POSTPOST
+--- timeout: 10
+
+
+
+=== TEST 3: parallel - postgres_set is rejected
+--- http_config eval: $::http_config
+--- config
+    location /postgres {
+        postgres_pass       database;
+        postgres_query      "select 1";
+        postgres_output     value;
+        postgres_set        $test 0 0;
+        postgres_query      "select 2";
+        postgres_output     value;
+        postgres_parallel   on;
+    }
+--- must_die
+--- error_log
+"postgres_parallel" can not be combined with "postgres_set"
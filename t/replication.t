@@ -0,0 +1,102 @@
+# vi:filetype=perl
+
+use lib 'lib';
+use Test::Nginx::Socket;
+
+repeat_each(1);
+master_on();
+workers(2);
+
+plan tests => repeat_each() * (blocks() * 2 + 6);
+
+$ENV{TEST_NGINX_POSTGRESQL_HOST} ||= '127.0.0.1';
+$ENV{TEST_NGINX_POSTGRESQL_PORT} ||= 5432;
+
+our $http_config = <<'_EOC_';
+    upstream database {
+        postgres_server       $TEST_NGINX_POSTGRESQL_HOST:$TEST_NGINX_POSTGRESQL_PORT
+                              dbname=ngx_test user=ngx_test password=ngx_test;
+        postgres_replication  slot=ngx_test publication=ngx_test;
+    }
+_EOC_
+
+run_tests();
+
+__DATA__
+
+=== TEST 1: replication - listen with several workers
+--- http_config eval: $::http_config
+--- config
+    location /listen {
+        postgres_pass       database;
+        postgres_listen     public.users;
+    }
+--- must_die
+--- error_log
+"postgres_replication" of upstream "database" can not be combined with "postgres_listen" when "worker_processes" is more than 1
+
+
+
+=== TEST 2: replication - changes of publication invalidate cache
+--- http_config
+    postgres_cache_zone  cache 1m;
+
+    upstream database {
+        postgres_server            $TEST_NGINX_POSTGRESQL_HOST:$TEST_NGINX_POSTGRESQL_PORT
+                                   dbname=ngx_test user=ngx_test password=ngx_test
+                                   connect_timeout=1 options=-cwal_sender_timeout=2000;
+        postgres_replication       slot=ngx_test publication=ngx_test;
+        postgres_cache_invalidate  cache cache_inval;
+    }
+--- config
+    default_type  text/plain;
+
+    location /t {
+        echo_location       /init;
+        echo_sleep          2;
+        echo_location       /get;
+        echo                "";
+        echo_location       /change;
+        echo_sleep          2;
+        echo_location       /get;
+    }
+
+    location /init {
+        postgres_pass       database;
+        postgres_query      "DROP TABLE IF EXISTS replication";
+        postgres_query      "CREATE TABLE replication (id integer PRIMARY KEY, v text)";
+        postgres_query      "INSERT INTO replication VALUES (1, 'a')";
+        postgres_query      "DROP PUBLICATION IF EXISTS ngx_test";
+        postgres_query      "CREATE PUBLICATION ngx_test FOR TABLE replication";
+        postgres_query      "SELECT pg_drop_replication_slot(slot_name) FROM pg_replication_slots WHERE slot_name = 'ngx_test' AND NOT active";
+        postgres_query      "SELECT pg_create_logical_replication_slot('ngx_test', 'pgoutput') WHERE NOT EXISTS (SELECT 1 FROM pg_replication_slots WHERE slot_name = 'ngx_test')";
+    }
+
+    location /get {
+        postgres_pass       database;
+        postgres_query      "SELECT v FROM replication WHERE id = 1";
+        postgres_output     value;
+        postgres_cache      cache;
+        postgres_cache_tag  public.replication;
+    }
+
+    location /change {
+        postgres_pass       database;
+        postgres_query      "INSERT INTO replication VALUES (2, 'b')";
+        postgres_query      "UPDATE replication SET v = 'c' WHERE id = 1";
+        postgres_query      "DELETE FROM replication WHERE id = 2";
+    }
+--- request
+GET /t
+--- error_code: 200
+--- response_body chomp
+a
+c
+--- timeout: 10
+--- error_log
+type = R
+type = I
+type = U
+type = D
+type = C
+keepalive, reply = 1
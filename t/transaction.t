@@ -0,0 +1,88 @@
+# vi:filetype=perl
+
+use lib 'lib';
+use Test::Nginx::Socket;
+
+repeat_each(2);
+
+plan tests => repeat_each() * (blocks() * 2);
+
+$ENV{TEST_NGINX_POSTGRESQL_HOST} ||= '127.0.0.1';
+$ENV{TEST_NGINX_POSTGRESQL_PORT} ||= 5432;
+
+our $http_config = <<'_EOC_';
+    upstream database {
+        postgres_server  $TEST_NGINX_POSTGRESQL_HOST:$TEST_NGINX_POSTGRESQL_PORT
+                         dbname=ngx_test user=ngx_test password=ngx_test;
+    }
+_EOC_
+
+our $config = <<'_EOC_';
+    default_type  text/plain;
+
+    location /t {
+        echo_location         /init;
+        echo_location         /transaction;
+        echo_location         /count;
+    }
+
+    location /init {
+        postgres_pass         database;
+        postgres_query        "DROP TABLE IF EXISTS transaction";
+        postgres_query        "CREATE TABLE transaction (v integer)";
+    }
+
+    location /count {
+        postgres_pass         database;
+        postgres_query        "SELECT count(*) FROM transaction";
+        postgres_output       value;
+    }
+_EOC_
+
+no_shuffle();
+run_tests();
+
+__DATA__
+
+=== TEST 1: transaction - commit
+--- http_config eval: $::http_config
+--- config eval
+$::config . <<'_EOC_';
+    location /transaction {
+        postgres_pass         database;
+        postgres_query        "INSERT INTO transaction (v) VALUES (1)";
+        postgres_query        "INSERT INTO transaction (v) VALUES (2)";
+        postgres_transaction  on;
+    }
+_EOC_
+--- request
+GET /t
+--- error_code: 200
+--- response_body chomp
+2
+--- timeout: 10
+
+
+
+=== TEST 2: transaction - rollback
+--- http_config eval: $::http_config
+--- config eval
+$::config . <<'_EOC_';
+    location /transaction {
+        postgres_pass         database;
+        postgres_query        "INSERT INTO transaction (v) VALUES (1)";
+        postgres_query        "SELECT 1 / 0";
+        postgres_transaction  on isolation=serializable;
+        error_page            500 = /empty;
+    }
+
+    location /empty {
+        return                200;
+    }
+_EOC_
+--- request
+GET /t
+--- error_code: 200
+--- response_body chomp
+0
+--- timeout: 10
@@ -405,3 +405,51 @@ Content-Type: application/x-resty-dbd-stream
 GET /postgres
 --- error_code: 500
 --- timeout: 10
+
+
+
+=== TEST 21: postgres_set with postgres_pipeline
+--- http_config eval: $::http_config
+--- config
+    default_type  text/plain;
+
+    location /postgres {
+        postgres_pass       database;
+        postgres_query      "select $arg_id::INT8OID + 1";
+        postgres_pipeline   on;
+        postgres_output     value;
+        postgres_set        $test 0 0;
+        add_header          "X-Test" $test;
+    }
+--- request
+GET /postgres?id=2
+--- error_code: 200
+--- response_headers
+X-Test: 3
+--- response_body chomp
+3
+--- timeout: 10
+
+
+
+=== TEST 22: postgres_set with postgres_lookup
+--- http_config eval: $::http_config
+--- config
+    default_type  text/plain;
+
+    location /postgres {
+        postgres_pass       database;
+        postgres_query      "select id from (values (1::int8), (2::int8)) as v(id) where id = any($arg_id::INT8ARRAYOID)";
+        postgres_lookup     $arg_id id;
+        postgres_output     value;
+        postgres_set        $test 0 0;
+        add_header          "X-Test" $test;
+    }
+--- request
+GET /postgres?id=2
+--- error_code: 200
+--- response_headers
+X-Test: 2
+--- response_body chomp
+2
+--- timeout: 10